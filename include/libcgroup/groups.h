@@ -43,6 +43,23 @@ enum cgroup_delete_flag {
 	 * CGFLAG_DELETE_RECURSIVE.
 	 */
 	CGFLAG_DELETE_EMPTY_ONLY = 4,
+
+	/**
+	 * Kill all processes of the group and its subgroups with cgroup.kill
+	 * instead of moving them to the parent group.  Only on cgroup v2
+	 * hierarchies, and not with the root group.  This flag cannot be used
+	 * with CGFLAG_DELETE_EMPTY_ONLY or CGFLAG_DELETE_FREEZE.
+	 */
+	CGFLAG_DELETE_KILL = 8,
+
+	/**
+	 * Freeze the group and its subgroups with cgroup.freeze before moving
+	 * their processes, so that they cannot fork while being moved, and
+	 * move whole processes instead of each of their threads.  On cgroup
+	 * v1 hierarchies the processes are moved without freezing them.  This
+	 * flag cannot be used with CGFLAG_DELETE_EMPTY_ONLY.
+	 */
+	CGFLAG_DELETE_FREEZE = 16,
 };
 
 /**
@@ -275,6 +292,11 @@ int cgroup_delete_cgroup(struct cgroup *cgroup, int ignore_migration);
  * #CGFLAG_DELETE_RECURSIVE flag specifies that all subgroups should be removed
  * too. If root group is being removed with this flag specified, all subgroups
  * are removed but the root group itself is left undeleted.
+ * The subgroups are removed bottom-up, independent subtrees by several
+ * threads at once.
+ * With #CGFLAG_DELETE_KILL or #CGFLAG_DELETE_FREEZE, the function waits
+ * until the kernel reports the group as unpopulated in cgroup.events before
+ * removing it.
  * @see cgroup_delete_flag.
  *
  * @param cgroup
@@ -582,7 +604,9 @@ char *cgroup_get_value_name(struct cgroup_controller *controller, int index);
 int cgroup_get_procs(char *name, char *controller, pid_t **pids, int *size);
 
 /**
- * Change permission of files and directories of given group
+ * Change permission of files and directories of given group and of its
+ * subgroups.  A hierarchy shared by several controllers of the group is
+ * walked once.
  * @param cgroup The cgroup which permissions should be changed
  * @param dir_mode The permission mode of group directory
  * @param dirm_change Denotes whether the directory change should be done
@@ -636,6 +660,180 @@ int cgroup_list_mount_points(const enum cg_version_t cgrp_version,
 int cgroup_get_controller_version(const char * const controller,
 				  enum cg_version_t * const version);
 
+/**
+ * @}
+ * @name Bulk access to control files
+ * Read or write one control file in each of many groups in a single call.
+ * The open/read/write/close of the files are spread over a few threads.
+ * Every request gets its own status, one failing file does not stop the
+ * others.
+ * @{
+ */
+
+/**
+ * One control file to read or write.
+ */
+struct cgroup_bulk_request {
+	/** Name of the controller, e.g. "memory". */
+	const char *controller;
+	/** Name of the group, relative to the root of the hierarchy. */
+	const char *path;
+	/** Name of the control file, e.g. "memory.max". */
+	const char *file;
+	/**
+	 * cgroup_bulk_get(): buffer receiving the value, without its
+	 * trailing newline.  cgroup_bulk_set(): the value to write.
+	 */
+	char *value;
+	/**
+	 * cgroup_bulk_get(): size of the buffer, longer values are
+	 * truncated.  Ignored by cgroup_bulk_set().
+	 */
+	size_t size;
+	/** Set to 0 on success, or to the ECG* error of this request. */
+	int status;
+	/** The errno behind an #ECGOTHER status. */
+	int error;
+};
+
+/**
+ * Read the control files of many groups.
+ * @param requests The files to read, each value buffer is filled with a
+ * NUL terminated string.
+ * @param count Number of requests.
+ * @return 0 if all the files were read, else the status of the first
+ * request that failed.
+ */
+int cgroup_bulk_get(struct cgroup_bulk_request *requests, int count);
+
+/**
+ * Write the control files of many groups.  Each value is written with a
+ * single write(), a multi-line value like the devices.allow rules of
+ * cgroup_set_value_string() needs one request per line.
+ * @param requests The files to write and their values.
+ * @param count Number of requests.
+ * @return 0 if all the files were written, else the status of the first
+ * request that failed.
+ */
+int cgroup_bulk_set(struct cgroup_bulk_request *requests, int count);
+
+/**
+ * @}
+ * @name Pressure notifications
+ * Register kernel PSI triggers on the cpu.pressure, memory.pressure and
+ * io.pressure files of cgroup v2 groups.  A trigger like
+ * "some 150000 1000000" fires when the tasks of the group were stalled
+ * on the resource for 150ms within a 1s window.  See the psi.rst
+ * document of the kernel for the format.  Without CAP_SYS_RESOURCE, the
+ * kernel only accepts windows which are multiples of 2s.
+ * @{
+ */
+
+/**
+ * Resources with pressure information.
+ */
+enum cgroup_psi_resource {
+	CGROUP_PSI_CPU = 0,
+	CGROUP_PSI_MEMORY,
+	CGROUP_PSI_IO,
+	CGROUP_PSI_MAX,
+};
+
+/**
+ * Register a trigger on a pressure file of a group.  The returned file
+ * descriptor reports POLLPRI when the trigger fires, and POLLERR once the
+ * group is removed.  The trigger is unregistered when it is closed.
+ * @param path Name of the group, relative to the root of the hierarchy.
+ * @param resource The resource to watch.
+ * @param trigger The trigger, e.g. "some 150000 1000000".
+ * @param fd Set to the file descriptor of the trigger.
+ * @return 0 on success, #ECGROUPUNSUPP if the group is not on a cgroup v2
+ * hierarchy or the kernel has no pressure information, #ECGINVAL if the
+ * kernel refuses the trigger.
+ */
+int cgroup_psi_trigger_open(const char *path,
+			    enum cgroup_psi_resource resource,
+			    const char *trigger, int *fd);
+
+/**
+ * Opaque set of triggers, see cgroup_psi_monitor_new().
+ */
+struct cgroup_psi_monitor;
+
+/**
+ * A trigger reported by cgroup_psi_monitor_wait().
+ */
+struct cgroup_psi_event {
+	/** Id of the trigger, as returned by cgroup_psi_monitor_add(). */
+	int id;
+	/** The group and the resource of the trigger. */
+	const char *path;
+	enum cgroup_psi_resource resource;
+	/**
+	 * The group was removed.  The trigger will not fire again and
+	 * should be removed.
+	 */
+	bool removed;
+};
+
+/**
+ * Create a monitor, waiting on many triggers with epoll.
+ * @return The monitor, NULL on error.
+ */
+struct cgroup_psi_monitor *cgroup_psi_monitor_new(void);
+
+/**
+ * Close all the triggers of a monitor and free it.
+ * @param monitor The monitor, set to NULL.
+ */
+void cgroup_psi_monitor_free(struct cgroup_psi_monitor **monitor);
+
+/**
+ * Register a trigger and add it to a monitor.
+ * @param monitor The monitor.
+ * @param path Name of the group, relative to the root of the hierarchy.
+ * @param resource The resource to watch.
+ * @param trigger The trigger, e.g. "some 150000 1000000".
+ * @param id Set to the id of the trigger, a small integer which is reused
+ * once the trigger is removed.
+ * @return 0 on success, see cgroup_psi_trigger_open() for the errors.
+ */
+int cgroup_psi_monitor_add(struct cgroup_psi_monitor *monitor,
+			   const char *path,
+			   enum cgroup_psi_resource resource,
+			   const char *trigger, int *id);
+
+/**
+ * Remove a trigger from a monitor and close it.
+ * @param monitor The monitor.
+ * @param id The id of the trigger.
+ * @return 0 on success, #ECGINVAL if there is no such trigger.
+ */
+int cgroup_psi_monitor_remove(struct cgroup_psi_monitor *monitor, int id);
+
+/**
+ * Get the epoll file descriptor of a monitor, to wait for it in another
+ * event loop.  It is readable when cgroup_psi_monitor_wait() has events to
+ * report.
+ * @param monitor The monitor.
+ * @return The file descriptor.
+ */
+int cgroup_psi_monitor_fd(struct cgroup_psi_monitor *monitor);
+
+/**
+ * Wait until triggers of a monitor fire.
+ * @param monitor The monitor.
+ * @param timeout Maximal time to wait in milliseconds, -1 to wait forever
+ * and 0 to return at once.
+ * @param events Set to the triggers which fired.  The array belongs to the
+ * monitor and is valid until the next call.
+ * @param count Set to the number of events, 0 on timeout.
+ * @return 0 on success, #ECGOTHER on error.
+ */
+int cgroup_psi_monitor_wait(struct cgroup_psi_monitor *monitor, int timeout,
+			    const struct cgroup_psi_event **events,
+			    int *count);
+
 /**
  * @}
  * @}
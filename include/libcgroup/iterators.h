@@ -8,6 +8,7 @@
 
 #ifndef SWIG
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <features.h>
 #endif
@@ -265,6 +266,286 @@ int cgroup_read_stats_next(void **handle, struct cgroup_stat *stat);
  */
 int cgroup_read_stats_end(void **handle);
 
+/**
+ * @}
+ *
+ * @name Read typed group stats
+ * Read the numeric stats files of a group, with "key value" lines like
+ * memory.stat, cpu.stat or memory.events, or with "MAJ:MIN key=value ..."
+ * lines like io.stat.  The keys are interned into small integer ids, shared
+ * by the whole process, and the values are parsed into 64 bit integers.
+ * A reader keeps its buffers, so reading a file again allocates nothing.
+ * Lines and values in other formats, e.g. "max", are skipped.
+ * @{
+ */
+
+/**
+ * Opaque stats reader, see cgroup_stat_reader_new().
+ */
+struct cgroup_stat_reader;
+
+/**
+ * One value of a stats file.
+ */
+struct cgroup_stat_entry {
+	/** Id of the key, see cgroup_stat_key_name(). */
+	int key;
+	/** Device of a "MAJ:MIN" line, both 0 for "key value" lines. */
+	unsigned int major;
+	unsigned int minor;
+	uint64_t value;
+};
+
+/**
+ * Get the id of a stat key, interning it if it was never seen.  Ids are
+ * small consecutive integers, starting from 0, that stay valid for the life
+ * of the process.
+ * @param name The key, e.g. "anon" or "rbytes".
+ * @return The id, -1 if the key cannot be interned.
+ */
+int cgroup_stat_key_id(const char *name);
+
+/**
+ * Get the name of a stat key.
+ * @param id The id of the key.
+ * @return The name, NULL if no key has this id.
+ */
+const char *cgroup_stat_key_name(int id);
+
+/**
+ * Create a stats reader.
+ * @return The reader, NULL if out of memory.
+ */
+struct cgroup_stat_reader *cgroup_stat_reader_new(void);
+
+/**
+ * Free a stats reader and the entries it returned.
+ * @param reader The reader, set to NULL.
+ */
+void cgroup_stat_reader_free(struct cgroup_stat_reader **reader);
+
+/**
+ * Only report some keys from now on, the other lines are skipped without
+ * looking at their values.
+ * @param reader The reader.
+ * @param keys The keys to report, NULL to report all keys again.
+ * @param count Number of keys.
+ */
+int cgroup_stat_reader_select(struct cgroup_stat_reader *reader,
+			      const char * const keys[], int count);
+
+/**
+ * Read a stats file of a group.
+ * @param reader The reader.
+ * @param controller Name of the controller the file belongs to.
+ * @param path The path to control group, relative to hierarchy root.
+ * @param file Name of the stats file, e.g. "memory.stat".
+ * @param entries Returned values, in file order.  They are valid until the
+ * next read with the same reader.
+ * @param count Returned number of values.
+ */
+int cgroup_stat_read(struct cgroup_stat_reader *reader,
+		     const char *controller, const char *path,
+		     const char *file,
+		     const struct cgroup_stat_entry **entries, int *count);
+
+/**
+ * Opaque stats collector, see cgroup_stat_collector_new().  A collector
+ * samples many stats files at once and reports how their values changed
+ * since the previous sample.  The files stay open and are read again from
+ * the start, so a sample opens nothing and parses each file once.
+ */
+struct cgroup_stat_collector;
+
+/**
+ * One value sampled by a collector.
+ */
+struct cgroup_stat_delta {
+	/** The file, as returned by cgroup_stat_collector_add(). */
+	int source;
+	/** Id of the key, see cgroup_stat_key_name(). */
+	int key;
+	/** Device of a "MAJ:MIN" line, both 0 for "key value" lines. */
+	unsigned int major;
+	unsigned int minor;
+	/** The value read by this sample. */
+	uint64_t value;
+	/** Change since the previous sample, 0 if the value is new. */
+	int64_t delta;
+	/** The change per second, 0 if the value is new. */
+	double rate;
+};
+
+/**
+ * Create a stats collector.
+ * @return The collector, NULL if out of memory.
+ */
+struct cgroup_stat_collector *cgroup_stat_collector_new(void);
+
+/**
+ * Free a stats collector, closing its files.
+ * @param collector The collector, set to NULL.
+ */
+void cgroup_stat_collector_free(struct cgroup_stat_collector **collector);
+
+/**
+ * Add a stats file to a collector.
+ * @param collector The collector.
+ * @param controller Name of the controller the file belongs to.
+ * @param path The path to control group, relative to hierarchy root.
+ * @param file Name of the stats file, e.g. "cpu.stat".
+ * @param keys The keys to sample, NULL to sample all of them.
+ * @param count Number of keys.
+ * @param source Returned id of the file, reported in the samples.
+ */
+int cgroup_stat_collector_add(struct cgroup_stat_collector *collector,
+			      const char *controller, const char *path,
+			      const char *file, const char * const keys[],
+			      int count, int *source);
+
+/**
+ * Sample all the files of a collector.  A file that cannot be read, e.g.
+ * because its group was removed, reports no values and is opened again by
+ * the following samples, so it starts over once the group exists again.
+ * If a sample fails partway, the files sampled before the failure keep
+ * their new values, and their next rates use the time since this sample.
+ * @param collector The collector.
+ * @param deltas Returned values of all files, in the order they were added
+ * and in file order.  They are valid until the next sample.
+ * @param count Returned number of values.
+ */
+int cgroup_stat_collector_sample(struct cgroup_stat_collector *collector,
+				 const struct cgroup_stat_delta **deltas,
+				 int *count);
+
+/**
+ * @}
+ *
+ * @name Watch group events
+ * Get notified of the changes of the cgroup.events and memory.events files
+ * of cgroup v2 groups instead of polling them.  The kernel reports every
+ * change of these files to inotify.  A watcher reads only the files that
+ * changed, once per call however many times they changed, and reports the
+ * values that differ from the previous read as typed events.  A group that
+ * got and lost its processes between two reads reports nothing.
+ * @{
+ */
+
+/**
+ * Opaque event watcher, see cgroup_event_watcher_new().
+ */
+struct cgroup_event_watcher;
+
+/**
+ * Files of a group to watch.
+ */
+enum cgroup_event_file {
+	/** cgroup.events: populated and frozen. */
+	CGROUP_EVENT_FILE_GROUP = 1,
+	/** memory.events: low, high, max, oom, oom_kill and oom_group_kill. */
+	CGROUP_EVENT_FILE_MEMORY = 2,
+};
+
+/**
+ * Type of an event.
+ */
+enum cgroup_event_type {
+	/** The group got or lost its processes, value is 0 or 1. */
+	CGROUP_EVENT_POPULATED = 0,
+	/** The group was frozen or thawed, value is 0 or 1. */
+	CGROUP_EVENT_FROZEN,
+	/** The memory.events counters, value is the new count. */
+	CGROUP_EVENT_MEMORY_LOW,
+	CGROUP_EVENT_MEMORY_HIGH,
+	CGROUP_EVENT_MEMORY_MAX,
+	CGROUP_EVENT_MEMORY_OOM,
+	CGROUP_EVENT_MEMORY_OOM_KILL,
+	CGROUP_EVENT_MEMORY_OOM_GROUP_KILL,
+	/**
+	 * The group was removed.  The watch reports nothing more until the
+	 * group is created again, unless its parent directory was removed
+	 * too.
+	 */
+	CGROUP_EVENT_REMOVED,
+	/**
+	 * A removed group was created again.  Its files are read again, the
+	 * following events report the changes from these values.
+	 */
+	CGROUP_EVENT_CREATED,
+	CGROUP_EVENT_MAX,
+};
+
+/**
+ * A change of a watched group.
+ */
+struct cgroup_event {
+	/** Id of the watch, as returned by cgroup_event_watcher_add(). */
+	int id;
+	/** The group, as given to cgroup_event_watcher_add(). */
+	const char *path;
+	enum cgroup_event_type type;
+	/** The new value. */
+	uint64_t value;
+	/** Increase of a counter since the previous read, 0 for states. */
+	uint64_t delta;
+};
+
+/**
+ * Create an event watcher.
+ * @return The watcher, NULL on error.
+ */
+struct cgroup_event_watcher *cgroup_event_watcher_new(void);
+
+/**
+ * Free an event watcher and all its watches.
+ * @param watcher The watcher, set to NULL.
+ */
+void cgroup_event_watcher_free(struct cgroup_event_watcher **watcher);
+
+/**
+ * Start watching a group.  Its files are read once, the following events
+ * report the changes from these values.
+ * @param watcher The watcher.
+ * @param path The path to control group, relative to hierarchy root.
+ * @param files The files to watch, a mask of #cgroup_event_file.
+ * @param id Set to the id of the watch, a small integer which is reused once
+ * the watch is removed.
+ * @return 0 on success, #ECGROUPNOTEXIST if the group does not exist,
+ * #ECGROUPUNSUPP if a file is not on a cgroup v2 hierarchy,
+ * #ECGVALUEEXISTS if the group is watched already.
+ */
+int cgroup_event_watcher_add(struct cgroup_event_watcher *watcher,
+			     const char *path, int files, int *id);
+
+/**
+ * Stop watching a group.
+ * @param watcher The watcher.
+ * @param id The id of the watch.
+ * @return 0 on success, #ECGINVAL if there is no such watch.
+ */
+int cgroup_event_watcher_remove(struct cgroup_event_watcher *watcher,
+				int id);
+
+/**
+ * Get the file descriptor of a watcher, to wait for it with poll() or
+ * epoll.  It is readable when cgroup_event_watcher_read() has events to
+ * report.
+ * @param watcher The watcher.
+ * @return The file descriptor.
+ */
+int cgroup_event_watcher_fd(struct cgroup_event_watcher *watcher);
+
+/**
+ * Read the pending changes of the watched groups, without blocking.
+ * @param watcher The watcher.
+ * @param events Set to the events.  The array belongs to the watcher and is
+ * valid until the next call.
+ * @param count Set to the number of events, 0 if nothing changed.
+ * @return 0 on success, #ECGOTHER on error.
+ */
+int cgroup_event_watcher_read(struct cgroup_event_watcher *watcher,
+			      const struct cgroup_event **events, int *count);
+
 /**
  * @}
  *
@@ -134,6 +134,67 @@ void cgroup_print_rules_config(FILE *fp);
  */
 int cgroup_change_all_cgroups(void);
 
+/**
+ * Progress of a scan started by cgroup_change_all_cgroups_begin().
+ */
+struct cgroup_change_all_stats {
+	/** Number of processes found in /proc when the scan started. */
+	int total;
+	/** Number of processes handled so far. */
+	int done;
+	/** Number of processes which could not be moved. */
+	int failed;
+	/** Time elapsed since the scan started, in microseconds. */
+	unsigned long long elapsed_usec;
+};
+
+/**
+ * Start an incremental scan, which changes the cgroup of all running PIDs
+ * based on the cached rules, like cgroup_change_all_cgroups() does.  The
+ * process details are read from /proc by a pool of worker threads, the
+ * processes are then moved by the caller in cgroup_change_all_cgroups_next().
+ * This allows the caller to handle other work in between the chunks.
+ *
+ * The scan must be ended by cgroup_change_all_cgroups_end().
+ * @param workers Number of worker threads, 0 selects a default based on the
+ *	number of online CPUs.
+ * @param handle Handle to be used in next calls, filled by this function.
+ * @return 0 on success, > 0 on error.
+ */
+int cgroup_change_all_cgroups_begin(int workers, void **handle);
+
+/**
+ * Handle the next chunk of processes of a scan started by
+ * cgroup_change_all_cgroups_begin().  The details of all processes of the
+ * chunk are read in parallel, just before they are moved, so changes made by
+ * the processes in between the chunks are never undone.
+ * @param handle Handle returned by cgroup_change_all_cgroups_begin().
+ * @param count Maximum number of processes to handle.
+ * @param stats Progress of the scan, filled by this function.  May be NULL.
+ * @return 0 when there are more processes to handle, #ECGEOF when the scan
+ *	is complete, > 0 on error.
+ */
+int cgroup_change_all_cgroups_next(void **handle, int count,
+				   struct cgroup_change_all_stats *stats);
+
+/**
+ * Leave a process alone in a scan started by cgroup_change_all_cgroups_begin(),
+ * e.g. because it was registered as unchanged meanwhile.  Nothing happens if
+ * the process was handled already or was not running when the scan started.
+ * @param handle Handle returned by cgroup_change_all_cgroups_begin().
+ * @param pid The process to skip.
+ * @return 0 on success, > 0 on error.
+ */
+int cgroup_change_all_cgroups_skip(void **handle, pid_t pid);
+
+/**
+ * End a scan started by cgroup_change_all_cgroups_begin(), stop the worker
+ * threads and release all resources.  Processes not handled yet are skipped.
+ * @param handle Handle returned by cgroup_change_all_cgroups_begin().
+ * @return 0 on success, > 0 on error.
+ */
+int cgroup_change_all_cgroups_end(void **handle);
+
 /**
  * Changes the cgroup of a program based on the rules in the config file.
  * If a rule exists for the given UID, GID or PROCESS NAME, then the given
@@ -203,6 +264,20 @@ int cgroup_change_cgroup_uid_gid(uid_t uid, gid_t gid, pid_t pid);
  */
 int cgroup_register_unchanged_process(pid_t pid, int flags);
 
+/**
+ * Register several unchanged processes to a cgrulesengd daemon at once.
+ * The processes are sent in batches over a connection which is kept open
+ * for subsequent calls, so registering many processes is much cheaper than
+ * calling cgroup_register_unchanged_process() for each of them.
+ * If the daemon does not work, this function returns 0 as success.
+ * @param pids Array of task ids.
+ * @param flags Array of bit flags, one for each task, as defined in
+ *	#cgroup_daemon_type
+ * @param count Number of tasks in the arrays.
+ */
+int cgroup_register_unchanged_processes(const pid_t *pids, const int *flags,
+					int count);
+
 /**
  * @}
  * @}
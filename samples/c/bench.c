@@ -0,0 +1,766 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Benchmarks of the libcgroup hot paths.
+ *
+ * The benchmarks run against a fake cgroup v1 hierarchy generated in a
+ * temporary directory and passed to the library through
+ * CGROUP_ROOT_OVERRIDE, together with a rules file passed through
+ * CGRULES_CONF_OVERRIDE, so they need neither root nor mounted cgroups and
+ * give repeatable results.  The latter is honoured by the unit test build of
+ * the library only, which the benchmark is linked with.  Every benchmark
+ * prints one line of space separated key=value pairs:
+ *
+ *	name=<name> ops=<n> ops_per_sec=<n> allocs_per_op=<n>
+ *	syscalls_per_op=<n>
+ *
+ * The allocations are counted by interposing malloc() and friends, the
+ * system calls by tracing a forked copy of the benchmark with ptrace().
+ * syscalls_per_op is -1 if the system does not allow that, and -c then
+ * exits with 77, the automake code for a skipped test, unless a budget was
+ * exceeded, because the system call budgets cannot be checked.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <ftw.h>
+
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Run every benchmark for at least this long */
+#define BENCH_MIN_NS	(500 * 1000 * 1000ULL)
+#define BENCH_MIN_OPS	10
+
+/* Number of operations traced to count the system calls */
+#define BENCH_TRACE_OPS	20
+
+#define CPU_HIER	"cpu,cpuacct"
+#define MEMORY_HIER	"memory"
+
+/* The cost of the benchmark depends on the size of the hierarchy */
+#define NO_BUDGET	-1
+
+/* Exit code of -c when the system call budgets cannot be checked */
+#define BENCH_SKIPPED	77
+
+struct bench {
+	const char *name;
+	int (*setup)(void);
+	int (*run)(void);
+	void (*teardown)(void);
+	/* Most allocations and system calls per operation allowed by -c */
+	int max_allocs;
+	int max_syscalls;
+};
+
+static char root[] = "/tmp/cgbench-XXXXXX";
+static char config_path[FILENAME_MAX];
+static char rules_path[FILENAME_MAX];
+static int num_groups = 100;
+static int num_procs = 100;
+static int check_budgets;
+static int syscalls_unchecked;
+
+static struct cgroup *bench_cgroup;
+static struct cgroup_stat_reader *bench_reader;
+static struct cgroup_stat_collector *bench_collector;
+static struct cgroup_bulk_request *bench_requests;
+
+static unsigned long long allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return (unsigned long long)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int write_file(const char *dir, const char *name, const char *value)
+{
+	char path[FILENAME_MAX];
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >=
+	    (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	f = fopen(path, "we");
+	if (!f)
+		return -1;
+
+	fputs(value, f);
+
+	return fclose(f);
+}
+
+static int create_group(const char *hier, const char *name, const char *procs)
+{
+	char dir[FILENAME_MAX];
+	int ret = 0;
+
+	snprintf(dir, sizeof(dir), "%s/%s/%s", root, hier, name);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	ret |= write_file(dir, "tasks", procs);
+	ret |= write_file(dir, "cgroup.procs", procs);
+	ret |= write_file(dir, "notify_on_release", "0\n");
+
+	if (strcmp(hier, CPU_HIER) == 0) {
+		ret |= write_file(dir, "cpu.shares", "1024\n");
+		ret |= write_file(dir, "cpu.cfs_period_us", "100000\n");
+		ret |= write_file(dir, "cpu.cfs_quota_us", "-1\n");
+		ret |= write_file(dir, "cpuacct.usage", "123456789\n");
+		ret |= write_file(dir, "cpuacct.stat",
+				  "user 1234\nsystem 567\n");
+	} else {
+		ret |= write_file(dir, "memory.limit_in_bytes",
+				  "9223372036854771712\n");
+		ret |= write_file(dir, "memory.usage_in_bytes", "1048576\n");
+		ret |= write_file(dir, "memory.stat",
+				  "cache 1048576\nrss 2097152\n"
+				  "rss_huge 0\nshmem 0\nmapped_file 4096\n"
+				  "dirty 0\nwriteback 0\nswap 0\n"
+				  "pgpgin 1024\npgpgout 512\npgfault 4096\n"
+				  "pgmajfault 8\ninactive_anon 0\n"
+				  "active_anon 2097152\ninactive_file 524288\n"
+				  "active_file 524288\nunevictable 0\n"
+				  "hierarchical_memory_limit "
+				  "9223372036854771712\n");
+	}
+
+	return ret;
+}
+
+/*
+ * Generate the fake hierarchy: a cpu,cpuacct and a memory hierarchy, each
+ * holding bench/g0 ... bench/g<num_groups - 1>, a configuration file
+ * setting a value in all of these groups and a rules file whose last rule
+ * matches the process name used by change_cgroup_flags.
+ */
+static int create_fake_hierarchy(void)
+{
+	const char *hiers[] = { CPU_HIER, MEMORY_HIER };
+	char name[FILENAME_MAX];
+	char *procs, *p;
+	int ret = 0;
+	FILE *f;
+	int i, j;
+
+	if (!mkdtemp(root)) {
+		perror(root);
+		return -1;
+	}
+
+	procs = malloc(num_procs * 12 + 1);
+	if (!procs)
+		return -1;
+
+	p = procs;
+	*p = '\0';
+	for (i = 0; i < num_procs; i++)
+		p += sprintf(p, "%d\n", 1000 + i);
+
+	for (i = 0; i < 2; i++) {
+		snprintf(name, sizeof(name), "%s/%s", root, hiers[i]);
+		if (mkdir(name, 0755) < 0) {
+			ret = -1;
+			break;
+		}
+
+		ret |= create_group(hiers[i], "", procs);
+		ret |= create_group(hiers[i], "bench", procs);
+		for (j = 0; j < num_groups; j++) {
+			snprintf(name, sizeof(name), "bench/g%d", j);
+			ret |= create_group(hiers[i], name, procs);
+		}
+	}
+	free(procs);
+
+	if (ret) {
+		fprintf(stderr, "cannot create the fake hierarchy in %s\n",
+			root);
+		return -1;
+	}
+
+	snprintf(config_path, sizeof(config_path), "%s/cgconfig.conf", root);
+	f = fopen(config_path, "we");
+	if (!f)
+		return -1;
+
+	for (j = 0; j < num_groups; j++) {
+		fprintf(f, "group bench/g%d {\n", j);
+		fprintf(f, "\tcpu {\n\t\tcpu.shares = %d;\n\t}\n", 512 + j);
+		fprintf(f, "\tmemory {\n");
+		fprintf(f, "\t\tmemory.limit_in_bytes = %d;\n",
+			1048576 * (j + 1));
+		fprintf(f, "\t}\n}\n");
+	}
+
+	if (fclose(f))
+		return -1;
+
+	snprintf(rules_path, sizeof(rules_path), "%s/cgrules.conf", root);
+	f = fopen(rules_path, "we");
+	if (!f)
+		return -1;
+
+	for (j = 1; j < num_groups && j < 10; j++)
+		fprintf(f, "*:cgbench%d\tcpu\tbench/g%d/\n", j, j);
+	fprintf(f, "*:cgbench\tcpu,memory\tbench/g0/\n");
+
+	return fclose(f);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type,
+			struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+static int bench_get_cgroup(void)
+{
+	struct cgroup *cgroup;
+	int ret;
+
+	cgroup = cgroup_new_cgroup("bench/g0");
+	if (!cgroup)
+		return ECGFAIL;
+
+	ret = cgroup_get_cgroup(cgroup);
+	cgroup_free(&cgroup);
+
+	return ret;
+}
+
+static int setup_modify_cgroup(void)
+{
+	struct cgroup_controller *cpu, *memory;
+
+	bench_cgroup = cgroup_new_cgroup("bench/g0");
+	if (!bench_cgroup)
+		return ECGFAIL;
+
+	cpu = cgroup_add_controller(bench_cgroup, "cpu");
+	memory = cgroup_add_controller(bench_cgroup, "memory");
+	if (!cpu || !memory)
+		return ECGFAIL;
+
+	if (cgroup_add_value_string(cpu, "cpu.shares", "2048") ||
+	    cgroup_add_value_string(cpu, "cpu.cfs_quota_us", "50000") ||
+	    cgroup_add_value_string(memory, "memory.limit_in_bytes",
+				    "1073741824"))
+		return ECGFAIL;
+
+	return 0;
+}
+
+static int setup_get_cgroup(void)
+{
+	bench_cgroup = cgroup_new_cgroup("bench/g0");
+	if (!bench_cgroup)
+		return ECGFAIL;
+
+	return cgroup_get_cgroup(bench_cgroup);
+}
+
+static void teardown_cgroup(void)
+{
+	cgroup_free(&bench_cgroup);
+}
+
+static int bench_modify_cgroup(void)
+{
+	return cgroup_modify_cgroup(bench_cgroup);
+}
+
+static int bench_get_value_string(void)
+{
+	struct cgroup_controller *cpu;
+	char *value;
+	int ret;
+
+	cpu = cgroup_get_controller(bench_cgroup, "cpu");
+	if (!cpu)
+		return ECGFAIL;
+
+	ret = cgroup_get_value_string(cpu, "cpu.shares", &value);
+	if (!ret)
+		free(value);
+
+	return ret;
+}
+
+static int bench_walk_tree(void)
+{
+	struct cgroup_file_info info;
+	void *handle;
+	int level;
+	int ret;
+
+	ret = cgroup_walk_tree_begin("cpu", "/", 0, &handle, &info, &level);
+	while (!ret)
+		ret = cgroup_walk_tree_next(0, &handle, &info, level);
+	cgroup_walk_tree_end(&handle);
+
+	return ret == ECGEOF ? 0 : ret;
+}
+
+static int bench_read_stats(void)
+{
+	struct cgroup_stat stat;
+	void *handle;
+	int ret;
+
+	ret = cgroup_read_stats_begin("memory", "bench/g0", &handle, &stat);
+	while (!ret)
+		ret = cgroup_read_stats_next(&handle, &stat);
+	cgroup_read_stats_end(&handle);
+
+	return ret == ECGEOF ? 0 : ret;
+}
+
+static int setup_stat_read(void)
+{
+	const struct cgroup_stat_entry *entries;
+	int count;
+
+	bench_reader = cgroup_stat_reader_new();
+	if (!bench_reader)
+		return ECGOTHER;
+
+	/* Intern the keys, like any reader after its first read */
+	return cgroup_stat_read(bench_reader, "memory", "bench/g0",
+				"memory.stat", &entries, &count);
+}
+
+static void teardown_stat_read(void)
+{
+	cgroup_stat_reader_free(&bench_reader);
+}
+
+static int bench_stat_read(void)
+{
+	const struct cgroup_stat_entry *entries;
+	int count;
+
+	return cgroup_stat_read(bench_reader, "memory", "bench/g0",
+				"memory.stat", &entries, &count);
+}
+
+static int setup_stat_collect(void)
+{
+	const struct cgroup_stat_delta *deltas;
+	char path[FILENAME_MAX];
+	int ret, source, count;
+	int i;
+
+	bench_collector = cgroup_stat_collector_new();
+	if (!bench_collector)
+		return ECGOTHER;
+
+	for (i = 0; i < num_groups; i++) {
+		snprintf(path, sizeof(path), "bench/g%d", i);
+		ret = cgroup_stat_collector_add(bench_collector, "memory", path,
+						"memory.stat", NULL, 0,
+						&source);
+		if (ret)
+			return ret;
+	}
+
+	/* The first sample sizes the columns */
+	return cgroup_stat_collector_sample(bench_collector, &deltas, &count);
+}
+
+static void teardown_stat_collect(void)
+{
+	cgroup_stat_collector_free(&bench_collector);
+}
+
+static int bench_stat_collect(void)
+{
+	const struct cgroup_stat_delta *deltas;
+	int count;
+
+	return cgroup_stat_collector_sample(bench_collector, &deltas, &count);
+}
+
+/* Value of memory.limit_in_bytes in the fake hierarchy */
+#define BENCH_LIMIT	"9223372036854771712"
+
+static int setup_bulk(void)
+{
+	struct cgroup_bulk_request *req;
+	int i;
+
+	bench_requests = calloc(num_groups, sizeof(*bench_requests));
+	if (!bench_requests)
+		return ECGOTHER;
+
+	for (i = 0; i < num_groups; i++) {
+		req = &bench_requests[i];
+		req->controller = "memory";
+		req->file = "memory.limit_in_bytes";
+		req->size = sizeof(BENCH_LIMIT) + 1;
+		req->value = malloc(req->size);
+		if (!req->value || asprintf((char **)&req->path, "bench/g%d",
+					    i) < 0)
+			return ECGOTHER;
+	}
+
+	return 0;
+}
+
+static void teardown_bulk(void)
+{
+	int i;
+
+	for (i = 0; i < num_groups; i++) {
+		free((char *)bench_requests[i].path);
+		free(bench_requests[i].value);
+	}
+	free(bench_requests);
+	bench_requests = NULL;
+}
+
+static int bench_bulk_get(void)
+{
+	return cgroup_bulk_get(bench_requests, num_groups);
+}
+
+static int bench_bulk_set(void)
+{
+	int i;
+
+	for (i = 0; i < num_groups; i++)
+		strcpy(bench_requests[i].value, BENCH_LIMIT);
+
+	return cgroup_bulk_set(bench_requests, num_groups);
+}
+
+static int bench_get_procs(void)
+{
+	pid_t *pids = NULL;
+	int size, ret;
+
+	ret = cgroup_get_procs("bench/g0", "cpu", &pids, &size);
+	free(pids);
+
+	return ret;
+}
+
+static int bench_attach_task_pid(void)
+{
+	return cgroup_attach_task_pid(bench_cgroup, getpid());
+}
+
+static int setup_change_cgroup(void)
+{
+	return cgroup_init_rules_cache();
+}
+
+static int bench_change_cgroup(void)
+{
+	return cgroup_change_cgroup_flags(getuid(), getgid(),
+					  "/usr/bin/cgbench", getpid(),
+					  CGFLAG_USECACHE);
+}
+
+static int bench_load_config(void)
+{
+	return cgroup_config_load_config(config_path);
+}
+
+static int bench_convert_cgroup(void)
+{
+	struct cgroup *out;
+	int ret;
+
+	out = cgroup_new_cgroup("bench/g0");
+	if (!out)
+		return ECGFAIL;
+
+	/* Convert to the version on disk, like cgxset does */
+	ret = cgroup_convert_cgroup(out, CGROUP_DISK, bench_cgroup, CGROUP_V1);
+	cgroup_free(&out);
+
+	return ret;
+}
+
+/*
+ * The budgets are the costs measured when the benchmark was last tuned plus
+ * about a quarter, so -c does not fail because of a different libc or
+ * kernel, but does when a change makes a hot path noticeably more
+ * expensive.  A cost of zero is kept exact.  Tighten the budgets when making
+ * a hot path cheaper.
+ */
+static const struct bench benches[] = {
+	{ "get_cgroup", NULL, bench_get_cgroup, NULL, 90, 104 },
+	{ "get_value_string", setup_get_cgroup, bench_get_value_string,
+	  teardown_cgroup, 1, 0 },
+	{ "modify_cgroup", setup_modify_cgroup, bench_modify_cgroup,
+	  teardown_cgroup, 12, 12 },
+	{ "walk_tree", NULL, bench_walk_tree, NULL, NO_BUDGET, NO_BUDGET },
+	{ "read_stats", NULL, bench_read_stats, NULL, 27, 7 },
+	{ "stat_read", setup_stat_read, bench_stat_read, teardown_stat_read,
+	  0, 4 },
+	/* One pread() per group */
+	{ "stat_collect", setup_stat_collect, bench_stat_collect,
+	  teardown_stat_collect, 0, NO_BUDGET },
+	/* The system calls depend on the engine and on the threads */
+	{ "bulk_get", setup_bulk, bench_bulk_get, teardown_bulk, NO_BUDGET,
+	  NO_BUDGET },
+	{ "bulk_set", setup_bulk, bench_bulk_set, teardown_bulk, NO_BUDGET,
+	  NO_BUDGET },
+	{ "get_procs", NULL, bench_get_procs, NULL, NO_BUDGET, NO_BUDGET },
+	{ "attach_task_pid", setup_get_cgroup, bench_attach_task_pid,
+	  teardown_cgroup, 8, 17 },
+	/* Matches the last of the bundled rules and moves the process */
+	{ "change_cgroup_flags", setup_change_cgroup, bench_change_cgroup,
+	  NULL, 35, 20 },
+	{ "config_load_config", NULL, bench_load_config, NULL, NO_BUDGET,
+	  NO_BUDGET },
+	{ "convert_cgroup", setup_modify_cgroup, bench_convert_cgroup,
+	  teardown_cgroup, 12, 0 },
+};
+
+/*
+ * Count the system calls done by BENCH_TRACE_OPS runs of a benchmark.  The
+ * runs happen in a forked child traced by this process, so the timed runs
+ * are not slowed down.
+ */
+static double count_syscalls(const struct bench *b)
+{
+	long syscalls = 0;
+	int status, sig;
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			_exit(1);
+		raise(SIGSTOP);
+
+		for (i = 0; i < BENCH_TRACE_OPS; i++)
+			b->run();
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status) ||
+	    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+		   (void *)PTRACE_O_TRACESYSGOOD) < 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		return -1;
+	}
+
+	sig = 0;
+	while (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) == 0) {
+		if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+			break;
+
+		sig = 0;
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+			syscalls++;
+		else if (WSTOPSIG(status) != SIGTRAP)
+			sig = WSTOPSIG(status);
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+
+	/* Every call stops on entry and exit, except the final _exit() */
+	return (double)((syscalls - 1) / 2) / BENCH_TRACE_OPS;
+}
+
+static int run_bench(const struct bench *b)
+{
+	unsigned long long start, elapsed, start_allocs;
+	unsigned long long ops = 0;
+	double syscalls, allocs_per_op;
+	int ret;
+
+	if (b->setup) {
+		ret = b->setup();
+		if (ret) {
+			fprintf(stderr, "%s: skipped, setup failed: %s\n",
+				b->name, cgroup_strerror(ret));
+			goto teardown;
+		}
+	}
+
+	/* Warm up and check that the benchmark works at all */
+	ret = b->run();
+	if (ret) {
+		fprintf(stderr, "%s: skipped, failed: %s\n", b->name,
+			cgroup_strerror(ret));
+		goto teardown;
+	}
+
+	syscalls = count_syscalls(b);
+
+	start_allocs = allocs;
+	start = now_ns();
+	do {
+		b->run();
+		ops++;
+		elapsed = now_ns() - start;
+	} while (elapsed < BENCH_MIN_NS || ops < BENCH_MIN_OPS);
+
+	allocs_per_op = (double)(allocs - start_allocs) / ops;
+
+	printf("name=%s ops=%llu ops_per_sec=%.0f allocs_per_op=%.2f ", b->name,
+	       ops, ops * 1e9 / elapsed, allocs_per_op);
+	printf("syscalls_per_op=%.2f\n", syscalls);
+	fflush(stdout);
+
+	if (!check_budgets)
+		goto teardown;
+
+	if (b->max_allocs != NO_BUDGET && allocs_per_op > b->max_allocs) {
+		fprintf(stderr, "%s: %.2f allocations per op, budget is %d\n",
+			b->name, allocs_per_op, b->max_allocs);
+		ret = ECGFAIL;
+	}
+
+	if (b->max_syscalls != NO_BUDGET && syscalls < 0) {
+		fprintf(stderr, "%s: cannot count the system calls with ",
+			b->name);
+		fprintf(stderr, "ptrace(), budget of %d not checked\n",
+			b->max_syscalls);
+		syscalls_unchecked = 1;
+	} else if (b->max_syscalls != NO_BUDGET &&
+		   syscalls > b->max_syscalls) {
+		fprintf(stderr, "%s: %.2f system calls per op, budget is %d\n",
+			b->name, syscalls, b->max_syscalls);
+		ret = ECGFAIL;
+	}
+
+teardown:
+	if (b->teardown)
+		b->teardown();
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c] [-g <groups>] [-p <pids>] ", prog);
+	fprintf(stderr, "[benchmark...]\n");
+	fprintf(stderr, "  -c  fail if a benchmark exceeds its allocation or ");
+	fprintf(stderr, "system call budget\n");
+	fprintf(stderr, "  -g  number of groups in the fake hierarchy\n");
+	fprintf(stderr, "  -p  number of pids in each group\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+	int opt, ret;
+	size_t i;
+	int j;
+
+	while ((opt = getopt(argc, argv, "cg:p:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			check_budgets = 1;
+			break;
+		case 'g':
+			num_groups = atoi(optarg);
+			break;
+		case 'p':
+			num_procs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (num_groups < 1 || num_procs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (create_fake_hierarchy()) {
+		failed = 1;
+		goto cleanup;
+	}
+
+	/* The library re-initializes itself when loading configuration */
+	setenv("CGROUP_ROOT_OVERRIDE", root, 1);
+	setenv("CGRULES_CONF_OVERRIDE", rules_path, 1);
+
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed with %s\n",
+			cgroup_strerror(ret));
+		failed = 1;
+		goto cleanup;
+	}
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (optind < argc) {
+			for (j = optind; j < argc; j++) {
+				if (strcmp(argv[j], benches[i].name) == 0)
+					break;
+			}
+			if (j == argc)
+				continue;
+		}
+
+		if (run_bench(&benches[i]))
+			failed = 1;
+	}
+
+cleanup:
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	if (!failed && syscalls_unchecked)
+		return BENCH_SKIPPED;
+
+	return failed;
+}
@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Tests of the removal of groups with CGFLAG_DELETE_KILL and
+ * CGFLAG_DELETE_FREEZE.
+ *
+ * The test runs against a fake cpu,cpuacct cgroup v1 hierarchy and a fake
+ * cgroup v2 hierarchy shared by the memory and pids controllers, generated
+ * in a temporary directory and passed to the library through
+ * CGROUP_ROOT_OVERRIDE.  Unlike on cgroupfs, the control files of a fake
+ * group are regular files which keep it from being removed, so rmdir() is
+ * interposed to remove them with the group, after recording the values
+ * written to cgroup.kill and cgroup.freeze.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <ftw.h>
+
+#include <sys/syscall.h>
+#include <sys/stat.h>
+
+#define V1_HIER		"cpu,cpuacct"
+#define V2_HIER		"unified"
+
+static char root[] = "/tmp/cgdelete-XXXXXX";
+static int failures;
+
+/* The files of the last group removed, "" if it had none */
+static char removed_kill[16];
+static char removed_freeze[16];
+
+/* rmdir() fails with this error if set */
+static int rmdir_errno;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+static void read_file(const char *dir, const char *name, char *buf,
+		      size_t size)
+{
+	char path[FILENAME_MAX];
+	ssize_t n = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		n = read(fd, buf, size - 1);
+		close(fd);
+	}
+	buf[n > 0 ? n : 0] = '\0';
+}
+
+/*
+ * Remove a group like cgroupfs does, together with its control files.
+ */
+int rmdir(const char *path)
+{
+	struct dirent *dent;
+	DIR *dir;
+
+	if (rmdir_errno) {
+		errno = rmdir_errno;
+		return -1;
+	}
+
+	read_file(path, "cgroup.kill", removed_kill, sizeof(removed_kill));
+	read_file(path, "cgroup.freeze", removed_freeze,
+		  sizeof(removed_freeze));
+
+	dir = opendir(path);
+	if (dir) {
+		/* Subgroups fail to be removed and keep the group */
+		while ((dent = readdir(dir)) != NULL)
+			unlinkat(dirfd(dir), dent->d_name, 0);
+		closedir(dir);
+	}
+
+	return syscall(SYS_unlinkat, AT_FDCWD, path, AT_REMOVEDIR);
+}
+
+static int write_file(const char *hier, const char *group, const char *name,
+		      const char *value)
+{
+	char path[FILENAME_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s/%s/%s", root, hier, group, name);
+	f = fopen(path, "we");
+	if (!f)
+		return -1;
+
+	fputs(value, f);
+
+	return fclose(f);
+}
+
+static const char *group_file(const char *hier, const char *group,
+			      const char *name)
+{
+	static char buf[64];
+	char dir[FILENAME_MAX];
+
+	snprintf(dir, sizeof(dir), "%s/%s/%s", root, hier, group);
+	read_file(dir, name, buf, sizeof(buf));
+
+	return buf;
+}
+
+static int group_exists(const char *hier, const char *group)
+{
+	char dir[FILENAME_MAX];
+
+	snprintf(dir, sizeof(dir), "%s/%s/%s", root, hier, group);
+
+	return access(dir, F_OK) == 0;
+}
+
+/*
+ * Create the group del holding a few processes, in both hierarchies, and
+ * empty the files of their root groups.
+ */
+static int create_groups(void)
+{
+	char dir[FILENAME_MAX];
+	int ret = 0;
+
+	snprintf(dir, sizeof(dir), "%s/%s/del", root, V1_HIER);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	ret |= write_file(V1_HIER, "", "tasks", "");
+	ret |= write_file(V1_HIER, "", "cgroup.procs", "");
+	ret |= write_file(V1_HIER, "del", "tasks", "201\n202\n203\n");
+	ret |= write_file(V1_HIER, "del", "cgroup.procs", "201\n");
+
+	snprintf(dir, sizeof(dir), "%s/%s/del", root, V2_HIER);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	ret |= write_file(V2_HIER, "", "cgroup.procs", "");
+	ret |= write_file(V2_HIER, "", "cgroup.kill", "");
+	ret |= write_file(V2_HIER, "", "cgroup.freeze", "");
+	ret |= write_file(V2_HIER, "del", "cgroup.controllers",
+			  "memory pids\n");
+	ret |= write_file(V2_HIER, "del", "cgroup.type", "domain\n");
+	ret |= write_file(V2_HIER, "del", "cgroup.procs", "101\n102\n");
+	ret |= write_file(V2_HIER, "del", "cgroup.events",
+			  "populated 0\nfrozen 0\n");
+	ret |= write_file(V2_HIER, "del", "cgroup.kill", "");
+	ret |= write_file(V2_HIER, "del", "cgroup.freeze", "0\n");
+
+	removed_kill[0] = '\0';
+	removed_freeze[0] = '\0';
+
+	return ret;
+}
+
+static int create_fake_hierarchy(void)
+{
+	char dir[FILENAME_MAX];
+	int ret = 0;
+
+	if (!mkdtemp(root)) {
+		perror(root);
+		return -1;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/%s", root, V1_HIER);
+	if (mkdir(dir, 0755) < 0)
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s/%s", root, V2_HIER);
+	if (mkdir(dir, 0755) < 0)
+		return -1;
+
+	ret |= write_file(V2_HIER, "", "cgroup.controllers", "memory pids\n");
+	ret |= write_file(V2_HIER, "", "cgroup.subtree_control",
+			  "memory pids\n");
+
+	return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type,
+			struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+/*
+ * Remove a group from the given controllers.
+ *	@return The error of cgroup_delete_cgroup_ext()
+ */
+static int delete_group(const char *name, const char *controllers[],
+			int flags)
+{
+	struct cgroup *cgroup;
+	int i, ret;
+
+	cgroup = cgroup_new_cgroup(name);
+	if (!cgroup)
+		return ECGFAIL;
+
+	for (i = 0; controllers[i]; i++) {
+		if (!cgroup_add_controller(cgroup, controllers[i])) {
+			cgroup_free(&cgroup);
+			return ECGFAIL;
+		}
+	}
+
+	ret = cgroup_delete_cgroup_ext(cgroup, flags);
+	cgroup_free(&cgroup);
+
+	return ret;
+}
+
+static const char *v1_controllers[] = { "cpu", NULL };
+static const char *v2_controllers[] = { "memory", "pids", NULL };
+
+static void test_flags(void)
+{
+	CHECK(create_groups() == 0);
+
+	CHECK(delete_group("del", v2_controllers,
+			   CGFLAG_DELETE_KILL |
+			   CGFLAG_DELETE_FREEZE) == ECGINVAL);
+	CHECK(delete_group("del", v2_controllers,
+			   CGFLAG_DELETE_KILL |
+			   CGFLAG_DELETE_EMPTY_ONLY) == ECGINVAL);
+	CHECK(delete_group("del", v2_controllers,
+			   CGFLAG_DELETE_FREEZE |
+			   CGFLAG_DELETE_EMPTY_ONLY) == ECGINVAL);
+
+	CHECK(group_exists(V2_HIER, "del"));
+	CHECK(strcmp(group_file(V2_HIER, "del", "cgroup.kill"), "") == 0);
+	CHECK(strcmp(group_file(V2_HIER, "del", "cgroup.freeze"), "0\n") == 0);
+}
+
+/*
+ * The root group is never killed nor frozen, and only its subgroups are
+ * removed.  del is removed first, so that the root group has none.
+ */
+static void test_root(void)
+{
+	CHECK(create_groups() == 0);
+	CHECK(delete_group("del", v2_controllers, CGFLAG_DELETE_KILL) == 0);
+
+	/* Without CGFLAG_DELETE_RECURSIVE, nothing is done */
+	CHECK(delete_group("/", v2_controllers, CGFLAG_DELETE_KILL) == 0);
+	CHECK(delete_group("/", v2_controllers,
+			   CGFLAG_DELETE_KILL |
+			   CGFLAG_DELETE_RECURSIVE) == ECGINVAL);
+	CHECK(delete_group("/", v2_controllers,
+			   CGFLAG_DELETE_FREEZE |
+			   CGFLAG_DELETE_RECURSIVE) == 0);
+
+	CHECK(group_exists(V2_HIER, ""));
+	CHECK(strcmp(group_file(V2_HIER, "", "cgroup.kill"), "") == 0);
+	CHECK(strcmp(group_file(V2_HIER, "", "cgroup.freeze"), "") == 0);
+}
+
+static void test_v1(void)
+{
+	/* cgroup v1 has no cgroup.kill */
+	CHECK(create_groups() == 0);
+	CHECK(delete_group("del", v1_controllers,
+			   CGFLAG_DELETE_KILL) == ECGROUPUNSUPP);
+	CHECK(group_exists(V1_HIER, "del"));
+	CHECK(strcmp(group_file(V1_HIER, "", "cgroup.procs"), "") == 0);
+
+	/*
+	 * Nor cgroup.freeze, whole processes are moved anyway.  The ids are
+	 * written one by one, again as long as the fake group lists them.
+	 */
+	CHECK(delete_group("del", v1_controllers, CGFLAG_DELETE_FREEZE) == 0);
+	CHECK(!group_exists(V1_HIER, "del"));
+	CHECK(strncmp(group_file(V1_HIER, "", "cgroup.procs"), "201", 3) == 0);
+	CHECK(strstr(group_file(V1_HIER, "", "cgroup.procs"), "202") == NULL);
+	CHECK(strcmp(group_file(V1_HIER, "", "tasks"), "") == 0);
+}
+
+/*
+ * The group is removed with the first controller, and is gone already for
+ * the second one.
+ */
+static void test_v2_shared(void)
+{
+	CHECK(create_groups() == 0);
+	CHECK(delete_group("del", v2_controllers, CGFLAG_DELETE_KILL) == 0);
+	CHECK(!group_exists(V2_HIER, "del"));
+	CHECK(removed_kill[0] == '1');
+	CHECK(strcmp(group_file(V2_HIER, "", "cgroup.procs"), "") == 0);
+
+	CHECK(create_groups() == 0);
+	CHECK(delete_group("del", v2_controllers, CGFLAG_DELETE_FREEZE) == 0);
+	CHECK(!group_exists(V2_HIER, "del"));
+	CHECK(removed_freeze[0] == '1');
+	CHECK(strncmp(group_file(V2_HIER, "", "cgroup.procs"),
+		      "101102", 6) == 0);
+
+	/* A group which fails to be removed is thawed */
+	CHECK(create_groups() == 0);
+	rmdir_errno = EBUSY;
+	CHECK(delete_group("del", v2_controllers,
+			   CGFLAG_DELETE_FREEZE) == ECGOTHER);
+	rmdir_errno = 0;
+	CHECK(group_exists(V2_HIER, "del"));
+	CHECK(group_file(V2_HIER, "del", "cgroup.freeze")[0] == '0');
+}
+
+int main(void)
+{
+	int ret;
+
+	if (create_fake_hierarchy()) {
+		fprintf(stderr, "cannot create the fake hierarchy in %s\n",
+			root);
+		failures++;
+		goto cleanup;
+	}
+
+	setenv("CGROUP_ROOT_OVERRIDE", root, 1);
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed with %s\n",
+			cgroup_strerror(ret));
+		failures++;
+		goto cleanup;
+	}
+
+	test_flags();
+	test_root();
+	test_v1();
+	test_v2_shared();
+
+cleanup:
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Tests of the cgroup.events and memory.events watcher.
+ *
+ * The test runs against a fake cgroup v2 hierarchy generated in a temporary
+ * directory and passed to the library through CGROUP_ROOT_OVERRIDE.  inotify
+ * reports the changes of its regular files like those of the kernel ones,
+ * so the test changes, removes and creates again the files and the groups
+ * and checks the events reported for them.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <ftw.h>
+
+#include <sys/stat.h>
+
+#define GROUP_EVENTS	"populated %d\nfrozen %d\n"
+#define MEMORY_EVENTS	"low 0\nhigh 0\nmax 0\noom %d\noom_kill %d\n" \
+			"oom_group_kill 0\n"
+
+static char root[] = "/tmp/cgevent-XXXXXX";
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+static int write_file(const char *group, const char *name, const char *fmt,
+		      int a, int b)
+{
+	char path[FILENAME_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/unified/%s/%s", root, group, name);
+	f = fopen(path, "we");
+	if (!f)
+		return -1;
+
+	fprintf(f, fmt, a, b);
+
+	return fclose(f);
+}
+
+static int create_group(const char *group)
+{
+	char dir[FILENAME_MAX];
+	int ret = 0;
+
+	snprintf(dir, sizeof(dir), "%s/unified/%s", root, group);
+	if (mkdir(dir, 0755) < 0)
+		return -1;
+
+	ret |= write_file(group, "cgroup.controllers", "memory\n", 0, 0);
+	ret |= write_file(group, "cgroup.events", GROUP_EVENTS, 0, 0);
+	ret |= write_file(group, "memory.events", MEMORY_EVENTS, 0, 0);
+
+	return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type,
+			struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+static void remove_group(const char *group)
+{
+	char dir[FILENAME_MAX];
+
+	snprintf(dir, sizeof(dir), "%s/unified/%s", root, group);
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Generate a cgroup v2 hierarchy with the memory controller, holding the
+ * groups ev and parent/ev.
+ */
+static int create_fake_hierarchy(void)
+{
+	char dir[FILENAME_MAX];
+	int ret = 0;
+
+	if (!mkdtemp(root)) {
+		perror(root);
+		return -1;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/unified", root);
+	if (mkdir(dir, 0755) < 0)
+		return -1;
+
+	ret |= write_file("", "cgroup.controllers", "memory\n", 0, 0);
+	ret |= write_file("", "cgroup.subtree_control", "memory\n", 0, 0);
+	ret |= create_group("ev");
+	ret |= create_group("parent");
+	ret |= create_group("parent/ev");
+
+	return ret;
+}
+
+/*
+ * Read the events of a watcher and check that they are exactly the given
+ * ones, in this order.
+ */
+static void check_events(struct cgroup_event_watcher *watcher,
+			 const struct cgroup_event *expected, int nr,
+			 int line)
+{
+	const struct cgroup_event *events;
+	int i, count, ret;
+
+	ret = cgroup_event_watcher_read(watcher, &events, &count);
+	if (ret || count != nr) {
+		fprintf(stderr, "%s:%d: read returned %d with %d events\n",
+			__FILE__, line, ret, count);
+		failures++;
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (events[i].id == expected[i].id &&
+		    strcmp(events[i].path, expected[i].path) == 0 &&
+		    events[i].type == expected[i].type &&
+		    events[i].value == expected[i].value &&
+		    events[i].delta == expected[i].delta)
+			continue;
+
+		fprintf(stderr, "%s:%d: event %d is %d %s %d %llu %llu\n",
+			__FILE__, line, i, events[i].id, events[i].path,
+			events[i].type, (unsigned long long)events[i].value,
+			(unsigned long long)events[i].delta);
+		failures++;
+	}
+}
+
+#define CHECK_EVENTS(watcher, ...)					\
+	do {								\
+		const struct cgroup_event expected[] = { __VA_ARGS__ };\
+									\
+		check_events(watcher, expected,				\
+			     sizeof(expected) / sizeof(expected[0]),	\
+			     __LINE__);					\
+	} while (0)
+
+#define CHECK_NO_EVENTS(watcher) check_events(watcher, NULL, 0, __LINE__)
+
+static void test_add(struct cgroup_event_watcher *watcher)
+{
+	int id, other;
+
+	CHECK(cgroup_event_watcher_add(watcher, "ev", CGROUP_EVENT_FILE_GROUP,
+				       &id) == 0);
+
+	/* A group is watched once only */
+	CHECK(cgroup_event_watcher_add(watcher, "ev", CGROUP_EVENT_FILE_GROUP,
+				       &other) == ECGVALUEEXISTS);
+
+	CHECK(cgroup_event_watcher_add(watcher, "missing",
+				       CGROUP_EVENT_FILE_GROUP,
+				       &other) == ECGROUPNOTEXIST);
+	CHECK(cgroup_event_watcher_add(watcher, "ev", 0, &other) == ECGINVAL);
+
+	/* The id of a removed watch is reused */
+	CHECK(cgroup_event_watcher_remove(watcher, id) == 0);
+	CHECK(cgroup_event_watcher_remove(watcher, id) == ECGINVAL);
+	CHECK(cgroup_event_watcher_add(watcher, "ev", CGROUP_EVENT_FILE_GROUP,
+				       &other) == 0);
+	CHECK(other == id);
+	CHECK(cgroup_event_watcher_remove(watcher, other) == 0);
+}
+
+static void test_changes(struct cgroup_event_watcher *watcher)
+{
+	int id = -1;
+
+	CHECK(cgroup_event_watcher_add(watcher, "ev",
+				       CGROUP_EVENT_FILE_GROUP |
+				       CGROUP_EVENT_FILE_MEMORY, &id) == 0);
+	CHECK_NO_EVENTS(watcher);
+
+	write_file("ev", "cgroup.events", GROUP_EVENTS, 1, 0);
+	CHECK_EVENTS(watcher, { id, "ev", CGROUP_EVENT_POPULATED, 1, 0 });
+
+	/* A counter reports its increase since the previous read */
+	write_file("ev", "memory.events", MEMORY_EVENTS, 1, 1);
+	write_file("ev", "memory.events", MEMORY_EVENTS, 1, 3);
+	CHECK_EVENTS(watcher,
+		     { id, "ev", CGROUP_EVENT_MEMORY_OOM, 1, 1 },
+		     { id, "ev", CGROUP_EVENT_MEMORY_OOM_KILL, 3, 3 });
+
+	/* A file rewritten with the same values reports nothing */
+	write_file("ev", "cgroup.events", GROUP_EVENTS, 1, 0);
+	CHECK_NO_EVENTS(watcher);
+
+	CHECK(cgroup_event_watcher_remove(watcher, id) == 0);
+	write_file("ev", "cgroup.events", GROUP_EVENTS, 0, 1);
+	CHECK_NO_EVENTS(watcher);
+}
+
+static void test_removed(struct cgroup_event_watcher *watcher)
+{
+	int id = -1;
+
+	CHECK(cgroup_event_watcher_add(watcher, "ev",
+				       CGROUP_EVENT_FILE_GROUP |
+				       CGROUP_EVENT_FILE_MEMORY, &id) == 0);
+
+	remove_group("ev");
+	CHECK_EVENTS(watcher, { id, "ev", CGROUP_EVENT_REMOVED, 0, 0 });
+	CHECK_NO_EVENTS(watcher);
+
+	/* The values of the group created again are not reported */
+	CHECK(create_group("ev") == 0);
+	write_file("ev", "cgroup.events", GROUP_EVENTS, 1, 1);
+	CHECK_EVENTS(watcher, { id, "ev", CGROUP_EVENT_CREATED, 0, 0 });
+
+	write_file("ev", "cgroup.events", GROUP_EVENTS, 0, 1);
+	CHECK_EVENTS(watcher, { id, "ev", CGROUP_EVENT_POPULATED, 0, 0 });
+
+	/* Both are reported for a group created again between two reads */
+	remove_group("ev");
+	CHECK(create_group("ev") == 0);
+	CHECK_EVENTS(watcher,
+		     { id, "ev", CGROUP_EVENT_REMOVED, 0, 0 },
+		     { id, "ev", CGROUP_EVENT_CREATED, 0, 0 });
+
+	CHECK(cgroup_event_watcher_remove(watcher, id) == 0);
+}
+
+static void test_parent_removed(struct cgroup_event_watcher *watcher)
+{
+	int id = -1;
+
+	CHECK(cgroup_event_watcher_add(watcher, "parent/ev",
+				       CGROUP_EVENT_FILE_GROUP, &id) == 0);
+
+	remove_group("parent");
+	CHECK_EVENTS(watcher,
+		     { id, "parent/ev", CGROUP_EVENT_REMOVED, 0, 0 });
+
+	/* The group is not watched anymore once its parent is removed */
+	CHECK(create_group("parent") == 0);
+	CHECK(create_group("parent/ev") == 0);
+	CHECK_NO_EVENTS(watcher);
+
+	CHECK(cgroup_event_watcher_remove(watcher, id) == 0);
+}
+
+int main(void)
+{
+	struct cgroup_event_watcher *watcher = NULL;
+	int ret;
+
+	if (create_fake_hierarchy()) {
+		fprintf(stderr, "cannot create the fake hierarchy in %s\n",
+			root);
+		failures++;
+		goto cleanup;
+	}
+
+	setenv("CGROUP_ROOT_OVERRIDE", root, 1);
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed with %s\n",
+			cgroup_strerror(ret));
+		failures++;
+		goto cleanup;
+	}
+
+	watcher = cgroup_event_watcher_new();
+	CHECK(watcher != NULL);
+	if (!watcher)
+		goto cleanup;
+
+	test_add(watcher);
+	test_changes(watcher);
+	test_removed(watcher);
+	test_parent_removed(watcher);
+
+	cgroup_event_watcher_free(&watcher);
+
+cleanup:
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Tests of the PSI triggers.
+ *
+ * The triggers are first written to a fake cgroup v2 hierarchy generated in
+ * a temporary directory and passed to the library through
+ * CGROUP_ROOT_OVERRIDE, which shows what is written to the pressure files
+ * and which errors are returned.  Regular files cannot be polled for
+ * POLLPRI, so the delivery of the events is then tested against the root
+ * group of the mounted cgroup v2 hierarchy, by keeping more processes
+ * runnable than there are CPUs.  The test exits with 77, the automake code
+ * for a skipped test, if that part cannot run, e.g. without a mounted
+ * cgroup v2 hierarchy or without PSI support, and nothing failed.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <ftw.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_SKIPPED	77
+
+/* Stall of 50ms within 500ms, the smallest window allowed */
+#define TEST_TRIGGER	"some 50000 500000"
+
+/*
+ * Stall of 100ms within 2s, without CAP_SYS_RESOURCE the window must be a
+ * multiple of 2s
+ */
+#define TEST_TRIGGER_UNPRIV	"some 100000 2000000"
+
+/* Wait this long for the trigger to fire */
+#define TEST_WAIT_MS	5000
+
+static char root[] = "/tmp/cgpsi-XXXXXX";
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+static int write_file(const char *dir, const char *name, const char *value)
+{
+	char path[FILENAME_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "we");
+	if (!f)
+		return -1;
+
+	fputs(value, f);
+
+	return fclose(f);
+}
+
+/*
+ * Generate a cgroup v2 hierarchy holding the group psi, which has no
+ * io.pressure.
+ */
+static int create_fake_hierarchy(void)
+{
+	char dir[FILENAME_MAX];
+	int ret = 0;
+
+	if (!mkdtemp(root)) {
+		perror(root);
+		return -1;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/unified", root);
+	if (mkdir(dir, 0755) < 0)
+		return -1;
+	ret |= write_file(dir, "cgroup.controllers", "cpu memory io\n");
+	ret |= write_file(dir, "cgroup.subtree_control", "cpu memory io\n");
+
+	snprintf(dir, sizeof(dir), "%s/unified/psi", root);
+	if (mkdir(dir, 0755) < 0)
+		return -1;
+	ret |= write_file(dir, "cgroup.controllers", "cpu memory io\n");
+	ret |= write_file(dir, "cpu.pressure", "");
+	ret |= write_file(dir, "memory.pressure", "");
+
+	return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type,
+			struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+static void test_trigger_write(void)
+{
+	char path[FILENAME_MAX];
+	char buf[64];
+	FILE *f;
+	size_t n;
+	int fd;
+
+	CHECK(cgroup_psi_trigger_open("psi", CGROUP_PSI_MEMORY, TEST_TRIGGER,
+				      &fd) == 0);
+	CHECK(fd >= 0);
+	if (fd >= 0)
+		close(fd);
+
+	/* The kernel expects the terminating NUL too */
+	snprintf(path, sizeof(path), "%s/unified/psi/memory.pressure", root);
+	f = fopen(path, "re");
+	CHECK(f != NULL);
+	if (!f)
+		return;
+	n = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+
+	CHECK(n == sizeof(TEST_TRIGGER));
+	CHECK(memcmp(buf, TEST_TRIGGER, sizeof(TEST_TRIGGER)) == 0);
+}
+
+static void test_trigger_errors(void)
+{
+	int fd;
+
+	CHECK(cgroup_psi_trigger_open("psi", CGROUP_PSI_IO, TEST_TRIGGER,
+				      &fd) == ECGROUPUNSUPP);
+	CHECK(cgroup_psi_trigger_open("missing", CGROUP_PSI_CPU, TEST_TRIGGER,
+				      &fd) == ECGROUPNOTEXIST);
+	CHECK(cgroup_psi_trigger_open("psi", CGROUP_PSI_MAX, TEST_TRIGGER,
+				      &fd) == ECGINVAL);
+	CHECK(cgroup_psi_trigger_open("psi", CGROUP_PSI_CPU, NULL,
+				      &fd) == ECGINVAL);
+}
+
+/*
+ * Keep one more process than CPUs runnable until the trigger on the root
+ * group fires.
+ *	@return 0 if the test ran, TEST_SKIPPED else
+ */
+static int test_trigger_delivery(void)
+{
+	const struct cgroup_psi_event *events;
+	struct cgroup_psi_monitor *monitor;
+	int i, id, ret, count = 0;
+	pid_t *pids;
+	long cpus;
+
+	unsetenv("CGROUP_ROOT_OVERRIDE");
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "skipped the delivery: %s\n",
+			cgroup_strerror(ret));
+		return TEST_SKIPPED;
+	}
+
+	monitor = cgroup_psi_monitor_new();
+	CHECK(monitor != NULL);
+	if (!monitor)
+		return 0;
+
+	ret = cgroup_psi_monitor_add(monitor, "/", CGROUP_PSI_CPU,
+				     TEST_TRIGGER_UNPRIV, &id);
+	if (ret) {
+		fprintf(stderr, "skipped the delivery: %s\n",
+			cgroup_strerror(ret));
+		cgroup_psi_monitor_free(&monitor);
+		return TEST_SKIPPED;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+
+	pids = calloc(cpus + 1, sizeof(*pids));
+	CHECK(pids != NULL);
+	for (i = 0; pids && i <= cpus; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			for (;;)
+				;
+		}
+	}
+
+	ret = cgroup_psi_monitor_wait(monitor, TEST_WAIT_MS, &events, &count);
+	CHECK(ret == 0);
+	CHECK(count == 1);
+	if (count == 1) {
+		CHECK(events[0].id == id);
+		CHECK(strcmp(events[0].path, "/") == 0);
+		CHECK(events[0].resource == CGROUP_PSI_CPU);
+		CHECK(!events[0].removed);
+	}
+
+	for (i = 0; pids && i <= cpus; i++) {
+		if (pids[i] > 0) {
+			kill(pids[i], SIGKILL);
+			waitpid(pids[i], NULL, 0);
+		}
+	}
+	free(pids);
+
+	CHECK(cgroup_psi_monitor_remove(monitor, id) == 0);
+	CHECK(cgroup_psi_monitor_remove(monitor, id) == ECGINVAL);
+	cgroup_psi_monitor_free(&monitor);
+
+	return 0;
+}
+
+int main(void)
+{
+	int skipped = 0;
+	int ret;
+
+	if (create_fake_hierarchy()) {
+		fprintf(stderr, "cannot create the fake hierarchy in %s\n",
+			root);
+		failures++;
+		goto cleanup;
+	}
+
+	setenv("CGROUP_ROOT_OVERRIDE", root, 1);
+	ret = cgroup_init();
+	if (ret) {
+		fprintf(stderr, "cgroup_init failed with %s\n",
+			cgroup_strerror(ret));
+		failures++;
+		goto cleanup;
+	}
+
+	test_trigger_write();
+	test_trigger_errors();
+	skipped = test_trigger_delivery();
+
+cleanup:
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	if (failures)
+		return 1;
+
+	return skipped;
+}
@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
 #include <fts.h>
 #include <pwd.h>
 #include <grp.h>
@@ -73,7 +75,10 @@ static __thread char errtext[MAXLEN];
 #define LL_MAX			100
 
 /* Check if cgroup_init has been called or not. */
-static int cgroup_initialized;
+int cgroup_initialized;
+
+/* Set if cg_mounts was supplied by the caller, not read from the system */
+int cg_mount_table_injected;
 
 /* List of configuration rules */
 static struct cgroup_rule_list rl;
@@ -88,14 +93,87 @@ static pthread_rwlock_t rl_lock = PTHREAD_RWLOCK_INITIALIZER;
 static char cg_cgroup_v2_mount_path[FILENAME_MAX];
 
 /* Namespace */
-__thread char *cg_namespace_table[CG_CONTROLLER_MAX];
+__thread char **cg_namespace_table;
+__thread int cg_namespace_table_max;
+
+/*
+ * Where the per-process directories are read from, see cg_set_procfs_path().
+ * Shorter than FILENAME_MAX, so that "<procfs>/<pid>/<file>" always fits in
+ * a FILENAME_MAX buffer.
+ */
+#define CG_PROCFS_PATH_MAX	(FILENAME_MAX - 64)
+static char cg_procfs_path[CG_PROCFS_PATH_MAX] = "/proc";
 
 pthread_rwlock_t cg_mount_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 struct cg_mount_table_s cg_mount_table[CG_CONTROLLER_MAX];
+struct cg_mount_table_s *cg_mounts = cg_mount_table;
+static int cg_mount_table_max = CG_CONTROLLER_MAX;	/* size of cg_mounts */
+
+/* Smallest number of slots of cg_mount_index, a power of two */
+#define CG_MOUNT_INDEX_MIN	32
+
+/*
+ * Hash of the controller names in cg_mounts, using open addressing.
+ * Each slot holds the index in cg_mounts + 1, or 0 if it is empty.
+ * Protected by cg_mount_table_lock, like the table.
+ */
+static int *cg_mount_index;
+static int cg_mount_index_size;
+static int cg_mount_index_count;
+
+/*
+ * Length of the first mount path of each cg_mounts entry, to build
+ * paths without scanning it, or 0 if it is not known.  Sized like
+ * cg_mounts and protected by its lock.
+ */
+static int cg_mount_table_len[CG_CONTROLLER_MAX];
+static int *cg_mount_len = cg_mount_table_len;
+
+/* Index of the first controller mounted as cgroup v2, -1 if there is none */
+static int cg_mount_v2_index = -1;
+
+/*
+ * A set of cg_mounts entries, one bit per index.  Entries past the
+ * mask are never cached, there are far fewer cgroup v2 controllers.
+ */
+#define CG_MASK_WORDS	2
+
+struct cg_controller_mask {
+	uint64_t bits[CG_MASK_WORDS];
+};
+
+/* Number of entries of cg_enabled_cache, a power of two */
+#define CG_ENABLED_CACHE_SIZE	64
+
+struct cg_enabled_entry {
+	/* cgroup v2 directory, NULL if the entry is unused */
+	char *path;
+	unsigned int generation;
+	/* Controllers listed in its cgroup.subtree_control file */
+	struct cg_controller_mask enabled;
+};
+
+/*
+ * Cache of the controllers enabled in cgroup.subtree_control files, mapped
+ * directly by the hash of the directory.  Only enabled controllers are
+ * cached, any other one is looked up in the file again.  An entry is stale
+ * once cg_enabled_generation moved on, which happens whenever the mount
+ * table is rebuilt or a subtree_control file is written by us.
+ */
+static struct cg_enabled_entry cg_enabled_cache[CG_ENABLED_CACHE_SIZE];
+static unsigned int cg_enabled_generation;
+static pthread_mutex_t cg_enabled_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Cgroup v2 mount paths, with empty controllers */
 struct cg_mount_point *cg_cgroup_v2_empty_mount_paths;
 
+/* Persistent connection to the batched protocol socket of cgrulesengd */
+static pthread_mutex_t cgred_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t cgred_batch_owner;
+static uint32_t cgred_batch_seq;
+static int cgred_batch_sk = -1;
+
 const char * const cgroup_strerror_codes[] = {
 	"Cgroup is not compiled in",
 	"Cgroup is not mounted",
@@ -133,6 +211,9 @@ const char * const cgroup_strerror_codes[] = {
 
 static const char * const cgroup_ignored_tasks_files[] = { "tasks", NULL };
 
+static int cg_mount_index_find(const char *name);
+static int cg_mount_index_find_v2(void);
+
 #ifndef UNIT_TEST
 static int cg_get_cgroups_from_proc_cgroups(pid_t pid, char *cgroup_list[],
 					    char *controller_list[],
@@ -152,92 +233,34 @@ static int cg_chown(const char *filename, uid_t owner, gid_t group)
 
 	return chown(filename, owner, group);
 }
-static int cg_chown_file(FTS *fts, FTSENT *ent, uid_t owner, gid_t group)
-{
-	const char *filename = fts->fts_path;
-	int ret = 0;
-
-	cgroup_dbg("chown: seeing file %s\n", filename);
-	switch (ent->fts_info) {
-	case FTS_ERR:
-		errno = ent->fts_errno;
-		break;
-	case FTS_D:
-	case FTS_DC:
-	case FTS_NSOK:
-	case FTS_NS:
-	case FTS_DNR:
-	case FTS_DP:
-	case FTS_F:
-	case FTS_DEFAULT:
-		ret = cg_chown(filename, owner, group);
-		break;
-	}
-	if (ret < 0) {
-		cgroup_warn("cannot change owner of file %s: %s\n", filename,
-			    strerror(errno));
-		last_errno = errno;
-		ret = ECGOTHER;
-	}
-	return ret;
-}
-
 /*
- * TODO: Need to decide a better place to put this function.
+ * Use owner permissions as an umask for group and others permissions
+ * because we trust kernel to initialize owner permissions to something
+ * useful.  Keep SUID and SGID bits.
  */
-static int cg_chown_recursive(char **path, uid_t owner, gid_t group)
+static mode_t cg_owner_umask(mode_t mode, mode_t cur_mode)
 {
-	int ret = 0;
-	FTS *fts;
+	mode_t umask, gmask, omask;
 
-	cgroup_dbg("chown: path is %s\n", *path);
-	fts = fts_open(path, FTS_PHYSICAL | FTS_NOCHDIR |
-		       FTS_NOSTAT, NULL);
-	if (fts == NULL) {
-		cgroup_warn("cannot open directory %s: %s\n", path,
-			    strerror(errno));
-		last_errno = errno;
-		return ECGOTHER;
-	}
-	while (1) {
-		FTSENT *ent;
+	/* 0700 == S_IRWXU */
+	umask = 0700 & cur_mode;
+	gmask = umask >> 3;
+	omask = gmask >> 3;
 
-		ent = fts_read(fts);
-		if (!ent) {
-			cgroup_warn("fts_read failed\n");
-			break;
-		}
-		ret = cg_chown_file(fts, ent, owner, group);
-	}
-	fts_close(fts);
-	return ret;
+	return mode & (umask|gmask|omask|S_ISUID|S_ISGID|S_ISVTX);
 }
 
 int cg_chmod_path(const char *path, mode_t mode, int owner_is_umask)
 {
-	mode_t mask = -1U;
 	struct stat buf;
 
 	if (owner_is_umask) {
-		mode_t umask, gmask, omask;
-
-		/*
-		 * Use owner permissions as an umask for group and others
-		 * permissions because we trust kernel to initialize owner
-		 * permissions to something useful.
-		 * Keep SUID and SGID bits.
-		 */
 		if (stat(path, &buf) == -1)
 			goto fail;
-		/* 0700 == S_IRWXU */
-		umask = 0700 & buf.st_mode;
-		gmask = umask >> 3;
-		omask = gmask >> 3;
-
-		mask = umask|gmask|omask|S_ISUID|S_ISGID|S_ISVTX;
+		mode = cg_owner_umask(mode, buf.st_mode);
 	}
 
-	if (chmod(path, mode & mask))
+	if (chmod(path, mode))
 		goto fail;
 
 	return 0;
@@ -249,112 +272,356 @@ fail:
 	return ECGOTHER;
 }
 
-int cg_chmod_file(FTS *fts, FTSENT *ent, mode_t dir_mode,
-		  int dirm_change, mode_t file_mode, int filem_change,
-		  int owner_is_umask)
+/* At most this many threads walk a subtree, including the calling one */
+#define CG_PERM_MAX_WORKERS	16
+
+/* Directories walked before the other threads are started */
+#define CG_PERM_SERIAL_DIRS	16
+
+/* Ownership and permissions applied to a subtree */
+struct cg_perm {
+	int chown;		/* change the owner to uid and gid */
+	uid_t uid;
+	gid_t gid;
+	mode_t dir_mode;
+	int dirm_change;
+	mode_t file_mode;
+	int filem_change;
+	int owner_is_umask;	/* see cg_owner_umask() */
+	const char * const *ignore_list;	/* files whose mode is kept */
+};
+
+/* Identity of a directory, to walk every hierarchy only once */
+struct cg_perm_seen {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct cg_perm_walk {
+	const struct cg_perm *perm;
+	const char *path;
+	int dirfd;		/* the root of the subtree */
+
+	/* Protects everything below */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **queue;		/* directories to walk, relative to dirfd */
+	int queue_count;
+	int queue_max;
+	int active;		/* threads walking a directory */
+
+	/* The first error, reported once for all the workers */
+	int failures;
+	int first_errno;
+	char *first_path;
+};
+
+static void cg_perm_fail(struct cg_perm_walk *walk, const char *dir,
+			 const char *name)
 {
-	const char *filename = fts->fts_path;
-	int ret = 0;
+	int err = errno;
 
-	cgroup_dbg("chmod: seeing file %s\n", filename);
+	pthread_mutex_lock(&walk->lock);
+	if (!walk->failures++) {
+		walk->first_errno = err;
+		if (asprintf(&walk->first_path, "%s/%s%s%s", walk->path, dir,
+			     name ? "/" : "", name ? name : "") < 0)
+			walk->first_path = NULL;
+	}
+	pthread_mutex_unlock(&walk->lock);
+}
 
-	switch (ent->fts_info) {
-	case FTS_ERR:
-		errno = ent->fts_errno;
-		break;
-	case FTS_D:
-	case FTS_DC:
-	case FTS_DNR:
-	case FTS_DP:
-		if (dirm_change)
-			ret = cg_chmod_path(filename, dir_mode, owner_is_umask);
-		break;
-	case FTS_F:
-	case FTS_NSOK:
-	case FTS_NS:
-	case FTS_DEFAULT:
-		if (filem_change)
-			ret = cg_chmod_path(filename, file_mode,
-					    owner_is_umask);
-		break;
+static int cg_perm_ignored(const struct cg_perm *perm, const char *name)
+{
+	int i;
+
+	if (!perm->ignore_list || !name)
+		return 0;
+
+	for (i = 0; perm->ignore_list[i]; i++)
+		if (!strcmp(perm->ignore_list[i], name))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Apply the ownership and the mode to one entry of a directory, or to the
+ * directory itself when name is NULL.
+ *	@return 0 on success, -1 on error with errno set
+ */
+static int cg_perm_apply(const struct cg_perm *perm, int dfd,
+			 const char *name, int is_dir)
+{
+	int mode_change = is_dir ? perm->dirm_change : perm->filem_change;
+	mode_t mode = is_dir ? perm->dir_mode : perm->file_mode;
+	struct stat st;
+	int ret;
+
+	if (perm->chown) {
+		if (name)
+			ret = fchownat(dfd, name, perm->uid, perm->gid,
+				       AT_SYMLINK_NOFOLLOW);
+		else
+			ret = fchown(dfd, perm->uid, perm->gid);
+		if (ret < 0)
+			return -1;
 	}
-	return ret;
+
+	if (!mode_change || cg_perm_ignored(perm, name))
+		return 0;
+
+	if (perm->owner_is_umask) {
+		if (name)
+			ret = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW);
+		else
+			ret = fstat(dfd, &st);
+		if (ret < 0)
+			return -1;
+		mode = cg_owner_umask(mode, st.st_mode);
+	}
+
+	return name ? fchmodat(dfd, name, mode, 0) : fchmod(dfd, mode);
+}
+
+/*
+ * Apply the ownership and the mode to the entries of one directory, and
+ * queue its subdirectories.
+ */
+static void cg_perm_walk_dir(struct cg_perm_walk *walk, char *dir)
+{
+	struct dirent *ent;
+	struct stat st;
+	char **queue;
+	char *child;
+	int is_dir;
+	DIR *d;
+	int fd;
+
+	fd = openat(walk->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		cg_perm_fail(walk, dir, NULL);
+		return;
+	}
+
+	d = fdopendir(fd);
+	if (!d) {
+		cg_perm_fail(walk, dir, NULL);
+		close(fd);
+		return;
+	}
+
+	while ((ent = readdir(d))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN &&
+		    !fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			is_dir = S_ISDIR(st.st_mode);
+
+		if (cg_perm_apply(walk->perm, fd, ent->d_name, is_dir))
+			cg_perm_fail(walk, dir, ent->d_name);
+
+		if (!is_dir)
+			continue;
+
+		if (asprintf(&child, "%s/%s", dir, ent->d_name) < 0) {
+			cg_perm_fail(walk, dir, ent->d_name);
+			continue;
+		}
+
+		pthread_mutex_lock(&walk->lock);
+		if (walk->queue_count == walk->queue_max) {
+			walk->queue_max = walk->queue_max ?
+					  walk->queue_max * 2 : 64;
+			queue = realloc(walk->queue,
+					walk->queue_max * sizeof(*queue));
+			if (!queue) {
+				pthread_mutex_unlock(&walk->lock);
+				cg_perm_fail(walk, child, NULL);
+				free(child);
+				continue;
+			}
+			walk->queue = queue;
+		}
+		walk->queue[walk->queue_count++] = child;
+		pthread_cond_signal(&walk->cond);
+		pthread_mutex_unlock(&walk->lock);
+	}
+
+	closedir(d);
+}
+
+/*
+ * Walk the queued directories until there is none left, or at most max of
+ * them when max is positive.
+ */
+static void cg_perm_walk_queue(struct cg_perm_walk *walk, int max)
+{
+	int walked = 0;
+	char *dir;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		while (!walk->queue_count && walk->active)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		if (!walk->queue_count || (max > 0 && walked == max))
+			break;
+
+		dir = walk->queue[--walk->queue_count];
+		walk->active++;
+		pthread_mutex_unlock(&walk->lock);
+
+		cg_perm_walk_dir(walk, dir);
+		free(dir);
+		walked++;
+
+		pthread_mutex_lock(&walk->lock);
+		/* Wake up the idle threads when the walk is complete */
+		if (--walk->active == 0 && !walk->queue_count)
+			pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
 }
 
+static void *cg_perm_worker(void *arg)
+{
+	cg_perm_walk_queue(arg, 0);
+	return NULL;
+}
 
 /**
- * Changes permissions of all directories and control files (i.e. all
- * files except files named in ignore_list. The list must be terminated with
- * NULL.
+ * Change the ownership and the permissions of a group and of all its files
+ * and subgroups in a single walk.  The directories are opened relative to
+ * their parent, and the subtrees of a large group are walked by several
+ * threads.  A hierarchy listed in seen, e.g. the cgroup v2 hierarchy
+ * shared by several controllers, is skipped and new ones are added to it.
+ *
+ * @param path The group.
+ * @param perm The ownership and the permissions to apply.
+ * @param seen The hierarchies walked already, NULL to walk anyway.
+ * @param seen_count The number of entries of seen.
+ * @return 0 on success, >0 on error.
  */
-static int cg_chmod_recursive_controller(char *path, mode_t dir_mode,
-		int dirm_change, mode_t file_mode, int filem_change,
-		int owner_is_umask, const char * const *ignore_list)
+static int cg_perm_recursive(const char *path, const struct cg_perm *perm,
+			     struct cg_perm_seen *seen, int *seen_count)
 {
-	int final_ret = 0;
-	char *fts_path[2];
-	int i, ignored;
-	int ret = 0;
-	FTS *fts;
+	pthread_t threads[CG_PERM_MAX_WORKERS - 1];
+	struct cg_perm_walk walk;
+	int workers, started;
+	struct stat st;
+	char *root;
+	long cpus;
+	int i, ret;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.perm = perm;
+	walk.path = path;
 
-	fts_path[0] = path;
-	fts_path[1] = NULL;
-	cgroup_dbg("chmod: path is %s\n", path);
+	cgroup_dbg("chown and chmod: path is %s\n", path);
 
-	fts = fts_open(fts_path, FTS_PHYSICAL | FTS_NOCHDIR |
-		       FTS_NOSTAT, NULL);
-	if (fts == NULL) {
-		cgroup_warn("cannot open directory %s: %s\n", fts_path,
+	walk.dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (walk.dirfd < 0 || fstat(walk.dirfd, &st) < 0) {
+		cgroup_warn("cannot open directory %s: %s\n", path,
 			    strerror(errno));
 		last_errno = errno;
+		if (walk.dirfd >= 0)
+			close(walk.dirfd);
 		return ECGOTHER;
 	}
-	while (1) {
-		FTSENT *ent;
 
-		ent = fts_read(fts);
-		if (!ent) {
-			if (errno != 0) {
-				cgroup_dbg("fts_read failed\n");
-				last_errno = errno;
-				final_ret = ECGOTHER;
+	if (seen) {
+		for (i = 0; i < *seen_count; i++) {
+			if (seen[i].dev == st.st_dev &&
+			    seen[i].ino == st.st_ino) {
+				close(walk.dirfd);
+				return 0;
 			}
-			break;
 		}
-		ignored = 0;
-		if (ignore_list != NULL)
-			for (i = 0; ignore_list[i] != NULL; i++)
-				if (!strcmp(ignore_list[i], ent->fts_name)) {
-					ignored = 1;
-					break;
-				}
-		if (ignored)
-			continue;
+		seen[*seen_count].dev = st.st_dev;
+		seen[*seen_count].ino = st.st_ino;
+		(*seen_count)++;
+	}
 
-		ret = cg_chmod_file(fts, ent, dir_mode, dirm_change,
-				    file_mode, filem_change,
-				    owner_is_umask);
-		if (ret) {
-			cgroup_warn("cannot change file mode %s: %s\n",
-				    fts_path, strerror(errno));
-			last_errno = errno;
-			final_ret = ECGOTHER;
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	if (cg_perm_apply(perm, walk.dirfd, NULL, 1))
+		cg_perm_fail(&walk, ".", NULL);
+
+	root = strdup(".");
+	if (root) {
+		cg_perm_walk_dir(&walk, root);
+		free(root);
+	} else {
+		cg_perm_fail(&walk, ".", NULL);
+	}
+
+	/* A small group is done before any thread would have started */
+	cg_perm_walk_queue(&walk, CG_PERM_SERIAL_DIRS);
+
+	started = 0;
+	if (walk.queue_count) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > CG_PERM_MAX_WORKERS ? CG_PERM_MAX_WORKERS :
+			  cpus < 1 ? 1 : (int)cpus;
+
+		/* The calling thread is one of the workers */
+		for (; started < workers - 1; started++) {
+			ret = pthread_create(&threads[started], NULL,
+					     cg_perm_worker, &walk);
+			if (ret) {
+				cgroup_warn("failed to start chmod worker: ");
+				cgroup_warn("%s\n", strerror(ret));
+				break;
+			}
 		}
+		cg_perm_walk_queue(&walk, 0);
 	}
-	fts_close(fts);
-	return final_ret;
+
+	while (started > 0)
+		pthread_join(threads[--started], NULL);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+	free(walk.queue);
+	close(walk.dirfd);
+
+	if (!walk.failures)
+		return 0;
+
+	cgroup_warn("cannot change owner or permissions of %d files, ",
+		    walk.failures);
+	cgroup_warn("e.g. %s: %s\n", walk.first_path ? walk.first_path : path,
+		    strerror(walk.first_errno));
+	free(walk.first_path);
+	last_errno = walk.first_errno;
+
+	return ECGOTHER;
 }
 
 int cg_chmod_recursive(struct cgroup *cgroup, mode_t dir_mode,
 		       int dirm_change, mode_t file_mode, int filem_change)
 {
+	struct cg_perm_seen *seen;
+	struct cg_perm perm;
+	int seen_count = 0;
 	int final_ret = 0;
 	char *path;
 	int i, ret;
 
+	memset(&perm, 0, sizeof(perm));
+	perm.dir_mode = dir_mode;
+	perm.dirm_change = dirm_change;
+	perm.file_mode = file_mode;
+	perm.filem_change = filem_change;
+
 	path = malloc(FILENAME_MAX);
-	if (!path) {
+	seen = calloc(cgroup->index + 1, sizeof(*seen));
+	if (!path || !seen) {
 		last_errno = errno;
+		free(path);
+		free(seen);
 		return ECGOTHER;
 	}
 	for (i = 0; i < cgroup->index; i++) {
@@ -364,12 +631,12 @@ int cg_chmod_recursive(struct cgroup *cgroup, mode_t dir_mode,
 			break;
 		}
 
-		ret = cg_chmod_recursive_controller(path, dir_mode, dirm_change,
-						    file_mode, filem_change, 0,
-						    NULL);
+		/* Co-mounted controllers share their hierarchy */
+		ret = cg_perm_recursive(path, &perm, seen, &seen_count);
 		if (ret)
 			final_ret = ret;
 	}
+	free(seen);
 	free(path);
 	return final_ret;
 }
@@ -402,31 +669,22 @@ static char *cgroup_basename(const char *path)
 
 int cgroup_test_subsys_mounted(const char *name)
 {
-	int i;
+	int mounted;
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
-		if (strncmp(cg_mount_table[i].name, name,
-			    sizeof(cg_mount_table[i].name)) == 0) {
-			pthread_rwlock_unlock(&cg_mount_table_lock);
-			return 1;
-		}
+	mounted = cg_mount_index_find(name) >= 0;
 
-		/* The user has likely requested a file like cgroup.type or
-		 * cgroup.procs.  Allow this request as long as there's a
-		 * cgroup v2 controller mounted.
-		 */
-		if (strncmp(name, CGROUP_FILE_PREFIX,
-			    strlen(CGROUP_FILE_PREFIX)) == 0 &&
-		    cg_mount_table[i].version == CGROUP_V2) {
-			pthread_rwlock_unlock(&cg_mount_table_lock);
-			return 1;
-		}
-	}
+	/* The user has likely requested a file like cgroup.type or
+	 * cgroup.procs.  Allow this request as long as there's a
+	 * cgroup v2 controller mounted.
+	 */
+	if (!mounted && strncmp(name, CGROUP_FILE_PREFIX,
+				strlen(CGROUP_FILE_PREFIX)) == 0)
+		mounted = cg_mount_index_find_v2() >= 0;
 
 	pthread_rwlock_unlock(&cg_mount_table_lock);
-	return 0;
+	return mounted;
 }
 
 /**
@@ -921,6 +1179,10 @@ finish:
  * Original description of this function moved to cgroup_parse_rules_file.
  * Also cloned and all occurences of file changed to files.
  *
+ * In the unit test builds, if the CGRULES_CONF_OVERRIDE environment variable
+ * names a file, only that file is parsed, e.g. to run against a fake
+ * hierarchy.
+ *
  * Parse the configuration files that maps UID/GIDs to cgroups.  If ever the
  * configuration files are modified, applications should call this function to
  * load the new configuration rules.  The function caller is responsible for
@@ -953,12 +1215,19 @@ static int cgroup_parse_rules(bool cache, uid_t muid,
 	/* Directory variables */
 	const char *dirname = CGRULES_CONF_DIR;
 	struct dirent *item;
+	char *override = NULL;
 	char *tmp;
 	int sret;
 	DIR *d;
 
 	int ret;
 
+#ifdef UNIT_TEST
+	override = secure_getenv(CGRULES_CONF_OVERRIDE_ENV);
+	if (override && override[0] == '\0')
+		override = NULL;
+#endif
+
 	/* Determine which list we're using. */
 	if (cache)
 		lst = &rl;
@@ -972,14 +1241,14 @@ static int cgroup_parse_rules(bool cache, uid_t muid,
 	pthread_rwlock_wrlock(&rl_lock);
 
 	/* Parse CGRULES_CONF_FILE configuration file (back compatibility). */
-	ret = cgroup_parse_rules_file(CGRULES_CONF_FILE,
+	ret = cgroup_parse_rules_file(override ? override : CGRULES_CONF_FILE,
 				      cache, muid, mgid, mprocname);
 
 	/*
 	 * if match (ret = -1), stop parsing other files, just return
 	 * or ret > 0 => error
 	 */
-	if (ret != 0) {
+	if (ret != 0 || override) {
 		pthread_rwlock_unlock(&rl_lock);
 		return ret;
 	}
@@ -1076,7 +1345,7 @@ int cg_add_duplicate_mount(struct cg_mount_table_s *item, const char *path)
 }
 
 /*
- * Tries to find if any controller in cg_mount_table have already mounted on
+ * Tries to find if any controller in cg_mounts have already mounted on
  * the mount_path and if mounted sets the matching controller idx share_mnt
  * flag and Return 1 or 0 otherwise.
  */
@@ -1086,9 +1355,9 @@ static int cgroup_set_cg_mnt_tbl_shared_mnt(char *mount_path, int *mnt_tbl_idx)
 
 	/* Check if controllers share mount points */
 	for  (i = 0; i < *mnt_tbl_idx; i++) {
-		if (strncmp(mount_path, cg_mount_table[i].mount.path,
+		if (strncmp(mount_path, cg_mounts[i].mount.path,
 			    FILENAME_MAX) == 0) {
-			cg_mount_table[i].shared_mnt = 1;
+			cg_mounts[i].shared_mnt = 1;
 			shared_mnt = 1;
 			break;
 		}
@@ -1097,83 +1366,368 @@ static int cgroup_set_cg_mnt_tbl_shared_mnt(char *mount_path, int *mnt_tbl_idx)
 	return shared_mnt;
 }
 
-static void cgroup_cg_mount_table_append(const char *name,
-					 const char *mount_path,
-					 enum cg_version_t version,
-					 int *mnt_tbl_idx,
-					 const char *mnt_opts,
-					 int shared_mnt)
+unsigned int cg_name_hash(const char *name)
 {
-	int i = *mnt_tbl_idx;
+	unsigned int hash = 2166136261u;
 
-	strncpy(cg_mount_table[i].name,	name, CONTROL_NAMELEN_MAX);
-	cg_mount_table[i].name[CONTROL_NAMELEN_MAX-1] = '\0';
+	/* FNV-1a */
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
 
-	strncpy(cg_mount_table[i].mount.path, mount_path, FILENAME_MAX);
-	cg_mount_table[i].mount.path[FILENAME_MAX-1] = '\0';
+	return hash;
+}
 
-	cg_mount_table[i].shared_mnt = shared_mnt;
-	cg_mount_table[i].version = version;
-	cg_mount_table[i].mount.next = NULL;
+unsigned int cg_name_hash_len(const char *name, size_t len)
+{
+	unsigned int hash = 2166136261u;
 
-	cgroup_dbg("Found cgroup option %s, count %d\n", mnt_opts, i);
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
 
-	(*mnt_tbl_idx)++;
+	return hash;
 }
 
-/**
- * Process a cgroup v1 mount and add it to cg_mount_table if it's not a
- * duplicate.
- *
- *	@param controllers List of controllers from /proc/cgroups
- *	@param ent File system description of cgroup mount being processed
- *	@param mnt_tbl_idx cg_mount_table index
- */
-STATIC int cgroup_process_v1_mnt(char *controllers[], struct mntent *ent,
-				 int *mnt_tbl_idx)
+static void cg_mount_index_insert(int idx)
 {
-	char *strtok_buffer = NULL, *mntopt = NULL;
-	int shared_mnt, duplicate;
-	int i, j, ret = 0;
+	unsigned int mask = cg_mount_index_size - 1;
+	unsigned int slot;
 
-	for (i = 0; controllers[i] != NULL; i++) {
-		mntopt = hasmntopt(ent, controllers[i]);
+	slot = cg_name_hash(cg_mounts[idx].name) & mask;
+	while (cg_mount_index[slot]) {
+		/* Keep the first entry, as a linear scan would find it */
+		if (strcmp(cg_mounts[cg_mount_index[slot] - 1].name,
+			   cg_mounts[idx].name) == 0)
+			return;
+		slot = (slot + 1) & mask;
+	}
 
-		if (!mntopt)
-			continue;
+	cg_mount_index[slot] = idx + 1;
+	cg_mount_index_count++;
 
-		cgroup_dbg("found %s in %s\n", controllers[i], ent->mnt_opts);
+	if (cg_mounts[idx].version == CGROUP_V2 && cg_mount_v2_index < 0)
+		cg_mount_v2_index = idx;
+}
 
-		/* Check if controllers share mount points */
-		shared_mnt = cgroup_set_cg_mnt_tbl_shared_mnt(ent->mnt_dir,
-							      mnt_tbl_idx);
+/*
+ * Add an entry of cg_mounts to the controller name index, which is
+ * rebuilt larger when it gets half full.  If that fails, the index is
+ * dropped and the lookups scan the table until the next attempt. This
+ * function should be called with cg_mount_table_lock taken.
+ */
+static void cg_mount_index_add(int idx)
+{
+	int size;
+	int i;
 
-		/* Do not have duplicates in mount table */
-		duplicate = 0;
-		for  (j = 0; j < *mnt_tbl_idx; j++) {
-			if (strncmp(controllers[i], cg_mount_table[j].name,
-				    FILENAME_MAX) == 0) {
-				duplicate = 1;
-				break;
-			}
-		}
+	if ((cg_mount_index_count + 1) * 2 > cg_mount_index_size) {
+		size = CG_MOUNT_INDEX_MIN;
+		while (size < (idx + 1) * 2)
+			size *= 2;
 
-		if (duplicate) {
-			cgroup_dbg("controller %s is already mounted on %s\n",
-				   mntopt, cg_mount_table[j].mount.path);
-			ret = cg_add_duplicate_mount(&cg_mount_table[j],
-						     ent->mnt_dir);
-			if (ret)
-				goto out;
-			/* Continue with next controller */
+		free(cg_mount_index);
+		cg_mount_index = calloc(size, sizeof(*cg_mount_index));
+		cg_mount_index_size = cg_mount_index ? size : 0;
+		cg_mount_index_count = 0;
+		cg_mount_v2_index = -1;
+		if (!cg_mount_index)
+			return;
+
+		for (i = 0; i < idx; i++)
+			cg_mount_index_insert(i);
+	}
+
+	cg_mount_index_insert(idx);
+}
+
+/*
+ * Find a controller in cg_mounts. This function should be called with
+ * cg_mount_table_lock taken.
+ *
+ *	@param name The controller name
+ *	@return the index in cg_mounts, -1 if it is not mounted
+ */
+static int cg_mount_index_find(const char *name)
+{
+	unsigned int slot;
+	int i;
+
+	/* The table was filled by hand, e.g. by the unit tests */
+	if (!cg_mount_index_count) {
+		for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
+			if (strcmp(cg_mounts[i].name, name) == 0)
+				return i;
+		}
+		return -1;
+	}
+
+	slot = cg_name_hash(name) & (cg_mount_index_size - 1);
+	while (cg_mount_index[slot]) {
+		i = cg_mount_index[slot] - 1;
+		if (strcmp(cg_mounts[i].name, name) == 0)
+			return i;
+		slot = (slot + 1) & (cg_mount_index_size - 1);
+	}
+
+	return -1;
+}
+
+/*
+ * Find the first controller mounted as cgroup v2. This function should be
+ * called with cg_mount_table_lock taken.
+ *
+ *	@return the index in cg_mounts, -1 if there is none
+ */
+static int cg_mount_index_find_v2(void)
+{
+	int i;
+
+	if (cg_mount_index_count)
+		return cg_mount_v2_index;
+
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
+		if (cg_mounts[i].version == CGROUP_V2)
+			return i;
+	}
+
+	return -1;
+}
+
+static inline void cg_mask_set(struct cg_controller_mask *mask, int idx)
+{
+	if (idx < CG_MASK_WORDS * 64)
+		mask->bits[idx / 64] |= 1ULL << (idx % 64);
+}
+
+static inline bool cg_mask_test(const struct cg_controller_mask *mask,
+				int idx)
+{
+	if (idx >= CG_MASK_WORDS * 64)
+		return false;
+
+	return mask->bits[idx / 64] & (1ULL << (idx % 64));
+}
+
+/* Forget all cached subtree_control files */
+static void cg_enabled_cache_invalidate(void)
+{
+	pthread_mutex_lock(&cg_enabled_cache_lock);
+	cg_enabled_generation++;
+	pthread_mutex_unlock(&cg_enabled_cache_lock);
+}
+
+/*
+ * Check the cache for a controller enabled in the subtree_control file of a
+ * directory.
+ *
+ *	@param path The cgroup v2 directory
+ *	@param idx Index of the controller in cg_mounts
+ *	@return true if it is known to be enabled
+ */
+static bool cg_enabled_cache_test(const char *path, int idx)
+{
+	struct cg_enabled_entry *entry;
+	bool enabled = false;
+
+	entry = &cg_enabled_cache[cg_name_hash(path) &
+				  (CG_ENABLED_CACHE_SIZE - 1)];
+
+	pthread_mutex_lock(&cg_enabled_cache_lock);
+	if (entry->path && entry->generation == cg_enabled_generation &&
+	    strcmp(entry->path, path) == 0)
+		enabled = cg_mask_test(&entry->enabled, idx);
+	pthread_mutex_unlock(&cg_enabled_cache_lock);
+
+	return enabled;
+}
+
+/*
+ * Remember the controllers enabled in the subtree_control file of a
+ * directory, replacing whatever was cached in its slot.
+ */
+static void cg_enabled_cache_store(const char *path,
+				   const struct cg_controller_mask *enabled)
+{
+	struct cg_enabled_entry *entry;
+	char *copy;
+
+	entry = &cg_enabled_cache[cg_name_hash(path) &
+				  (CG_ENABLED_CACHE_SIZE - 1)];
+
+	pthread_mutex_lock(&cg_enabled_cache_lock);
+	if (!entry->path || strcmp(entry->path, path) != 0) {
+		copy = strdup(path);
+		if (!copy)
+			goto unlock;
+
+		free(entry->path);
+		entry->path = copy;
+	}
+	entry->generation = cg_enabled_generation;
+	entry->enabled = *enabled;
+unlock:
+	pthread_mutex_unlock(&cg_enabled_cache_lock);
+}
+
+/*
+ * Grow cg_mounts, the new entries are empty.  The first time, the entries
+ * are copied from cg_mount_table to the heap.  This function should be
+ * called with cg_mount_table_lock taken.
+ */
+static int cg_mount_table_grow(void)
+{
+	int max = cg_mount_table_max * 2;
+	struct cg_mount_table_s *table;
+	int *len;
+
+	if (cg_mounts == cg_mount_table) {
+		table = calloc(max, sizeof(*table));
+		len = calloc(max, sizeof(*len));
+		if (!table || !len) {
+			last_errno = errno;
+			free(table);
+			free(len);
+			return ECGOTHER;
+		}
+
+		memcpy(table, cg_mount_table, sizeof(cg_mount_table));
+		memcpy(len, cg_mount_table_len, sizeof(cg_mount_table_len));
+	} else {
+		table = realloc(cg_mounts, max * sizeof(*table));
+		if (!table) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		cg_mounts = table;
+
+		len = realloc(cg_mount_len, max * sizeof(*len));
+		if (!len) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		memset(&table[cg_mount_table_max], 0,
+		       (max - cg_mount_table_max) * sizeof(*table));
+		memset(&len[cg_mount_table_max], 0,
+		       (max - cg_mount_table_max) * sizeof(*len));
+	}
+
+	cg_mounts = table;
+	cg_mount_len = len;
+	cg_mount_table_max = max;
+
+	return 0;
+}
+
+/*
+ * Copy the first entries of cg_mounts to the exported cg_mount_table, if
+ * cg_mounts was moved to the heap.  This function should be called with
+ * cg_mount_table_lock taken.
+ */
+static void cg_mount_table_sync(void)
+{
+	if (cg_mounts == cg_mount_table)
+		return;
+
+	memcpy(cg_mount_table, cg_mounts,
+	       (CG_CONTROLLER_MAX - 1) * sizeof(*cg_mounts));
+	memset(&cg_mount_table[CG_CONTROLLER_MAX - 1], 0,
+	       sizeof(cg_mount_table[0]));
+}
+
+static int cgroup_cg_mount_table_append(const char *name,
+					const char *mount_path,
+					enum cg_version_t version,
+					int *mnt_tbl_idx,
+					const char *mnt_opts,
+					int shared_mnt)
+{
+	int i = *mnt_tbl_idx;
+	int ret;
+
+	/* Keep the terminating empty entry */
+	if (i + 1 >= cg_mount_table_max) {
+		ret = cg_mount_table_grow();
+		if (ret)
+			return ret;
+	}
+
+	strncpy(cg_mounts[i].name,	name, CONTROL_NAMELEN_MAX);
+	cg_mounts[i].name[CONTROL_NAMELEN_MAX-1] = '\0';
+
+	strncpy(cg_mounts[i].mount.path, mount_path, FILENAME_MAX);
+	cg_mounts[i].mount.path[FILENAME_MAX-1] = '\0';
+	cg_mount_len[i] = strlen(cg_mounts[i].mount.path);
+
+	cg_mounts[i].shared_mnt = shared_mnt;
+	cg_mounts[i].version = version;
+	cg_mounts[i].mount.next = NULL;
+
+	cg_mount_index_add(i);
+
+	cgroup_dbg("Found cgroup option %s, count %d\n", mnt_opts, i);
+
+	(*mnt_tbl_idx)++;
+
+	return 0;
+}
+
+/**
+ * Process a cgroup v1 mount and add it to cg_mounts if it's not a
+ * duplicate.
+ *
+ *	@param controllers List of controllers from /proc/cgroups
+ *	@param ent File system description of cgroup mount being processed
+ *	@param mnt_tbl_idx cg_mounts index
+ */
+STATIC int cgroup_process_v1_mnt(char *controllers[], struct mntent *ent,
+				 int *mnt_tbl_idx)
+{
+	char *strtok_buffer = NULL, *mntopt = NULL;
+	int shared_mnt, duplicate;
+	int i, j, ret = 0;
+
+	for (i = 0; controllers[i] != NULL; i++) {
+		mntopt = hasmntopt(ent, controllers[i]);
+
+		if (!mntopt)
 			continue;
+
+		cgroup_dbg("found %s in %s\n", controllers[i], ent->mnt_opts);
+
+		/* Check if controllers share mount points */
+		shared_mnt = cgroup_set_cg_mnt_tbl_shared_mnt(ent->mnt_dir,
+							      mnt_tbl_idx);
+
+		/* Do not have duplicates in mount table */
+		duplicate = 0;
+		for  (j = 0; j < *mnt_tbl_idx; j++) {
+			if (strncmp(controllers[i], cg_mounts[j].name,
+				    FILENAME_MAX) == 0) {
+				duplicate = 1;
+				break;
+			}
 		}
 
-		cgroup_cg_mount_table_append(controllers[i], ent->mnt_dir,
-					     CGROUP_V1, mnt_tbl_idx,
-					     ent->mnt_opts, shared_mnt);
+		if (duplicate) {
+			cgroup_dbg("controller %s is already mounted on %s\n",
+				   mntopt, cg_mounts[j].mount.path);
+			ret = cg_add_duplicate_mount(&cg_mounts[j],
+						     ent->mnt_dir);
+			if (ret)
+				goto out;
+			/* Continue with next controller */
+			continue;
+		}
 
-		if ((*mnt_tbl_idx) >= CG_CONTROLLER_MAX)
+		ret = cgroup_cg_mount_table_append(controllers[i],
+						   ent->mnt_dir, CGROUP_V1,
+						   mnt_tbl_idx, ent->mnt_opts,
+						   shared_mnt);
+		if (ret)
 			goto out;
 	}
 
@@ -1202,7 +1756,7 @@ STATIC int cgroup_process_v1_mnt(char *controllers[], struct mntent *ent,
 		/* Check if it is a duplicate */
 		duplicate = 0;
 		for (j = 0; j < *mnt_tbl_idx; j++) {
-			if (strncmp(mntopt, cg_mount_table[j].name,
+			if (strncmp(mntopt, cg_mounts[j].name,
 				    FILENAME_MAX) == 0) {
 				duplicate = 1;
 				break;
@@ -1211,15 +1765,15 @@ STATIC int cgroup_process_v1_mnt(char *controllers[], struct mntent *ent,
 
 		if (duplicate) {
 			cgroup_dbg("controller %s is already mounted on %s\n",
-				   mntopt, cg_mount_table[j].mount.path);
-			ret = cg_add_duplicate_mount(&cg_mount_table[j],
+				   mntopt, cg_mounts[j].mount.path);
+			ret = cg_add_duplicate_mount(&cg_mounts[j],
 						     ent->mnt_dir);
 			goto out;
 		}
 
-		cgroup_cg_mount_table_append(mntopt, ent->mnt_dir,
-					     CGROUP_V1, mnt_tbl_idx,
-					     ent->mnt_opts, shared_mnt);
+		ret = cgroup_cg_mount_table_append(mntopt, ent->mnt_dir,
+						   CGROUP_V1, mnt_tbl_idx,
+						   ent->mnt_opts, shared_mnt);
 	}
 
 out:
@@ -1227,11 +1781,11 @@ out:
 }
 
 /**
- * Process a cgroup v2 mount and add it to cg_mount_table if it's not a
+ * Process a cgroup v2 mount and add it to cg_mounts if it's not a
  * duplicate.
  *
  *	@param ent File system description of cgroup mount being processed
- *	@param mnt_tbl_idx cg_mount_table index
+ *	@param mnt_tbl_idx cg_mounts index
  */
 STATIC int cgroup_process_v2_mnt(struct mntent *ent, int *mnt_tbl_idx)
 {
@@ -1305,7 +1859,7 @@ STATIC int cgroup_process_v2_mnt(struct mntent *ent, int *mnt_tbl_idx)
 		/* Do not have duplicates in mount table */
 		duplicate = 0;
 		for  (i = 0; i < *mnt_tbl_idx; i++) {
-			if (strncmp(cg_mount_table[i].name, controller,
+			if (strncmp(cg_mounts[i].name, controller,
 				    FILENAME_MAX) == 0) {
 				duplicate = 1;
 				break;
@@ -1314,9 +1868,9 @@ STATIC int cgroup_process_v2_mnt(struct mntent *ent, int *mnt_tbl_idx)
 
 		if (duplicate) {
 			cgroup_dbg("controller %s is already mounted on %s\n",
-				   controller, cg_mount_table[i].mount.path);
+				   controller, cg_mounts[i].mount.path);
 
-			ret = cg_add_duplicate_mount(&cg_mount_table[i],
+			ret = cg_add_duplicate_mount(&cg_mounts[i],
 						     ent->mnt_dir);
 			if (ret)
 				break;
@@ -1325,11 +1879,10 @@ STATIC int cgroup_process_v2_mnt(struct mntent *ent, int *mnt_tbl_idx)
 		}
 
 		/* This controller is not in the mount table.  add it */
-		cgroup_cg_mount_table_append(controller, ent->mnt_dir,
-					     CGROUP_V2, mnt_tbl_idx,
-					     controller, shared_mnt);
-
-		if ((*mnt_tbl_idx) >= CG_CONTROLLER_MAX)
+		ret = cgroup_cg_mount_table_append(controller, ent->mnt_dir,
+						   CGROUP_V2, mnt_tbl_idx,
+						   controller, shared_mnt);
+		if (ret)
 			goto out;
 	} while ((controller = strtok_r(NULL, " ", &stok_buff)));
 
@@ -1349,8 +1902,8 @@ static void cgroup_free_cg_mount_table(void)
 	struct cg_mount_point *mount, *tmp;
 	int i;
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
-		mount = cg_mount_table[i].mount.next;
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
+		mount = cg_mounts[i].mount.next;
 
 		while (mount) {
 			tmp = mount;
@@ -1359,24 +1912,67 @@ static void cgroup_free_cg_mount_table(void)
 		}
 	}
 
-	memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+	if (cg_mounts != cg_mount_table) {
+		free(cg_mounts);
+		free(cg_mount_len);
+		cg_mounts = cg_mount_table;
+		cg_mount_len = cg_mount_table_len;
+		cg_mount_table_max = CG_CONTROLLER_MAX;
+	}
+
+	memset(cg_mount_table, 0, sizeof(cg_mount_table));
+	memset(cg_mount_table_len, 0, sizeof(cg_mount_table_len));
+	if (cg_mount_index)
+		memset(cg_mount_index, 0,
+		       cg_mount_index_size * sizeof(*cg_mount_index));
+	cg_mount_index_count = 0;
+	cg_mount_v2_index = -1;
 	memset(&cg_cgroup_v2_mount_path, 0, sizeof(cg_cgroup_v2_mount_path));
 	memset(&cg_cgroup_v2_empty_mount_paths, 0,
 	       sizeof(cg_cgroup_v2_empty_mount_paths));
 }
 
+/*
+ * Append a copy of name to a NULL terminated list of controllers, which is
+ * grown by one entry.
+ */
+static int cg_controllers_append(char ***controllers, int *count,
+				 const char *name)
+{
+	char **list;
+
+	list = realloc(*controllers, (*count + 2) * sizeof(*list));
+	if (!list) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	*controllers = list;
+
+	list[*count] = strdup(name);
+	if (!list[*count]) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	(*count)++;
+	list[*count] = NULL;
+
+	return 0;
+}
+
 /*
  * Reads /proc/cgroups and populates the controllers/subsys_name. This function
  * should be called with cg_mount_table_lock taken.
  */
-static int cgroup_populate_controllers(char *controllers[CG_CONTROLLER_MAX])
+static int cgroup_populate_controllers(char ***controllers)
 {
 	int hierarchy, num_cgroups, enabled;
 	char subsys_name[FILENAME_MAX];
 	FILE *proc_cgroup;
 	char *buf = NULL;
 	int ret = 0;
-	int i, err;
+	int i = 0;
+	int err;
 
 	proc_cgroup = fopen("/proc/cgroups", "re");
 	if (!proc_cgroup) {
@@ -1404,20 +2000,15 @@ static int cgroup_populate_controllers(char *controllers[CG_CONTROLLER_MAX])
 		goto err;
 	}
 
-	i = 0;
 	while (!feof(proc_cgroup)) {
 		err = fscanf(proc_cgroup, "%s %d %d %d", subsys_name,
 			     &hierarchy, &num_cgroups, &enabled);
 		if (err < 0)
 			break;
 
-		controllers[i] = strdup(subsys_name);
-		if (controllers[i] == NULL) {
-			last_errno = errno;
-			ret = ECGOTHER;
+		ret = cg_controllers_append(controllers, &i, subsys_name);
+		if (ret)
 			break;
-		}
-		i++;
 	}
 
 err:
@@ -1427,22 +2018,50 @@ err:
 	if (buf)
 		free(buf);
 
-	if (ret != 0) {
-		for (i = 0; controllers[i]; i++) {
-			free(controllers[i]);
-			controllers[i] = NULL;
-		}
+	return ret;
+}
+
+/*
+ * Add a cgroup v1 or v2 mount to the global cg_mounts, other file
+ * systems are ignored. This function should be called with
+ * cg_mount_table_lock taken.
+ */
+static int cgroup_process_mnt(char *controllers[], struct mntent *ent,
+			      int *found_mnt)
+{
+	int ret = 0;
+
+	if (strcmp(ent->mnt_type, "cgroup") == 0)
+		ret = cgroup_process_v1_mnt(controllers, ent, found_mnt);
+
+	if (strcmp(ent->mnt_type, "cgroup2") == 0) {
+		ret = cgroup_process_v2_mnt(ent, found_mnt);
+		/* The controllers file was empty.  Ignore and move on. */
+		if (ret == ECGEOF)
+			ret = 0;
 	}
 
 	return ret;
 }
 
+/*
+ * Check that mount points were found. This function should be called with
+ * cg_mount_table_lock taken.
+ */
+static int cgroup_check_mount_count(int found_mnt)
+{
+	if (!found_mnt)
+		return ECGROUPNOTMOUNTED;
+
+	return 0;
+}
+
 /*
  * Reads /proc/mounts and populates the cgroup v1/v2 mount points into the
- * global cg_mount_table. This function should be called with
+ * global cg_mounts. This function should be called with
  * cg_mount_table_lock taken.
  */
-static int cgroup_populate_mount_points(char *controllers[CG_CONTROLLER_MAX])
+static int cgroup_populate_mount_points(char *controllers[])
 {
 	char mntent_buffer[4 * FILENAME_MAX];
 	struct mntent *ent, *temp_ent = NULL;
@@ -1467,102 +2086,266 @@ static int cgroup_populate_mount_points(char *controllers[CG_CONTROLLER_MAX])
 
 	while ((ent = getmntent_r(proc_mount, temp_ent,	mntent_buffer,
 				  sizeof(mntent_buffer))) != NULL) {
+		ret = cgroup_process_mnt(controllers, ent, &found_mnt);
+		if (ret)
+			goto err;
+	}
 
-		if (strcmp(ent->mnt_type, "cgroup") == 0) {
-			ret = cgroup_process_v1_mnt(controllers, ent,
-						    &found_mnt);
-			if (ret)
-				goto err;
+	ret = cgroup_check_mount_count(found_mnt);
 
-			if (found_mnt >= CG_CONTROLLER_MAX)
-				break;
+err:
+	if (proc_mount)
+		fclose(proc_mount);
 
+	if (temp_ent)
+		free(temp_ent);
+
+	return ret;
+}
+
+/*
+ * Collects the v1 controllers named in the mount options of the caller
+ * supplied hierarchies, in place of the ones listed in /proc/cgroups. This
+ * function should be called with cg_mount_table_lock taken.
+ */
+static int cg_desc_controllers(const struct cgroup_mount_desc *mounts,
+			       int count, char ***controllers)
+{
+	char *options, *opt, *stok_buff = NULL;
+	int i, j, n = 0;
+	int ret = 0;
+
+	for (i = 0; i < count && !ret; i++) {
+		if (!mounts[i].options)
 			continue;
+
+		options = strdup(mounts[i].options);
+		if (!options) {
+			last_errno = errno;
+			ret = ECGOTHER;
+			break;
 		}
 
-		if (strcmp(ent->mnt_type, "cgroup2") == 0) {
-			ret = cgroup_process_v2_mnt(ent, &found_mnt);
-			if (ret == ECGEOF) {
-			/*
-			 * The controllers file was empty.  Ignore and move on.
-			 */
-				ret = 0;
+		for (opt = strtok_r(options, ",", &stok_buff); opt;
+		     opt = strtok_r(NULL, ",", &stok_buff)) {
+			if (strncmp(opt, "name=", 5) == 0)
 				continue;
+
+			for (j = 0; j < n; j++) {
+				if (strcmp((*controllers)[j], opt) == 0)
+					break;
 			}
+			if (j < n)
+				continue;
 
+			ret = cg_controllers_append(controllers, &n, opt);
 			if (ret)
-				goto err;
-
-			if (found_mnt >= CG_CONTROLLER_MAX)
 				break;
 		}
-	}
 
-	if (!found_mnt)
-		ret = ECGROUPNOTMOUNTED;
-
-	if (found_mnt >= CG_CONTROLLER_MAX) {
-		cgroup_err("Mount points exceeds CG_CONTROLLER_MAX");
-		ret = ECGMAXVALUESEXCEEDED;
-		/*
-		 * There are loops in the libcgroup codebase that expect there
-		 * to be a null name entry at the end of the cg_mount_table[].
-		 */
-		cg_mount_table[CG_CONTROLLER_MAX - 1].name[0] = '\0';
+		free(options);
 	}
 
-err:
-	if (proc_mount)
-		fclose(proc_mount);
-
-	if (temp_ent)
-		free(temp_ent);
-
 	return ret;
 }
 
-/**
- * cgroup_init(), initializes the MOUNT_POINT.
- *
- * This code is theoretically thread safe now. Its not really tested
- * so it can blow up. If does for you, please let us know with your
- * test case and we can really make it thread safe.
- *
+/*
+ * Populates the global cg_mounts from the caller supplied hierarchies,
+ * each of them is processed as if it was a mount listed in /proc/mounts.
+ * This function should be called with cg_mount_table_lock taken.
  */
-int cgroup_init(void)
+static int cg_desc_mount_points(const struct cgroup_mount_desc *mounts,
+				int count, char *controllers[])
 {
-	static char *controllers[CG_CONTROLLER_MAX];
+	char options[FILENAME_MAX];
+	char dir[FILENAME_MAX];
+	struct mntent ent;
+	int found_mnt = 0;
 	int ret = 0;
 	int i;
 
-	cgroup_set_default_logger(-1);
+	for (i = 0; i < count; i++) {
+		if (!mounts[i].path) {
+			ret = ECGINVAL;
+			break;
+		}
+
+		/* cgroup_process_v1_mnt() tokenizes the options in place */
+		snprintf(dir, sizeof(dir), "%s", mounts[i].path);
+		snprintf(options, sizeof(options), "rw,%s",
+			 mounts[i].options ? mounts[i].options : "");
+
+		memset(&ent, 0, sizeof(ent));
+		ent.mnt_fsname = mounts[i].options ? "cgroup" : "cgroup2";
+		ent.mnt_type = ent.mnt_fsname;
+		ent.mnt_dir = dir;
+		ent.mnt_opts = options;
+
+		ret = cgroup_process_mnt(controllers, &ent, &found_mnt);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		ret = cgroup_check_mount_count(found_mnt);
+
+	return ret;
+}
+
+/*
+ * Initializes the cg_mounts, either from the caller supplied
+ * hierarchies or, if mounts is NULL, from the mounted ones.
+ */
+static int cg_init_mount_table(const struct cgroup_mount_desc *mounts,
+			       int count)
+{
+	char **controllers;
+	int ret = 0;
+	int i;
+
+	cgroup_set_default_logger(-1);
+
+	/* A NULL terminated list, grown as the controllers are found */
+	controllers = calloc(1, sizeof(*controllers));
+	if (!controllers) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
 
 	pthread_rwlock_wrlock(&cg_mount_table_lock);
 
 	/* Free global variables filled by previous cgroup_init() */
 	cgroup_free_cg_mount_table();
+	cg_enabled_cache_invalidate();
+	cg_mount_table_injected = 0;
 
-	ret = cgroup_populate_controllers(controllers);
+	if (mounts)
+		ret = cg_desc_controllers(mounts, count, &controllers);
+	else
+		ret = cgroup_populate_controllers(&controllers);
 	if (ret)
 		goto unlock_exit;
 
-	ret = cgroup_populate_mount_points(controllers);
+	if (mounts)
+		ret = cg_desc_mount_points(mounts, count, controllers);
+	else
+		ret = cgroup_populate_mount_points(controllers);
 	if (ret)
 		goto unlock_exit;
 
+	cg_mount_table_injected = mounts != NULL;
 	cgroup_initialized = 1;
 
 unlock_exit:
-	for (i = 0; controllers[i]; i++) {
+	cg_mount_table_sync();
+
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+
+	for (i = 0; controllers[i]; i++)
 		free(controllers[i]);
-		controllers[i] = NULL;
+	free(controllers);
+
+	return ret;
+}
+
+/*
+ * Entries of unknown type are kept and checked with stat() by the caller,
+ * some file systems do not report d_type.
+ */
+static int cg_filter_hierarchy_dir(const struct dirent *dent)
+{
+	return (dent->d_type == DT_DIR || dent->d_type == DT_UNKNOWN) &&
+	       dent->d_name[0] != '.';
+}
+
+/*
+ * Initializes the cg_mounts from the hierarchies found in the
+ * subdirectories of the given directory, see CGROUP_ROOT_OVERRIDE in
+ * cgroup_init_mount_table().
+ */
+static int cg_init_root_override(const char *root)
+{
+	struct cgroup_mount_desc *mounts = NULL;
+	char (*dirs)[FILENAME_MAX] = NULL;
+	struct dirent **dents = NULL;
+	char path[FILENAME_MAX];
+	int count, nr = 0, i;
+	struct stat st;
+	int ret;
+
+	count = scandir(root, &dents, cg_filter_hierarchy_dir, alphasort);
+	if (count < 0) {
+		cgroup_err("cannot read %s: %s\n", root, strerror(errno));
+		last_errno = errno;
+		return ECGOTHER;
 	}
 
-	pthread_rwlock_unlock(&cg_mount_table_lock);
+	mounts = calloc(count + 1, sizeof(*mounts));
+	dirs = calloc(count + 1, sizeof(*dirs));
+	if (!mounts || !dirs) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(dirs[nr], sizeof(dirs[nr]), "%s/%s", root,
+			 dents[i]->d_name);
+
+		if (dents[i]->d_type == DT_UNKNOWN &&
+		    (lstat(dirs[nr], &st) < 0 || !S_ISDIR(st.st_mode)))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dirs[nr],
+			 CGV2_CONTROLLERS_FILE);
+
+		mounts[nr].path = dirs[nr];
+		mounts[nr].options = access(path, F_OK) == 0 ?
+				     NULL : dents[i]->d_name;
+		nr++;
+	}
+
+	cgroup_dbg("using the hierarchies under %s\n", root);
+	ret = cg_init_mount_table(mounts, nr);
+
+out:
+	for (i = 0; i < count; i++)
+		free(dents[i]);
+	free(dents);
+	free(mounts);
+	free(dirs);
 
 	return ret;
 }
 
+/**
+ * cgroup_init(), initializes the MOUNT_POINT.
+ *
+ * This code is theoretically thread safe now. Its not really tested
+ * so it can blow up. If does for you, please let us know with your
+ * test case and we can really make it thread safe.
+ *
+ */
+int cgroup_init(void)
+{
+	const char *root;
+
+	root = secure_getenv(CGROUP_ROOT_OVERRIDE_ENV);
+	if (root && root[0] != '\0')
+		return cg_init_root_override(root);
+
+	return cg_init_mount_table(NULL, 0);
+}
+
+int cgroup_init_mount_table(const struct cgroup_mount_desc *mounts,
+			    int count)
+{
+	if (!mounts || count < 0)
+		return ECGINVAL;
+
+	return cg_init_mount_table(mounts, count);
+}
+
 static int cg_test_mounted_fs(void)
 {
 	char mntent_buff[4 * FILENAME_MAX];
@@ -1571,6 +2354,10 @@ static int cg_test_mounted_fs(void)
 	FILE *proc_mount = NULL;
 	int ret = 1;
 
+	/* The caller supplied hierarchies need not be mounted */
+	if (cg_mount_table_injected)
+		return 1;
+
 	proc_mount = fopen("/proc/mounts", "re");
 	if (proc_mount == NULL)
 		return 0;
@@ -1609,28 +2396,29 @@ static inline pid_t cg_gettid(void)
 	return syscall(__NR_gettid);
 }
 
-static char *cg_concat_path(const char *pref, const char *suf, char *path)
+/*
+ * Append n characters to a path of length *len, truncating it at
+ * FILENAME_MAX - 1 characters.
+ */
+static inline void cg_path_append(char *path, size_t *len, const char *str,
+				  size_t n)
 {
-	if ((suf[strlen(suf)-1] == '/') ||
-	    ((strlen(suf) == 0) && (pref[strlen(pref)-1] == '/'))) {
-		snprintf(path, FILENAME_MAX, "%s%s", pref,
-			 suf+((suf[0] == '/') ? 1 : 0));
-	} else {
-		snprintf(path, FILENAME_MAX, "%s%s/", pref,
-			 suf+((suf[0] == '/') ? 1 : 0));
-	}
+	if (n > FILENAME_MAX - 1 - *len)
+		n = FILENAME_MAX - 1 - *len;
 
-	path[FILENAME_MAX-1] = '\0';
-	return path;
+	memcpy(path + *len, str, n);
+	*len += n;
 }
 
-
 /* Call with cg_mount_table_lock taken */
 /* path value have to have size at least FILENAME_MAX */
 char *cg_build_path_locked(const char *name, char *path,
 			   const char *type)
 {
-	int i, ret;
+	const char *prefix, *namespace = NULL;
+	size_t len = 0, prefix_len;
+	size_t name_len;
+	int i;
 
 	/*
 	 * If no type is specified, and there's a valid cgroup v2 mount,
@@ -1638,71 +2426,58 @@ char *cg_build_path_locked(const char *name, char *path,
 	 * This can be used to create a cgroup v2 cgroup that's not attached
 	 * to any controller.
 	 */
-	if (!type && strlen(cg_cgroup_v2_mount_path) > 0) {
-		ret = snprintf(path, FILENAME_MAX, "%s/",
-			       cg_cgroup_v2_mount_path);
-		if (ret >= FILENAME_MAX)
-			cgroup_dbg("filename too long: %s/",
-				   cg_cgroup_v2_mount_path);
-
-		if (name) {
-			char *tmp;
-
-			tmp = strdup(path);
-			if (tmp == NULL)
-				return NULL;
-
-			cg_concat_path(tmp, name, path);
-			free(tmp);
-		}
-		return path;
-	}
+	if (!type && cg_cgroup_v2_mount_path[0] != '\0') {
+		prefix = cg_cgroup_v2_mount_path;
+		prefix_len = strlen(prefix);
+	} else {
+		if (!type)
+			return NULL;
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
 		/* Two ways to successfully move forward here:
 		 * 1. The "type" controller matches the name of a mounted
 		 *    controller
 		 * 2. The "type" controller requested is "cgroup" and there's
 		 *    a "real" controller mounted as cgroup v2
 		 */
-		if ((type && strcmp(cg_mount_table[i].name, type) == 0) ||
-		    (type && strcmp(type, CGROUP_FILE_PREFIX) == 0 &&
-		     cg_mount_table[i].version == CGROUP_V2)) {
-
-			if (cg_namespace_table[i]) {
-				ret = snprintf(path, FILENAME_MAX, "%s/%s/",
-					       cg_mount_table[i].mount.path,
-					       cg_namespace_table[i]);
-				if (ret >= FILENAME_MAX) {
-					cgroup_dbg("filename too long");
-					cgroup_dbg(":%s/%s/",
-						   cg_mount_table[i].mount.path,
-						   cg_namespace_table[i]);
-				}
-			} else {
-				ret = snprintf(path, FILENAME_MAX, "%s/",
-					       cg_mount_table[i].mount.path);
-				if (ret >= FILENAME_MAX) {
-					cgroup_dbg("filename too long");
-					cgroup_dbg(":%s/",
-						   cg_mount_table[i].mount.path);
-				}
-			}
+		i = cg_mount_index_find(type);
+		if (i < 0 && strcmp(type, CGROUP_FILE_PREFIX) == 0)
+			i = cg_mount_index_find_v2();
+		if (i < 0)
+			return NULL;
 
-			if (name) {
-				char *tmp;
+		prefix = cg_mounts[i].mount.path;
+		prefix_len = cg_mount_len[i];
+		if (!prefix_len)
+			prefix_len = strlen(prefix);
+		if (i < cg_namespace_table_max)
+			namespace = cg_namespace_table[i];
+	}
 
-				tmp = strdup(path);
-				if (tmp == NULL)
-					break;
+	cg_path_append(path, &len, prefix, prefix_len);
+	cg_path_append(path, &len, "/", 1);
 
-				cg_concat_path(tmp, name, path);
-				free(tmp);
-			}
-			return path;
-		}
+	if (namespace) {
+		cg_path_append(path, &len, namespace, strlen(namespace));
+		cg_path_append(path, &len, "/", 1);
 	}
-	return NULL;
+
+	if (name) {
+		if (name[0] == '/')
+			name++;
+
+		/* Directories end with a slash */
+		name_len = strlen(name);
+		cg_path_append(path, &len, name, name_len);
+		if (name_len && name[name_len - 1] != '/')
+			cg_path_append(path, &len, "/", 1);
+	}
+
+	path[len] = '\0';
+
+	if (len == FILENAME_MAX - 1)
+		cgroup_dbg("filename too long: %s\n", path);
+
+	return path;
 }
 
 char *cg_build_path(const char *name, char *path, const char *type)
@@ -1818,7 +2593,7 @@ STATIC int cgroupv2_controller_enabled(const char * const cg_name,
 	char *parent = NULL, *dname;
 	enum cg_version_t version;
 	bool enabled;
-	int error;
+	int error, idx;
 
 	error = cgroup_get_controller_version(ctrl_name, &version);
 	if (error)
@@ -1849,6 +2624,15 @@ STATIC int cgroupv2_controller_enabled(const char * const cg_name,
 
 	dname = dirname(parent);
 
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	idx = cg_mount_index_find(ctrl_name);
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+
+	if (idx >= 0 && cg_enabled_cache_test(dname, idx)) {
+		error = 0;
+		goto err;
+	}
+
 	error = cgroupv2_get_subtree_control(dname, ctrl_name, &enabled);
 	if (error)
 		goto err;
@@ -1925,8 +2709,7 @@ int cgroup_attach_task_pid(struct cgroup *cgroup, pid_t tid)
 	}
 	if (!cgroup) {
 		pthread_rwlock_rdlock(&cg_mount_table_lock);
-		for (i = 0; i < CG_CONTROLLER_MAX &&
-				cg_mount_table[i].name[0] != '\0'; i++) {
+		for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
 			ret = cgroupv2_controller_enabled(cgroup->name,
 				cgroup->controller[i]->name);
 			if (ret)
@@ -1963,7 +2746,7 @@ int cgroup_attach_task_pid(struct cgroup *cgroup, pid_t tid)
 		     empty_cgroup > 0 || i < cgroup->index;
 		     i++, empty_cgroup--) {
 
-			if (cgroup->controller[i])
+			if (i < cgroup->index)
 				controller_name = cgroup->controller[i]->name;
 
 			ret = cgroupv2_controller_enabled(cgroup->name,
@@ -2096,7 +2879,12 @@ static int cg_set_control_value(char *path, const char *val)
 	if (!cg_test_mounted_fs())
 		return ECGROUPNOTMOUNTED;
 
-	ctl_file = open(path, O_RDWR | O_CLOEXEC);
+	/*
+	 * The kernel replaces the whole value on every write, the regular
+	 * files of a caller supplied hierarchy have to be truncated.
+	 */
+	ctl_file = open(path, O_RDWR | O_CLOEXEC |
+			(cg_mount_table_injected ? O_TRUNC : 0));
 
 	if (ctl_file == -1) {
 		if (errno == EPERM) {
@@ -2254,9 +3042,11 @@ STATIC int cgroupv2_get_subtree_control(const char *path,
 					bool * const enabled)
 {
 	char *path_copy = NULL, *saveptr = NULL, *token, *ret_c;
+	struct cg_controller_mask mask = { { 0 } };
 	int ret, error = ECGROUPNOTMOUNTED;
 	char buffer[FILENAME_MAX];
 	FILE *fp = NULL;
+	int idx;
 
 	if (!path || !ctrl_name || !enabled)
 		return ECGOTHER;
@@ -2289,16 +3079,23 @@ STATIC int cgroupv2_get_subtree_control(const char *path,
 
 	/*
 	 * Split the enabled controllers by " " and evaluate if the requested
-	 * controller is enabled.
+	 * controller is enabled.  Cache all of them for the next checks.
 	 */
-	token = strtok_r(buffer, " ", &saveptr);
-	do {
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	for (token = strtok_r(buffer, " ", &saveptr); token;
+	     token = strtok_r(NULL, " ", &saveptr)) {
 		if (strncmp(ctrl_name, token, FILENAME_MAX) == 0) {
 			error = 0;
 			*enabled = true;
-			break;
 		}
-	} while ((token = strtok_r(NULL, " ", &saveptr)));
+
+		idx = cg_mount_index_find(token);
+		if (idx >= 0)
+			cg_mask_set(&mask, idx);
+	}
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+
+	cg_enabled_cache_store(path, &mask);
 
 out:
 	if (path_copy)
@@ -2347,6 +3144,7 @@ STATIC int cgroupv2_subtree_control(const char *path, const char *ctrl_name,
 		goto out;
 
 	error = cg_set_control_value(path_copy, value);
+	cg_enabled_cache_invalidate();
 	if (error)
 		goto out;
 
@@ -2374,9 +3172,9 @@ STATIC int cgroupv2_subtree_control_recursive(char *path,
 	size_t mount_len;
 	int i, error = 0;
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
-		if (strncmp(cg_mount_table[i].name, ctrl_name,
-			    sizeof(cg_mount_table[i].name)) == 0) {
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
+		if (strncmp(cg_mounts[i].name, ctrl_name,
+			    sizeof(cg_mounts[i].name)) == 0) {
 			found_mount = true;
 			break;
 		}
@@ -2395,7 +3193,7 @@ STATIC int cgroupv2_subtree_control_recursive(char *path,
 	 * subdir by subdir, and enable the subtree control file each step
 	 * of the way
 	 */
-	mount_len = strlen(cg_mount_table[i].mount.path);
+	mount_len = strlen(cg_mounts[i].mount.path);
 	path_copy[mount_len] = '\0';
 
 	tmp_path = strtok_r(&path[mount_len], "/", &stok_buff);
@@ -2469,24 +3267,23 @@ err:
 int cgroup_copy_controller_values(struct cgroup_controller * const dst,
 				  const struct cgroup_controller * const src)
 {
+	struct control_value *dst_val = NULL;
 	int i, ret = 0;
 
 	if (!dst || !src)
 		return ECGFAIL;
 
 	strncpy(dst->name, src->name, CONTROL_NAMELEN_MAX);
-	for (i = 0; i < src->index; i++, dst->index++) {
+	for (i = 0; i < src->index; i++) {
 		struct control_value *src_val = src->values[i];
-		struct control_value *dst_val;
 
-		dst->values[i] = calloc(1, sizeof(struct control_value));
-		if (!dst->values[i]) {
+		dst_val = calloc(1, sizeof(struct control_value));
+		if (!dst_val) {
 			last_errno = errno;
 			ret = ECGOTHER;
 			goto err;
 		}
 
-		dst_val = dst->values[i];
 		strncpy(dst_val->value, src_val->value, CG_CONTROL_VALUE_MAX);
 		strncpy(dst_val->name, src_val->name, FILENAME_MAX);
 
@@ -2515,24 +3312,36 @@ int cgroup_copy_controller_values(struct cgroup_controller * const dst,
 		}
 
 		dst_val->dirty = src_val->dirty;
+
+		ret = cg_value_append(dst, dst_val);
+		if (ret)
+			goto err;
 	}
 
 	return ret;
 
 err:
-	dst->index = 0;
-	for (i = 0; i < src->index; i++) {
-		if (dst->values[i]) {
-			if (dst->values[i]->multiline_value)
-				free(dst->values[i]->multiline_value);
+	if (dst_val) {
+		if (dst_val->multiline_value)
+			free(dst_val->multiline_value);
 
-			if (dst->values[i]->prev_name)
-				free(dst->values[i]->prev_name);
+		if (dst_val->prev_name)
+			free(dst_val->prev_name);
 
-			free(dst->values[i]);
-		}
+		free(dst_val);
 	}
 
+	for (i = 0; i < dst->index; i++) {
+		if (dst->values[i]->multiline_value)
+			free(dst->values[i]->multiline_value);
+
+		if (dst->values[i]->prev_name)
+			free(dst->values[i]->prev_name);
+
+		free(dst->values[i]);
+	}
+	dst->index = 0;
+
 	return ret;
 }
 
@@ -2558,6 +3367,15 @@ int cgroup_copy_cgroup(struct cgroup *dst, struct cgroup *src)
 
 	cgroup_free_controllers(dst);
 
+	if (src->index) {
+		dst->controller = calloc(src->index, sizeof(*dst->controller));
+		if (!dst->controller) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		dst->controller_max = src->index;
+	}
+
 	for (i = 0; i < src->index; i++, dst->index++) {
 		struct cgroup_controller *src_ctlr = src->controller[i];
 		struct cgroup_controller *dst_ctlr;
@@ -2618,23 +3436,27 @@ err:
 	return error;
 }
 
+/**
+ * Create a group in the hierarchy of one controller and set its values.
+ * The ownership is set by cg_create_cgroup_ownership() once the group
+ * exists in all hierarchies.
+ *
+ * @param cgroup The group.
+ * @param controller The controller, NULL for the cgroup v2 hierarchy.
+ */
 static int _cgroup_create_cgroup(const struct cgroup * const cgroup,
-				 const struct cgroup_controller * const controller,
-				 int ignore_ownership)
+				 const struct cgroup_controller * const controller)
 {
 	enum cg_version_t version = CGROUP_UNK;
-	char *fts_path[2];
 	char *base = NULL;
 	char *path = NULL;
 	int error;
 
-	fts_path[0] = (char *)malloc(FILENAME_MAX);
-	if (!fts_path[0]) {
+	path = (char *)malloc(FILENAME_MAX);
+	if (!path) {
 		last_errno = errno;
 		return ECGOTHER;
 	}
-	fts_path[1] = NULL;
-	path = fts_path[0];
 
 	if (controller) {
 		if (!cg_build_path(cgroup->name, path, controller->name)) {
@@ -2683,36 +3505,12 @@ static int _cgroup_create_cgroup(const struct cgroup * const cgroup,
 		goto err;
 	}
 
-	if (!ignore_ownership) {
-		cgroup_dbg("Changing ownership of %s\n", fts_path[0]);
-		error = cg_chown_recursive(fts_path,
-			cgroup->control_uid, cgroup->control_gid);
-		if (!error)
-			error = cg_chmod_recursive_controller(fts_path[0],
-					cgroup->control_dperm,
-					cgroup->control_dperm != NO_PERMS,
-					cgroup->control_fperm,
-					cgroup->control_fperm != NO_PERMS,
-					1, cgroup_ignored_tasks_files);
-	}
-
-	if (error)
-		goto err;
-
 	if (controller) {
 		error = cgroup_set_values_recursive(base, controller, false);
 		if (error)
 			goto err;
 	}
 
-	if (!ignore_ownership && version == CGROUP_V1) {
-		error = cgroup_chown_chmod_tasks(base,
-				cgroup->tasks_uid, cgroup->tasks_gid,
-				cgroup->task_fperm);
-		if (error)
-			goto err;
-	}
-
 err:
 	if (path)
 		free(path);
@@ -2721,6 +3519,73 @@ err:
 	return error;
 }
 
+/**
+ * Set the ownership and the permissions of a group in the hierarchies of
+ * its first count controllers, or in the cgroup v2 hierarchy if it has no
+ * controller.  Each hierarchy is walked once, however many of the
+ * controllers share it, and only after all controllers are enabled, so
+ * that their files are there.
+ */
+static int cg_create_cgroup_ownership(const struct cgroup * const cgroup,
+				      int count)
+{
+	enum cg_version_t version = CGROUP_UNK;
+	struct cg_perm_seen *seen;
+	char path[FILENAME_MAX];
+	const char *controller;
+	struct cg_perm perm;
+	int seen_count = 0;
+	int i, error = 0;
+
+	memset(&perm, 0, sizeof(perm));
+	perm.chown = 1;
+	perm.uid = cgroup->control_uid;
+	if (perm.uid == NO_UID_GID)
+		perm.uid = getuid();
+	perm.gid = cgroup->control_gid;
+	if (perm.gid == NO_UID_GID)
+		perm.gid = getgid();
+	perm.dir_mode = cgroup->control_dperm;
+	perm.dirm_change = cgroup->control_dperm != NO_PERMS;
+	perm.file_mode = cgroup->control_fperm;
+	perm.filem_change = cgroup->control_fperm != NO_PERMS;
+	perm.owner_is_umask = 1;
+	perm.ignore_list = cgroup_ignored_tasks_files;
+
+	seen = calloc(count + 1, sizeof(*seen));
+	if (!seen) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	for (i = 0; i < count || (i == 0 && !cgroup->index); i++) {
+		controller = cgroup->index ? cgroup->controller[i]->name : NULL;
+
+		if (!cg_build_path(cgroup->name, path, controller)) {
+			error = ECGOTHER;
+			break;
+		}
+
+		cgroup_dbg("Changing ownership of %s\n", path);
+		error = cg_perm_recursive(path, &perm, seen, &seen_count);
+		if (error)
+			break;
+
+		if (controller &&
+		    !cgroup_get_controller_version(controller, &version) &&
+		    version == CGROUP_V1) {
+			error = cgroup_chown_chmod_tasks(path,
+					cgroup->tasks_uid, cgroup->tasks_gid,
+					cgroup->task_fperm);
+			if (error)
+				break;
+		}
+	}
+
+	free(seen);
+	return error;
+}
+
 /**
  * cgroup_create_cgroup creates a new control group.
  * struct cgroup *cgroup: The control group to be created
@@ -2733,7 +3598,7 @@ err:
 int cgroup_create_cgroup(struct cgroup *cgroup, int ignore_ownership)
 {
 	int error = 0;
-	int i;
+	int i, ret;
 
 	if (!cgroup_initialized)
 		return ECGROUPNOTINITIALIZED;
@@ -2749,7 +3614,7 @@ int cgroup_create_cgroup(struct cgroup *cgroup, int ignore_ownership)
 
 	if (cgroup->index == 0) {
 		/* Create an empty cgroup v2 cgroup */
-		error = _cgroup_create_cgroup(cgroup, NULL, ignore_ownership);
+		error = _cgroup_create_cgroup(cgroup, NULL);
 		if (error)
 			return error;
 	}
@@ -2760,13 +3625,22 @@ int cgroup_create_cgroup(struct cgroup *cgroup, int ignore_ownership)
 	 * data structure. If not, we fail.
 	 */
 	for (i = 0; i < cgroup->index; i++) {
-		error = _cgroup_create_cgroup(cgroup, cgroup->controller[i],
-					      ignore_ownership);
+		error = _cgroup_create_cgroup(cgroup, cgroup->controller[i]);
 		if (error)
-			return error;
+			break;
 	}
 
-	return 0;
+	/* The group exists where its values could not be set */
+	if (error && error != ECGCANTSETVALUE)
+		return error;
+
+	if (!ignore_ownership) {
+		ret = cg_create_cgroup_ownership(cgroup, error ? i + 1 : i);
+		if (ret)
+			return ret;
+	}
+
+	return error;
 }
 
 /**
@@ -2818,7 +3692,7 @@ static int cgroup_get_parent_name(struct cgroup *cgroup, char **parent)
 
 /*
  * Checks if the cgroup's controller shares the mount point with any other
- * controller in cg_mount_table. Returns 1 if shared or 0.
+ * controller in cg_mounts. Returns 1 if shared or 0.
  */
 static int is_cgrp_ctrl_shared_mnt(char *controller)
 {
@@ -2827,11 +3701,11 @@ static int is_cgrp_ctrl_shared_mnt(char *controller)
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
 
-		if (strncmp(cg_mount_table[i].name, controller,
-			    sizeof(cg_mount_table[i].name)) == 0 &&
-		    cg_mount_table[i].shared_mnt) {
+		if (strncmp(cg_mounts[i].name, controller,
+			    sizeof(cg_mounts[i].name)) == 0 &&
+		    cg_mounts[i].shared_mnt) {
 			ret = 1;
 			break;
 		}
@@ -3016,6 +3890,262 @@ static int cg_move_task_files(FILE *input_tasks, FILE *output_tasks)
 	return 0;
 }
 
+/**
+ * Move all processes listed in a tasks file to another one.
+ * @param path The tasks file to read the processes from.
+ * @param output_tasks Pre-opened file to write tasks to.
+ * @return 0 on succes, >0 on error.
+ */
+static int cg_move_tasks_path(const char *path, FILE *output_tasks)
+{
+	FILE *delete_tasks;
+	int ret = 0;
+
+	delete_tasks = fopen(path, "re");
+	if (delete_tasks) {
+		ret = cg_move_task_files(delete_tasks, output_tasks);
+		if (ret != 0) {
+			cgroup_warn("removing tasks from %s ", path);
+			cgroup_warn("failed: %s\n", cgroup_strerror(ret));
+		}
+		fclose(delete_tasks);
+	} else {
+		/*
+		 * Can't open the tasks file. If the file does not
+		 * exist, ignore it - the group has been already
+		 * removed.
+		 */
+		if (errno != ENOENT) {
+			cgroup_err("cannot open %s: %s\n", path,
+				   strerror(errno));
+			last_errno = errno;
+			ret = ECGOTHER;
+		}
+	}
+
+	return ret;
+}
+
+/* Passes over the processes of a group to move, see cg_move_procs() */
+#define CG_MOVE_PASSES		8
+
+/* How long a deleted group may stay populated, in milliseconds */
+#define CG_DELETE_WAIT_MS	10000
+
+/**
+ * Write one process id to an opened tasks or cgroup.procs file.
+ * @return 0 on success or if the process is gone, -1 on error.
+ */
+static int cg_move_pid(int fd, const char *id, size_t len)
+{
+	if (write(fd, id, len) >= 0 || errno == ESRCH)
+		return 0;
+
+	return -1;
+}
+
+/**
+ * Move all processes listed in a tasks or cgroup.procs file to another one.
+ * Unlike cg_move_task_files(), the file is read in large chunks and each id
+ * is written with a single write(), with no stdio buffering.  The file is
+ * read again until it is empty, since processes may be added to it while it
+ * is read.
+ * @param dirfd The directory path is relative to, or AT_FDCWD.
+ * @param path The file to read the processes from.
+ * @param output_tasks Pre-opened file to write processes to.
+ * @return 0 on succes, >0 on error.
+ */
+static int cg_move_procs(int dirfd, const char *path, FILE *output_tasks)
+{
+	int out = fileno(output_tasks);
+	int pass, fd, moved = 1;
+	size_t have, len;
+	char buf[16384];
+	char *id, *nl;
+	ssize_t n;
+
+	for (pass = 0; moved && pass < CG_MOVE_PASSES; pass++) {
+		fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			/* The group is gone already */
+			if (errno == ENOENT)
+				return 0;
+			goto err;
+		}
+
+		moved = 0;
+		have = 0;
+		for (;;) {
+			n = read(fd, buf + have, sizeof(buf) - have - 1);
+			if (n < 0) {
+				close(fd);
+				goto err;
+			}
+			have += n;
+
+			/* The last line needs no newline at the end */
+			if (n == 0 && have > 0 && buf[have - 1] != '\n')
+				buf[have++] = '\n';
+
+			id = buf;
+			while ((nl = memchr(id, '\n', buf + have - id))) {
+				len = nl - id;
+				if (len && cg_move_pid(out, id, len)) {
+					close(fd);
+					goto err;
+				}
+				moved += !!len;
+				id = nl + 1;
+			}
+
+			/* Keep the incomplete line for the next read */
+			have = buf + have - id;
+			memmove(buf, id, have);
+
+			if (n == 0)
+				break;
+		}
+		close(fd);
+	}
+
+	return 0;
+err:
+	last_errno = errno;
+	return ECGOTHER;
+}
+
+/**
+ * Build the path of the file the processes of a group are moved through.
+ * With CGFLAG_DELETE_FREEZE, whole processes are moved on cgroup v1 too.
+ */
+static int cg_build_migration_path(char *path, size_t path_sz,
+				   const char *cgroup_name,
+				   const char *controller, int flags)
+{
+	enum cg_version_t version;
+
+	if (!(flags & CGFLAG_DELETE_FREEZE) ||
+	    cgroup_get_controller_version(controller, &version) ||
+	    version != CGROUP_V1)
+		return cgroup_build_tasks_procs_path(path, path_sz, cgroup_name,
+						     controller);
+
+	if (!cg_build_path(cgroup_name, path, controller))
+		return ECGOTHER;
+	strncat(path, "cgroup.procs", path_sz - strlen(path) - 1);
+
+	return 0;
+}
+
+/**
+ * Write to cgroup.kill or cgroup.freeze of a group, depending on the flags.
+ * This acts on all its subgroups too.
+ * @param cgroup_name The group.
+ * @param controller The controller, NULL for the unified hierarchy.
+ * @param flags Combination of CGFLAG_DELETE_* flags.
+ * @param value The value to write, "0" only makes sense to thaw the group.
+ * @return 0 on success, >0 on error.
+ */
+static int cg_delete_stop_group(const char *cgroup_name,
+				const char *controller, int flags,
+				const char *value)
+{
+	int kill = flags & CGFLAG_DELETE_KILL;
+	enum cg_version_t version;
+	char path[FILENAME_MAX];
+	int fd, ret;
+
+	ret = cgroup_get_controller_version(controller, &version);
+	if (ret)
+		return ret;
+
+	if (version != CGROUP_V2)
+		return kill ? ECGROUPUNSUPP : 0;
+
+	if (!cg_build_path(cgroup_name, path, controller))
+		return ECGROUPSUBSYSNOTMOUNTED;
+	strncat(path, kill ? "cgroup.kill" : "cgroup.freeze",
+		sizeof(path) - strlen(path) - 1);
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		ret = write(fd, value, strlen(value)) < 0 ? -1 : 0;
+		close(fd);
+		if (!ret)
+			return 0;
+	}
+
+	/*
+	 * Kernels older than 5.14 have no cgroup.kill, the processes of a
+	 * group which cannot be frozen are moved anyway.
+	 */
+	if (errno == ENOENT)
+		return kill ? ECGROUPUNSUPP : 0;
+
+	cgroup_warn("cannot write %s: %s\n", path, strerror(errno));
+	last_errno = errno;
+	return ECGOTHER;
+}
+
+/**
+ * Wait until a cgroup v2 group has no process left, neither in it nor in
+ * its subgroups, according to the populated field of cgroup.events.  The
+ * kernel wakes up the pollers of this file on each change.  After
+ * CG_DELETE_WAIT_MS, the function returns anyway and the removal of the
+ * group fails.
+ * @param dirfd The directory group is relative to, or AT_FDCWD.
+ * @param group The directory of the group.
+ */
+static void cg_delete_wait_unpopulated(int dirfd, const char *group)
+{
+	struct timespec now, deadline;
+	char path[FILENAME_MAX];
+	struct pollfd pfd;
+	char buf[256];
+	char *field;
+	ssize_t n;
+	long wait;
+	int len;
+
+	len = strlen(group);
+	len = snprintf(path, sizeof(path), "%s%scgroup.events", group,
+		       len && group[len - 1] != '/' ? "/" : "");
+	if (len < 0 || len >= (int)sizeof(path))
+		return;
+
+	pfd.fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (pfd.fd < 0)
+		return;
+	pfd.events = POLLPRI;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += CG_DELETE_WAIT_MS / 1000;
+
+	for (;;) {
+		n = pread(pfd.fd, buf, sizeof(buf) - 1, 0);
+		if (n < 0)
+			break;
+		buf[n] = '\0';
+
+		field = strstr(buf, "populated ");
+		if (!field || field[strlen("populated ")] == '0')
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = (deadline.tv_sec - now.tv_sec) * 1000 +
+		       (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (wait <= 0) {
+			cgroup_warn("%s is still populated\n", path);
+			break;
+		}
+
+		if (poll(&pfd, 1, wait) < 0 && errno != EINTR)
+			break;
+	}
+
+	close(pfd.fd);
+}
+
 /**
  * Remove one cgroup from specific controller. The function  moves all
  * processes from it to given target group.
@@ -3036,64 +4166,441 @@ static int cg_move_task_files(FILE *input_tasks, FILE *output_tasks)
 static int cg_delete_cgroup_controller(char *cgroup_name, char *controller,
 				       FILE *target_tasks, int flags)
 {
+	enum cg_version_t version = CGROUP_UNK;
 	char path[FILENAME_MAX];
-	FILE *delete_tasks;
 	int ret = 0;
 
-	cgroup_dbg("Removing group %s:%s\n", controller, cgroup_name);
+	cgroup_dbg("Removing group %s:%s\n", controller, cgroup_name);
+
+	cgroup_get_controller_version(controller, &version);
+
+	if (!(flags & (CGFLAG_DELETE_EMPTY_ONLY | CGFLAG_DELETE_KILL))) {
+		/*
+		 * Open tasks file of the group to delete.
+		 */
+		ret = cg_build_migration_path(path, sizeof(path), cgroup_name,
+					      controller, flags);
+		if (ret != 0)
+			return ECGROUPSUBSYSNOTMOUNTED;
+
+		if (flags & CGFLAG_DELETE_FREEZE) {
+			ret = cg_move_procs(AT_FDCWD, path, target_tasks);
+			if (ret != 0) {
+				cgroup_warn("removing tasks from %s ", path);
+				cgroup_warn("failed: %s\n",
+					    cgroup_strerror(ret));
+			}
+		} else {
+			ret = cg_move_tasks_path(path, target_tasks);
+		}
+
+		if (ret != 0 && !(flags & CGFLAG_DELETE_IGNORE_MIGRATION))
+			return ret;
+	}
+
+	/* Killed processes take a while to leave the group */
+	if (version == CGROUP_V2 &&
+	    (flags & (CGFLAG_DELETE_KILL | CGFLAG_DELETE_FREEZE))) {
+		if (!cg_build_path(cgroup_name, path, controller))
+			return ECGROUPSUBSYSNOTMOUNTED;
+		cg_delete_wait_unpopulated(AT_FDCWD, path);
+	}
+
+	/*
+	 * Remove the group.
+	 */
+	if (!cg_build_path(cgroup_name, path, controller))
+		return ECGROUPSUBSYSNOTMOUNTED;
+
+	ret = rmdir(path);
+	if (ret == 0 || errno == ENOENT)
+		return 0;
+
+	if ((flags & CGFLAG_DELETE_EMPTY_ONLY) && (errno == EBUSY))
+		return ECGNONEMPTY;
+
+	cgroup_warn("cannot remove directory %s: %s\n", path, strerror(errno));
+	last_errno = errno;
+	return ECGOTHER;
+}
+
+/* At most this many threads remove a subtree, including the calling one */
+#define CG_RMTREE_MAX_WORKERS	16
+
+/* A thread is started for every this many groups to remove */
+#define CG_RMTREE_GROUPS_PER_WORKER	64
+
+/* A group of the subtree being removed */
+struct cg_rmtree_node {
+	char *path;		/* relative to the root of the subtree */
+	int parent;		/* -1 for the children of the root */
+	int pending;		/* children not removed yet */
+	int failed;		/* a child could not be removed */
+};
+
+struct cg_rmtree {
+	const char *controller;
+	FILE *target_tasks;
+	int flags;
+	int dirfd;		/* the root of the subtree */
+	enum cg_version_t version;
+
+	struct cg_rmtree_node *nodes;
+	int count;
+	int max;
+
+	/* Protects everything below and the pending and failed of nodes */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int *ready;		/* nodes whose children are all removed */
+	int ready_count;
+	int remaining;		/* nodes not processed yet */
+
+	/* The first error, reported once for all the workers */
+	int failures;
+	int first_error;
+	int first_errno;
+	const char *first_path;
+};
+
+static int cg_rmtree_add(struct cg_rmtree *tree, int parent,
+			 const char *name)
+{
+	struct cg_rmtree_node *nodes, *node;
+	const char *prefix = "";
+	int len;
+
+	if (tree->count == tree->max) {
+		tree->max = tree->max ? tree->max * 2 : 64;
+		nodes = realloc(tree->nodes, tree->max * sizeof(*nodes));
+		if (!nodes)
+			return -1;
+		tree->nodes = nodes;
+	}
+
+	if (parent >= 0)
+		prefix = tree->nodes[parent].path;
+
+	node = &tree->nodes[tree->count];
+	len = asprintf(&node->path, "%s%s%s", prefix, *prefix ? "/" : "",
+		       name);
+	if (len < 0)
+		return -1;
+
+	node->parent = parent;
+	node->pending = 0;
+	node->failed = 0;
+	if (parent >= 0)
+		tree->nodes[parent].pending++;
+	tree->count++;
+
+	return 0;
+}
+
+/*
+ * List the children of one group of the subtree, or of its root when
+ * parent is -1.
+ */
+static int cg_rmtree_scan_dir(struct cg_rmtree *tree, int parent)
+{
+	struct dirent *ent;
+	struct stat st;
+	int fd, ret = 0;
+	DIR *dir;
+
+	if (parent < 0)
+		fd = dup(tree->dirfd);
+	else
+		fd = openat(tree->dirfd, tree->nodes[parent].path,
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return -1;
+	}
+
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		if (ent->d_type == DT_UNKNOWN) {
+			if (fstatat(dirfd(dir), ent->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) < 0 ||
+			    !S_ISDIR(st.st_mode))
+				continue;
+		} else if (ent->d_type != DT_DIR) {
+			continue;
+		}
+
+		ret = cg_rmtree_add(tree, parent, ent->d_name);
+		if (ret)
+			break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/*
+ * List all groups of the subtree, parents before their children.
+ */
+static int cg_rmtree_scan(struct cg_rmtree *tree)
+{
+	int i;
+
+	if (cg_rmtree_scan_dir(tree, -1))
+		return -1;
+
+	/* The nodes added meanwhile are scanned too */
+	for (i = 0; i < tree->count; i++)
+		if (cg_rmtree_scan_dir(tree, i))
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Find the file the processes of one group are moved through, relative to
+ * the root of the subtree.  The paths are not built with cg_build_path(),
+ * which depends on the namespaces of the calling thread.
+ *	@return 0 on success, >0 on error
+ */
+static int cg_rmtree_migration_path(struct cg_rmtree *tree,
+				    struct cg_rmtree_node *node,
+				    char *path, size_t path_sz)
+{
+	const char *file = "cgroup.procs";
+	char type[LL_MAX];
+	ssize_t n;
+	int fd, len;
+
+	if (tree->version == CGROUP_V1) {
+		if (!(tree->flags & CGFLAG_DELETE_FREEZE))
+			file = "tasks";
+	} else {
+		/* Threaded groups only list threads, see cgroup_get_cg_type */
+		len = snprintf(path, path_sz, "%s/cgroup.type", node->path);
+		if (len < 0 || (size_t)len >= path_sz)
+			return ECGOTHER;
+
+		fd = openat(tree->dirfd, path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			n = read(fd, type, sizeof(type) - 1);
+			close(fd);
+			if (n > 0 && !strncmp(type, "threaded", 8))
+				file = "cgroup.threads";
+		}
+	}
+
+	len = snprintf(path, path_sz, "%s/%s", node->path, file);
+	if (len < 0 || (size_t)len >= path_sz)
+		return ECGOTHER;
+
+	return 0;
+}
+
+/*
+ * Move the processes of one group out of it and remove it.
+ *	@return 0 on success, >0 on error
+ */
+static int cg_rmtree_remove(struct cg_rmtree *tree,
+			    struct cg_rmtree_node *node)
+{
+	char path[FILENAME_MAX];
+	int flags = tree->flags;
+	int ret;
+
+	/*
+	 * The workers share the target file, the stdio stream must not be
+	 * used.  cg_move_procs() writes each id with its own write().
+	 */
+	if (!(flags & CGFLAG_DELETE_KILL)) {
+		ret = cg_rmtree_migration_path(tree, node, path, sizeof(path));
+		if (ret)
+			return ret;
+
+		ret = cg_move_procs(tree->dirfd, path, tree->target_tasks);
+		if (ret && !(flags & CGFLAG_DELETE_IGNORE_MIGRATION))
+			return ret;
+	}
+
+	if ((flags & (CGFLAG_DELETE_KILL | CGFLAG_DELETE_FREEZE)) &&
+	    tree->version == CGROUP_V2)
+		cg_delete_wait_unpopulated(tree->dirfd, node->path);
+
+	if (unlinkat(tree->dirfd, node->path, AT_REMOVEDIR) == 0 ||
+	    errno == ENOENT)
+		return 0;
+
+	last_errno = errno;
+	return ECGOTHER;
+}
+
+static void *cg_rmtree_worker(void *arg)
+{
+	struct cg_rmtree *tree = arg;
+	struct cg_rmtree_node *node;
+	int ret, idx, parent;
+
+	pthread_mutex_lock(&tree->lock);
+	for (;;) {
+		while (!tree->ready_count && tree->remaining)
+			pthread_cond_wait(&tree->cond, &tree->lock);
+		if (!tree->remaining)
+			break;
+
+		idx = tree->ready[--tree->ready_count];
+		node = &tree->nodes[idx];
+
+		/* A group with a child left cannot be removed */
+		ret = ECGNONEMPTY;
+		if (!node->failed) {
+			pthread_mutex_unlock(&tree->lock);
+			ret = cg_rmtree_remove(tree, node);
+			pthread_mutex_lock(&tree->lock);
+
+			if (ret) {
+				if (!tree->failures++) {
+					tree->first_error = ret;
+					tree->first_errno = last_errno;
+					tree->first_path = node->path;
+				}
+			}
+		}
+
+		parent = node->parent;
+		if (parent >= 0) {
+			tree->nodes[parent].failed |= !!ret;
+			if (--tree->nodes[parent].pending == 0)
+				tree->ready[tree->ready_count++] = parent;
+		}
+
+		if (--tree->remaining == 0 || tree->ready_count)
+			pthread_cond_broadcast(&tree->cond);
+	}
+	pthread_mutex_unlock(&tree->lock);
+
+	return NULL;
+}
+
+static int cg_rmtree_workers(int count)
+{
+	long cpus;
+	int workers;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = cpus > CG_RMTREE_MAX_WORKERS ? CG_RMTREE_MAX_WORKERS :
+		  cpus < 1 ? 1 : (int)cpus;
+
+	if (workers > count / CG_RMTREE_GROUPS_PER_WORKER)
+		workers = count / CG_RMTREE_GROUPS_PER_WORKER;
+
+	return workers < 1 ? 1 : workers;
+}
+
+/**
+ * Remove all subgroups of one control group, bottom-up.  A group is removed
+ * as soon as all its children are, so independent subtrees are removed
+ * concurrently by a pool of threads.  The groups are removed with
+ * unlinkat() relative to the directory of the root group.
+ *
+ * @param cgroup_name The root group, which is not removed.
+ * @param controller The controller, where to delete.
+ * @param target_tasks Opened file, where all tasks should be moved.
+ * @param flags Combination of CGFLAG_DELETE_* flags.
+ * @return 0 on success, >0 on error.
+ */
+static int cg_delete_subgroups(char *cgroup_name, char *controller,
+			       FILE *target_tasks, int flags)
+{
+	pthread_t threads[CG_RMTREE_MAX_WORKERS - 1];
+	char path[FILENAME_MAX];
+	struct cg_rmtree tree;
+	int workers, started;
+	int i, ret = 0;
+
+	if (!cg_build_path(cgroup_name, path, controller))
+		return ECGROUPSUBSYSNOTMOUNTED;
+
+	memset(&tree, 0, sizeof(tree));
+	tree.controller = controller;
+	tree.target_tasks = target_tasks;
+	tree.flags = flags;
+
+	ret = cgroup_get_controller_version(controller, &tree.version);
+	if (ret)
+		return ret;
+
+	tree.dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (tree.dirfd < 0) {
+		/* The group has been already removed */
+		if (errno == ENOENT)
+			return 0;
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	if (cg_rmtree_scan(&tree))
+		goto err;
+
+	if (!tree.count)
+		goto out;
+
+	tree.ready = malloc(tree.count * sizeof(*tree.ready));
+	if (!tree.ready)
+		goto err;
 
-	if (!(flags & CGFLAG_DELETE_EMPTY_ONLY)) {
-		/*
-		 * Open tasks file of the group to delete.
-		 */
-		ret = cgroup_build_tasks_procs_path(path, sizeof(path),
-						    cgroup_name, controller);
-		if (ret != 0)
-			return ECGROUPSUBSYSNOTMOUNTED;
+	for (i = 0; i < tree.count; i++)
+		if (!tree.nodes[i].pending)
+			tree.ready[tree.ready_count++] = i;
+	tree.remaining = tree.count;
 
-		delete_tasks = fopen(path, "re");
-		if (delete_tasks) {
-			ret = cg_move_task_files(delete_tasks, target_tasks);
-			if (ret != 0) {
-				cgroup_warn("removing tasks from %s ");
-				cgroup_warn("failed: %s\n", path,
-					    cgroup_strerror(ret));
-			}
-			fclose(delete_tasks);
-		} else {
-			/*
-			 * Can't open the tasks file. If the file does not
-			 * exist, ignore it - the group has been already
-			 * removed.
-			 */
-			if (errno != ENOENT) {
-				cgroup_err("cannot open %s: %s\n", path,
-					   strerror(errno));
-				last_errno = errno;
-				ret = ECGOTHER;
-			}
-		}
+	pthread_mutex_init(&tree.lock, NULL);
+	pthread_cond_init(&tree.cond, NULL);
 
-		if (ret != 0 && !(flags & CGFLAG_DELETE_IGNORE_MIGRATION))
-			return ret;
+	/* The calling thread is one of the workers */
+	workers = cg_rmtree_workers(tree.count);
+	for (started = 0; started < workers - 1; started++) {
+		ret = pthread_create(&threads[started], NULL, cg_rmtree_worker,
+				     &tree);
+		if (ret) {
+			cgroup_warn("failed to start delete worker: %s\n",
+				    strerror(ret));
+			break;
+		}
 	}
 
-	/*
-	 * Remove the group.
-	 */
-	if (!cg_build_path(cgroup_name, path, controller))
-		return ECGROUPSUBSYSNOTMOUNTED;
+	cg_rmtree_worker(&tree);
 
-	ret = rmdir(path);
-	if (ret == 0 || errno == ENOENT)
-		return 0;
+	while (started > 0)
+		pthread_join(threads[--started], NULL);
+	pthread_cond_destroy(&tree.cond);
+	pthread_mutex_destroy(&tree.lock);
 
-	if ((flags & CGFLAG_DELETE_EMPTY_ONLY) && (errno == EBUSY))
-		return ECGNONEMPTY;
+	ret = 0;
+	if (tree.failures) {
+		last_errno = tree.first_errno;
+		ret = tree.first_error;
+		cgroup_warn("cannot remove %d groups of %s, e.g. %s: %s\n",
+			    tree.failures, path, tree.first_path,
+			    cgroup_strerror(ret));
+	}
+	goto out;
 
-	cgroup_warn("cannot remove directory %s: %s\n", path, strerror(errno));
+err:
 	last_errno = errno;
-	return ECGOTHER;
+	ret = ECGOTHER;
+out:
+	for (i = 0; i < tree.count; i++)
+		free(tree.nodes[i].path);
+	free(tree.nodes);
+	free(tree.ready);
+	close(tree.dirfd);
+
+	return ret;
 }
 
 /**
@@ -3111,59 +4618,16 @@ static int cg_delete_cgroup_controller_recursive(char *cgroup_name,
 		char *controller, FILE *target_tasks, int flags,
 		int delete_root)
 {
-	char child_name[FILENAME_MAX + 1];
-	struct cgroup_file_info info;
-	int level, group_len;
-	void *handle;
 	int ret;
 
 	cgroup_dbg("Recursively removing %s:%s\n", controller, cgroup_name);
 
-	ret = cgroup_walk_tree_begin(controller, cgroup_name, 0, &handle,
-				     &info, &level);
-
-	if (ret == 0)
-		ret = cgroup_walk_tree_set_flags(&handle,
-						 CGROUP_WALK_TYPE_POST_DIR);
-
-	if (ret != 0) {
-		cgroup_walk_tree_end(&handle);
-		return ret;
-	}
-
-	group_len = strlen(info.full_path);
-
-	/*
-	 * Skip the root group, it will be handled explicitly at the end.
-	 */
-	ret = cgroup_walk_tree_next(0, &handle, &info, level);
-
-	while (ret == 0) {
-		if (info.type == CGROUP_FILE_TYPE_DIR && info.depth > 0) {
-			snprintf(child_name, sizeof(child_name), "%s/%s",
-				 cgroup_name, info.full_path + group_len);
-
-			ret = cg_delete_cgroup_controller(child_name,
-					controller, target_tasks,
-					flags);
-			if (ret != 0)
-				break;
-		}
-
-		ret = cgroup_walk_tree_next(0, &handle, &info, level);
-	}
-	if (ret == ECGEOF) {
-		/*
-		 * Iteration finished successfully, remove the root group.
-		 */
-		ret = 0;
-		if (delete_root)
-			ret = cg_delete_cgroup_controller(cgroup_name,
-					controller, target_tasks,
-					flags);
-	}
+	ret = cg_delete_subgroups(cgroup_name, controller, target_tasks,
+				  flags);
+	if (ret == 0 && delete_root)
+		ret = cg_delete_cgroup_controller(cgroup_name, controller,
+						  target_tasks, flags);
 
-	cgroup_walk_tree_end(&handle);
 	return ret;
 }
 
@@ -3189,7 +4653,7 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 	char *parent_name = NULL;
 	int delete_group = 1;
 	int empty_cgroup = 0;
-	int i, ret;
+	int i, ret, stopped;
 
 	if (!cgroup_initialized)
 		return ECGROUPNOTINITIALIZED;
@@ -3201,6 +4665,13 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 	    && (flags & CGFLAG_DELETE_EMPTY_ONLY))
 		return ECGINVAL;
 
+	if ((flags & CGFLAG_DELETE_KILL) && (flags & CGFLAG_DELETE_FREEZE))
+		return ECGINVAL;
+
+	if ((flags & (CGFLAG_DELETE_KILL | CGFLAG_DELETE_FREEZE))
+	    && (flags & CGFLAG_DELETE_EMPTY_ONLY))
+		return ECGINVAL;
+
 	if (cgroup->index == 0)
 		/* Valid empty cgroup v2 with not controllers added. */
 		empty_cgroup = 1;
@@ -3220,7 +4691,7 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 		ret = 0;
 		controller_name = NULL;
 
-		if (cgroup->controller[i])
+		if (i < cgroup->index)
 			controller_name = cgroup->controller[i]->name;
 
 		/* Find parent, it can be different for each controller */
@@ -3242,6 +4713,12 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 					 * recursive mode
 					 */
 					continue;
+				/* The root group has no cgroup.kill */
+				if (flags & CGFLAG_DELETE_KILL) {
+					if (first_error == 0)
+						first_error = ECGINVAL;
+					continue;
+				}
 				/*
 				 * Move all tasks to the root group and
 				 * do not delete it afterwards.
@@ -3258,11 +4735,11 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 			}
 		}
 
-		if (parent_name) {
+		if (parent_name && !(flags & CGFLAG_DELETE_KILL)) {
 			/* Tasks need to be moved, pre-open target tasks file */
-			ret = cgroup_build_tasks_procs_path(parent_path,
+			ret = cg_build_migration_path(parent_path,
 					sizeof(parent_path), parent_name,
-					controller_name);
+					controller_name, flags);
 			if (ret != 0) {
 				if (first_error == 0)
 					first_error = ECGFAIL;
@@ -3283,7 +4760,16 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 				continue;
 			}
 		}
-		if (flags & CGFLAG_DELETE_RECURSIVE) {
+		/* Kill or freeze the whole subtree at once */
+		stopped = delete_group &&
+			  (flags & (CGFLAG_DELETE_KILL | CGFLAG_DELETE_FREEZE));
+		if (stopped)
+			ret = cg_delete_stop_group(cgroup->name,
+						   controller_name, flags, "1");
+
+		if (ret) {
+			stopped = 0;
+		} else if (flags & CGFLAG_DELETE_RECURSIVE) {
 			ret = cg_delete_cgroup_controller_recursive(
 					cgroup->name,
 					controller_name,
@@ -3295,6 +4781,11 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgroup, int flags)
 					parent_tasks, flags);
 		}
 
+		/* Do not leave the processes of a group still there frozen */
+		if (ret && stopped && (flags & CGFLAG_DELETE_FREEZE))
+			cg_delete_stop_group(cgroup->name, controller_name,
+					     flags, "0");
+
 		if (parent_tasks) {
 			fclose(parent_tasks);
 			parent_tasks = NULL;
@@ -3406,7 +4897,7 @@ int cgroup_fill_cgc(struct dirent *ctrl_dir, struct cgroup *cgroup,
 	 * some sort of a flag, but this is fine for now.
 	 */
 
-	cg_build_path_locked(cgroup->name, path, cg_mount_table[cg_index].name);
+	cg_build_path_locked(cgroup->name, path, cg_mounts[cg_index].name);
 	strncat(path, d_name, sizeof(path) - strlen(path));
 
 	error = stat(path, &stat_buffer);
@@ -3456,8 +4947,8 @@ int cgroup_fill_cgc(struct dirent *ctrl_dir, struct cgroup *cgroup,
 		goto fill_error;
 	}
 
-	if (strcmp(ctrl_name, cg_mount_table[cg_index].name) == 0) {
-		error = cg_rd_ctrl_file(cg_mount_table[cg_index].name,
+	if (strcmp(ctrl_name, cg_mounts[cg_index].name) == 0) {
+		error = cg_rd_ctrl_file(cg_mounts[cg_index].name,
 					cgroup->name, ctrl_dir->d_name,
 					&ctrl_value);
 		if (error || !ctrl_value)
@@ -3503,14 +4994,13 @@ int cgroup_get_cgroup(struct cgroup *cgroup)
 	}
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
-	for (i = 0; i < CG_CONTROLLER_MAX &&
-			cg_mount_table[i].name[0] != '\0'; i++) {
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
 		struct cgroup_controller *cgc;
 		struct stat stat_buffer;
 		int path_len;
 
 		if (!cg_build_path_locked(NULL, path,
-					cg_mount_table[i].name))
+					cg_mounts[i].name))
 			continue;
 
 		path_len = strlen(path);
@@ -3521,7 +5011,7 @@ int cgroup_get_cgroup(struct cgroup *cgroup)
 			continue;
 
 		if (!cg_build_path_locked(cgroup->name, path,
-					  cg_mount_table[i].name)) {
+					  cg_mounts[i].name)) {
 			/*
 			 * This fails when the cgroup does not exist
 			 * for that controller.
@@ -3531,7 +5021,7 @@ int cgroup_get_cgroup(struct cgroup *cgroup)
 
 		/* Get the uid and gid information. */
 
-		if (cg_mount_table[i].version == CGROUP_V1) {
+		if (cg_mounts[i].version == CGROUP_V1) {
 			ret = asprintf(&control_path, "%s/tasks", path);
 
 			if (ret < 0) {
@@ -3554,7 +5044,7 @@ int cgroup_get_cgroup(struct cgroup *cgroup)
 		}
 
 		cgc = cgroup_add_controller(cgroup,
-				cg_mount_table[i].name);
+				cg_mounts[i].name);
 		if (!cgc) {
 			error = ECGINVAL;
 			goto unlock_error;
@@ -3590,17 +5080,12 @@ int cgroup_get_cgroup(struct cgroup *cgroup)
 			 * Make sure that memory.limit_in_bytes is placed before
 			 * memory.memsw.limit_in_bytes in the list of values
 			 */
-			int memsw_limit = -1;
-			int mem_limit = -1;
-
-			for (j = 0; j < cgc->index; j++) {
-				if (!strcmp(cgc->values[j]->name,
-					    "memory.memsw.limit_in_bytes"))
-					memsw_limit = j;
-				else if (!strcmp(cgc->values[j]->name,
-						 "memory.limit_in_bytes"))
-					mem_limit = j;
-			}
+			int memsw_limit;
+			int mem_limit;
+
+			memsw_limit = cg_value_find(cgc,
+					"memory.memsw.limit_in_bytes");
+			mem_limit = cg_value_find(cgc, "memory.limit_in_bytes");
 
 			if (memsw_limit >= 0 && memsw_limit < mem_limit) {
 				struct control_value *val =
@@ -3608,6 +5093,7 @@ int cgroup_get_cgroup(struct cgroup *cgroup)
 
 				cgc->values[memsw_limit] = cgc->values[mem_limit];
 				cgc->values[mem_limit] = val;
+				cg_value_index_reset(cgc);
 			}
 		}
 	}
@@ -3669,16 +5155,15 @@ static int cg_prepare_cgroup(struct cgroup *cgroup, pid_t pid,
 		if (strcmp(controller, "*") == 0) {
 			pthread_rwlock_rdlock(&cg_mount_table_lock);
 
-			for (j = 0; j < CG_CONTROLLER_MAX &&
-				cg_mount_table[j].name[0] != '\0'; j++) {
+			for (j = 0; cg_mounts[j].name[0] != '\0'; j++) {
 				cgroup_dbg("Adding controller %s\n",
-					   cg_mount_table[j].name);
+					   cg_mounts[j].name);
 				cptr = cgroup_add_controller(cgroup,
-						cg_mount_table[j].name);
+						cg_mounts[j].name);
 				if (!cptr) {
 					cgroup_warn("adding controller '%s' ");
 					cgroup_warn("failed\n",
-						    cg_mount_table[j].name);
+						    cg_mounts[j].name);
 					pthread_rwlock_unlock(&cg_mount_table_lock);
 					cgroup_free_controllers(cgroup);
 					return ECGROUPNOTALLOWED;
@@ -4397,102 +5882,412 @@ int cgroup_change_cgroup_flags(uid_t uid, gid_t gid,
 		}
 		cgroup_dbg("OK!\n");
 
-		/*
-		 * Now, check for multi-line rules.  As long as the "next"
-		 * rule starts with '%', it's actually part of the rule that
-		 * we just executed.
-		 */
-		tmp = tmp->next;
-	} while (tmp && (tmp->username[0] == '%'));
+		/*
+		 * Now, check for multi-line rules.  As long as the "next"
+		 * rule starts with '%', it's actually part of the rule that
+		 * we just executed.
+		 */
+		tmp = tmp->next;
+	} while (tmp && (tmp->username[0] == '%'));
+
+finished:
+	return ret;
+}
+
+int cgroup_change_cgroup_uid_gid_flags(uid_t uid, gid_t gid,
+				       pid_t pid, int flags)
+{
+	return cgroup_change_cgroup_flags(uid, gid, NULL, pid, flags);
+}
+
+/**
+ * Provides backwards-compatibility with older versions of the API.  This
+ * function is deprecated, and cgroup_change_cgroup_uid_gid_flags() should be
+ * used instead.  In fact, this function simply calls the newer one with flags
+ * set to 0 (none).
+ *	@param uid The UID to match
+ *	@param gid The GID to match
+ *	@param pid The PID of the process to move
+ *	@return 0 on success, > 0 on error
+ *
+ */
+int cgroup_change_cgroup_uid_gid(uid_t uid, gid_t gid, pid_t pid)
+{
+	return cgroup_change_cgroup_uid_gid_flags(uid, gid, pid, 0);
+}
+
+/**
+ * Changes the cgroup of a program based on the path provided.  In this case,
+ * the user must already know into which cgroup the task should be placed and
+ * no rules will be parsed.
+ *
+ *  returns 0 on success.
+ */
+int cgroup_change_cgroup_path(const char *dest, pid_t pid,
+			      const char *const controllers[])
+{
+	struct dirent *task_dir = NULL;
+	char path[FILENAME_MAX];
+	struct cgroup cgroup;
+	int nr, ret;
+	pid_t tid;
+	DIR *dir;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+	memset(&cgroup, 0, sizeof(struct cgroup));
+
+	ret = cg_prepare_cgroup(&cgroup, pid, dest, controllers);
+	if (ret)
+		return ret;
+	/* Add process to cgroup */
+	ret = cgroup_attach_task_pid(&cgroup, pid);
+	if (ret) {
+		cgroup_warn("cgroup_attach_task_pid failed: %d\n", ret);
+		goto finished;
+	}
+
+	/* Add all threads to cgroup */
+	snprintf(path, FILENAME_MAX, "%s/%d/task/", cg_procfs_path, pid);
+	dir = opendir(path);
+	if (!dir) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto finished;
+	}
+
+	while ((task_dir = readdir(dir)) != NULL) {
+		nr = sscanf(task_dir->d_name, "%i", &tid);
+		if (nr < 1)
+			continue;
+
+		if (tid == pid)
+			continue;
+
+		ret = cgroup_attach_task_pid(&cgroup, tid);
+		if (ret) {
+			cgroup_warn("cgroup_attach_task_pid failed: %d\n", ret);
+			break;
+		}
+	}
+
+	closedir(dir);
+
+finished:
+	cgroup_free_controllers(&cgroup);
+	return ret;
+}
+
+/* Per-process result of the /proc reads done by the scan workers */
+struct cg_change_all_slot {
+	pid_t pid;
+	uid_t euid;
+	gid_t egid;
+	char *procname;
+	int ret;
+	int skip;	/* see cgroup_change_all_cgroups_skip() */
+};
+
+struct cg_change_all_handle {
+	struct cg_change_all_slot *slots;
+	int total;
+	int pos;
+
+	pthread_t *workers;
+	int nr_workers;
+
+	/* Protects the chunk state below */
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int chunk_next;
+	int chunk_end;
+	int pending;
+	int stop;
+
+	struct timespec start;
+	int failed;
+};
+
+static void cg_change_all_read_slot(struct cg_change_all_slot *slot)
+{
+	int procfd;
+
+	if (slot->skip)
+		return;
+
+	procfd = cg_open_procfd(slot->pid);
+	if (procfd < 0) {
+		slot->ret = ECGROUPNOTEXIST;
+		return;
+	}
+
+	slot->ret = cg_get_uid_gid_from_procfd(procfd, &slot->euid,
+					       &slot->egid);
+	if (!slot->ret)
+		slot->ret = cg_get_procname_from_procfd(procfd,
+							&slot->procname);
+	close(procfd);
+}
+
+static void *cg_change_all_worker(void *arg)
+{
+	struct cg_change_all_handle *h = arg;
+	int idx;
+
+	pthread_mutex_lock(&h->lock);
+	while (!h->stop) {
+		if (h->chunk_next >= h->chunk_end) {
+			pthread_cond_wait(&h->work_cond, &h->lock);
+			continue;
+		}
+
+		idx = h->chunk_next++;
+		pthread_mutex_unlock(&h->lock);
+
+		cg_change_all_read_slot(&h->slots[idx]);
+
+		pthread_mutex_lock(&h->lock);
+		if (--h->pending == 0)
+			pthread_cond_signal(&h->done_cond);
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	return NULL;
+}
+
+static int cg_change_all_default_workers(void)
+{
+	long cpus;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		return 1;
+
+	return cpus > CG_CHANGE_ALL_MAX_WORKERS ? CG_CHANGE_ALL_MAX_WORKERS :
+						  (int)cpus;
+}
+
+static void cg_change_all_stop_workers(struct cg_change_all_handle *h)
+{
+	int i;
+
+	pthread_mutex_lock(&h->lock);
+	h->stop = 1;
+	pthread_cond_broadcast(&h->work_cond);
+	pthread_mutex_unlock(&h->lock);
+
+	for (i = 0; i < h->nr_workers; i++)
+		pthread_join(h->workers[i], NULL);
+	h->nr_workers = 0;
+}
+
+int cgroup_change_all_cgroups_begin(int workers, void **handle)
+{
+	struct cg_change_all_handle *h;
+	struct cg_change_all_slot *tmp;
+	struct dirent *pid_dir = NULL;
+	int allocated = 0;
+	int ret = 0;
+	DIR *dir;
+	int pid;
+
+	if (!handle || workers < 0)
+		return ECGINVAL;
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &h->start);
+
+	dir = opendir(cg_procfs_path);
+	if (!dir) {
+		last_errno = errno;
+		free(h);
+		return ECGOTHER;
+	}
+
+	while ((pid_dir = readdir(dir)) != NULL) {
+		if (sscanf(pid_dir->d_name, "%i", &pid) < 1)
+			continue;
+
+		if (h->total == allocated) {
+			allocated = allocated ? allocated * 2 : 1024;
+			tmp = realloc(h->slots, allocated * sizeof(*tmp));
+			if (!tmp) {
+				last_errno = errno;
+				ret = ECGOTHER;
+				break;
+			}
+			h->slots = tmp;
+		}
+
+		memset(&h->slots[h->total], 0, sizeof(*h->slots));
+		h->slots[h->total++].pid = pid;
+	}
+	closedir(dir);
+
+	if (ret) {
+		free(h->slots);
+		free(h);
+		return ret;
+	}
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->work_cond, NULL);
+	pthread_cond_init(&h->done_cond, NULL);
+
+	if (!workers)
+		workers = cg_change_all_default_workers();
+	if (workers > h->total)
+		workers = h->total;
+
+	/*
+	 * Without worker threads, cgroup_change_all_cgroups_next() reads the
+	 * processes by itself.
+	 */
+	if (workers > 1) {
+		h->workers = calloc(workers, sizeof(*h->workers));
+		if (!h->workers)
+			workers = 0;
+	}
+
+	for (; h->nr_workers < workers && h->workers; h->nr_workers++) {
+		ret = pthread_create(&h->workers[h->nr_workers], NULL,
+				     cg_change_all_worker, h);
+		if (ret) {
+			cgroup_warn("failed to start scan worker: %s\n",
+				    strerror(ret));
+			ret = 0;
+			break;
+		}
+	}
+
+	cgroup_dbg("scanning %d processes with %d workers\n", h->total,
+		   h->nr_workers);
 
-finished:
-	return ret;
-}
+	*handle = h;
 
-int cgroup_change_cgroup_uid_gid_flags(uid_t uid, gid_t gid,
-				       pid_t pid, int flags)
-{
-	return cgroup_change_cgroup_flags(uid, gid, NULL, pid, flags);
+	return 0;
 }
 
-/**
- * Provides backwards-compatibility with older versions of the API.  This
- * function is deprecated, and cgroup_change_cgroup_uid_gid_flags() should be
- * used instead.  In fact, this function simply calls the newer one with flags
- * set to 0 (none).
- *	@param uid The UID to match
- *	@param gid The GID to match
- *	@param pid The PID of the process to move
- *	@return 0 on success, > 0 on error
- *
- */
-int cgroup_change_cgroup_uid_gid(uid_t uid, gid_t gid, pid_t pid)
+int cgroup_change_all_cgroups_next(void **handle, int count,
+				   struct cgroup_change_all_stats *stats)
 {
-	return cgroup_change_cgroup_uid_gid_flags(uid, gid, pid, 0);
-}
+	struct cg_change_all_slot *slot;
+	struct cg_change_all_handle *h;
+	struct timespec now;
+	int end, i, err;
 
-/**
- * Changes the cgroup of a program based on the path provided.  In this case,
- * the user must already know into which cgroup the task should be placed and
- * no rules will be parsed.
- *
- *  returns 0 on success.
- */
-int cgroup_change_cgroup_path(const char *dest, pid_t pid,
-			      const char *const controllers[])
-{
-	struct dirent *task_dir = NULL;
-	char path[FILENAME_MAX];
-	struct cgroup cgroup;
-	int nr, ret;
-	pid_t tid;
-	DIR *dir;
+	if (!handle || !*handle || count < 1)
+		return ECGINVAL;
 
-	if (!cgroup_initialized) {
-		cgroup_warn("libcgroup is not initialized\n");
-		return ECGROUPNOTINITIALIZED;
+	h = *handle;
+
+	end = h->pos + count;
+	if (end > h->total)
+		end = h->total;
+
+	/*
+	 * Read the whole chunk before moving any of its processes.  Nothing
+	 * else runs in this thread meanwhile, so a process which changes its
+	 * credentials now is reported by netlink after it has been moved
+	 * here, and its new cgroup is not overwritten with stale data.
+	 */
+	if (h->nr_workers) {
+		pthread_mutex_lock(&h->lock);
+		h->chunk_next = h->pos;
+		h->chunk_end = end;
+		h->pending = end - h->pos;
+		pthread_cond_broadcast(&h->work_cond);
+		while (h->pending)
+			pthread_cond_wait(&h->done_cond, &h->lock);
+		pthread_mutex_unlock(&h->lock);
+	} else {
+		for (i = h->pos; i < end; i++)
+			cg_change_all_read_slot(&h->slots[i]);
 	}
-	memset(&cgroup, 0, sizeof(struct cgroup));
 
-	ret = cg_prepare_cgroup(&cgroup, pid, dest, controllers);
-	if (ret)
-		return ret;
-	/* Add process to cgroup */
-	ret = cgroup_attach_task_pid(&cgroup, pid);
-	if (ret) {
-		cgroup_warn("cgroup_attach_task_pid failed: %d\n", ret);
-		goto finished;
+	for (i = h->pos; i < end; i++) {
+		slot = &h->slots[i];
+
+		/* The process has exited meanwhile */
+		if (slot->ret || slot->skip)
+			continue;
+
+		err = cgroup_change_cgroup_flags(slot->euid, slot->egid,
+						 slot->procname, slot->pid,
+						 CGFLAG_USECACHE);
+		if (err) {
+			cgroup_dbg("cgroup change pid %i failed\n", slot->pid);
+			h->failed++;
+		}
+
+		free(slot->procname);
+		slot->procname = NULL;
 	}
+	h->pos = end;
 
-	/* Add all threads to cgroup */
-	snprintf(path, FILENAME_MAX, "/proc/%d/task/", pid);
-	dir = opendir(path);
-	if (!dir) {
-		last_errno = errno;
-		ret = ECGOTHER;
-		goto finished;
+	if (stats) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		stats->total = h->total;
+		stats->done = h->pos;
+		stats->failed = h->failed;
+		stats->elapsed_usec = (now.tv_sec - h->start.tv_sec) * 1000000;
+		stats->elapsed_usec += (now.tv_nsec - h->start.tv_nsec) / 1000;
 	}
 
-	while ((task_dir = readdir(dir)) != NULL) {
-		nr = sscanf(task_dir->d_name, "%i", &tid);
-		if (nr < 1)
-			continue;
+	return h->pos < h->total ? 0 : ECGEOF;
+}
 
-		if (tid == pid)
-			continue;
+int cgroup_change_all_cgroups_skip(void **handle, pid_t pid)
+{
+	struct cg_change_all_handle *h;
+	int i;
 
-		ret = cgroup_attach_task_pid(&cgroup, tid);
-		if (ret) {
-			cgroup_warn("cgroup_attach_task_pid failed: %d\n", ret);
+	if (!handle || !*handle)
+		return ECGINVAL;
+
+	h = *handle;
+
+	/* The chunks are read and moved within _next(), no worker runs now */
+	for (i = h->pos; i < h->total; i++) {
+		if (h->slots[i].pid == pid) {
+			h->slots[i].skip = 1;
 			break;
 		}
 	}
 
-	closedir(dir);
+	return 0;
+}
 
-finished:
-	cgroup_free_controllers(&cgroup);
-	return ret;
+int cgroup_change_all_cgroups_end(void **handle)
+{
+	struct cg_change_all_handle *h;
+	int i;
+
+	if (!handle || !*handle)
+		return ECGINVAL;
+
+	h = *handle;
+
+	cg_change_all_stop_workers(h);
+	for (i = h->pos; i < h->total; i++)
+		free(h->slots[i].procname);
+
+	pthread_cond_destroy(&h->done_cond);
+	pthread_cond_destroy(&h->work_cond);
+	pthread_mutex_destroy(&h->lock);
+	free(h->workers);
+	free(h->slots);
+	free(h);
+	*handle = NULL;
+
+	return 0;
 }
 
 /**
@@ -4506,41 +6301,19 @@ finished:
  */
 int cgroup_change_all_cgroups(void)
 {
-	struct dirent *pid_dir = NULL;
-	char *path = "/proc/";
-	DIR *dir;
+	void *handle;
+	int ret;
 
-	dir = opendir(path);
-	if (!dir)
+	if (cgroup_change_all_cgroups_begin(0, &handle))
 		return -ECGOTHER;
 
-	while ((pid_dir = readdir(dir)) != NULL) {
-		int err, pid;
-		uid_t euid;
-		gid_t egid;
-		char *procname = NULL;
-
-		err = sscanf(pid_dir->d_name, "%i", &pid);
-		if (err < 1)
-			continue;
-
-		err = cgroup_get_uid_gid_from_procfs(pid, &euid, &egid);
-		if (err)
-			continue;
-
-		err = cgroup_get_procname_from_procfs(pid, &procname);
-		if (err)
-			continue;
-
-		err = cgroup_change_cgroup_flags(euid, egid, procname, pid,
-						 CGFLAG_USECACHE);
-		if (err)
-			cgroup_dbg("cgroup change pid %i failed\n", pid);
+	do {
+		ret = cgroup_change_all_cgroups_next(&handle,
+						     CG_CHANGE_ALL_CHUNK, NULL);
+	} while (!ret);
 
-		free(procname);
-	}
+	cgroup_change_all_cgroups_end(&handle);
 
-	closedir(dir);
 	return 0;
 }
 
@@ -4673,7 +6446,7 @@ int cgroup_get_current_controller_path(pid_t pid, const char *controller,
 		return ECGROUPNOTINITIALIZED;
 	}
 
-	ret = asprintf(&path, "/proc/%d/cgroup", pid);
+	ret = asprintf(&path, "%s/%d/cgroup", cg_procfs_path, pid);
 	if (ret <= 0) {
 		cgroup_warn("cannot allocate memory (/proc/pid/cgroup) ");
 		cgroup_warn("ret %d\n", ret);
@@ -5220,15 +6993,15 @@ int cgroup_get_controller_next(void **handle, struct cgroup_mount_point *info)
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
 
-	if (cg_mount_table[*pos].name[0] == '\0') {
+	if (cg_mounts[*pos].name[0] == '\0') {
 		ret = ECGEOF;
 		goto out_unlock;
 	}
 
-	strncpy(info->name, cg_mount_table[*pos].name, FILENAME_MAX - 1);
+	strncpy(info->name, cg_mounts[*pos].name, FILENAME_MAX - 1);
 	info->name[FILENAME_MAX - 1] = '\0';
 
-	strncpy(info->path, cg_mount_table[*pos].mount.path, FILENAME_MAX - 1);
+	strncpy(info->path, cg_mounts[*pos].mount.path, FILENAME_MAX - 1);
 	info->path[FILENAME_MAX - 1] = '\0';
 
 	(*pos)++;
@@ -5263,16 +7036,63 @@ int cgroup_get_controller_begin(void **handle, struct cgroup_mount_point *info)
 	return cgroup_get_controller_next(handle, info);
 }
 
+int cg_set_procfs_path(const char *path)
+{
+	if (!path)
+		path = "/proc";
+
+	if (strlen(path) >= sizeof(cg_procfs_path))
+		return ECGINVAL;
+
+	strcpy(cg_procfs_path, path);
+
+	return 0;
+}
+
 /**
- * Get process data (euid and egid) from /proc/<pid>/status file.
+ * Open the /proc/<pid> directory of a process.
  * @param pid: The process id
- * @param euid: The uid of param pid
- * @param egid: The gid of param pid
- * @return 0 on success, > 0 on error.
+ * @return The directory file descriptor, < 0 on error.
  */
-int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid)
+int cg_open_procfd(pid_t pid)
 {
 	char path[FILENAME_MAX];
+
+	snprintf(path, sizeof(path), "%s/%d", cg_procfs_path, pid);
+
+	return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Open a file below a /proc/<pid> directory.  If the process has exited
+ * meanwhile, the open fails with ESRCH instead of reading another process
+ * which reused the pid.
+ */
+static FILE *cg_fopen_procfd(int procfd, const char *name)
+{
+	FILE *f;
+	int fd;
+
+	fd = openat(procfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	f = fdopen(fd, "re");
+	if (!f)
+		close(fd);
+
+	return f;
+}
+
+/**
+ * Get process data (euid and egid) from /proc/<pid>/status file.
+ * @param procfd: The /proc/<pid> directory of the process
+ * @param euid: The uid of the process
+ * @param egid: The gid of the process
+ * @return 0 on success, > 0 on error.
+ */
+int cg_get_uid_gid_from_procfd(int procfd, uid_t *euid, gid_t *egid)
+{
 	uid_t ruid, suid, fsuid;
 	gid_t rgid, sgid, fsgid;
 	bool found_euid = false;
@@ -5280,8 +7100,7 @@ int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid)
 	char buf[4092];
 	FILE *f;
 
-	sprintf(path, "/proc/%d/status", pid);
-	f = fopen(path, "re");
+	f = cg_fopen_procfd(procfd, "status");
 	if (!f)
 		return ECGROUPNOTEXIST;
 
@@ -5311,12 +7130,26 @@ int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid)
 		 * /proc/<pid>/status. The format has been changed
 		 * and we should catch up the change.
 		 */
-		cgroup_warn("invalid file format of /proc/%d/status\n", pid);
+		cgroup_warn("invalid file format of /proc/<pid>/status\n");
 		return ECGFAIL;
 	}
 	return 0;
 }
 
+int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid)
+{
+	int procfd, ret;
+
+	procfd = cg_open_procfd(pid);
+	if (procfd < 0)
+		return ECGROUPNOTEXIST;
+
+	ret = cg_get_uid_gid_from_procfd(procfd, euid, egid);
+	close(procfd);
+
+	return ret;
+}
+
 /**
  * Given a pid, this function will return the controllers and cgroups that
  * the pid is a member of.  The caller is expected to allocate the
@@ -5345,7 +7178,7 @@ STATIC int cg_get_cgroups_from_proc_cgroups(pid_t pid, char *cgroup_list[],
 #ifdef UNIT_TEST
 	sprintf(path, "%s", TEST_PROC_PID_CGROUP_FILE);
 #else
-	sprintf(path, "/proc/%d/cgroup", pid);
+	snprintf(path, sizeof(path), "%s/%d/cgroup", cg_procfs_path, pid);
 #endif
 	f = fopen(path, "re");
 	if (!f)
@@ -5430,16 +7263,15 @@ STATIC int cg_get_cgroups_from_proc_cgroups(pid_t pid, char *cgroup_list[],
  * @param pname_status : The process name
  * @return 0 on success, > 0 on error.
  */
-static int cg_get_procname_from_proc_status(pid_t pid, char **procname_status)
+static int cg_get_procname_from_proc_status(int procfd,
+					    char **procname_status)
 {
-	char path[FILENAME_MAX];
 	int ret = ECGFAIL;
 	char buf[4092];
 	FILE *f;
 	int len;
 
-	sprintf(path, "/proc/%d/status", pid);
-	f = fopen(path, "re");
+	f = cg_fopen_procfd(procfd, "status");
 	if (!f)
 		return ECGROUPNOTEXIST;
 
@@ -5473,7 +7305,7 @@ static int cg_get_procname_from_proc_status(pid_t pid, char **procname_status)
  * @param pname_cmdline: The process name taken from /proc/<pid>/cmdline
  * @return 0 on success, > 0 on error.
  */
-static int cg_get_procname_from_proc_cmdline(pid_t pid,
+static int cg_get_procname_from_proc_cmdline(int procfd,
 			const char *pname_status, char **pname_cmdline)
 {
 	char buf_pname[FILENAME_MAX];
@@ -5485,13 +7317,11 @@ static int cg_get_procname_from_proc_cmdline(pid_t pid,
 	FILE *f;
 
 	memset(buf_cwd, '\0', sizeof(buf_cwd));
-	sprintf(path, "/proc/%d/cwd", pid);
 
-	if (readlink(path, buf_cwd, sizeof(buf_cwd)) < 0)
+	if (readlinkat(procfd, "cwd", buf_cwd, sizeof(buf_cwd)) < 0)
 		return ECGROUPNOTEXIST;
 
-	sprintf(path, "/proc/%d/cmdline", pid);
-	f = fopen(path, "re");
+	f = cg_fopen_procfd(procfd, "cmdline");
 	if (!f)
 		return ECGROUPNOTEXIST;
 
@@ -5555,19 +7385,18 @@ static int cg_get_procname_from_proc_cmdline(pid_t pid,
  * Get a process name from /proc file system.
  * This function allocates memory for a process name, writes a process
  * name onto it. So a caller should free the memory when unusing it.
- * @param pid: The process id
+ * @param procfd: The /proc/<pid> directory of the process
  * @param procname: The process name
  * @return 0 on success, > 0 on error.
  */
-int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
+int cg_get_procname_from_procfd(int procfd, char **procname)
 {
-	char path[FILENAME_MAX];
 	char buf[FILENAME_MAX];
 	char *pname_cmdline;
 	char *pname_status;
 	int ret;
 
-	ret = cg_get_procname_from_proc_status(pid, &pname_status);
+	ret = cg_get_procname_from_proc_status(procfd, &pname_status);
 	if (ret)
 		return ret;
 
@@ -5575,8 +7404,7 @@ int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
 	 * Get the full patch of process name from /proc/<pid>/exe.
 	 */
 	memset(buf, '\0', sizeof(buf));
-	sprintf(path, "/proc/%d/exe", pid);
-	if (readlink(path, buf, sizeof(buf)) < 0) {
+	if (readlinkat(procfd, "exe", buf, sizeof(buf)) < 0) {
 		/*
 		 * readlink() fails if a kernel thread, and a process
 		 * name is taken from /proc/<pid>/status.
@@ -5606,7 +7434,7 @@ int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
 	 * Then the full path of a shell script is taken from
 	 * /proc/<pid>/cmdline.
 	 */
-	ret = cg_get_procname_from_proc_cmdline(pid, pname_status,
+	ret = cg_get_procname_from_proc_cmdline(procfd, pname_status,
 						&pname_cmdline);
 	if (!ret) {
 		*procname = pname_cmdline;
@@ -5628,7 +7456,21 @@ int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
 	return 0;
 }
 
-int cgroup_register_unchanged_process(pid_t pid, int flags)
+int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
+{
+	int procfd, ret;
+
+	procfd = cg_open_procfd(pid);
+	if (procfd < 0)
+		return ECGROUPNOTEXIST;
+
+	ret = cg_get_procname_from_procfd(procfd, procname);
+	close(procfd);
+
+	return ret;
+}
+
+static int cg_register_unchanged_process_stream(pid_t pid, int flags)
 {
 	char buff[sizeof(CGRULE_SUCCESS_STORE_PID)];
 	struct sockaddr_un addr;
@@ -5670,6 +7512,138 @@ close:
 	return ret;
 }
 
+/*
+ * Send one message of the batched protocol to cgrulesengd and wait for the
+ * reply.  Returns 0 on success, 1 if the daemon failed to store some of the
+ * processes and -1 if the connection is broken.
+ */
+static int cg_register_unchanged_batch(int sk, const pid_t *pids,
+				       const int *flags, int count,
+				       uint32_t seq)
+{
+	struct cgrule_batch_reply reply;
+	struct cgrule_batch_item *item;
+	struct cgrule_batch_hdr *hdr;
+	char msg[CGRULE_BATCH_MSG_MAX];
+	ssize_t len;
+	int i;
+
+	hdr = (struct cgrule_batch_hdr *)msg;
+	item = (struct cgrule_batch_item *)(hdr + 1);
+
+	hdr->magic = CGRULE_BATCH_MAGIC;
+	hdr->version = CGRULE_BATCH_VERSION;
+	hdr->count = count;
+	hdr->seq = seq;
+	for (i = 0; i < count; i++) {
+		item[i].pid = pids[i];
+		item[i].flags = flags[i];
+	}
+
+	len = sizeof(*hdr) + count * sizeof(*item);
+	if (send(sk, msg, len, MSG_NOSIGNAL) != len)
+		return -1;
+
+	do {
+		len = recv(sk, &reply, sizeof(reply), 0);
+	} while (len < 0 && errno == EINTR);
+
+	if (len != sizeof(reply) || reply.magic != CGRULE_BATCH_MAGIC ||
+	    reply.seq != seq)
+		return -1;
+
+	if (reply.status || reply.failed)
+		return 1;
+
+	return 0;
+}
+
+static int cg_connect_unchanged_batch(void)
+{
+	struct sockaddr_un addr;
+	int sk;
+
+	sk = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sk < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, CGRULE_CGRED_BATCH_SOCKET_PATH);
+
+	if (connect(sk, (struct sockaddr *)&addr, sizeof(addr.sun_family) +
+		    strlen(CGRULE_CGRED_BATCH_SOCKET_PATH)) < 0) {
+		close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+int cgroup_register_unchanged_processes(const pid_t *pids, const int *flags,
+					int count)
+{
+	int i, n, err, retried = 0;
+	int ret = 0;
+
+	if (!pids || !flags || count < 0)
+		return ECGINVAL;
+
+	pthread_mutex_lock(&cgred_batch_lock);
+
+	/* Do not share the connection with the parent after fork() */
+	if (cgred_batch_sk >= 0 && cgred_batch_owner != getpid()) {
+		close(cgred_batch_sk);
+		cgred_batch_sk = -1;
+	}
+
+	for (i = 0; i < count; i += n) {
+		n = min(count - i, CGRULE_BATCH_MAX_ITEMS);
+
+		if (cgred_batch_sk < 0) {
+			cgred_batch_sk = cg_connect_unchanged_batch();
+			if (cgred_batch_sk < 0)
+				break;
+			cgred_batch_owner = getpid();
+		}
+
+		err = cg_register_unchanged_batch(cgred_batch_sk, pids + i,
+						  flags + i, n,
+						  ++cgred_batch_seq);
+		if (err < 0) {
+			close(cgred_batch_sk);
+			cgred_batch_sk = -1;
+
+			/* The daemon might have been restarted, reconnect */
+			if (!retried++) {
+				n = 0;
+				continue;
+			}
+			break;
+		}
+		if (err)
+			ret = 1;
+	}
+
+	pthread_mutex_unlock(&cgred_batch_lock);
+
+	/*
+	 * The daemon does not provide the batched protocol, send the rest
+	 * with one connection per process.
+	 */
+	for (; i < count; i++) {
+		if (cg_register_unchanged_process_stream(pids[i], flags[i]))
+			ret = 1;
+	}
+
+	return ret;
+}
+
+int cgroup_register_unchanged_process(pid_t pid, int flags)
+{
+	return cgroup_register_unchanged_processes(&pid, &flags, 1);
+}
+
 int cgroup_get_subsys_mount_point(const char *controller, char **mount_point)
 {
 	int ret = ECGROUPNOTEXIST;
@@ -5682,11 +7656,11 @@ int cgroup_get_subsys_mount_point(const char *controller, char **mount_point)
 		return ECGINVAL;
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
-		if (strncmp(cg_mount_table[i].name, controller, FILENAME_MAX))
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
+		if (strncmp(cg_mounts[i].name, controller, FILENAME_MAX))
 			continue;
 
-		*mount_point = strdup(cg_mount_table[i].mount.path);
+		*mount_point = strdup(cg_mounts[i].mount.path);
 
 		if (!*mount_point) {
 			last_errno = errno;
@@ -5997,11 +7971,11 @@ int cgroup_get_subsys_mount_point_begin(const char *controller, void **handle,
 		return ECGINVAL;
 
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++)
-		if (strcmp(controller, cg_mount_table[i].name) == 0)
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++)
+		if (strcmp(controller, cg_mounts[i].name) == 0)
 			break;
 
-	if (cg_mount_table[i].name[0] == '\0') {
+	if (cg_mounts[i].name[0] == '\0') {
 		/* The controller is not mounted at all */
 		*handle = NULL;
 		*path = '\0';
@@ -6012,8 +7986,8 @@ int cgroup_get_subsys_mount_point_begin(const char *controller, void **handle,
 	 * 'handle' is pointer to struct cg_mount_point, which should be
 	 * returned next.
 	 */
-	*handle = cg_mount_table[i].mount.next;
-	strcpy(path, cg_mount_table[i].mount.path);
+	*handle = cg_mounts[i].mount.next;
+	strcpy(path, cg_mounts[i].mount.path);
 	return 0;
 }
 
@@ -6065,15 +8039,16 @@ int cgroup_get_controller_version(const char * const controller,
 
 	*version = CGROUP_UNK;
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
-		if (strncmp(cg_mount_table[i].name, controller,
-			    sizeof(cg_mount_table[i].name)) == 0) {
-			*version = cg_mount_table[i].version;
-			return 0;
-		}
-	}
+	if (!controller)
+		return ECGROUPNOTEXIST;
+
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	i = cg_mount_index_find(controller);
+	if (i >= 0)
+		*version = cg_mounts[i].version;
+	pthread_rwlock_unlock(&cg_mount_table_lock);
 
-	return ECGROUPNOTEXIST;
+	return i < 0 ? ECGROUPNOTEXIST : 0;
 }
 
 static int search_and_append_mnt_path(struct cg_mount_point **mount_point,
@@ -6133,11 +8108,11 @@ int cgroup_list_mount_points(const enum cg_version_t cgrp_version,
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
-		if (cg_mount_table[i].version != cgrp_version)
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
+		if (cg_mounts[i].version != cgrp_version)
 			continue;
 
-		mount_point = &cg_mount_table[i].mount;
+		mount_point = &cg_mounts[i].mount;
 		while (mount_point) {
 			ret = search_and_append_mnt_path(&mnt_tmp,
 							 mount_point->path);
@@ -6154,7 +8129,7 @@ int cgroup_list_mount_points(const enum cg_version_t cgrp_version,
 
 	/*
 	 * Cgroup v2 can be mounted without any controller and these mount
-	 * paths are not part of the cg_mount_table.  Check and append them
+	 * paths are not part of the cg_mounts.  Check and append them
 	 * to mnt_paths.
 	 */
 	if (cgrp_version == CGROUP_V2 && cg_cgroup_v2_empty_mount_paths ) {
@@ -0,0 +1,448 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/**
+ * Bulk reads and writes of control files.
+ *
+ * The requests are shared by a few threads doing the usual open/read/close.
+ * The threads are started by the first call and wait for the next ones, they
+ * exit after being idle for CG_BULK_IDLE_SEC.  While they work for a caller
+ * they use its cgconfig namespaces to build the paths.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+#include <libcgroup-internal.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+/* The threads take this many requests at a time */
+#define CG_BULK_CHUNK		16
+
+/* At most this many threads, including the calling one */
+#define CG_BULK_MAX_WORKERS	16
+
+/* The pool threads exit after waiting this long for work */
+#define CG_BULK_IDLE_SEC	10
+
+struct cg_bulk_work {
+	struct cgroup_bulk_request *requests;
+	int count;
+	bool set;
+
+	/* Namespaces of the calling thread, see cg_bulk_adopt_namespaces() */
+	char **namespace_table;
+	int namespace_table_max;
+
+	/* Protects next */
+	pthread_mutex_t lock;
+	int next;
+};
+
+/*
+ * The threads sharing the requests with the calling thread.  One caller at
+ * a time uses them, the others process their requests alone.
+ */
+static struct {
+	/* Protects everything below */
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	int started;		/* threads running */
+	bool busy;		/* a caller owns the threads */
+
+	/* The current work, NULL once the caller finished its share */
+	struct cg_bulk_work *work;
+	unsigned long generation;	/* bumped for every work */
+	int wanted;		/* threads the work asks for */
+	int joined;		/* threads which took the work */
+	int active;		/* threads still working on it */
+} cg_bulk_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t cg_bulk_pool_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Build the path of the control file of a request.
+ *	@return 0 on success, the status of the request on error
+ */
+static int cg_bulk_path(const struct cgroup_bulk_request *req, char *path)
+{
+	size_t len, file_len;
+
+	if (!req->controller || !req->file || strchr(req->file, '/'))
+		return ECGINVAL;
+
+	if (!cg_build_path(req->path, path, req->controller))
+		return ECGROUPSUBSYSNOTMOUNTED;
+
+	len = strlen(path);
+	file_len = strlen(req->file);
+	if (len + file_len >= FILENAME_MAX)
+		return ECGINVAL;
+	memcpy(path + len, req->file, file_len + 1);
+
+	return 0;
+}
+
+static int cg_bulk_open_error(struct cgroup_bulk_request *req, int err)
+{
+	switch (err) {
+	case ENOENT:
+		return ECGROUPVALUENOTEXIST;
+	case EPERM:
+	case EACCES:
+		return ECGROUPNOTALLOWED;
+	default:
+		req->error = err;
+		return ECGOTHER;
+	}
+}
+
+/*
+ * Store the result of the read() or write() of a request.
+ *	@param res The number of bytes, or a negative errno
+ */
+static void cg_bulk_done(struct cgroup_bulk_request *req, bool set,
+			 ssize_t res)
+{
+	if (res < 0) {
+		req->error = -res;
+		req->status = ECGOTHER;
+		return;
+	}
+
+	if (set) {
+		/* The kernel took only a part of the value */
+		if ((size_t)res < strlen(req->value)) {
+			req->error = EIO;
+			req->status = ECGOTHER;
+		}
+		return;
+	}
+
+	if (res > 0 && req->value[res - 1] == '\n')
+		res--;
+	req->value[res] = '\0';
+}
+
+/*
+ * Check a request before opening its file.
+ *	@return true if the file has to be opened
+ */
+static bool cg_bulk_prepare(struct cgroup_bulk_request *req, bool set,
+			    char *path)
+{
+	req->error = 0;
+	req->status = 0;
+
+	if (!req->value || (!set && !req->size))
+		req->status = ECGINVAL;
+	else
+		req->status = cg_bulk_path(req, path);
+
+	return !req->status;
+}
+
+static void cg_bulk_one(struct cgroup_bulk_request *req, bool set)
+{
+	char path[FILENAME_MAX];
+	ssize_t res;
+	int fd;
+
+	if (!cg_bulk_prepare(req, set, path))
+		return;
+
+	fd = open(path, (set ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0) {
+		req->status = cg_bulk_open_error(req, errno);
+		return;
+	}
+
+	if (set) {
+		res = write(fd, req->value, strlen(req->value));
+
+		/*
+		 * The kernel replaces the whole value on every write, the
+		 * regular files of a caller supplied hierarchy have to be cut
+		 * after it.  Unlike O_TRUNC, this keeps their blocks.
+		 */
+		if (res >= 0 && cg_mount_table_injected &&
+		    ftruncate(fd, res) < 0)
+			res = -1;
+	} else {
+		res = read(fd, req->value, req->size - 1);
+	}
+	cg_bulk_done(req, set, res < 0 ? -errno : res);
+
+	close(fd);
+}
+
+static void cg_bulk_run(struct cg_bulk_work *work)
+{
+	int i, end;
+
+	for (;;) {
+		pthread_mutex_lock(&work->lock);
+		i = work->next;
+		work->next += CG_BULK_CHUNK;
+		pthread_mutex_unlock(&work->lock);
+
+		if (i >= work->count)
+			break;
+
+		end = i + CG_BULK_CHUNK;
+		if (end > work->count)
+			end = work->count;
+
+		for (; i < end; i++)
+			cg_bulk_one(&work->requests[i], work->set);
+	}
+}
+
+/*
+ * Build the paths of a pool thread with the namespaces of the caller, which
+ * waits for the thread before it can change them.  NULL work drops them.
+ */
+static void cg_bulk_adopt_namespaces(const struct cg_bulk_work *work)
+{
+	cg_namespace_table = work ? work->namespace_table : NULL;
+	cg_namespace_table_max = work ? work->namespace_table_max : 0;
+}
+
+/*
+ * Check whether a pool thread, which took the work of generation seen last,
+ * has to join the current work.  This function should be called with
+ * cg_bulk_pool.lock taken.
+ */
+static bool cg_bulk_pool_has_work(unsigned long seen)
+{
+	return cg_bulk_pool.work && cg_bulk_pool.generation != seen &&
+	       cg_bulk_pool.joined < cg_bulk_pool.wanted;
+}
+
+static void *cg_bulk_worker(void *arg)
+{
+	struct cg_bulk_work *work;
+	struct timespec deadline;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&cg_bulk_pool.lock);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += CG_BULK_IDLE_SEC;
+
+		while (!cg_bulk_pool_has_work(seen)) {
+			if (pthread_cond_timedwait(&cg_bulk_pool.work_cond,
+						   &cg_bulk_pool.lock,
+						   &deadline) == ETIMEDOUT &&
+			    !cg_bulk_pool_has_work(seen))
+				goto exit;
+		}
+
+		work = cg_bulk_pool.work;
+		seen = cg_bulk_pool.generation;
+		cg_bulk_pool.joined++;
+		cg_bulk_pool.active++;
+		pthread_mutex_unlock(&cg_bulk_pool.lock);
+
+		cg_bulk_adopt_namespaces(work);
+		cg_bulk_run(work);
+		cg_bulk_adopt_namespaces(NULL);
+
+		pthread_mutex_lock(&cg_bulk_pool.lock);
+		if (--cg_bulk_pool.active == 0)
+			pthread_cond_signal(&cg_bulk_pool.done_cond);
+	}
+
+exit:
+	/* The next caller starts a new thread */
+	cg_bulk_pool.started--;
+	pthread_mutex_unlock(&cg_bulk_pool.lock);
+
+	return NULL;
+}
+
+/* The idle timeout must not depend on the wall clock */
+static void cg_bulk_pool_init_work_cond(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cg_bulk_pool.work_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* The threads of the pool do not exist in a forked child */
+static void cg_bulk_pool_atfork_child(void)
+{
+	pthread_mutex_init(&cg_bulk_pool.lock, NULL);
+	cg_bulk_pool_init_work_cond();
+	pthread_cond_init(&cg_bulk_pool.done_cond, NULL);
+	cg_bulk_pool.started = 0;
+	cg_bulk_pool.busy = false;
+	cg_bulk_pool.work = NULL;
+	cg_bulk_pool.joined = 0;
+	cg_bulk_pool.active = 0;
+}
+
+static void cg_bulk_pool_init(void)
+{
+	cg_bulk_pool_init_work_cond();
+	pthread_atfork(NULL, NULL, cg_bulk_pool_atfork_child);
+}
+
+/*
+ * Start pool threads until there are count of them.  This function should
+ * be called with cg_bulk_pool.lock taken.
+ */
+static void cg_bulk_pool_start(int count)
+{
+	sigset_t sigset, oldset;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (cg_bulk_pool.started >= count)
+		return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* Signals are for the threads of the application */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+
+	while (cg_bulk_pool.started < count) {
+		ret = pthread_create(&thread, &attr, cg_bulk_worker, NULL);
+		if (ret) {
+			cgroup_warn("failed to start bulk worker: %s\n",
+				    strerror(ret));
+			break;
+		}
+		cg_bulk_pool.started++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+static int cg_bulk_workers(int count)
+{
+	long cpus;
+	int workers;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = cpus > CG_BULK_MAX_WORKERS ? CG_BULK_MAX_WORKERS :
+		  cpus < 1 ? 1 : (int)cpus;
+
+	/* A thread is not worth waking up for less than a few chunks */
+	if (workers > count / (2 * CG_BULK_CHUNK))
+		workers = count / (2 * CG_BULK_CHUNK);
+
+	return workers < 1 ? 1 : workers;
+}
+
+static void cg_bulk_threads(struct cgroup_bulk_request *requests, int count,
+			    bool set)
+{
+	struct cg_bulk_work work;
+	int workers;
+
+	work.requests = requests;
+	work.count = count;
+	work.set = set;
+	work.namespace_table = cg_namespace_table;
+	work.namespace_table_max = cg_namespace_table_max;
+	work.next = 0;
+	pthread_mutex_init(&work.lock, NULL);
+
+	/* The calling thread is one of the workers */
+	workers = cg_bulk_workers(count);
+	if (workers < 2) {
+		cg_bulk_run(&work);
+		goto out;
+	}
+
+	pthread_once(&cg_bulk_pool_once, cg_bulk_pool_init);
+
+	pthread_mutex_lock(&cg_bulk_pool.lock);
+	if (cg_bulk_pool.busy) {
+		pthread_mutex_unlock(&cg_bulk_pool.lock);
+		cg_bulk_run(&work);
+		goto out;
+	}
+
+	cg_bulk_pool.busy = true;
+	cg_bulk_pool_start(workers - 1);
+	cg_bulk_pool.work = &work;
+	cg_bulk_pool.generation++;
+	cg_bulk_pool.wanted = workers - 1;
+	cg_bulk_pool.joined = 0;
+	pthread_cond_broadcast(&cg_bulk_pool.work_cond);
+	pthread_mutex_unlock(&cg_bulk_pool.lock);
+
+	cg_bulk_run(&work);
+
+	/* No thread may take the work late, it lives on our stack */
+	pthread_mutex_lock(&cg_bulk_pool.lock);
+	cg_bulk_pool.work = NULL;
+	while (cg_bulk_pool.active)
+		pthread_cond_wait(&cg_bulk_pool.done_cond, &cg_bulk_pool.lock);
+	cg_bulk_pool.busy = false;
+	pthread_mutex_unlock(&cg_bulk_pool.lock);
+
+out:
+	pthread_mutex_destroy(&work.lock);
+}
+
+static int cg_bulk(struct cgroup_bulk_request *requests, int count,
+		   bool set)
+{
+	int i;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!requests || count < 0)
+		return ECGINVAL;
+
+	if (!count)
+		return 0;
+
+	cg_bulk_threads(requests, count, set);
+
+	for (i = 0; i < count; i++) {
+		if (requests[i].status) {
+			if (requests[i].status == ECGOTHER)
+				last_errno = requests[i].error;
+			return requests[i].status;
+		}
+	}
+
+	return 0;
+}
+
+int cgroup_bulk_get(struct cgroup_bulk_request *requests, int count)
+{
+	return cg_bulk(requests, count, false);
+}
+
+int cgroup_bulk_set(struct cgroup_bulk_request *requests, int count)
+{
+	return cg_bulk(requests, count, true);
+}
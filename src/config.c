@@ -823,13 +823,13 @@ static int config_validate_namespaces(void)
 	int i;
 
 	pthread_rwlock_wrlock(&cg_mount_table_lock);
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
 		/*
 		 * If we get the path in the first run, then we
 		 * are good, else we will need to go for two
 		 * loops. This should be optimized in the future
 		 */
-		mount_path = cg_mount_table[i].mount.path;
+		mount_path = cg_mounts[i].mount.path;
 
 		if (!mount_path) {
 			last_errno = errno;
@@ -864,7 +864,7 @@ static int config_validate_namespaces(void)
 		 * Search through the mount table to locate which subsystems
 		 * are mounted together.
 		 */
-		while (!strncmp(cg_mount_table[j].mount.path, mount_path,
+		while (!strncmp(cg_mounts[j].mount.path, mount_path,
 							FILENAME_MAX)) {
 			if (!namespace && cg_namespace_table[j]) {
 				/* In case namespace is not setup, set it up */
@@ -931,15 +931,27 @@ out_error:
 static int config_order_namespace_table(void)
 {
 	int error = 0;
+	int count;
 	int i = 0;
 
 	pthread_rwlock_wrlock(&cg_mount_table_lock);
-	/* Set everything to NULL */
-	for (i = 0; i < CG_CONTROLLER_MAX; i++)
-		cg_namespace_table[i] = NULL;
-
-	memset(cg_namespace_table, 0,
-	       CG_CONTROLLER_MAX * sizeof(cg_namespace_table[0]));
+	/* Drop the namespaces loaded before */
+	for (i = 0; i < cg_namespace_table_max; i++)
+		free(cg_namespace_table[i]);
+	free(cg_namespace_table);
+	cg_namespace_table_max = 0;
+
+	for (count = 0; cg_mounts[count].name[0] != '\0'; count++)
+		;
+
+	/* One entry per mounted controller, all NULL */
+	cg_namespace_table = calloc(count + 1, sizeof(*cg_namespace_table));
+	if (!cg_namespace_table) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto error_out;
+	}
+	cg_namespace_table_max = count + 1;
 
 	/*
 	 * Now fill up the namespace table looking at the table we have
@@ -950,9 +962,9 @@ static int config_order_namespace_table(void)
 		int j;
 		int flag = 0;
 
-		for (j = 0; cg_mount_table[j].name[0] != '\0'; j++) {
+		for (j = 0; cg_mounts[j].name[0] != '\0'; j++) {
 			if (strncmp(config_namespace_table[i].name,
-				cg_mount_table[j].name, FILENAME_MAX) == 0) {
+				cg_mounts[j].name, FILENAME_MAX) == 0) {
 
 				flag = 1;
 
@@ -1679,8 +1691,6 @@ int cgroup_add_cgroup_templates(int offset)
  */
 int cgroup_expand_template_table(void)
 {
-	int i;
-
 	template_table = realloc(template_table,
 		(template_table_index + config_template_table_index)
 		*sizeof(struct cgroup));
@@ -1688,8 +1698,8 @@ int cgroup_expand_template_table(void)
 	if (template_table == NULL)
 		return -ECGOTHER;
 
-	for (i = 0; i < config_template_table_index; i++)
-		template_table[i + template_table_index].index = 0;
+	memset(&template_table[template_table_index], 0,
+	       config_template_table_index * sizeof(struct cgroup));
 
 	template_table_index += config_template_table_index;
 
@@ -1825,7 +1835,7 @@ int cgroup_config_create_template_group(struct cgroup *cgroup,
 		}
 	}
 
-	for (i = 0; cgroup->controller[i] != NULL; i++) {
+	for (i = 0; i < cgroup->index; i++) {
 		/*
 		 * for each controller we have to add to cgroup structure
 		 * either template cgroup or empty controller.
@@ -1842,7 +1852,7 @@ int cgroup_config_create_template_group(struct cgroup *cgroup,
 			}
 
 			/* template name match */
-			for (k = 0; t_cgroup->controller[k] != NULL; k++) {
+			for (k = 0; k < t_cgroup->index; k++) {
 				if (strcmp((cgroup->controller[i])->name,
 					(t_cgroup->controller[k])->name) != 0) {
 					/* controller name does not match */
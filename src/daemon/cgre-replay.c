@@ -0,0 +1,395 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/**
+ * Recording of the proc connector events received by the cgroup rules engine
+ * daemon, and their deterministic replay.
+ *
+ * A recording keeps every event together with the credentials and the name
+ * of the process, as read from /proc when the event arrived.  The replay
+ * recreates these processes in a fake procfs and feeds the events through
+ * cgre_process_event(), so the rule engine can be benchmarked and tested
+ * without real process churn.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "../libcgroup-internal.h"
+#include "cgrulesengd.h"
+#include "cgre-replay.h"
+#include "cgre-stats.h"
+
+#include <syslog.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <ftw.h>
+
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <linux/magic.h>
+
+int cgre_replaying;
+
+static FILE *record_file;
+
+/**
+ * Get the process whose state is needed to classify it after an event.
+ *	@param ev The event
+ *	@return the pid, 0 if the event needs no classification
+ */
+static pid_t cgre_record_pid(const struct proc_event *ev)
+{
+	switch (ev->what) {
+	case PROC_EVENT_FORK:
+		return ev->event_data.fork.child_pid;
+	case PROC_EVENT_EXEC:
+		return ev->event_data.exec.process_pid;
+	case PROC_EVENT_UID:
+	case PROC_EVENT_GID:
+		return ev->event_data.id.process_pid;
+	default:
+		return 0;
+	}
+}
+
+int cgre_record_open(const char *path)
+{
+	struct cgre_record_hdr hdr;
+
+	record_file = fopen(path, "we");
+	if (!record_file) {
+		flog(LOG_ERR, "Failed to open recording %s: %s\n", path,
+		     strerror(errno));
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CGRE_RECORD_MAGIC;
+	hdr.version = CGRE_RECORD_VERSION;
+	hdr.event_size = sizeof(struct proc_event);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, record_file) != 1) {
+		flog(LOG_ERR, "Failed to write recording %s: %s\n", path,
+		     strerror(errno));
+		fclose(record_file);
+		record_file = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+void cgre_record_event(const struct proc_event *ev)
+{
+	struct cgre_record rec;
+	char *procname = NULL;
+	uid_t euid;
+	gid_t egid;
+	int procfd;
+	pid_t pid;
+
+	if (!record_file)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	memcpy(&rec.ev, ev, sizeof(*ev));
+
+	pid = cgre_record_pid(ev);
+	procfd = pid > 0 ? cg_open_procfd(pid) : -1;
+	if (procfd >= 0) {
+		if (!cg_get_uid_gid_from_procfd(procfd, &euid, &egid) &&
+		    !cg_get_procname_from_procfd(procfd, &procname)) {
+			rec.euid = euid;
+			rec.egid = egid;
+			rec.procname_len = strlen(procname);
+		}
+		close(procfd);
+	}
+
+	if (fwrite(&rec, sizeof(rec), 1, record_file) != 1 ||
+	    (rec.procname_len &&
+	     fwrite(procname, rec.procname_len, 1, record_file) != 1)) {
+		flog(LOG_WARNING, "Failed to write recording, stopping: %s\n",
+		     strerror(errno));
+		cgre_record_close();
+	}
+
+	free(procname);
+}
+
+void cgre_record_close(void)
+{
+	if (!record_file)
+		return;
+
+	if (fclose(record_file))
+		flog(LOG_WARNING, "Failed to write recording: %s\n",
+		     strerror(errno));
+	record_file = NULL;
+}
+
+static int cgre_replay_write_file(int dirfd, const char *name,
+				  const char *buf, size_t len)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0644);
+	if (fd < 0)
+		return -1;
+
+	ret = write(fd, buf, len);
+	close(fd);
+
+	return ret == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * Create or update the fake /proc/<pid> directory of a recorded process, with
+ * the files libcgroup reads to classify it.
+ *	@param root The fake procfs
+ *	@param pid The process id
+ *	@param rec The record of the process
+ *	@param procname The recorded process name
+ *	@return 0 on success, -1 on error
+ */
+static int cgre_replay_add_process(const char *root, pid_t pid,
+				   const struct cgre_record *rec,
+				   const char *procname)
+{
+	char path[FILENAME_MAX];
+	char status[FILENAME_MAX];
+	const char *comm;
+	int dirfd, len;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%d", root, pid);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return -1;
+
+	/* The kernel truncates the name in the status file to 15 characters */
+	comm = strrchr(procname, '/');
+	comm = comm ? comm + 1 : procname;
+	len = snprintf(status, sizeof(status),
+		       "Name:\t%.15s\n"
+		       "Uid:\t%u\t%u\t%u\t%u\n"
+		       "Gid:\t%u\t%u\t%u\t%u\n",
+		       comm, rec->euid, rec->euid, rec->euid, rec->euid,
+		       rec->egid, rec->egid, rec->egid, rec->egid);
+
+	if (cgre_replay_write_file(dirfd, "status", status, len) ||
+	    cgre_replay_write_file(dirfd, "cgroup", "", 0))
+		goto out;
+
+	/* Kernel threads have no executable */
+	unlinkat(dirfd, "exe", 0);
+	if (procname[0] == '/' && symlinkat(procname, dirfd, "exe") < 0)
+		goto out;
+
+	/* libcgroup moves all the threads listed in task/ */
+	snprintf(path, sizeof(path), "task/%d", pid);
+	if ((mkdirat(dirfd, "task", 0755) < 0 && errno != EEXIST) ||
+	    (mkdirat(dirfd, path, 0755) < 0 && errno != EEXIST))
+		goto out;
+
+	ret = 0;
+out:
+	close(dirfd);
+	return ret;
+}
+
+static void cgre_replay_remove_process(const char *root, pid_t pid)
+{
+	char path[FILENAME_MAX];
+	int dirfd;
+
+	snprintf(path, sizeof(path), "%s/%d", root, pid);
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return;
+
+	snprintf(path, sizeof(path), "task/%d", pid);
+	unlinkat(dirfd, path, AT_REMOVEDIR);
+	unlinkat(dirfd, "task", AT_REMOVEDIR);
+	unlinkat(dirfd, "exe", 0);
+	unlinkat(dirfd, "status", 0);
+	unlinkat(dirfd, "cgroup", 0);
+	close(dirfd);
+
+	snprintf(path, sizeof(path), "%s/%d", root, pid);
+	rmdir(path);
+}
+
+static int cgre_replay_remove_entry(const char *path, const struct stat *sb,
+				    int type, struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+static void cgre_replay_count_event(const struct proc_event *ev)
+{
+	switch (ev->what) {
+	case PROC_EVENT_FORK:
+		cgre_stats_inc(CGRE_STAT_EVENT_FORK);
+		break;
+	case PROC_EVENT_EXEC:
+		cgre_stats_inc(CGRE_STAT_EVENT_EXEC);
+		break;
+	case PROC_EVENT_UID:
+		cgre_stats_inc(CGRE_STAT_EVENT_UID);
+		break;
+	case PROC_EVENT_GID:
+		cgre_stats_inc(CGRE_STAT_EVENT_GID);
+		break;
+	case PROC_EVENT_EXIT:
+		cgre_stats_inc(CGRE_STAT_EVENT_EXIT);
+		break;
+	default:
+		cgre_stats_inc(CGRE_STAT_EVENT_OTHER);
+		break;
+	}
+}
+
+int cgre_replay_check_hierarchy(void)
+{
+	struct cg_mount_point *mount = NULL;
+	struct statfs fs;
+	int i;
+
+	if (!cg_mount_table_injected) {
+		flog(LOG_ERR, "Replay needs a scratch hierarchy, set %s\n",
+		     CGROUP_ROOT_OVERRIDE_ENV);
+		return 1;
+	}
+
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
+		for (mount = &cg_mounts[i].mount; mount;
+		     mount = mount->next) {
+			if (statfs(mount->path, &fs) < 0 ||
+			    fs.f_type == CGROUP_SUPER_MAGIC ||
+			    fs.f_type == CGROUP2_SUPER_MAGIC)
+				goto unlock;
+		}
+	}
+
+unlock:
+	if (mount)
+		flog(LOG_ERR, "Replay refused, %s is not a scratch dir\n",
+		     mount->path);
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+
+	return mount != NULL;
+}
+
+int cgre_replay(const char *path)
+{
+	char root[] = "/tmp/cgre-replay-XXXXXX";
+	char procname[FILENAME_MAX];
+	struct cgre_record_hdr hdr;
+	struct cgre_record rec;
+	__u64 events = 0;
+	__u64 busy_ns = 0;
+	__u64 start_ns;
+	int ret = 1;
+	pid_t pid;
+	FILE *f;
+
+	/* The recorded pids must never be moved in the real hierarchy */
+	if (cgre_replay_check_hierarchy())
+		return 1;
+
+	f = fopen(path, "re");
+	if (!f) {
+		flog(LOG_ERR, "Failed to open recording %s: %s\n", path,
+		     strerror(errno));
+		return 1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr.magic != CGRE_RECORD_MAGIC ||
+	    hdr.version != CGRE_RECORD_VERSION ||
+	    hdr.event_size != sizeof(struct proc_event)) {
+		flog(LOG_ERR, "%s is not a compatible recording\n", path);
+		goto close_file;
+	}
+
+	if (!mkdtemp(root)) {
+		flog(LOG_ERR, "Failed to create the fake procfs: %s\n",
+		     strerror(errno));
+		goto close_file;
+	}
+
+	cg_set_procfs_path(root);
+	cgre_replaying = 1;
+	cgre_stats_init();
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.procname_len >= sizeof(procname) ||
+		    (rec.procname_len &&
+		     fread(procname, rec.procname_len, 1, f) != 1)) {
+			flog(LOG_ERR, "Truncated recording %s\n", path);
+			goto cleanup;
+		}
+		procname[rec.procname_len] = '\0';
+
+		pid = cgre_record_pid(&rec.ev);
+		if (pid > 0 && rec.procname_len &&
+		    cgre_replay_add_process(root, pid, &rec, procname))
+			flog(LOG_WARNING,
+			     "Failed to create fake process %d: %s\n", pid,
+			     strerror(errno));
+
+		/*
+		 * The daemon compares the event timestamps with its own
+		 * clock, move the event to the present.
+		 */
+		start_ns = cgre_stats_now();
+		rec.ev.timestamp_ns = start_ns;
+
+		cgre_replay_count_event(&rec.ev);
+		cgre_process_event(&rec.ev, rec.ev.what);
+
+		busy_ns += cgre_stats_now() - start_ns;
+		events++;
+
+		if (rec.ev.what == PROC_EVENT_EXIT)
+			cgre_replay_remove_process(root,
+					rec.ev.event_data.exit.process_pid);
+	}
+
+	if (ferror(f)) {
+		flog(LOG_ERR, "Failed to read recording %s: %s\n", path,
+		     strerror(errno));
+		goto cleanup;
+	}
+
+	fprintf(stdout, "replay_events %llu\n", (unsigned long long)events);
+	fprintf(stdout, "replay_busy_ns %llu\n", (unsigned long long)busy_ns);
+	fprintf(stdout, "replay_events_per_sec %llu\n",
+		(unsigned long long)(busy_ns ?
+				     events * 1000000000ULL / busy_ns : 0));
+	cgre_stats_write(stdout);
+	fflush(stdout);
+	ret = 0;
+
+cleanup:
+	cgre_replaying = 0;
+	cg_set_procfs_path(NULL);
+	nftw(root, cgre_replay_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+close_file:
+	fclose(f);
+
+	return ret;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * Recording of the proc connector events received by the cgroup rules engine
+ * daemon, and their deterministic replay.
+ */
+
+#ifndef _CGRE_REPLAY_H
+#define _CGRE_REPLAY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/types.h>
+
+#define CGRE_RECORD_MAGIC	0x43475245	/* "CGRE" */
+#define CGRE_RECORD_VERSION	1
+
+/*
+ * A recording starts with this header.  The records are stored in host byte
+ * order with the struct proc_event layout of the recording daemon, so they
+ * can only be replayed by a build using the same kernel headers.
+ */
+struct cgre_record_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 event_size;	/* sizeof(struct proc_event) */
+	__u32 pad;
+};
+
+/*
+ * One event, followed by procname_len bytes of the process name (without the
+ * terminating NUL).  The credentials and the name are those the daemon read
+ * from /proc when the event arrived.
+ */
+struct cgre_record {
+	struct proc_event ev;
+	__u32 euid;
+	__u32 egid;
+	__u32 procname_len;	/* 0 if the process could not be read */
+	__u32 pad;
+};
+
+/* Non-zero while replaying, the processes are fake and cannot be pinned */
+extern int cgre_replaying;
+
+/**
+ * Open a recording file and write its header.  From now on, every event
+ * passed to cgre_record_event() is appended to it.
+ *	@param path The file to write
+ *	@return 0 on success, > 0 on error
+ */
+int cgre_record_open(const char *path);
+
+/**
+ * Append an event and the current state of the process it refers to to the
+ * recording.  Does nothing unless a recording is open.
+ *	@param ev The event
+ */
+void cgre_record_event(const struct proc_event *ev);
+
+/**
+ * Flush and close the recording, if one is open.
+ */
+void cgre_record_close(void);
+
+/**
+ * Check that libcgroup works on a scratch hierarchy, set up with
+ * CGROUP_ROOT_OVERRIDE or cgroup_init_mount_table() in plain directories.
+ * A replay run against the real cgroup file systems would move the recorded
+ * pids, which now belong to unrelated processes, and create real groups.
+ *	@return 0 if the hierarchy is a scratch one, > 0 otherwise
+ */
+int cgre_replay_check_hierarchy(void);
+
+/**
+ * Replay a recording.  Every recorded process is materialized in a fake
+ * procfs in a temporary directory, then the event is passed to
+ * cgre_process_event().  The throughput and the statistics of the daemon are
+ * printed at the end.  Fails unless cgre_replay_check_hierarchy() passes.
+ *	@param path The recording to replay
+ *	@return 0 on success, > 0 on error
+ */
+int cgre_replay(const char *path);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CGRE_REPLAY_H */
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/**
+ * Counters and latency histograms of the cgroup rules engine daemon.
+ *
+ * The histograms use logarithmic buckets, each split into linear sub-buckets
+ * like HdrHistogram does, so every recorded value is kept with a relative
+ * error below 1/HIST_SUB_BUCKETS at a fixed memory cost.
+ */
+
+#include "cgre-stats.h"
+
+#include <time.h>
+
+/* Number of linear sub-buckets per power of two, a power of two itself */
+#define HIST_SUB_BITS		(3)
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+
+/* Enough buckets for any 64 bit value */
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct cgre_histogram {
+	__u64 buckets[HIST_BUCKETS];
+	__u64 count;
+	__u64 sum;
+	__u64 max;
+};
+
+static const char * const cgre_stat_names[CGRE_STAT_MAX] = {
+	[CGRE_STAT_EVENT_FORK]		= "events_fork",
+	[CGRE_STAT_EVENT_EXEC]		= "events_exec",
+	[CGRE_STAT_EVENT_UID]		= "events_uid",
+	[CGRE_STAT_EVENT_GID]		= "events_gid",
+	[CGRE_STAT_EVENT_EXIT]		= "events_exit",
+	[CGRE_STAT_EVENT_OTHER]		= "events_other",
+	[CGRE_STAT_NETLINK_DATAGRAMS]	= "netlink_datagrams",
+	[CGRE_STAT_NETLINK_OVERRUNS]	= "netlink_overruns",
+	[CGRE_STAT_NETLINK_TRUNCATED]	= "netlink_truncated",
+	[CGRE_STAT_RESYNCS]		= "resyncs",
+	[CGRE_STAT_CLASSIFY_OK]		= "classify_ok",
+	[CGRE_STAT_CLASSIFY_FAILED]	= "classify_failed",
+	[CGRE_STAT_CLASSIFY_EXITED]	= "classify_exited",
+	[CGRE_STAT_PARENT_INFO_HITS]	= "parent_info_hits",
+	[CGRE_STAT_PARENT_INFO_MISSES]	= "parent_info_misses",
+	[CGRE_STAT_UNCHANGED_HITS]	= "unchanged_hits",
+	[CGRE_STAT_UNCHANGED_MISSES]	= "unchanged_misses",
+	[CGRE_STAT_COALESCED]		= "events_coalesced",
+	[CGRE_STAT_STICKY_REQUESTS]	= "sticky_requests",
+	[CGRE_STAT_PENDING_EVENTS]	= "pending_events",
+	[CGRE_STAT_PENDING_EVENTS_MAX]	= "pending_events_max",
+	[CGRE_STAT_UNCHANGED_PROCESSES]	= "unchanged_processes",
+	[CGRE_STAT_PARENT_INFO_ENTRIES]	= "parent_info_entries",
+	[CGRE_STAT_LOG_DROPPED]		= "log_dropped",
+	[CGRE_STAT_GROUP_EVENTS]	= "group_events",
+	[CGRE_STAT_OOM_KILLS]		= "oom_kills",
+};
+
+static const char * const cgre_hist_names[CGRE_HIST_MAX] = {
+	[CGRE_HIST_EVENT_LATENCY]	= "event_latency_ns",
+	[CGRE_HIST_PROCFS_READ]		= "procfs_read_ns",
+	[CGRE_HIST_CGROUP_CHANGE]	= "cgroup_change_ns",
+	[CGRE_HIST_NETLINK_BATCH]	= "netlink_batch",
+};
+
+__u64 cgre_stats[CGRE_STAT_MAX];
+
+static struct cgre_histogram cgre_hists[CGRE_HIST_MAX];
+
+static __u64 cgre_stats_start;
+
+static int cgre_hist_index(__u64 value)
+{
+	int msb;
+
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+	       ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Highest value which falls into the given bucket */
+static __u64 cgre_hist_value(int idx)
+{
+	int shift;
+
+	if (idx < HIST_SUB_BUCKETS)
+		return idx;
+
+	shift = idx / HIST_SUB_BUCKETS - 1;
+
+	return (((__u64)(idx % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS + 1))
+		<< shift) - 1;
+}
+
+void cgre_stats_init(void)
+{
+	cgre_stats_start = cgre_stats_now();
+}
+
+void cgre_stats_record(enum cgre_hist hist, __u64 value)
+{
+	struct cgre_histogram *h = &cgre_hists[hist];
+
+	h->buckets[cgre_hist_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+__u64 cgre_stats_now(void)
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) < 0)
+		return 0;
+
+	return ((__u64)tp.tv_sec * 1000 * 1000 * 1000) + tp.tv_nsec;
+}
+
+/**
+ * Find the value below which the given share of the recorded values lies.
+ *	@param h The histogram
+ *	@param permille The share in 1/1000
+ *	@return the upper bound of the bucket holding the percentile
+ */
+static __u64 cgre_hist_percentile(const struct cgre_histogram *h,
+				  int permille)
+{
+	__u64 rank, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = (h->count * permille + 999) / 1000;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == HIST_BUCKETS || cgre_hist_value(i) > h->max)
+		return h->max;
+
+	return cgre_hist_value(i);
+}
+
+void cgre_stats_write(FILE *f)
+{
+	const struct cgre_histogram *h;
+	const char *name;
+	int i;
+
+	fprintf(f, "uptime_ns %llu\n",
+		(unsigned long long)(cgre_stats_now() - cgre_stats_start));
+
+	for (i = 0; i < CGRE_STAT_MAX; i++)
+		fprintf(f, "%s %llu\n", cgre_stat_names[i],
+			(unsigned long long)cgre_stats[i]);
+
+	for (i = 0; i < CGRE_HIST_MAX; i++) {
+		h = &cgre_hists[i];
+		name = cgre_hist_names[i];
+
+		fprintf(f, "%s_count %llu\n", name,
+			(unsigned long long)h->count);
+		fprintf(f, "%s_avg %llu\n", name,
+			(unsigned long long)(h->count ? h->sum / h->count : 0));
+		fprintf(f, "%s_p50 %llu\n", name,
+			(unsigned long long)cgre_hist_percentile(h, 500));
+		fprintf(f, "%s_p90 %llu\n", name,
+			(unsigned long long)cgre_hist_percentile(h, 900));
+		fprintf(f, "%s_p99 %llu\n", name,
+			(unsigned long long)cgre_hist_percentile(h, 990));
+		fprintf(f, "%s_p999 %llu\n", name,
+			(unsigned long long)cgre_hist_percentile(h, 999));
+		fprintf(f, "%s_max %llu\n", name,
+			(unsigned long long)h->max);
+	}
+}
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * Counters and latency histograms of the cgroup rules engine daemon.
+ */
+
+#ifndef _CGRE_STATS_H
+#define _CGRE_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/types.h>
+#include <stdio.h>
+
+/*
+ * Counters and gauges.  They are only updated from the event loop thread, so
+ * they are plain integers and need no locking.
+ */
+enum cgre_stat {
+	CGRE_STAT_EVENT_FORK,
+	CGRE_STAT_EVENT_EXEC,
+	CGRE_STAT_EVENT_UID,
+	CGRE_STAT_EVENT_GID,
+	CGRE_STAT_EVENT_EXIT,
+	CGRE_STAT_EVENT_OTHER,
+	CGRE_STAT_NETLINK_DATAGRAMS,
+	CGRE_STAT_NETLINK_OVERRUNS,
+	CGRE_STAT_NETLINK_TRUNCATED,
+	CGRE_STAT_RESYNCS,
+	CGRE_STAT_CLASSIFY_OK,
+	CGRE_STAT_CLASSIFY_FAILED,
+	CGRE_STAT_CLASSIFY_EXITED,
+	CGRE_STAT_PARENT_INFO_HITS,
+	CGRE_STAT_PARENT_INFO_MISSES,
+	CGRE_STAT_UNCHANGED_HITS,
+	CGRE_STAT_UNCHANGED_MISSES,
+	CGRE_STAT_COALESCED,
+	CGRE_STAT_STICKY_REQUESTS,
+	CGRE_STAT_PENDING_EVENTS,
+	CGRE_STAT_PENDING_EVENTS_MAX,
+	CGRE_STAT_UNCHANGED_PROCESSES,
+	CGRE_STAT_PARENT_INFO_ENTRIES,
+	CGRE_STAT_LOG_DROPPED,
+	CGRE_STAT_GROUP_EVENTS,
+	CGRE_STAT_OOM_KILLS,
+	CGRE_STAT_MAX,
+};
+
+enum cgre_hist {
+	CGRE_HIST_EVENT_LATENCY,	/* kernel event to process moved */
+	CGRE_HIST_PROCFS_READ,		/* pinning and reading /proc/<pid> */
+	CGRE_HIST_CGROUP_CHANGE,	/* matching the rules, moving */
+	CGRE_HIST_NETLINK_BATCH,	/* datagrams per recvmmsg() */
+	CGRE_HIST_MAX,
+};
+
+extern __u64 cgre_stats[CGRE_STAT_MAX];
+
+static inline void cgre_stats_inc(enum cgre_stat stat)
+{
+	cgre_stats[stat]++;
+}
+
+static inline void cgre_stats_add(enum cgre_stat stat, __u64 value)
+{
+	cgre_stats[stat] += value;
+}
+
+static inline void cgre_stats_set(enum cgre_stat stat, __u64 value)
+{
+	cgre_stats[stat] = value;
+}
+
+/**
+ * Start the statistics, the reported uptime is counted from now.
+ */
+void cgre_stats_init(void);
+
+/**
+ * Record a value, usually a duration in nanoseconds, in a histogram.
+ *	@param hist The histogram
+ *	@param value The value to record
+ */
+void cgre_stats_record(enum cgre_hist hist, __u64 value);
+
+/**
+ * Read the monotonic clock, the same clock as the proc connector uses for
+ * the event timestamps.
+ *	@return the current time in nanoseconds
+ */
+__u64 cgre_stats_now(void);
+
+/**
+ * Write a text snapshot of all counters and histograms, one "name value"
+ * pair per line.
+ *	@param f The stream to write to
+ */
+void cgre_stats_write(FILE *f);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CGRE_STATS_H */
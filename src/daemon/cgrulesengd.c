@@ -27,9 +27,13 @@
 #include "../libcgroup-internal.h"
 #include "../tools/tools-common.h"
 #include "cgrulesengd.h"
+#include "cgre-replay.h"
+#include "cgre-stats.h"
 #include "libcgroup.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
@@ -40,21 +44,65 @@
 #include <stdio.h>
 #include <time.h>
 
+#include <poll.h>
 #include <pwd.h>
 #include <grp.h>
 
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/syslog.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <linux/connector.h>
 #include <linux/cn_proc.h>
 #include <linux/netlink.h>
+#include <linux/filter.h>
 #include <linux/un.h>
 
 #define NUM_PER_REALLOCATIOM	(100)
 
+/* Interval of the periodic cache maintenance in seconds */
+#define MAINTENANCE_INTERVAL	(10)
+
+/* Age after which the parent info is no longer needed */
+#define PARENT_INFO_EXPIRY_NS	\
+	((__u64)MAINTENANCE_INTERVAL * 1000 * 1000 * 1000)
+
+/* Time to wait for the proc connector to acknowledge a subscription */
+#define MCAST_ACK_TIMEOUT_MS	(100)
+
+/* Maximum number of events returned by one epoll_wait() */
+#define MAX_EPOLL_EVENTS	(8)
+
+/* Maximum number of simultaneous legacy protocol connections */
+#define MAX_STREAM_CLIENTS	(16)
+
+/* Time after which an incomplete legacy protocol request is dropped */
+#define STREAM_CLIENT_TIMEOUT_NS	((__u64)5 * 1000 * 1000 * 1000)
+
+/* Maximum number of simultaneous batched protocol connections */
+#define MAX_BATCH_CLIENTS	(64)
+
+/* Time after which an inactive batched protocol connection is closed */
+#define BATCH_CLIENT_IDLE_NS	((__u64)60 * 1000 * 1000 * 1000)
+
+/* Number of running processes reclassified between two event loop passes */
+#define SCAN_CHUNK_SIZE		(64)
+
+/* Number of records in the log ring of each thread, a power of two */
+#define LOG_RING_SIZE		(256)
+
+/* Maximum length of a log record, longer messages are truncated */
+#define LOG_RECORD_SIZE		(512)
+
 /* list of config files from CGCONFIG_CONF_FILE and CGCONFIG_CONF_DIR */
 static struct cgroup_string_list template_files;
 
@@ -73,6 +121,61 @@ uid_t socket_user = -1;
 /* Owner of the socket, -1 means no change */
 gid_t socket_group = -1;
 
+/* Receive buffer size of the netlink socket, 0 keeps the kernel default */
+int netlink_rcvbuf;
+
+/* Preallocated message vector for batched netlink reception */
+struct netlink_recv_vector {
+	struct mmsghdr msgs[RECV_BATCH_SIZE];
+	struct iovec iov[RECV_BATCH_SIZE];
+	struct sockaddr_nl addr[RECV_BATCH_SIZE];
+	char buff[RECV_BATCH_SIZE][BUFF_SIZE];
+};
+
+static struct netlink_recv_vector recv_vec;
+
+/* Open batched protocol connections and the time of their last message */
+struct cgre_batch_client {
+	int fd;
+	__u64 last_ns;
+};
+
+static struct cgre_batch_client batch_clients[MAX_BATCH_CLIENTS];
+static int batch_clients_count;
+
+/* Legacy protocol connections and their partially received request */
+struct cgre_stream_client {
+	int fd;
+	__u64 start_ns;
+	size_t len;
+	char buf[sizeof(pid_t) + sizeof(int)];
+};
+
+static struct cgre_stream_client stream_clients[MAX_STREAM_CLIENTS];
+static int stream_clients_count;
+
+/* Event coalescing window in microseconds, 0 disables coalescing */
+long coalesce_usec;
+
+/* Timer firing when the oldest coalescing window expires */
+static int coalesce_tfd = -1;
+
+/* Scan of the running processes, NULL when complete */
+static void *scan_handle;
+
+/* Last progress of the scan logged, in tenths */
+static int scan_logged;
+
+/* Events were lost during the scan, scan again once it completes */
+static int scan_again;
+
+/* Groups whose cgroup.events and memory.events are logged */
+static const char **watch_groups;
+static int watch_groups_count;
+
+/* Watcher of these groups, NULL when there is none */
+static struct cgroup_event_watcher *group_watcher;
+
 /**
  * Prints the usage information for this program and, optionally, an error
  * message.  This function uses vfprintf.
@@ -109,15 +212,357 @@ static void usage(FILE *fd, const char *msg, ...)
 	fprintf(fd, " " CGRULE_CGRED_SOCKET_PATH " socket user\n");
 	fprintf(fd, "    -g <group>   | --socket-group=<group> set");
 	fprintf(fd, " "	CGRULE_CGRED_SOCKET_PATH " socket group\n");
+	fprintf(fd, "    -b <bytes>   | --rcvbuf=<bytes>\t  set netlink ");
+	fprintf(fd, "socket receive buffer size\n");
+	fprintf(fd, "    -c <usec>    | --coalesce=<usec>\t  merge events ");
+	fprintf(fd, "of a process within the window\n");
+	fprintf(fd, "    -r <path>    | --record=<path>\t  record events ");
+	fprintf(fd, "to file\n");
+	fprintf(fd, "    -R <path>    | --replay=<path>\t  replay recorded ");
+	fprintf(fd, "events and exit\n");
+	fprintf(fd, "    -e <group>   | --watch=<group>\t  log the events ");
+	fprintf(fd, "of a cgroup v2 group\n");
 	fprintf(fd, "    -h           | --help\t\t  show this ");
 	fprintf(fd, "help\n\n");
 	va_end(ap);
 }
 
+struct log_record {
+	int level;
+	char msg[LOG_RECORD_SIZE];
+};
+
+/*
+ * Single producer, single consumer ring of formatted log records.  The
+ * owning thread fills it, the log thread writes the records out.  The ring
+ * of an exited thread is reused by the next thread which logs.
+ */
+struct log_ring {
+	struct log_record records[LOG_RING_SIZE];
+	unsigned int head;		/* next record to fill */
+	unsigned int tail;		/* next record to write out */
+	unsigned long dropped;		/* records lost on a full ring */
+	unsigned long reported;		/* dropped records already reported */
+	int in_use;
+	struct log_ring *next;
+};
+
+/* All log rings, entries are never removed */
+static struct log_ring *log_rings;
+
+/* Log ring of the current thread */
+static __thread struct log_ring *log_ring_self;
+
+/* Releases the log ring of an exiting thread */
+static pthread_key_t log_ring_key;
+
+static pthread_t log_thread;
+
+/* Wakes the idle log thread up when a ring becomes non-empty */
+static int log_efd = -1;
+
+/* Non-zero when the log records are written by the log thread */
+static int log_async;
+
+/* Protects the log thread state below */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long log_idle_passes;
+static int log_stop;
+
+/* Total number of log records dropped because a log ring was full */
+unsigned long log_dropped;
+
+static void cgre_log_release_ring(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get the log ring of the current thread.  A free ring is reused, a new one
+ * is allocated only if all rings are owned by other threads.
+ *	@return the ring, NULL on allocation failure
+ */
+static struct log_ring *cgre_log_get_ring(void)
+{
+	struct log_ring *ring;
+	int unused;
+
+	if (log_ring_self)
+		return log_ring_self;
+
+	ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		unused = 0;
+		if (__atomic_compare_exchange_n(&ring->in_use, &unused, 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+
+		ring->in_use = 1;
+		ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&log_rings, &ring->next,
+						    ring, 0, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+	}
+
+	log_ring_self = ring;
+	pthread_setspecific(log_ring_key, ring);
+
+	return ring;
+}
+
+static void cgre_log_wake(void)
+{
+	__u64 one = 1;
+	ssize_t ret;
+
+	ret = write(log_efd, &one, sizeof(one));
+	(void)ret;
+}
+
+/**
+ * Format a message into the log ring of the current thread.  Never blocks,
+ * the message is counted as dropped if the ring is full.
+ *	@param level The log level (LOG_EMERG ... LOG_DEBUG)
+ *	@param format The format for the message (vprintf style)
+ *	@param ap Any args to format (vprintf style)
+ *	@return 0 on success, -1 if the message must be written synchronously
+ */
+static int cgre_log_queue(int level, const char *format, va_list ap)
+{
+	struct log_record *rec;
+	struct log_ring *ring;
+	unsigned int head;
+
+	ring = cgre_log_get_ring();
+	if (!ring)
+		return -1;
+
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+	    LOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+	rec->level = level;
+	vsnprintf(rec->msg, sizeof(rec->msg), format, ap);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/*
+	 * Wake the log thread up only if the ring was empty.  Otherwise it
+	 * is still draining the ring and sees the new record as well.  The
+	 * fence pairs with the one in cgre_log_drain().
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == 1)
+		cgre_log_wake();
+
+	return 0;
+}
+
+static void cgre_log_output(int level, const char *msg)
+{
+	if (logfile)
+		fputs(msg, logfile);
+
+	if (logfacility)
+		syslog(LOG_MAKEPRI(logfacility, level), "%s", msg);
+}
+
+/**
+ * Write out all records queued in the log rings.  The log file is flushed
+ * once per pass instead of once per record.
+ *	@return the number of records written
+ */
+static int cgre_log_drain(void)
+{
+	struct log_record *rec;
+	struct log_ring *ring;
+	unsigned int head, tail;
+	unsigned long dropped;
+	char msg[64];
+	int written = 0;
+
+	/* Order the previous tail updates before the head reads below */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++) {
+			rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+			cgre_log_output(rec->level, rec->msg);
+			written++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped == ring->reported)
+			continue;
+
+		__atomic_add_fetch(&log_dropped, dropped - ring->reported,
+				   __ATOMIC_RELAXED);
+		if (loglevel >= LOG_WARNING) {
+			snprintf(msg, sizeof(msg),
+				 "Warning: dropped %lu log messages\n",
+				 dropped - ring->reported);
+			cgre_log_output(LOG_WARNING, msg);
+			written++;
+		}
+		ring->reported = dropped;
+	}
+
+	if (written && logfile)
+		fflush(logfile);
+
+	return written;
+}
+
+static void *cgre_log_thread(void *arg)
+{
+	__u64 count;
+	ssize_t ret;
+
+	pthread_mutex_lock(&log_lock);
+	for (;;) {
+		pthread_mutex_unlock(&log_lock);
+		if (cgre_log_drain()) {
+			pthread_mutex_lock(&log_lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&log_lock);
+		log_idle_passes++;
+		pthread_cond_broadcast(&log_cond);
+		if (log_stop)
+			break;
+
+		/*
+		 * Sleep until a ring becomes non-empty or the thread is
+		 * flushed or stopped.  A wakeup which raced with the drain
+		 * above only causes an extra pass.
+		 */
+		pthread_mutex_unlock(&log_lock);
+		ret = read(log_efd, &count, sizeof(count));
+		(void)ret;
+		pthread_mutex_lock(&log_lock);
+	}
+	pthread_mutex_unlock(&log_lock);
+
+	return NULL;
+}
+
+/**
+ * Start the log thread.  From now on, flog() only formats the messages into
+ * per-thread rings and the log thread writes them to the log file and to
+ * syslog.  Must be called after the daemon has forked.
+ */
+static void cgre_log_start_async(void)
+{
+	sigset_t sigset, oldset;
+	int ret;
+
+	log_efd = eventfd(0, EFD_CLOEXEC);
+	if (log_efd < 0) {
+		flog(LOG_WARNING, "Failed to start the log thread: %s\n",
+		     strerror(errno));
+		return;
+	}
+
+	ret = pthread_key_create(&log_ring_key, cgre_log_release_ring);
+	if (ret) {
+		flog(LOG_WARNING, "Failed to start the log thread: %s\n",
+		     strerror(ret));
+		goto close_efd;
+	}
+
+	/* All signals are handled by the event loop, never by this thread */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	ret = pthread_create(&log_thread, NULL, cgre_log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret) {
+		flog(LOG_WARNING, "Failed to start the log thread: %s\n",
+		     strerror(ret));
+		pthread_key_delete(log_ring_key);
+		goto close_efd;
+	}
+
+	log_async = 1;
+	return;
+
+close_efd:
+	close(log_efd);
+	log_efd = -1;
+}
+
+/**
+ * Wait until the log thread has written out all records queued by the
+ * current thread, so the log file can be written to directly.
+ */
+static void cgre_log_flush(void)
+{
+	unsigned long passes;
+
+	if (!log_async)
+		return;
+
+	/*
+	 * The first idle pass may have started before our last record was
+	 * queued, the second one has not.
+	 */
+	pthread_mutex_lock(&log_lock);
+	passes = log_idle_passes;
+	while (log_idle_passes - passes < 2) {
+		cgre_log_wake();
+		pthread_cond_wait(&log_cond, &log_lock);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * Write out all queued records and stop the log thread.  Logging is
+ * synchronous afterwards.
+ */
+static void cgre_log_stop(void)
+{
+	if (!log_async)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	log_stop = 1;
+	cgre_log_wake();
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_join(log_thread, NULL);
+	log_async = 0;
+	close(log_efd);
+	log_efd = -1;
+
+	if (log_dropped)
+		flog(LOG_WARNING, "Dropped %lu log messages in total\n",
+		     log_dropped);
+}
+
 /**
  * Prints a formatted message (like vprintf()) to all log destinations.
- * Flushes the file stream's buffer so that the message is immediately
- * readable.
+ * Once the log thread runs, the message is only queued and written out
+ * asynchronously.  Otherwise the file stream's buffer is flushed so that the
+ * message is immediately readable.
  *	@param level The log level (LOG_EMERG ... LOG_DEBUG)
  *	@param format The format for the message (vprintf style)
  *	@param ap Any args to format (vprintf style)
@@ -131,6 +576,9 @@ void flog_write(int level, const char *format,  va_list ap)
 	if (level > loglevel)
 		return;
 
+	if (log_async && !cgre_log_queue(level, format, ap))
+		return;
+
 	/* copy the argument list if needed - it can be processed only once */
 	if (logfile && logfacility) {
 		copy = 1;
@@ -285,9 +733,11 @@ static int cgre_was_parent_changed_when_forking(const struct proc_event *ev)
 		timestamp_parent = array_pi.parent_info[i]->timestamp;
 		if (timestamp_child > timestamp_parent)
 			continue;
+		cgre_stats_inc(CGRE_STAT_PARENT_INFO_HITS);
 		return 1;
 	}
 
+	cgre_stats_inc(CGRE_STAT_PARENT_INFO_MISSES);
 	return 0;
 }
 
@@ -304,6 +754,24 @@ struct array_unchanged {
 
 struct array_unchanged array_unch;
 
+struct pending_event {
+	pid_t pid;
+	int pidfd;	/* opened when the first event arrived, or -1 */
+	int type;
+	/* Fork event whose parent was pending, see cgre_process_event() */
+	int check_parent;
+	__u64 deadline;
+	struct proc_event ev;
+};
+
+struct array_pending {
+	int index;
+	int num_allocation;
+	struct pending_event *events;
+};
+
+struct array_pending array_pend;
+
 static int cgre_store_unchanged_process(pid_t pid, int flags)
 {
 	int i;
@@ -330,6 +798,10 @@ static int cgre_store_unchanged_process(pid_t pid, int flags)
 	array_unch.proc[array_unch.index].flags = flags;
 	array_unch.index++;
 
+	/* A running scan must not move the process anymore */
+	if (scan_handle)
+		cgroup_change_all_cgroups_skip(&scan_handle, pid);
+
 	flog(LOG_DEBUG, "Store the unchanged process (PID: %d, FLAGS: %d)\n",
 			pid, flags);
 
@@ -362,9 +834,11 @@ static int cgre_is_unchanged_process(pid_t pid)
 	for (i = 0; i < array_unch.index; i++) {
 		if (array_unch.proc[i].pid != pid)
 			continue;
+		cgre_stats_inc(CGRE_STAT_UNCHANGED_HITS);
 		return 1;
 	}
 
+	cgre_stats_inc(CGRE_STAT_UNCHANGED_MISSES);
 	return 0;
 }
 
@@ -384,82 +858,251 @@ static int cgre_is_unchanged_child(pid_t pid)
 }
 
 /**
- * Process an event from the kernel, and determine the correct UID/GID/PID to
- * pass to libcgroup.  Then, libcgroup will decide the cgroup to move the PID
- * to, if any.
- *	@param ev The event to process
- *	@param type The type of event to process (part of ev)
+ * Find the slot of a batched protocol connection.
+ *	@param fd The client connection
+ *	@return the slot index, -1 if the connection is not open
+ */
+static int cgre_find_batch_client(int fd)
+{
+	int i;
+
+	for (i = 0; i < batch_clients_count; i++) {
+		if (batch_clients[i].fd == fd)
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Close a batched protocol connection and release its slot.
+ *	@param slot The slot index of the connection
+ *	@param epfd The epoll instance the connection is registered with
+ */
+static void cgre_close_batch_client(int slot, int epfd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, batch_clients[slot].fd, NULL);
+	close(batch_clients[slot].fd);
+	batch_clients[slot] = batch_clients[--batch_clients_count];
+}
+
+/**
+ * Close the batched protocol connections which have not sent any message
+ * within BATCH_CLIENT_IDLE_NS.  The library reconnects transparently on its
+ * next request, so an idle client only loses its slot.
+ *	@param epfd The epoll instance the connections are registered with
+ */
+static void cgre_expire_batch_clients(int epfd)
+{
+	__u64 now = cgre_stats_now();
+	int i;
+
+	for (i = batch_clients_count - 1; i >= 0; i--) {
+		if (now - batch_clients[i].last_ns < BATCH_CLIENT_IDLE_NS)
+			continue;
+		flog(LOG_DEBUG, "Closing idle batch client %d\n",
+		     batch_clients[i].fd);
+		cgre_close_batch_client(i, epfd);
+	}
+}
+
+/**
+ * Find the slot of a legacy protocol connection.
+ *	@param fd The client connection
+ *	@return the slot index, -1 if the connection is not open
+ */
+static int cgre_find_stream_client(int fd)
+{
+	int i;
+
+	for (i = 0; i < stream_clients_count; i++) {
+		if (stream_clients[i].fd == fd)
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Close a legacy protocol connection and release its slot.
+ *	@param slot The slot index of the connection
+ *	@param epfd The epoll instance the connection is registered with
+ */
+static void cgre_close_stream_client(int slot, int epfd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, stream_clients[slot].fd, NULL);
+	close(stream_clients[slot].fd);
+	stream_clients[slot] = stream_clients[--stream_clients_count];
+}
+
+/**
+ * Close the legacy protocol connections whose request is not complete
+ * within STREAM_CLIENT_TIMEOUT_NS.
+ *	@param epfd The epoll instance the connections are registered with
+ */
+static void cgre_expire_stream_clients(int epfd)
+{
+	__u64 now = cgre_stats_now();
+	int i;
+
+	for (i = stream_clients_count - 1; i >= 0; i--) {
+		if (now - stream_clients[i].start_ns < STREAM_CLIENT_TIMEOUT_NS)
+			continue;
+		flog(LOG_WARNING, "Warning: closing stalled client %d\n",
+		     stream_clients[i].fd);
+		cgre_close_stream_client(i, epfd);
+	}
+}
+
+/**
+ * Periodic maintenance of the daemon caches.  Drop the parent info entries
+ * which are too old to match any pending fork event, forget unchanged
+ * processes which have exited without us seeing their exit event and close
+ * the client connections which have been idle for too long.
+ *	@param epfd The epoll instance the batch clients are registered with
+ */
+static void cgre_run_maintenance(int epfd)
+{
+	struct timespec tp;
+	__u64 uptime_ns;
+	int i;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == 0) {
+		uptime_ns = ((__u64)tp.tv_sec * 1000 * 1000 * 1000) +
+			    tp.tv_nsec;
+		if (uptime_ns > PARENT_INFO_EXPIRY_NS)
+			cgre_remove_old_parent_info(uptime_ns -
+						    PARENT_INFO_EXPIRY_NS);
+	}
+
+	for (i = array_unch.index - 1; i >= 0; i--) {
+		if (kill(array_unch.proc[i].pid, 0) == 0 || errno != ESRCH)
+			continue;
+		cgre_remove_unchanged_process(array_unch.proc[i].pid);
+	}
+
+	cgre_expire_stream_clients(epfd);
+	cgre_expire_batch_clients(epfd);
+}
+
+/**
+ * Check whether the process referred to by a pidfd is still running.
+ *	@param pidfd The pidfd
+ *	@return 1 if the process exists, 0 otherwise
+ */
+static int cgre_pidfd_alive(int pidfd)
+{
+#ifdef __NR_pidfd_send_signal
+	if (syscall(__NR_pidfd_send_signal, pidfd, 0, NULL, 0) < 0 &&
+	    errno == ESRCH)
+		return 0;
+#endif
+	return 1;
+}
+
+/**
+ * Open a pidfd for the process an event refers to, as soon as the event
+ * arrives.  The pidfd keeps referring to that process, even if the pid is
+ * reused later.
+ *	@param pid The process id
+ *	@return the pidfd, -1 with errno set to ESRCH if the process is gone,
+ *	-1 with another errno if the kernel has no pidfd support
+ */
+static int cgre_open_pidfd(pid_t pid)
+{
+#ifdef __NR_pidfd_open
+	/* Replayed processes exist only in the fake procfs */
+	if (!cgre_replaying)
+		return syscall(__NR_pidfd_open, pid, 0);
+#endif
+	errno = ENOSYS;
+	return -1;
+}
+
+/**
+ * Pin the process a pidfd refers to.  The /proc/<pid> directory is opened
+ * after the pidfd.  If the pidfd still refers to a running process
+ * afterwards, the directory belongs to the same process and all further
+ * procfs reads through it are immune to pid reuse.
+ *	@param pid The process id
+ *	@param pidfd The pidfd of the process, -1 if there is none
+ *	@return the /proc/<pid> directory descriptor, -1 if the process is gone
+ */
+static int cgre_pin_process(pid_t pid, int pidfd)
+{
+	int procfd;
+
+	procfd = cg_open_procfd(pid);
+	if (procfd < 0)
+		return -1;
+
+	if (pidfd >= 0 && !cgre_pidfd_alive(pidfd)) {
+		close(procfd);
+		return -1;
+	}
+
+	return procfd;
+}
+
+/**
+ * Read the credentials and the executable of a process and let libcgroup
+ * move it to the cgroup given by the rules.
+ *	@param pid The process to classify
+ *	@param pidfd The pidfd of the process, closed by this function, -1 if
+ *	there is none
+ *	@param ev The event which triggered the classification
+ *	@param type The type of the event (part of ev)
  *	@return 0 on success, > 0 on failure
  */
-int cgre_process_event(const struct proc_event *ev, const int type)
+static int cgre_classify_process(pid_t pid, int pidfd,
+				 const struct proc_event *ev, const int type)
 {
-	pid_t pid = 0, log_pid = 0;
 	uid_t euid, log_uid = 0;
 	gid_t egid, log_gid = 0;
-	pid_t ppid, cpid;
+	pid_t log_pid = 0;
+	int procfd;
 	char *procname;
+	__u64 start_ns;
+	int reused = 0;
 
 	int ret = 0;
 
-	switch (type) {
-	case PROC_EVENT_UID:
-	case PROC_EVENT_GID:
+	start_ns = cgre_stats_now();
+
+	procfd = cgre_pin_process(pid, pidfd);
+	if (procfd < 0) {
+		/* The process finished already, that is not a problem. */
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_EXITED);
+		if (pidfd >= 0)
+			close(pidfd);
+		return 0;
+	}
+
+	ret = cg_get_uid_gid_from_procfd(procfd, &euid, &egid);
+	if (ret == ECGROUPNOTEXIST) {
 		/*
-		 * If the unchanged process, the daemon should not change the
-		 * cgroup of the process.
-		 */
-		if (cgre_is_unchanged_process(ev->event_data.id.process_pid))
-			return 0;
-		pid = ev->event_data.id.process_pid;
-		break;
-	case PROC_EVENT_FORK:
-		ppid = ev->event_data.fork.parent_pid;
-		cpid = ev->event_data.fork.child_pid;
-		if (cgre_is_unchanged_child(ppid)) {
-			if (cgre_store_unchanged_process(cpid,
-					CGROUP_DAEMON_UNCHANGE_CHILDREN))
-				return 1;
-		}
-
-		/*
-		 * If this process was forked while changing parent's cgroup,
-		 * this process's cgroup also should be changed.
-		 */
-		if (!cgre_was_parent_changed_when_forking(ev))
-			return 0;
-		pid = ev->event_data.fork.child_pid;
-		break;
-	case PROC_EVENT_EXIT:
-		cgre_remove_unchanged_process(ev->event_data.exit.process_pid);
-		return 0;
-	case PROC_EVENT_EXEC:
-		/*
-		 * If the unchanged process, the daemon should not change the
-		 * cgroup of the process.
+		 * cg_get_uid_gid_from_procfd() returns ECGROUPNOTEXIST
+		 * if a process finished and that is not a problem.
 		 */
-		if (cgre_is_unchanged_process(ev->event_data.exec.process_pid))
-			return 0;
-		pid = ev->event_data.exec.process_pid;
-		break;
-	default:
-		break;
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_EXITED);
+		ret = 0;
+		goto close_fds;
+	} else if (ret) {
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_FAILED);
+		goto close_fds;
 	}
 
-	ret = cgroup_get_uid_gid_from_procfs(pid, &euid, &egid);
-	if (ret == ECGROUPNOTEXIST)
-		/*
-		 * cgroup_get_uid_gid_from_procfs() returns ECGROUPNOTEXIST
-		 * if a process finished and that is not a problem.
-		 */
-		return 0;
-	else if (ret)
-		return ret;
+	ret = cg_get_procname_from_procfd(procfd, &procname);
+	if (ret == ECGROUPNOTEXIST) {
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_EXITED);
+		ret = 0;
+		goto close_fds;
+	} else if (ret) {
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_FAILED);
+		goto close_fds;
+	}
 
-	ret = cgroup_get_procname_from_procfs(pid, &procname);
-	if (ret == ECGROUPNOTEXIST)
-		return 0;
-	else if (ret)
-		return ret;
+	cgre_stats_record(CGRE_HIST_PROCFS_READ, cgre_stats_now() - start_ns);
 
 	/*
 	 * Now that we have the UID, the GID, and the PID, we can make a call
@@ -489,19 +1132,43 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 		break;
 	}
 
+	/*
+	 * Do not move the pid if the process has exited meanwhile, it might
+	 * already belong to somebody else.
+	 */
+	if (pidfd >= 0 && !cgre_pidfd_alive(pidfd)) {
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_EXITED);
+		ret = 0;
+		goto free_procname;
+	}
+
+	start_ns = cgre_stats_now();
 	ret = cgroup_change_cgroup_flags(euid, egid, procname, pid,
 					 CGFLAG_USECACHE);
+	cgre_stats_record(CGRE_HIST_CGROUP_CHANGE,
+			  cgre_stats_now() - start_ns);
+
+	/*
+	 * The kernel moves processes by pid only.  If the process exited
+	 * since the check above and its pid was taken by another process,
+	 * the latter was moved instead.
+	 */
+	if (pidfd >= 0 && !cgre_pidfd_alive(pidfd) && kill(pid, 0) == 0)
+		reused = 1;
+
 	if (ret == ECGOTHER) {
 		/*
 		 * A process finished already but we may have missed changing it,
 		 * make sure to apply to forked children.
 		 */
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_EXITED);
 		if (cgroup_get_last_errno() == ESRCH ||
 		    cgroup_get_last_errno() == ENOENT)
 			ret = cgre_store_parent_info(pid);
 		else
 			ret = 0;
 	} else if (ret) {
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_FAILED);
 		flog(LOG_WARNING,
 		     "Cgroup change for PID: %d, UID: %d, GID: %d, ",
 		     log_pid, log_uid, log_gid);
@@ -512,13 +1179,293 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 		     "Cgroup change for PID: %d, UID: %d, GID: %d, ",
 		     log_pid, log_uid, log_gid);
 		flog(LOG_INFO, "PROCNAME: %s OK\n", procname);
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_OK);
+		cgre_stats_record(CGRE_HIST_EVENT_LATENCY,
+				  cgre_stats_now() - ev->timestamp_ns);
 		ret = cgre_store_parent_info(pid);
 	}
+
+free_procname:
 	free(procname);
+close_fds:
+	close(procfd);
+	if (pidfd >= 0)
+		close(pidfd);
+
+	/* Classify the process which reused the pid by its own details */
+	if (reused) {
+		flog(LOG_WARNING, "PID %d was reused while it was moved\n",
+		     pid);
+		pidfd = cgre_open_pidfd(pid);
+		if (pidfd >= 0 || errno != ESRCH)
+			ret = cgre_classify_process(pid, pidfd, ev,
+						    PROC_EVENT_EXEC);
+	}
 
 	return ret;
 }
 
+/**
+ * Drop the pending classification of a process, if there is one.
+ *	@param pid The process id
+ */
+static void cgre_remove_pending_event(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < array_pend.index; i++) {
+		if (array_pend.events[i].pid != pid)
+			continue;
+
+		if (array_pend.events[i].pidfd >= 0)
+			close(array_pend.events[i].pidfd);
+		memmove(&array_pend.events[i], &array_pend.events[i + 1],
+			sizeof(struct pending_event) *
+			(array_pend.index - i - 1));
+		array_pend.index--;
+		return;
+	}
+}
+
+/**
+ * Check whether the classification of a process is pending.
+ *	@param pid The process id
+ *	@return 1 if an event of the process is queued, 0 otherwise
+ */
+static int cgre_is_pending_event(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < array_pend.index; i++) {
+		if (array_pend.events[i].pid == pid)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Arm the coalescing timer to expire after the given time.
+ *	@param delay_ns The delay in nanoseconds
+ */
+static void cgre_arm_coalesce_timer(__u64 delay_ns)
+{
+	struct itimerspec its;
+
+	if (delay_ns == 0)
+		delay_ns = 1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = delay_ns / (1000 * 1000 * 1000);
+	its.it_value.tv_nsec = delay_ns % (1000 * 1000 * 1000);
+
+	if (timerfd_settime(coalesce_tfd, 0, &its, NULL) < 0)
+		flog(LOG_WARNING, "Failed to arm coalescing timer: %s\n",
+		     strerror(errno));
+}
+
+/**
+ * Queue the classification of a process until the coalescing window, which
+ * starts with the first event, expires.  Further events for the same process
+ * within the window replace the queued one, so the process is classified
+ * only once, with its final credentials and executable.  The process is
+ * pinned with a pidfd right away, so the pid cannot be reused by another
+ * process during the window.
+ *	@param pid The process to classify
+ *	@param ev The event which triggered the classification
+ *	@param type The type of the event (part of ev)
+ *	@param check_parent Classify the process only if its parent was changed
+ *	after the fork
+ *	@return 0 on success, > 0 on failure
+ */
+static int cgre_defer_event(pid_t pid, const struct proc_event *ev,
+			    const int type, int check_parent)
+{
+	struct pending_event *pend;
+	struct timespec tp;
+	__u64 uptime_ns;
+	int pidfd;
+	int i;
+
+	for (i = 0; i < array_pend.index; i++) {
+		pend = &array_pend.events[i];
+		if (pend->pid != pid)
+			continue;
+
+		flog(LOG_DEBUG, "Coalesced event for PID: %d\n", pid);
+		cgre_stats_inc(CGRE_STAT_COALESCED);
+		pend->type = type;
+		pend->check_parent = check_parent;
+		memcpy(&pend->ev, ev, sizeof(*ev));
+		return 0;
+	}
+
+	pidfd = cgre_open_pidfd(pid);
+	if (pidfd < 0 && errno == ESRCH) {
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_EXITED);
+		return 0;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) < 0)
+		return cgre_classify_process(pid, pidfd, ev, type);
+	uptime_ns = ((__u64)tp.tv_sec * 1000 * 1000 * 1000) + tp.tv_nsec;
+
+	if (array_pend.index >= array_pend.num_allocation) {
+		int alloc = array_pend.num_allocation + NUM_PER_REALLOCATIOM;
+		void *new_array = realloc(array_pend.events,
+					  sizeof(struct pending_event) * alloc);
+		if (!new_array) {
+			flog(LOG_WARNING, "Failed to allocate memory\n");
+			return cgre_classify_process(pid, pidfd, ev, type);
+		}
+		array_pend.events = new_array;
+		array_pend.num_allocation = alloc;
+	}
+
+	pend = &array_pend.events[array_pend.index];
+	pend->pid = pid;
+	pend->pidfd = pidfd;
+	pend->type = type;
+	pend->check_parent = check_parent;
+	pend->deadline = uptime_ns + (__u64)coalesce_usec * 1000;
+	memcpy(&pend->ev, ev, sizeof(*ev));
+	array_pend.index++;
+
+	if (array_pend.index > cgre_stats[CGRE_STAT_PENDING_EVENTS_MAX])
+		cgre_stats_set(CGRE_STAT_PENDING_EVENTS_MAX, array_pend.index);
+
+	if (array_pend.index == 1)
+		cgre_arm_coalesce_timer((__u64)coalesce_usec * 1000);
+
+	return 0;
+}
+
+/**
+ * Classify the processes whose coalescing window has expired and re-arm the
+ * timer for the rest.  The pending events are sorted by their deadline,
+ * because all windows have the same length.
+ */
+static void cgre_flush_pending_events(void)
+{
+	struct pending_event pend;
+	struct timespec tp;
+	__u64 uptime_ns;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) < 0)
+		uptime_ns = (__u64)-1;
+	else
+		uptime_ns = ((__u64)tp.tv_sec * 1000 * 1000 * 1000) +
+			    tp.tv_nsec;
+
+	while (array_pend.index > 0 &&
+	       array_pend.events[0].deadline <= uptime_ns) {
+		memcpy(&pend, &array_pend.events[0], sizeof(pend));
+
+		/* The pidfd is handed over to cgre_classify_process() */
+		array_pend.events[0].pidfd = -1;
+		cgre_remove_pending_event(pend.pid);
+
+		/*
+		 * The process may have become unchanged meanwhile, and the
+		 * parent has been classified by now, if it was moved.
+		 */
+		if (cgre_is_unchanged_process(pend.pid) ||
+		    (pend.check_parent &&
+		     !cgre_was_parent_changed_when_forking(&pend.ev))) {
+			if (pend.pidfd >= 0)
+				close(pend.pidfd);
+			continue;
+		}
+
+		cgre_classify_process(pend.pid, pend.pidfd, &pend.ev,
+				      pend.type);
+	}
+
+	if (array_pend.index > 0)
+		cgre_arm_coalesce_timer(array_pend.events[0].deadline -
+					uptime_ns);
+}
+
+/**
+ * Process an event from the kernel, and determine the correct UID/GID/PID to
+ * pass to libcgroup.  Then, libcgroup will decide the cgroup to move the PID
+ * to, if any.
+ *	@param ev The event to process
+ *	@param type The type of event to process (part of ev)
+ *	@return 0 on success, > 0 on failure
+ */
+int cgre_process_event(const struct proc_event *ev, const int type)
+{
+	pid_t ppid, cpid;
+	pid_t pid = 0;
+	int pidfd;
+
+	switch (type) {
+	case PROC_EVENT_UID:
+	case PROC_EVENT_GID:
+		/*
+		 * If the unchanged process, the daemon should not change the
+		 * cgroup of the process.
+		 */
+		if (cgre_is_unchanged_process(ev->event_data.id.process_pid))
+			return 0;
+		pid = ev->event_data.id.process_pid;
+		break;
+	case PROC_EVENT_FORK:
+		ppid = ev->event_data.fork.parent_pid;
+		cpid = ev->event_data.fork.child_pid;
+		if (cgre_is_unchanged_child(ppid)) {
+			if (cgre_store_unchanged_process(cpid,
+					CGROUP_DAEMON_UNCHANGE_CHILDREN))
+				return 1;
+		}
+
+		/*
+		 * The classification of the parent is still pending, so there
+		 * is no parent info yet.  Queue the child behind the parent
+		 * and check the parent info once the parent has been handled.
+		 */
+		if (coalesce_usec > 0 && coalesce_tfd >= 0 &&
+		    cgre_is_pending_event(ppid))
+			return cgre_defer_event(cpid, ev, type, 1);
+
+		/*
+		 * If this process was forked while changing parent's cgroup,
+		 * this process's cgroup also should be changed.
+		 */
+		if (!cgre_was_parent_changed_when_forking(ev))
+			return 0;
+		pid = ev->event_data.fork.child_pid;
+		break;
+	case PROC_EVENT_EXIT:
+		cgre_remove_unchanged_process(ev->event_data.exit.process_pid);
+		cgre_remove_pending_event(ev->event_data.exit.process_pid);
+		return 0;
+	case PROC_EVENT_EXEC:
+		/*
+		 * If the unchanged process, the daemon should not change the
+		 * cgroup of the process.
+		 */
+		if (cgre_is_unchanged_process(ev->event_data.exec.process_pid))
+			return 0;
+		pid = ev->event_data.exec.process_pid;
+		break;
+	default:
+		break;
+	}
+
+	if (coalesce_usec > 0 && coalesce_tfd >= 0)
+		return cgre_defer_event(pid, ev, type, 0);
+
+	pidfd = cgre_open_pidfd(pid);
+	if (pidfd < 0 && errno == ESRCH) {
+		cgre_stats_inc(CGRE_STAT_CLASSIFY_EXITED);
+		return 0;
+	}
+
+	return cgre_classify_process(pid, pidfd, ev, type);
+}
+
 /**
  * Handle a netlink message.  In the event of PROC_EVENT_UID or PROC_EVENT_GID,
  * we pass the event along to cgre_process_event for further processing.  All
@@ -536,8 +1483,11 @@ static int cgre_handle_msg(struct cn_msg *cn_hdr)
 
 	/* Get the event data.  We only care about two event types. */
 	ev = (struct proc_event *)cn_hdr->data;
+	cgre_record_event(ev);
+
 	switch (ev->what) {
 	case PROC_EVENT_UID:
+		cgre_stats_inc(CGRE_STAT_EVENT_UID);
 		flog(LOG_DEBUG,
 		     "UID Event: PID = %d, tGID = %d, rUID = %d, eUID = %d\n",
 		     ev->event_data.id.process_pid,
@@ -547,6 +1497,7 @@ static int cgre_handle_msg(struct cn_msg *cn_hdr)
 		ret = cgre_process_event(ev, PROC_EVENT_UID);
 		break;
 	case PROC_EVENT_GID:
+		cgre_stats_inc(CGRE_STAT_EVENT_GID);
 		flog(LOG_DEBUG,
 		     "GID Event: PID = %d, tGID = %d, rGID = %d, eGID = %d\n",
 		     ev->event_data.id.process_pid,
@@ -556,144 +1507,1007 @@ static int cgre_handle_msg(struct cn_msg *cn_hdr)
 		ret = cgre_process_event(ev, PROC_EVENT_GID);
 		break;
 	case PROC_EVENT_FORK:
+		cgre_stats_inc(CGRE_STAT_EVENT_FORK);
 		ret = cgre_process_event(ev, PROC_EVENT_FORK);
 		break;
 	case PROC_EVENT_EXIT:
+		cgre_stats_inc(CGRE_STAT_EVENT_EXIT);
 		ret = cgre_process_event(ev, PROC_EVENT_EXIT);
 		break;
 	case PROC_EVENT_EXEC:
+		cgre_stats_inc(CGRE_STAT_EVENT_EXEC);
 		flog(LOG_DEBUG, "EXEC Event: PID = %d, tGID = %d\n",
 		     ev->event_data.exec.process_pid,
 		     ev->event_data.exec.process_tgid);
 		ret = cgre_process_event(ev, PROC_EVENT_EXEC);
 		break;
 	default:
+		cgre_stats_inc(CGRE_STAT_EVENT_OTHER);
 		break;
 	}
 
 	return ret;
 }
 
-static int cgre_receive_netlink_msg(int sk_nl)
+/**
+ * Start the reclassification of all running processes.  It proceeds in
+ * chunks from the event loop, see cgre_continue_scan().
+ *	@return 0 on success, > 0 on error
+ */
+static int cgre_start_scan(void)
+{
+	int i, ret;
+
+	ret = cgroup_change_all_cgroups_begin(0, &scan_handle);
+	if (ret) {
+		flog(LOG_WARNING, "Failed to initialize running tasks: %s\n",
+		     cgroup_strerror(ret));
+		scan_handle = NULL;
+		return ret;
+	}
+	scan_logged = 0;
+	scan_again = 0;
+
+	/* The processes registered as unchanged (sticky) are left alone */
+	for (i = 0; i < array_unch.index; i++)
+		cgroup_change_all_cgroups_skip(&scan_handle,
+					       array_unch.proc[i].pid);
+
+	return 0;
+}
+
+/**
+ * Reclassify the next chunk of the running processes.  New process events
+ * are handled before each chunk, so they are not delayed by a large number
+ * of processes running at startup.  The scan handle is released once all
+ * processes are handled.
+ */
+static void cgre_continue_scan(void)
+{
+	struct cgroup_change_all_stats stats;
+	int ret;
+
+	ret = cgroup_change_all_cgroups_next(&scan_handle, SCAN_CHUNK_SIZE,
+					     &stats);
+	if (ret && ret != ECGEOF) {
+		flog(LOG_WARNING, "Failed to initialize running tasks: %s\n",
+		     cgroup_strerror(ret));
+		cgroup_change_all_cgroups_end(&scan_handle);
+		return;
+	}
+
+	if (stats.total && stats.done * 10 / stats.total > scan_logged) {
+		scan_logged = stats.done * 10 / stats.total;
+		flog(LOG_DEBUG, "Scanned %d of %d running processes\n",
+		     stats.done, stats.total);
+	}
+
+	if (!ret)
+		return;
+
+	flog(LOG_INFO, "Scanned %d running processes in %llu ms, ", stats.done,
+	     stats.elapsed_usec / 1000);
+	flog(LOG_INFO, "%d could not be moved\n", stats.failed);
+	cgroup_change_all_cgroups_end(&scan_handle);
+
+	if (scan_again)
+		cgre_start_scan();
+}
+
+/**
+ * Reclassify all running processes after the kernel dropped proc connector
+ * messages.  The processes are rescanned in chunks from the event loop,
+ * like at startup.  If a scan is running already, the processes it handled
+ * may have lost events too, so another scan follows once it completes.
+ */
+static void cgre_resync_processes(void)
 {
-	struct sockaddr_nl from_nla;
-	socklen_t from_nla_len;
+	flog(LOG_WARNING, "Netlink events were lost, rescanning processes\n");
+	cgre_stats_inc(CGRE_STAT_RESYNCS);
+
+	if (scan_handle)
+		scan_again = 1;
+	else
+		cgre_start_scan();
+}
+
+/**
+ * Set the receive buffer of the netlink socket.  SO_RCVBUFFORCE allows us to
+ * exceed net.core.rmem_max, fall back to SO_RCVBUF if it is not permitted.
+ *	@param sk_nl The netlink socket
+ *	@param size Requested buffer size in bytes, 0 keeps the kernel default
+ */
+static void cgre_set_netlink_rcvbuf(int sk_nl, int size)
+{
+	socklen_t len = sizeof(size);
+
+	if (size <= 0)
+		return;
+
+	if (setsockopt(sk_nl, SOL_SOCKET, SO_RCVBUFFORCE, &size, len) < 0 &&
+	    setsockopt(sk_nl, SOL_SOCKET, SO_RCVBUF, &size, len) < 0) {
+		flog(LOG_WARNING, "Failed to set netlink receive buffer: %s\n",
+		     strerror(errno));
+		return;
+	}
+
+	if (getsockopt(sk_nl, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0)
+		flog(LOG_DEBUG, "Netlink receive buffer set to %d bytes\n",
+		     size);
+}
+
+/**
+ * Process one datagram received from the netlink socket.
+ *	@param msg The received message
+ *	@param recv_len Length of the received data
+ *	@return 0 on success, > 0 on error
+ */
+static int cgre_process_netlink_datagram(struct msghdr *msg, int recv_len)
+{
+	struct sockaddr_nl *from_nla = msg->msg_name;
 	struct cn_msg *cn_hdr;
 	struct nlmsghdr *nlh;
+
+	if (recv_len < 1)
+		return 0;
+
+	cgre_stats_inc(CGRE_STAT_NETLINK_DATAGRAMS);
+
+	if (msg->msg_namelen != sizeof(*from_nla)) {
+		flog(LOG_ERR, "Bad address size reading netlink socket\n");
+		return 0;
+	}
+
+	if (from_nla->nl_groups != CN_IDX_PROC || from_nla->nl_pid != 0)
+		return 0;
+
+	if (msg->msg_flags & MSG_TRUNC) {
+		cgre_stats_inc(CGRE_STAT_NETLINK_TRUNCATED);
+		flog(LOG_ERR, "Truncated netlink message dropped\n");
+		return 0;
+	}
+
+	nlh = (struct nlmsghdr *)msg->msg_iov->iov_base;
+	while (NLMSG_OK(nlh, recv_len)) {
+		cn_hdr = NLMSG_DATA(nlh);
+
+		if (nlh->nlmsg_type == NLMSG_NOOP) {
+			nlh = NLMSG_NEXT(nlh, recv_len);
+			continue;
+		}
+		if (nlh->nlmsg_type == NLMSG_OVERRUN) {
+			cgre_stats_inc(CGRE_STAT_NETLINK_OVERRUNS);
+			cgre_resync_processes();
+		}
+		if ((nlh->nlmsg_type == NLMSG_ERROR) ||
+		    (nlh->nlmsg_type == NLMSG_OVERRUN))
+			break;
+		if (cgre_handle_msg(cn_hdr) < 0)
+			return 1;
+		if (nlh->nlmsg_type == NLMSG_DONE)
+			break;
+		nlh = NLMSG_NEXT(nlh, recv_len);
+	}
+
+	return 0;
+}
+
+/**
+ * Attach a socket filter to the netlink socket, so the kernel drops the proc
+ * connector events we never act on before they are queued on the socket.
+ * Messages which are not proc connector events are always accepted.
+ *	@param sk_nl The netlink socket
+ */
+static void cgre_attach_netlink_filter(int sk_nl)
+{
+	const int cn_off = NLMSG_LENGTH(0);
+	const int ev_off = cn_off + offsetof(struct cn_msg, data) +
+			   offsetof(struct proc_event, what);
+	struct sock_filter filter[] = {
+		/* Accept anything that is not a proc connector event */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+			 offsetof(struct nlmsghdr, nlmsg_type)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(NLMSG_DONE), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			 cn_off + offsetof(struct cn_msg, id.idx)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_IDX_PROC), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			 cn_off + offsetof(struct cn_msg, id.val)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(CN_VAL_PROC), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+		/* Keep only the event types handled by cgre_handle_msg() */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ev_off),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_FORK), 5, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXEC), 4, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_UID), 3, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_GID), 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXIT), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	};
+	struct sock_fprog fprog = {
+		.len = sizeof(filter) / sizeof(filter[0]),
+		.filter = filter,
+	};
+
+	if (setsockopt(sk_nl, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+		       sizeof(fprog)) < 0) {
+		flog(LOG_WARNING, "Failed to attach netlink socket filter: %s\n",
+		     strerror(errno));
+		return;
+	}
+
+	flog(LOG_DEBUG, "Netlink socket filter attached\n");
+}
+
+/**
+ * Send a PROC_CN_MCAST_LISTEN request to the proc connector.
+ *	@param sk_nl The netlink socket
+ *	@param filtered Subscribe to the CGRE_PROC_EVENTS types only
+ *	@return 0 on success, -1 on error
+ */
+static int cgre_send_mcast_listen(int sk_nl, int filtered)
+{
+	struct cgre_proc_input *pinput;
+	enum proc_cn_mcast_op *mcop_msg;
+	struct nlmsghdr *nl_hdr;
+	struct cn_msg *cn_hdr;
 	char buff[BUFF_SIZE];
-	size_t recv_len;
 
+	nl_hdr = (struct nlmsghdr *)buff;
+	cn_hdr = (struct cn_msg *)NLMSG_DATA(nl_hdr);
 	memset(buff, 0, sizeof(buff));
-	from_nla_len = sizeof(from_nla);
-	recv_len = recvfrom(sk_nl, buff, sizeof(buff), 0,
-		(struct sockaddr *)&from_nla, &from_nla_len);
-	if (recv_len == ENOBUFS) {
-		flog(LOG_ERR, "ERROR: NETLINK BUFFER FULL, MESSAGE DROPPED!\n");
-		return 0;
+
+	if (filtered) {
+		flog(LOG_DEBUG, "Sending proc connector: ");
+		flog(LOG_DEBUG, "PROC_CN_MCAST_LISTEN with mask 0x%x...\n",
+		     CGRE_PROC_EVENTS);
+		pinput = (struct cgre_proc_input *)&cn_hdr->data[0];
+		pinput->mcast_op = PROC_CN_MCAST_LISTEN;
+		pinput->event_type = CGRE_PROC_EVENTS;
+		nl_hdr->nlmsg_len = SEND_FILTER_MESSAGE_LEN;
+		cn_hdr->len = sizeof(struct cgre_proc_input);
+	} else {
+		flog(LOG_DEBUG,
+		     "Sending proc connector: PROC_CN_MCAST_LISTEN...\n");
+		mcop_msg = (enum proc_cn_mcast_op *)&cn_hdr->data[0];
+		*mcop_msg = PROC_CN_MCAST_LISTEN;
+		nl_hdr->nlmsg_len = SEND_MESSAGE_LEN;
+		cn_hdr->len = sizeof(enum proc_cn_mcast_op);
 	}
 
-	if (recv_len < 1)
+	/* fill the netlink header */
+	nl_hdr->nlmsg_type = NLMSG_DONE;
+	nl_hdr->nlmsg_flags = 0;
+	nl_hdr->nlmsg_seq = 0;
+	nl_hdr->nlmsg_pid = getpid();
+
+	/* fill the connector header, the kernel answers with ack + 1 */
+	cn_hdr->id.idx = CN_IDX_PROC;
+	cn_hdr->id.val = CN_VAL_PROC;
+	cn_hdr->seq = 0;
+	cn_hdr->ack = getpid();
+	flog(LOG_DEBUG, "Sending netlink message len=%d, cn_msg len=%d\n",
+		nl_hdr->nlmsg_len, (int) sizeof(struct cn_msg));
+
+	if (send(sk_nl, nl_hdr, nl_hdr->nlmsg_len, 0) != nl_hdr->nlmsg_len) {
+		flog(LOG_ERR, "Error: failed to send netlink message ");
+		flog(LOG_ERR, "(mcast ctl op): %s\n", strerror(errno));
+		return -1;
+	}
+	flog(LOG_DEBUG, "Message sent\n");
+
+	return 0;
+}
+
+/**
+ * Wait for the acknowledgment of a cgre_send_mcast_listen() request.  The
+ * kernel applies the event type mask of the subscriber to the
+ * acknowledgment too, so it is received on another socket which did not
+ * subscribe and gets all proc connector messages.
+ *	@param sk_probe The other socket, bound to the proc connector group
+ *	@return 0 if the kernel accepted the request, an errno value if it
+ *	rejected it, ETIMEDOUT if it did not answer
+ */
+static int cgre_wait_mcast_ack(int sk_probe)
+{
+	struct pollfd pfd = { .fd = sk_probe, .events = POLLIN };
+	__u64 deadline, now;
+	struct nlmsghdr *nlh;
+	struct proc_event *ev;
+	struct cn_msg *cn_hdr;
+	char buff[BUFF_SIZE];
+	ssize_t len;
+	int timeout;
+
+	deadline = cgre_stats_now() + (__u64)MCAST_ACK_TIMEOUT_MS * 1000000;
+
+	for (;;) {
+		now = cgre_stats_now();
+		if (now >= deadline)
+			return ETIMEDOUT;
+		timeout = (deadline - now + 999999) / 1000000;
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			return errno;
+
+		len = recv(sk_probe, buff, sizeof(buff), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR ||
+			    errno == ENOBUFS)
+				continue;
+			return errno;
+		}
+
+		for (nlh = (struct nlmsghdr *)buff; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != NLMSG_DONE)
+				continue;
+			cn_hdr = NLMSG_DATA(nlh);
+			ev = (struct proc_event *)cn_hdr->data;
+			if (cn_hdr->id.idx == CN_IDX_PROC &&
+			    cn_hdr->ack == (__u32)getpid() + 1 &&
+			    ev->what == PROC_EVENT_NONE)
+				return ev->event_data.ack.err;
+		}
+	}
+}
+
+/**
+ * Subscribe to the proc connector events.  Only the CGRE_PROC_EVENTS types
+ * are requested first.  Kernels without event type masks, before 6.6
+ * unless backported, drop such a request without an answer, so the daemon
+ * subscribes to all events when no acknowledgment arrives.
+ *	@param sk_nl The netlink socket
+ *	@return 0 on success, -1 on error
+ */
+static int cgre_listen_proc_events(int sk_nl)
+{
+	struct sockaddr_nl nla;
+	int sk_probe, err;
+
+	sk_probe = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			  NETLINK_CONNECTOR);
+	if (sk_probe < 0)
+		return cgre_send_mcast_listen(sk_nl, 0);
+
+	memset(&nla, 0, sizeof(nla));
+	nla.nl_family = AF_NETLINK;
+	nla.nl_groups = CN_IDX_PROC;
+
+	if (bind(sk_probe, (struct sockaddr *)&nla, sizeof(nla)) < 0)
+		err = errno;
+	else if (cgre_send_mcast_listen(sk_nl, 1))
+		err = EIO;
+	else
+		err = cgre_wait_mcast_ack(sk_probe);
+	close(sk_probe);
+
+	if (!err) {
+		flog(LOG_DEBUG, "Proc connector event mask accepted\n");
 		return 0;
+	}
 
-	if (from_nla_len != sizeof(from_nla)) {
-		flog(LOG_ERR, "Bad address size reading netlink socket\n");
+	flog(LOG_INFO, "Proc connector event mask not supported: %s\n",
+	     strerror(err));
+	return cgre_send_mcast_listen(sk_nl, 0);
+}
+
+static int cgre_receive_netlink_msg(int sk_nl)
+{
+	struct msghdr *hdr;
+	int i, cnt;
+
+	for (i = 0; i < RECV_BATCH_SIZE; i++) {
+		hdr = &recv_vec.msgs[i].msg_hdr;
+
+		recv_vec.iov[i].iov_base = recv_vec.buff[i];
+		recv_vec.iov[i].iov_len = BUFF_SIZE;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name = &recv_vec.addr[i];
+		hdr->msg_namelen = sizeof(recv_vec.addr[i]);
+		hdr->msg_iov = &recv_vec.iov[i];
+		hdr->msg_iovlen = 1;
+	}
+
+	cnt = recvmmsg(sk_nl, recv_vec.msgs, RECV_BATCH_SIZE, MSG_DONTWAIT,
+		       NULL);
+	if (cnt < 0) {
+		if (errno == ENOBUFS) {
+			/*
+			 * The kernel could not queue some of the events, the
+			 * only way to recover is to rescan all processes.
+			 */
+			flog(LOG_ERR,
+			     "ERROR: NETLINK BUFFER FULL, MESSAGE DROPPED!\n");
+			cgre_stats_inc(CGRE_STAT_NETLINK_OVERRUNS);
+			cgre_resync_processes();
+		} else if (errno != EAGAIN && errno != EINTR) {
+			flog(LOG_WARNING, "Failed to read netlink socket: %s\n",
+			     strerror(errno));
+		}
 		return 0;
 	}
 
-	if (from_nla.nl_groups != CN_IDX_PROC
-	    || from_nla.nl_pid != 0)
-		return 0;
+	cgre_stats_record(CGRE_HIST_NETLINK_BATCH, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		if (cgre_process_netlink_datagram(&recv_vec.msgs[i].msg_hdr,
+						  recv_vec.msgs[i].msg_len))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Send a text snapshot of the daemon statistics to a client of the stats
+ * socket and close the connection.
+ *	@param sk_stats The stats socket
+ */
+static void cgre_send_stats(int sk_stats)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int fd;
+
+	fd = accept4(sk_stats, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			flog(LOG_WARNING,
+			     "Warning: 'accept' command error: %s\n",
+			     strerror(errno));
+		return;
+	}
+
+	cgre_stats_set(CGRE_STAT_PENDING_EVENTS, array_pend.index);
+	cgre_stats_set(CGRE_STAT_UNCHANGED_PROCESSES, array_unch.index);
+	cgre_stats_set(CGRE_STAT_PARENT_INFO_ENTRIES, array_pi.index);
+	cgre_stats_set(CGRE_STAT_LOG_DROPPED,
+		       __atomic_load_n(&log_dropped, __ATOMIC_RELAXED));
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		flog(LOG_WARNING, "Failed to allocate memory\n");
+		goto close;
+	}
+	cgre_stats_write(f);
+	fclose(f);
+
+	if (send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		flog(LOG_WARNING, "Warning: cannot write to stats socket: %s\n",
+		     strerror(errno));
+	free(buf);
+
+close:
+	close(fd);
+}
+
+static int cgre_epoll_add(int epfd, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static const char * const cgre_group_event_names[CGROUP_EVENT_MAX] = {
+	[CGROUP_EVENT_POPULATED]		= "populated",
+	[CGROUP_EVENT_FROZEN]			= "frozen",
+	[CGROUP_EVENT_MEMORY_LOW]		= "low",
+	[CGROUP_EVENT_MEMORY_HIGH]		= "high",
+	[CGROUP_EVENT_MEMORY_MAX]		= "max",
+	[CGROUP_EVENT_MEMORY_OOM]		= "oom",
+	[CGROUP_EVENT_MEMORY_OOM_KILL]		= "oom_kill",
+	[CGROUP_EVENT_MEMORY_OOM_GROUP_KILL]	= "oom_group_kill",
+	[CGROUP_EVENT_REMOVED]			= "removed",
+	[CGROUP_EVENT_CREATED]			= "created",
+};
+
+/**
+ * Start watching the groups given with --watch.  A group which cannot be
+ * watched is only reported, the rules engine works without it.
+ *	@return The watcher, NULL if no group is watched
+ */
+static struct cgroup_event_watcher *cgre_watch_groups(void)
+{
+	struct cgroup_event_watcher *watcher;
+	int i, id, ret, watched = 0;
+
+	if (!watch_groups_count)
+		return NULL;
+
+	watcher = cgroup_event_watcher_new();
+	if (!watcher) {
+		flog(LOG_WARNING, "Warning: cannot watch groups: %s\n",
+		     cgroup_strerror(ECGOTHER));
+		return NULL;
+	}
+
+	for (i = 0; i < watch_groups_count; i++) {
+		ret = cgroup_event_watcher_add(watcher, watch_groups[i],
+					       CGROUP_EVENT_FILE_GROUP |
+					       CGROUP_EVENT_FILE_MEMORY, &id);
+		/* The memory controller may not be enabled in the group */
+		if (ret == ECGROUPUNSUPP)
+			ret = cgroup_event_watcher_add(watcher, watch_groups[i],
+						       CGROUP_EVENT_FILE_GROUP,
+						       &id);
+		if (ret) {
+			flog(LOG_WARNING, "Warning: cannot watch group %s: ",
+			     watch_groups[i]);
+			flog(LOG_WARNING, "%s\n", cgroup_strerror(ret));
+			continue;
+		}
+		watched++;
+	}
+
+	if (!watched)
+		cgroup_event_watcher_free(&watcher);
+
+	return watcher;
+}
+
+/**
+ * Log the events of the watched groups.  A removed group stays watched, and
+ * reports again once it is created again.
+ */
+static void cgre_receive_group_events(void)
+{
+	const struct cgroup_event *events;
+	const struct cgroup_event *ev;
+	int i, count, ret;
+
+	ret = cgroup_event_watcher_read(group_watcher, &events, &count);
+	if (ret) {
+		flog(LOG_WARNING, "Warning: cannot read group events: %s\n",
+		     cgroup_strerror(ret));
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		ev = &events[i];
+		cgre_stats_inc(CGRE_STAT_GROUP_EVENTS);
+
+		switch (ev->type) {
+		case CGROUP_EVENT_REMOVED:
+			flog(LOG_INFO, "Group %s removed\n", ev->path);
+			break;
+		case CGROUP_EVENT_CREATED:
+			flog(LOG_INFO, "Group %s created\n", ev->path);
+			break;
+		case CGROUP_EVENT_MEMORY_OOM_KILL:
+		case CGROUP_EVENT_MEMORY_OOM_GROUP_KILL:
+			cgre_stats_add(CGRE_STAT_OOM_KILLS, ev->delta);
+			flog(LOG_NOTICE, "Group %s: %s %llu (+%llu)\n",
+			     ev->path, cgre_group_event_names[ev->type],
+			     (unsigned long long)ev->value,
+			     (unsigned long long)ev->delta);
+			break;
+		default:
+			flog(LOG_INFO, "Group %s: %s %llu\n", ev->path,
+			     cgre_group_event_names[ev->type],
+			     (unsigned long long)ev->value);
+			break;
+		}
+	}
+}
+
+/**
+ * Process one message of the batched protocol and send the reply.
+ *	@param fd The client connection
+ *	@param msg The received message
+ *	@param len Length of the received message
+ *	@return 0 on success, -1 if the connection should be closed
+ */
+static int cgre_process_batch_msg(int fd, const char *msg, ssize_t len)
+{
+	const struct cgrule_batch_hdr *hdr;
+	const struct cgrule_batch_item *item;
+	struct cgrule_batch_reply reply;
+	int i;
+
+	if (len < (ssize_t)sizeof(*hdr)) {
+		flog(LOG_WARNING, "Warning: short batch message\n");
+		return -1;
+	}
+
+	hdr = (const struct cgrule_batch_hdr *)msg;
+	item = (const struct cgrule_batch_item *)(hdr + 1);
+
+	memset(&reply, 0, sizeof(reply));
+	reply.magic = CGRULE_BATCH_MAGIC;
+	reply.version = CGRULE_BATCH_VERSION;
+	reply.seq = hdr->seq;
+
+	if (hdr->magic != CGRULE_BATCH_MAGIC ||
+	    hdr->version != CGRULE_BATCH_VERSION) {
+		flog(LOG_WARNING, "Warning: unsupported batch protocol %u\n",
+		     hdr->version);
+		reply.status = EPROTONOSUPPORT;
+		goto send;
+	}
+
+	if (hdr->count > CGRULE_BATCH_MAX_ITEMS ||
+	    len != (ssize_t)(sizeof(*hdr) + hdr->count * sizeof(*item))) {
+		flog(LOG_WARNING, "Warning: malformed batch message\n");
+		reply.status = EINVAL;
+		goto send;
+	}
+
+	for (i = 0; i < hdr->count; i++) {
+		if (item[i].flags == CGROUP_DAEMON_CANCEL_UNCHANGE_PROCESS) {
+			cgre_remove_unchanged_process(item[i].pid);
+			continue;
+		}
+
+		if (kill(item[i].pid, 0) < 0 && errno == ESRCH) {
+			flog(LOG_WARNING,
+			     "Warning: there is no such process (PID: %d)\n",
+			     item[i].pid);
+			reply.failed++;
+			continue;
+		}
+
+		cgre_stats_inc(CGRE_STAT_STICKY_REQUESTS);
+		if (cgre_store_unchanged_process(item[i].pid, item[i].flags))
+			reply.failed++;
+	}
+
+send:
+	if (send(fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		flog(LOG_WARNING,
+		     "Warning: cannot write to daemon socket: %s\n",
+		     strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Read all pending messages from a batched protocol client.  The
+ * connection is closed when the client hangs up or misbehaves.
+ *	@param fd The client connection
+ *	@param epfd The epoll instance the connection is registered with
+ */
+static void cgre_receive_batch_msg(int fd, int epfd)
+{
+	static char msg[CGRULE_BATCH_MSG_MAX];
+	ssize_t len;
+	int slot;
 
-	nlh = (struct nlmsghdr *)buff;
-	while (NLMSG_OK(nlh, recv_len)) {
-		cn_hdr = NLMSG_DATA(nlh);
+	/* The connection may have been evicted earlier in this loop pass */
+	slot = cgre_find_batch_client(fd);
+	if (slot < 0)
+		return;
 
-		if (nlh->nlmsg_type == NLMSG_NOOP) {
-			nlh = NLMSG_NEXT(nlh, recv_len);
-			continue;
-		}
-		if ((nlh->nlmsg_type == NLMSG_ERROR) ||
-		    (nlh->nlmsg_type == NLMSG_OVERRUN))
+	for (;;) {
+		len = recv(fd, msg, sizeof(msg), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (len <= 0)
 			break;
-		if (cgre_handle_msg(cn_hdr) < 0)
-			return 1;
-		if (nlh->nlmsg_type == NLMSG_DONE)
+		batch_clients[slot].last_ns = cgre_stats_now();
+		if (cgre_process_batch_msg(fd, msg, len))
 			break;
-		nlh = NLMSG_NEXT(nlh, recv_len);
 	}
 
-	return 0;
+	cgre_close_batch_client(slot, epfd);
 }
 
-static void cgre_receive_unix_domain_msg(int sk_unix)
+/**
+ * Accept a new connection on the batched protocol socket and add it to the
+ * event loop.  When all the slots are taken, the least recently active
+ * connection is closed to make room for the new one.
+ *	@param sk_batch The listening socket
+ *	@param epfd The epoll instance
+ */
+static void cgre_accept_batch_client(int sk_batch, int epfd)
 {
-	struct sockaddr_un caddr;
-	char path[FILENAME_MAX];
-	struct stat buff_stat;
-	socklen_t caddr_len;
 	int fd_client;
-	int flags;
-	pid_t pid;
+	int oldest;
+	int i;
 
-	caddr_len = sizeof(caddr);
-	fd_client = accept(sk_unix, (struct sockaddr *)&caddr, &caddr_len);
+	fd_client = accept4(sk_batch, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (fd_client < 0) {
 		flog(LOG_WARNING, "Warning: 'accept' command error: %s\n",
 		     strerror(errno));
 		return;
 	}
 
-	if (read(fd_client, &pid, sizeof(pid)) < 0) {
-		flog(LOG_WARNING, "Warning: 'read' command error: %s\n",
+	if (cgre_epoll_add(epfd, fd_client) < 0) {
+		flog(LOG_WARNING, "Warning: cannot poll batch client: %s\n",
 		     strerror(errno));
-		goto close;
+		close(fd_client);
+		return;
+	}
+
+	if (batch_clients_count >= MAX_BATCH_CLIENTS) {
+		oldest = 0;
+		for (i = 1; i < batch_clients_count; i++) {
+			if (batch_clients[i].last_ns <
+			    batch_clients[oldest].last_ns)
+				oldest = i;
+		}
+		flog(LOG_INFO, "Too many batch clients, closing client %d\n",
+		     batch_clients[oldest].fd);
+		cgre_close_batch_client(oldest, epfd);
 	}
 
+	batch_clients[batch_clients_count].fd = fd_client;
+	batch_clients[batch_clients_count].last_ns = cgre_stats_now();
+	batch_clients_count++;
+}
+
+/**
+ * Accept a new connection on the legacy protocol socket and add it to the
+ * event loop.  When all the slots are taken, the oldest connection is
+ * closed to make room for the new one.
+ *	@param sk_unix The listening socket
+ *	@param epfd The epoll instance
+ */
+static void cgre_accept_stream_client(int sk_unix, int epfd)
+{
+	struct cgre_stream_client *client;
+	int fd_client;
+	int oldest;
+	int i;
+
+	fd_client = accept4(sk_unix, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd_client < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			flog(LOG_WARNING,
+			     "Warning: 'accept' command error: %s\n",
+			     strerror(errno));
+		return;
+	}
+
+	if (cgre_epoll_add(epfd, fd_client) < 0) {
+		flog(LOG_WARNING, "Warning: cannot poll client: %s\n",
+		     strerror(errno));
+		close(fd_client);
+		return;
+	}
+
+	if (stream_clients_count >= MAX_STREAM_CLIENTS) {
+		oldest = 0;
+		for (i = 1; i < stream_clients_count; i++) {
+			if (stream_clients[i].start_ns <
+			    stream_clients[oldest].start_ns)
+				oldest = i;
+		}
+		flog(LOG_INFO, "Too many clients, closing client %d\n",
+		     stream_clients[oldest].fd);
+		cgre_close_stream_client(oldest, epfd);
+	}
+
+	client = &stream_clients[stream_clients_count++];
+	client->fd = fd_client;
+	client->start_ns = cgre_stats_now();
+	client->len = 0;
+}
+
+/**
+ * Handle a complete request of the legacy protocol and send the reply.
+ *	@param fd The client connection
+ *	@param pid The process to register
+ *	@param flags The flags of the registration
+ */
+static void cgre_process_stream_msg(int fd, pid_t pid, int flags)
+{
+	char path[FILENAME_MAX];
+	struct stat buff_stat;
+
 	sprintf(path, "/proc/%d", pid);
 	if (stat(path, &buff_stat)) {
 		flog(LOG_WARNING,
 		     "Warning: there is no such process (PID: %d)\n", pid);
-		goto close;
+		return;
+	}
+
+	if (flags == CGROUP_DAEMON_CANCEL_UNCHANGE_PROCESS) {
+		cgre_remove_unchanged_process(pid);
+	} else {
+		cgre_stats_inc(CGRE_STAT_STICKY_REQUESTS);
+		if (cgre_store_unchanged_process(pid, flags))
+			return;
 	}
 
-	if (read(fd_client, &flags, sizeof(flags)) < 0) {
+	if (send(fd, CGRULE_SUCCESS_STORE_PID,
+		 sizeof(CGRULE_SUCCESS_STORE_PID),
+		 MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		flog(LOG_WARNING,
+		     "Warning: cannot write to daemon socket: %s\n",
+		     strerror(errno));
+}
+
+/**
+ * Read the available part of a legacy protocol request, a pid followed by
+ * the flags.  The request may arrive in pieces, the connection is closed
+ * once it is complete and answered, or when the client hangs up.
+ *	@param slot The slot index of the connection
+ *	@param epfd The epoll instance the connection is registered with
+ */
+static void cgre_receive_stream_msg(int slot, int epfd)
+{
+	struct cgre_stream_client *client = &stream_clients[slot];
+	ssize_t len;
+	pid_t pid;
+	int flags;
+
+	len = recv(client->fd, client->buf + client->len,
+		   sizeof(client->buf) - client->len, MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len < 0) {
 		flog(LOG_WARNING, "Warning: error reading daemon socket: %s\n",
 		     strerror(errno));
 		goto close;
 	}
+	if (len == 0)
+		goto close;
 
-	if (flags == CGROUP_DAEMON_CANCEL_UNCHANGE_PROCESS)
-		cgre_remove_unchanged_process(pid);
+	client->len += len;
+	if (client->len < sizeof(client->buf))
+		return;
+
+	memcpy(&pid, client->buf, sizeof(pid));
+	memcpy(&flags, client->buf + sizeof(pid), sizeof(flags));
+	cgre_process_stream_msg(client->fd, pid, flags);
+
+close:
+	cgre_close_stream_client(slot, epfd);
+}
+
+/**
+ * Read the messages of a client connection of either protocol.
+ *	@param fd The client connection
+ *	@param epfd The epoll instance the connection is registered with
+ */
+static void cgre_receive_client_msg(int fd, int epfd)
+{
+	int slot;
+
+	slot = cgre_find_stream_client(fd);
+	if (slot >= 0)
+		cgre_receive_stream_msg(slot, epfd);
 	else
-		if (cgre_store_unchanged_process(pid, flags))
-			goto close;
+		cgre_receive_batch_msg(fd, epfd);
+}
 
-	if (write(fd_client, CGRULE_SUCCESS_STORE_PID,
-		  sizeof(CGRULE_SUCCESS_STORE_PID)) < 0) {
+/**
+ * Create a listening unix socket accessible by the configured socket owner.
+ *	@param path Path of the socket
+ *	@param type Socket type, SOCK_STREAM or SOCK_SEQPACKET
+ *	@param backlog Backlog passed to listen()
+ *	@return the socket, -1 on error
+ */
+static int cgre_create_unix_socket(const char *path, int type, int backlog)
+{
+	struct sockaddr_un saddr;
+	int sk;
 
-		flog(LOG_WARNING,
-		     "Warning: cannot write to daemon socket: %s\n",
+	sk = socket(PF_UNIX, type, 0);
+	if (sk < 0) {
+		flog(LOG_ERR, "Error creating UNIX socket: %s\n",
 		     strerror(errno));
-		goto close;
+		return -1;
 	}
 
-close:
-	close(fd_client);
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sun_family = AF_UNIX;
+	strcpy(saddr.sun_path, path);
+	unlink(path);
+
+	if (bind(sk, (struct sockaddr *)&saddr,
+	    sizeof(saddr.sun_family) + strlen(path)) < 0) {
+		flog(LOG_ERR, "Error binding UNIX socket %s: %s\n",
+		     path, strerror(errno));
+		goto err;
+	}
+
+	if (listen(sk, backlog) < 0) {
+		flog(LOG_ERR, "Error listening on UNIX socket %s: %s\n",
+		     path, strerror(errno));
+		goto err;
+	}
+
+	/* change the owner */
+	if (chown(path, socket_user, socket_group) < 0) {
+		flog(LOG_ERR, "Error changing %s socket owner: %s\n",
+		     path, strerror(errno));
+		goto err;
+	}
+
+	flog(LOG_DEBUG, "Socket %s owner successfully set to %d:%d\n",
+	     path, (int) socket_user, (int) socket_group);
+
+	if (chmod(path, 0660) < 0) {
+		flog(LOG_ERR, "Error changing %s socket permissions: %s\n",
+		     path, strerror(errno));
+		goto err;
+	}
+
+	return sk;
+
+err:
+	close(sk);
+	return -1;
 }
 
-static int cgre_create_netlink_socket_process_msg(void)
+/**
+ * Handle the signals delivered through the signalfd.  This runs in the
+ * event loop, so the handlers are free to call any function.
+ *	@param sfd The signalfd
+ */
+static void cgre_receive_signals(int sfd)
 {
-	int sk_nl = 0, sk_unix = 0, sk_max;
-	enum proc_cn_mcast_op *mcop_msg;
+	struct signalfd_siginfo si;
+
+	while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGUSR1:
+			cgre_flash_templates(si.ssi_signo);
+			break;
+		case SIGUSR2:
+			cgre_flash_rules(si.ssi_signo);
+			break;
+		case SIGINT:
+		case SIGTERM:
+			cgre_catch_term(si.ssi_signo);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/**
+ * Create the timerfd used for the periodic cache maintenance.
+ *	@return the timer file descriptor, -1 on error
+ */
+static int cgre_create_maintenance_timer(void)
+{
+	struct itimerspec its;
+	int tfd;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0)
+		return -1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = MAINTENANCE_INTERVAL;
+	its.it_interval.tv_sec = MAINTENANCE_INTERVAL;
+
+	if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+		close(tfd);
+		return -1;
+	}
+
+	return tfd;
+}
+
+static int cgre_create_netlink_socket_process_msg(const sigset_t *sigset)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int sk_nl = -1, sk_unix = -1, sk_batch = -1, sk_stats = -1;
+	int epfd = -1, sfd = -1, tfd = -1, wfd = -1;
+	uint64_t expirations;
+	int i, nfds;
 	struct sockaddr_nl my_nla;
-	struct sockaddr_un saddr;
-	struct nlmsghdr *nl_hdr;
-	struct cn_msg *cn_hdr;
-	char buff[BUFF_SIZE];
-	fd_set fds, readfds;
-	sigset_t sigset;
 	int rc = -1;
 
+	cgre_stats_init();
+
 	/*
 	 * Create an endpoint for communication. Use the kernel user
 	 * interface device (PF_NETLINK) which is a datagram oriented
@@ -718,117 +2532,153 @@ static int cgre_create_netlink_socket_process_msg(void)
 		goto close_and_exit;
 	}
 
-	nl_hdr = (struct nlmsghdr *)buff;
-	cn_hdr = (struct cn_msg *)NLMSG_DATA(nl_hdr);
-	mcop_msg = (enum proc_cn_mcast_op *)&cn_hdr->data[0];
-	flog(LOG_DEBUG, "Sending proc connector: PROC_CN_MCAST_LISTEN...\n");
-	memset(buff, 0, sizeof(buff));
-	*mcop_msg = PROC_CN_MCAST_LISTEN;
+	cgre_set_netlink_rcvbuf(sk_nl, netlink_rcvbuf);
 
-	/* fill the netlink header */
-	nl_hdr->nlmsg_len = SEND_MESSAGE_LEN;
-	nl_hdr->nlmsg_type = NLMSG_DONE;
-	nl_hdr->nlmsg_flags = 0;
-	nl_hdr->nlmsg_seq = 0;
-	nl_hdr->nlmsg_pid = getpid();
+	cgre_attach_netlink_filter(sk_nl);
 
-	/* fill the connector header */
-	cn_hdr->id.idx = CN_IDX_PROC;
-	cn_hdr->id.val = CN_VAL_PROC;
-	cn_hdr->seq = 0;
-	cn_hdr->ack = 0;
-	cn_hdr->len = sizeof(enum proc_cn_mcast_op);
-	flog(LOG_DEBUG, "Sending netlink message len=%d, cn_msg len=%d\n",
-		nl_hdr->nlmsg_len, (int) sizeof(struct cn_msg));
+	if (cgre_listen_proc_events(sk_nl))
+		goto close_and_exit;
 
-	if (send(sk_nl, nl_hdr, nl_hdr->nlmsg_len, 0) != nl_hdr->nlmsg_len) {
-		flog(LOG_ERR, "Error: failed to send netlink message ");
-		flog(LOG_ERR, "(mcast ctl op): %s\n", strerror(errno));
+	/* Setup Unix domain sockets. */
+	sk_unix = cgre_create_unix_socket(CGRULE_CGRED_SOCKET_PATH,
+					  SOCK_STREAM | SOCK_NONBLOCK,
+					  MAX_STREAM_CLIENTS);
+	if (sk_unix < 0)
 		goto close_and_exit;
-	}
-	flog(LOG_DEBUG, "Message sent\n");
 
-	/* Setup Unix domain socket. */
-	sk_unix = socket(PF_UNIX, SOCK_STREAM, 0);
-	if (sk_unix < 0) {
-		flog(LOG_ERR, "Error creating UNIX socket: %s\n",
-		     strerror(errno));
+	sk_batch = cgre_create_unix_socket(CGRULE_CGRED_BATCH_SOCKET_PATH,
+					   SOCK_SEQPACKET | SOCK_NONBLOCK,
+					   MAX_BATCH_CLIENTS);
+	if (sk_batch < 0)
 		goto close_and_exit;
-	}
 
-	memset(&saddr, 0, sizeof(saddr));
-	saddr.sun_family = AF_UNIX;
-	strcpy(saddr.sun_path, CGRULE_CGRED_SOCKET_PATH);
-	unlink(CGRULE_CGRED_SOCKET_PATH);
+	sk_stats = cgre_create_unix_socket(CGRULE_CGRED_STATS_SOCKET_PATH,
+					   SOCK_STREAM | SOCK_NONBLOCK, 16);
+	if (sk_stats < 0)
+		goto close_and_exit;
 
-	if (bind(sk_unix, (struct sockaddr *)&saddr,
-	    sizeof(saddr.sun_family) + strlen(CGRULE_CGRED_SOCKET_PATH)) < 0) {
-		flog(LOG_ERR, "Error binding UNIX socket %s: %s\n",
-		     CGRULE_CGRED_SOCKET_PATH, strerror(errno));
+	sfd = signalfd(-1, sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0) {
+		flog(LOG_ERR, "Error creating signalfd: %s\n", strerror(errno));
 		goto close_and_exit;
 	}
 
-	if (listen(sk_unix, 1) < 0) {
-		flog(LOG_ERR, "Error listening on UNIX socket %s: %s\n",
-		     CGRULE_CGRED_SOCKET_PATH, strerror(errno));
+	tfd = cgre_create_maintenance_timer();
+	if (tfd < 0) {
+		flog(LOG_ERR, "Error creating maintenance timer: %s\n",
+		     strerror(errno));
 		goto close_and_exit;
 	}
 
-	/* change the owner */
-	if (chown(CGRULE_CGRED_SOCKET_PATH, socket_user, socket_group) < 0) {
-		flog(LOG_ERR, "Error changing %s socket owner: %s\n",
-		     CGRULE_CGRED_SOCKET_PATH, strerror(errno));
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		flog(LOG_ERR, "Error creating epoll instance: %s\n",
+		     strerror(errno));
 		goto close_and_exit;
 	}
 
-	flog(LOG_DEBUG, "Socket %s owner successfully set to %d:%d\n",
-	     CGRULE_CGRED_SOCKET_PATH, (int) socket_user,
-	     (int) socket_group);
+	if (coalesce_usec > 0) {
+		coalesce_tfd = timerfd_create(CLOCK_MONOTONIC,
+					      TFD_NONBLOCK | TFD_CLOEXEC);
+		if (coalesce_tfd < 0 ||
+		    cgre_epoll_add(epfd, coalesce_tfd) < 0) {
+			flog(LOG_ERR, "Error creating coalescing timer: %s\n",
+			     strerror(errno));
+			goto close_and_exit;
+		}
+	}
 
-	if (chmod(CGRULE_CGRED_SOCKET_PATH, 0660) < 0) {
-		flog(LOG_ERR, "Error changing %s socket permissions: %s\n",
-		     CGRULE_CGRED_SOCKET_PATH, strerror(errno));
+	if (cgre_epoll_add(epfd, sk_nl) < 0 ||
+	    cgre_epoll_add(epfd, sk_unix) < 0 ||
+	    cgre_epoll_add(epfd, sk_batch) < 0 ||
+	    cgre_epoll_add(epfd, sk_stats) < 0 ||
+	    cgre_epoll_add(epfd, sfd) < 0 ||
+	    cgre_epoll_add(epfd, tfd) < 0) {
+		flog(LOG_ERR, "Error adding descriptor to epoll: %s\n",
+		     strerror(errno));
 		goto close_and_exit;
 	}
 
-	FD_ZERO(&readfds);
-	FD_SET(sk_nl, &readfds);
-	FD_SET(sk_unix, &readfds);
-	if (sk_nl < sk_unix)
-		sk_max = sk_unix;
-	else
-		sk_max = sk_nl;
+	group_watcher = cgre_watch_groups();
+	if (group_watcher) {
+		wfd = cgroup_event_watcher_fd(group_watcher);
+		if (cgre_epoll_add(epfd, wfd) < 0) {
+			flog(LOG_ERR, "Error adding descriptor to epoll: %s\n",
+			     strerror(errno));
+			goto close_and_exit;
+		}
+	}
 
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGUSR2);
-	for (;;) {
-		/*
-		 * For avoiding the deadlock and "Interrupted system call"
-		 * error, restrict the effective range of SIGUSR2 signal.
-		 */
-		sigprocmask(SIG_UNBLOCK, &sigset, NULL);
-		sigprocmask(SIG_BLOCK, &sigset, NULL);
+	/*
+	 * The running processes are scanned only now that their events are
+	 * reported, so no change is lost.  The sticky requests are served
+	 * while the scan runs; cgre_store_unchanged_process() removes the
+	 * registered processes from the remaining scan chunks.
+	 */
+	cgre_start_scan();
 
-		memcpy(&fds, &readfds, sizeof(fd_set));
-		if (select(sk_max + 1, &fds, NULL, NULL, NULL) < 0) {
-			flog(LOG_ERR, "Selecting error: %s\n", strerror(errno));
+	for (;;) {
+		nfds = epoll_wait(epfd, events, MAX_EPOLL_EVENTS,
+				  scan_handle ? 0 : -1);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			flog(LOG_ERR, "Polling error: %s\n", strerror(errno));
 			goto close_and_exit;
 		}
 
-		if (FD_ISSET(sk_nl, &fds)) {
-			if (cgre_receive_netlink_msg(sk_nl))
-				break;
+		for (i = 0; i < nfds; i++) {
+			if (events[i].data.fd == sk_nl) {
+				if (cgre_receive_netlink_msg(sk_nl))
+					goto close_and_exit;
+			} else if (events[i].data.fd == sk_unix) {
+				cgre_accept_stream_client(sk_unix, epfd);
+			} else if (events[i].data.fd == sfd) {
+				cgre_receive_signals(sfd);
+			} else if (events[i].data.fd == tfd) {
+				if (read(tfd, &expirations,
+					 sizeof(expirations)) > 0)
+					cgre_run_maintenance(epfd);
+			} else if (events[i].data.fd == coalesce_tfd) {
+				if (read(coalesce_tfd, &expirations,
+					 sizeof(expirations)) > 0)
+					cgre_flush_pending_events();
+			} else if (events[i].data.fd == sk_batch) {
+				cgre_accept_batch_client(sk_batch, epfd);
+			} else if (events[i].data.fd == sk_stats) {
+				cgre_send_stats(sk_stats);
+			} else if (events[i].data.fd == wfd) {
+				cgre_receive_group_events();
+			} else {
+				cgre_receive_client_msg(events[i].data.fd,
+							epfd);
+			}
 		}
 
-		if (FD_ISSET(sk_unix, &fds))
-			cgre_receive_unix_domain_msg(sk_unix);
+		if (scan_handle)
+			cgre_continue_scan();
 	}
 
 close_and_exit:
+	if (scan_handle)
+		cgroup_change_all_cgroups_end(&scan_handle);
+	if (coalesce_tfd >= 0)
+		close(coalesce_tfd);
+	cgroup_event_watcher_free(&group_watcher);
+	if (epfd >= 0)
+		close(epfd);
+	if (tfd >= 0)
+		close(tfd);
+	if (sfd >= 0)
+		close(sfd);
 	if (sk_nl >= 0)
 		close(sk_nl);
 	if (sk_unix >= 0)
 		close(sk_unix);
+	if (sk_batch >= 0)
+		close(sk_batch);
+	if (sk_stats >= 0)
+		close(sk_stats);
 
 	return rc;
 }
@@ -939,6 +2789,7 @@ int cgre_start_daemon(const char *logp, const int logf,
 
 	if (!daemon) {
 		/* We can skip the rest, since we're not becoming a daemon. */
+		cgre_log_start_async();
 		flog(LOG_INFO, "Proceeding with PID %d\n", getpid());
 		return 0;
 	}
@@ -964,14 +2815,16 @@ int cgre_start_daemon(const char *logp, const int logf,
 	close(STDERR_FILENO);
 
 	/* If we make it this far, we're a real daemon! Or we chose not to.  */
+	cgre_log_start_async();
 	flog(LOG_INFO, "Proceeding with PID %d\n", getpid());
 
 	return 0;
 }
 
 /**
- * Catch the SIGUSR2 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Handle the SIGUSR2 signal and reload the rules configuration.  This function
+ * is called from the event loop and makes use of the logfile and flog() to
+ * print the new rules.
  *	@param signum The signal that we caught (always SIGUSR2)
  */
 void cgre_flash_rules(int signum)
@@ -989,8 +2842,10 @@ void cgre_flash_rules(int signum)
 
 	/* Print the results of the new table to our log file. */
 	if (logfile && loglevel >= LOG_INFO) {
+		cgre_log_flush();
 		cgroup_print_rules_config(logfile);
 		fprintf(logfile, "\n");
+		fflush(logfile);
 	}
 
 	/* Ask libcgroup to reload the template rules table. */
@@ -998,8 +2853,9 @@ void cgre_flash_rules(int signum)
 }
 
 /**
- * Catch the SIGUSR1 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Handle the SIGUSR1 signal and reload the templates configuration.  This
+ * function is called from the event loop and makes use of the logfile and
+ * flog() to print the new rules.
  *	@param signum The signal that we caught (always SIGUSR1)
  */
 void cgre_flash_templates(int signum)
@@ -1017,8 +2873,8 @@ void cgre_flash_templates(int signum)
 }
 
 /**
- * Catch the SIGTERM and SIGINT signals so that we can exit gracefully.  Before
- * exiting, this function makes use of the logfile and flog().
+ * Handle the SIGTERM and SIGINT signals so that we can exit gracefully.
+ * Before exiting, this function makes use of the logfile and flog().
  *	@param signum The signal that we caught (SIGTERM, SIGINT)
  */
 void cgre_catch_term(int signum)
@@ -1028,6 +2884,8 @@ void cgre_catch_term(int signum)
 
 	flog(LOG_INFO, "Stopped CGroup Rules Engine Daemon at %s\n",
 	     ctime(&tm));
+	cgre_record_close();
+	cgre_log_stop();
 
 	/* Close the log file, if we opened one */
 	if (logfile && logfile != stdout)
@@ -1088,8 +2946,8 @@ int main(int argc, char *argv[])
 	/* Verbose level */
 	int verbosity = 1;
 
-	/* For catching signals */
-	struct sigaction sa;
+	/* Signals handled in the event loop */
+	sigset_t sigset;
 
 	/* Should we daemonize? */
 	unsigned char daemon = 1;
@@ -1099,9 +2957,15 @@ int main(int argc, char *argv[])
 
 	struct passwd *pw;
 	struct group *gr;
+	const char **groups;
+	char *endptr;
+
+	/* Event recording to write, or to replay */
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
 
 	/* Command line arguments */
-	const char *short_options = "hvqf:s::ndQu:g:";
+	const char *short_options = "hvqf:s::ndQu:g:b:c:r:R:e:";
 	struct option long_options[] = {
 		{"help",	       no_argument, NULL, 'h'},
 		{"verbose",	       no_argument, NULL, 'v'},
@@ -1113,19 +2977,16 @@ int main(int argc, char *argv[])
 		{"nolog",	       no_argument, NULL, 'Q'},
 		{"socket-user",  required_argument, NULL, 'u'},
 		{"socket-group", required_argument, NULL, 'g'},
+		{"rcvbuf",	 required_argument, NULL, 'b'},
+		{"coalesce",	 required_argument, NULL, 'c'},
+		{"record",	 required_argument, NULL, 'r'},
+		{"replay",	 required_argument, NULL, 'R'},
+		{"watch",	 required_argument, NULL, 'e'},
 		{NULL, 0, NULL, 0}
 	};
 
 	int fileindex;
 
-	/* Make sure the user is root. */
-	if (getuid() != 0) {
-		fprintf(stderr, "Error: Only root can start/stop the control");
-		fprintf(stderr,	" group rules engine daemon\n");
-		ret = 1;
-		goto finished;
-	}
-
 	/*
 	 * Check environment variable CGROUP_LOGLEVEL. If it's set to DEBUG,
 	 * set appropriate verbosity level.
@@ -1215,6 +3076,43 @@ int main(int argc, char *argv[])
 			flog(LOG_DEBUG, "Using socket group %s id %d\n",
 			     optarg, (int)socket_group);
 			break;
+		case 'b': /* --rcvbuf */
+			netlink_rcvbuf = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || netlink_rcvbuf < 0) {
+				usage(stderr, "Invalid receive buffer size %s",
+				      optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
+		case 'c': /* --coalesce */
+			coalesce_usec = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || coalesce_usec < 0) {
+				usage(stderr, "Invalid coalescing window %s",
+				      optarg);
+				ret = 2;
+				goto finished;
+			}
+			break;
+		case 'r': /* --record */
+			record_path = optarg;
+			break;
+		case 'R': /* --replay */
+			replay_path = optarg;
+			daemon = 0;
+			break;
+		case 'e': /* --watch */
+			groups = realloc(watch_groups,
+					 (watch_groups_count + 1) *
+					 sizeof(*watch_groups));
+			if (!groups) {
+				fprintf(stderr, "Error: out of memory\n");
+				ret = 2;
+				goto finished;
+			}
+			groups[watch_groups_count++] = optarg;
+			watch_groups = groups;
+			break;
 		default:
 			usage(stderr, "");
 			ret = 2;
@@ -1222,6 +3120,25 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/*
+	 * Make sure the user is root.  A replay touches no real process and
+	 * runs on a scratch hierarchy only, see cgre_replay_check_hierarchy().
+	 */
+	if (getuid() != 0 && !replay_path) {
+		fprintf(stderr, "Error: Only root can start/stop the control");
+		fprintf(stderr,	" group rules engine daemon\n");
+		ret = 1;
+		goto finished;
+	}
+
+	/* Open the recording before the daemon changes its directory */
+	if (record_path && !replay_path && cgre_record_open(record_path)) {
+		fprintf(stderr, "Error: Failed to open recording %s: %s\n",
+			record_path, strerror(errno));
+		ret = 2;
+		goto finished;
+	}
+
 	/* Initialize libcgroup. */
 	ret = cgroup_init();
 	if (ret != 0) {
@@ -1230,6 +3147,14 @@ int main(int argc, char *argv[])
 		goto finished;
 	}
 
+	if (replay_path && cgre_replay_check_hierarchy()) {
+		fprintf(stderr, "Error: %s must point to a scratch hierarchy ",
+			CGROUP_ROOT_OVERRIDE_ENV);
+		fprintf(stderr, "for a replay\n");
+		ret = 1;
+		goto finished;
+	}
+
 	/* Ask libcgroup to load the configuration rules. */
 	ret = cgroup_string_list_init(&template_files,
 		CGCONFIG_CONF_FILES_LIST_MINIMUM_SIZE);
@@ -1284,65 +3209,46 @@ int main(int argc, char *argv[])
 	}
 
 	/*
-	 * Set up the signal handler to reload the cached rules upon reception
-	 * of a SIGUSR2 signal.
+	 * Block the signals we handle.  They are read from a signalfd in the
+	 * event loop, so the rules and templates are reloaded outside of the
+	 * signal context.
 	 */
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = &cgre_flash_rules;
-	sigemptyset(&sa.sa_mask);
-	ret = sigaction(SIGUSR2, &sa, NULL);
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	sigaddset(&sigset, SIGUSR2);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	ret = sigprocmask(SIG_BLOCK, &sigset, NULL);
 	if (ret) {
-		flog(LOG_ERR,
-		     "Failed to set up signal handler for SIGUSR2. Error: %s\n",
+		flog(LOG_ERR, "Failed to block signals. Error: %s\n",
 		     strerror(errno));
 		goto finished;
 	}
 
-	/*
-	 * Set up the signal handler to reload templates cache upon
-	 * reception of a SIGUSR1 signal.
-	 */
-	sa.sa_handler = &cgre_flash_templates;
-	ret = sigaction(SIGUSR1, &sa, NULL);
-	if (ret) {
-		flog(LOG_ERR,
-		     "Failed to set up signal handler for SIGUSR1. Error: %s\n",
-		     strerror(errno));
-		goto finished;
+	/* Print the configuration to the log file, or stdout. */
+	if (logfile && loglevel >= LOG_INFO) {
+		cgre_log_flush();
+		cgroup_print_rules_config(logfile);
+		fflush(logfile);
 	}
 
-	/*
-	 * Set up the signal handler to catch SIGINT and SIGTERM so that we
-	 * can exit gracefully.
-	 */
-	sa.sa_handler = &cgre_catch_term;
-	ret = sigaction(SIGINT, &sa, NULL);
-	ret |= sigaction(SIGTERM, &sa, NULL);
-	if (ret) {
-		flog(LOG_ERR,
-		     "Failed to set up the signal handler. Error: %s\n",
-		     strerror(errno));
+	if (replay_path) {
+		ret = cgre_replay(replay_path);
 		goto finished;
 	}
 
-	/* Print the configuration to the log file, or stdout. */
-	if (logfile && loglevel >= LOG_INFO)
-		cgroup_print_rules_config(logfile);
-
-	/* Scan for running applications with rules */
-	ret = cgroup_change_all_cgroups();
-	if (ret)
-		flog(LOG_WARNING, "Failed to initialize running tasks.\n");
-
 	flog(LOG_INFO, "Started the CGroup Rules Engine Daemon.\n");
 
 	/* We loop endlesly in this function, unless we encounter an error. */
-	ret =  cgre_create_netlink_socket_process_msg();
+	ret =  cgre_create_netlink_socket_process_msg(&sigset);
 
 finished:
 	cgroup_string_list_free(&template_files);
 
 finished_without_temp_files:
+	free(watch_groups);
+	cgre_record_close();
+	cgre_log_stop();
 	if (logfile && logfile != stdout)
 		fclose(logfile);
 
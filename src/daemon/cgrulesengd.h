@@ -43,6 +43,27 @@ extern "C" {
 #define PROC_CN_MCAST_LISTEN (1)
 #define PROC_CN_MCAST_IGNORE (2)
 
+/* Number of netlink datagrams fetched from the kernel by one recvmmsg() */
+#define RECV_BATCH_SIZE	(64)
+
+/* Proc connector events the daemon acts on, all others are filtered out */
+#define CGRE_PROC_EVENTS	(PROC_EVENT_FORK | PROC_EVENT_EXEC | \
+				 PROC_EVENT_UID | PROC_EVENT_GID | \
+				 PROC_EVENT_EXIT)
+
+/*
+ * Subscription request with an event type mask (struct proc_input in newer
+ * kernel headers).  Kernels without support ignore it, see
+ * cgre_listen_proc_events().
+ */
+struct cgre_proc_input {
+	enum proc_cn_mcast_op mcast_op;
+	__u32 event_type;
+};
+
+#define SEND_FILTER_MESSAGE_LEN (NLMSG_LENGTH(sizeof(struct cn_msg) + \
+				 sizeof(struct cgre_proc_input)))
+
 /**
  * Prints the usage information for this program and, optionally, an error
  * message.  This function uses vfprintf.
@@ -95,22 +116,24 @@ int cgre_start_daemon(const char *logp, const int logf,
 		      const unsigned char daemon, const int logv);
 
 /**
- * Catch the SIGUSR2 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Handle the SIGUSR2 signal and reload the rules configuration.  This function
+ * is called from the event loop and makes use of the logfile and flog() to
+ * print the new rules.
  *	@param signum The signal that we caught (always SIGUSR2)
  */
 void cgre_flash_rules(int signum);
 
 /**
- * Catch the SIGUSR1 signal and reload the rules configuration.  This function
- * makes use of the logfile and flog() to print the new rules.
+ * Handle the SIGUSR1 signal and reload the templates configuration.  This
+ * function is called from the event loop and makes use of the logfile and
+ * flog() to print the new rules.
  *	@param signum The signal that we caught (always SIGUSR1)
  */
 void cgre_flash_templates(int signum);
 
 /**
- * Catch the SIGTERM and SIGINT signal so that we can exit gracefully.  Before
- * exiting, this function makes use of the logfile and flog().
+ * Handle the SIGTERM and SIGINT signal so that we can exit gracefully.
+ * Before exiting, this function makes use of the logfile and flog().
  *	@param signum The signal that we caught (SIGTERM, SIGINT)
  */
 void cgre_catch_term(int signum);
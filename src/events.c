@@ -0,0 +1,962 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/**
+ * Notification of the changes of the cgroup.events and memory.events files.
+ *
+ * The kernel notifies inotify of every change of these files.  A watcher
+ * drains its inotify queue, marks the files that changed, then reads each
+ * of them once and compares the values with the previous ones.  A removed
+ * group generates no event on its files, so the parent directory of every
+ * watched group is watched too and reports the removal.  It keeps being
+ * watched after the removal, and reports when the group is created again.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+#include <libcgroup-internal.h>
+
+#include <sys/inotify.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* The watches and the parent directories grow by this many entries */
+#define CG_EVENT_WATCHES_CHUNK	16
+
+/* Smallest number of slots of the inotify watch hash, a power of two */
+#define CG_EVENT_SLOTS_MIN	64
+
+/* Kinds of inotify watches, stored in the low bits of the hash entries */
+enum {
+	CG_EVENT_NODE_GROUP = 0,	/* cgroup.events of a group */
+	CG_EVENT_NODE_MEMORY,		/* memory.events of a group */
+	CG_EVENT_NODE_PARENT,		/* directory holding groups */
+	CG_EVENT_NODE_SHIFT = 2,
+};
+
+/* Files of a watch, indexed by CG_EVENT_NODE_GROUP and _MEMORY */
+#define CG_EVENT_FILES		2
+
+static const char * const cg_event_file_names[CG_EVENT_FILES] = {
+	"cgroup.events",
+	"memory.events",
+};
+
+/* Key of each event in its file */
+static const char * const cg_event_keys[CGROUP_EVENT_REMOVED] = {
+	[CGROUP_EVENT_POPULATED] = "populated",
+	[CGROUP_EVENT_FROZEN] = "frozen",
+	[CGROUP_EVENT_MEMORY_LOW] = "low",
+	[CGROUP_EVENT_MEMORY_HIGH] = "high",
+	[CGROUP_EVENT_MEMORY_MAX] = "max",
+	[CGROUP_EVENT_MEMORY_OOM] = "oom",
+	[CGROUP_EVENT_MEMORY_OOM_KILL] = "oom_kill",
+	[CGROUP_EVENT_MEMORY_OOM_GROUP_KILL] = "oom_group_kill",
+};
+
+/* Events of each file, the others are counters */
+#define CG_EVENT_GROUP_FIRST	CGROUP_EVENT_POPULATED
+#define CG_EVENT_MEMORY_FIRST	CGROUP_EVENT_MEMORY_LOW
+
+struct cg_event_file {
+	int wd;			/* -1 if the file is not watched */
+	char *path;
+	bool dirty;		/* changed since it was last read */
+	uint64_t values[CGROUP_EVENT_REMOVED];
+};
+
+struct cg_event_watch {
+	char *path;		/* NULL if the slot is free */
+	const char *name;	/* last component of the directory */
+	size_t name_len;
+	int parent;		/* index in parents */
+	int mask;		/* mask of cgroup_event_file */
+	bool removed;
+	struct cg_event_file files[CG_EVENT_FILES];
+};
+
+/* A directory holding watched groups */
+struct cg_event_parent {
+	int wd;
+	int refs;		/* watches in this directory, 0 if free */
+};
+
+struct cgroup_event_watcher {
+	int fd;
+	struct cgroup_stat_reader *reader;
+
+	/* Id of the key of each event */
+	int keys[CGROUP_EVENT_REMOVED];
+
+	/* Indexed by the id of the watches */
+	struct cg_event_watch *watches;
+	int watches_max;
+
+	struct cg_event_parent *parents;
+	int parents_max;
+
+	/*
+	 * Hash of the inotify watch descriptors, using open addressing.  A
+	 * slot holds (index << CG_EVENT_NODE_SHIFT | kind) + 1, or 0 if it is
+	 * free.
+	 */
+	int *slots;
+	int slots_max;
+	int slots_count;
+
+	/* Files to read, as (watch << 1 | file) */
+	int *dirty;
+	int dirty_count;
+
+	struct cgroup_event *events;
+	int events_count;
+	int events_max;
+};
+
+static unsigned int cg_event_wd_hash(int wd)
+{
+	return (unsigned int)wd * 2654435761U;
+}
+
+/*
+ * Find the hash slot of an inotify watch descriptor.
+ *	@return the slot, holding 0 if the descriptor is not in the hash
+ */
+static unsigned int cg_event_slot_find(struct cgroup_event_watcher *w,
+				       int wd)
+{
+	unsigned int mask = w->slots_max - 1;
+	unsigned int slot;
+	int node;
+
+	slot = cg_event_wd_hash(wd) & mask;
+	while (w->slots[slot]) {
+		node = w->slots[slot] - 1;
+		if ((node & ((1 << CG_EVENT_NODE_SHIFT) - 1)) ==
+		    CG_EVENT_NODE_PARENT) {
+			if (w->parents[node >> CG_EVENT_NODE_SHIFT].wd == wd)
+				break;
+		} else if (w->watches[node >> CG_EVENT_NODE_SHIFT]
+				   .files[node & 1].wd == wd) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return slot;
+}
+
+static int cg_event_slot_grow(struct cgroup_event_watcher *w)
+{
+	int *old = w->slots;
+	int old_max = w->slots_max;
+	unsigned int mask, slot;
+	int i, node, wd;
+
+	w->slots_max = old_max ? old_max * 2 : CG_EVENT_SLOTS_MIN;
+	w->slots = calloc(w->slots_max, sizeof(*w->slots));
+	if (!w->slots) {
+		last_errno = errno;
+		w->slots = old;
+		w->slots_max = old_max;
+		return ECGOTHER;
+	}
+
+	mask = w->slots_max - 1;
+	for (i = 0; i < old_max; i++) {
+		if (!old[i])
+			continue;
+
+		node = old[i] - 1;
+		if ((node & ((1 << CG_EVENT_NODE_SHIFT) - 1)) ==
+		    CG_EVENT_NODE_PARENT)
+			wd = w->parents[node >> CG_EVENT_NODE_SHIFT].wd;
+		else
+			wd = w->watches[node >> CG_EVENT_NODE_SHIFT]
+				     .files[node & 1].wd;
+
+		slot = cg_event_wd_hash(wd) & mask;
+		while (w->slots[slot])
+			slot = (slot + 1) & mask;
+		w->slots[slot] = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+/*
+ * Enter an inotify watch descriptor in the hash.  It is kept at most half
+ * full.  The descriptor has to be stored in its file or parent first.
+ */
+static int cg_event_slot_insert(struct cgroup_event_watcher *w, int wd,
+				int node)
+{
+	unsigned int slot;
+	int ret;
+
+	if ((w->slots_count + 1) * 2 > w->slots_max) {
+		ret = cg_event_slot_grow(w);
+		if (ret)
+			return ret;
+	}
+
+	slot = cg_event_slot_find(w, wd);
+	w->slots[slot] = node + 1;
+	w->slots_count++;
+
+	return 0;
+}
+
+/*
+ * Remove an inotify watch descriptor from the hash, moving back the
+ * entries that follow it so that the lookups do not stop early.
+ */
+static void cg_event_slot_remove(struct cgroup_event_watcher *w, int wd)
+{
+	unsigned int mask = w->slots_max - 1;
+	unsigned int slot, next, home;
+	int node, next_wd;
+
+	slot = cg_event_slot_find(w, wd);
+	if (!w->slots[slot])
+		return;
+
+	w->slots[slot] = 0;
+	w->slots_count--;
+
+	for (next = (slot + 1) & mask; w->slots[next];
+	     next = (next + 1) & mask) {
+		node = w->slots[next] - 1;
+		if ((node & ((1 << CG_EVENT_NODE_SHIFT) - 1)) ==
+		    CG_EVENT_NODE_PARENT)
+			next_wd = w->parents[node >> CG_EVENT_NODE_SHIFT].wd;
+		else
+			next_wd = w->watches[node >> CG_EVENT_NODE_SHIFT]
+					  .files[node & 1].wd;
+
+		/* Move the entry if the hole is between its home and it */
+		home = cg_event_wd_hash(next_wd) & mask;
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			w->slots[slot] = w->slots[next];
+			w->slots[next] = 0;
+			slot = next;
+		}
+	}
+}
+
+/*
+ * Look up the watch descriptor of an inotify event.
+ *	@return the node, -1 if the descriptor is not watched anymore
+ */
+static int cg_event_node_find(struct cgroup_event_watcher *w, int wd)
+{
+	unsigned int slot;
+
+	if (!w->slots_max)
+		return -1;
+
+	slot = cg_event_slot_find(w, wd);
+
+	return w->slots[slot] - 1;
+}
+
+struct cgroup_event_watcher *cgroup_event_watcher_new(void)
+{
+	struct cgroup_event_watcher *w;
+	int i;
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		last_errno = errno;
+		return NULL;
+	}
+
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd < 0) {
+		last_errno = errno;
+		free(w);
+		return NULL;
+	}
+
+	w->reader = cgroup_stat_reader_new();
+	if (!w->reader)
+		goto err;
+
+	for (i = 0; i < CGROUP_EVENT_REMOVED; i++) {
+		w->keys[i] = cgroup_stat_key_id(cg_event_keys[i]);
+		if (w->keys[i] < 0)
+			goto err;
+	}
+
+	return w;
+err:
+	cgroup_event_watcher_free(&w);
+	return NULL;
+}
+
+/*
+ * Stop the inotify watches of the files of a group.
+ */
+static void cg_event_files_stop(struct cgroup_event_watcher *w, int id)
+{
+	struct cg_event_watch *watch = &w->watches[id];
+	int i;
+
+	for (i = 0; i < CG_EVENT_FILES; i++) {
+		if (watch->files[i].wd < 0)
+			continue;
+
+		cg_event_slot_remove(w, watch->files[i].wd);
+		inotify_rm_watch(w->fd, watch->files[i].wd);
+		watch->files[i].wd = -1;
+	}
+}
+
+/*
+ * Stop the inotify watches of a group, it reports nothing more.
+ */
+static void cg_event_watch_stop(struct cgroup_event_watcher *w, int id)
+{
+	struct cg_event_watch *watch = &w->watches[id];
+	struct cg_event_parent *parent;
+
+	cg_event_files_stop(w, id);
+
+	if (watch->parent < 0)
+		return;
+
+	parent = &w->parents[watch->parent];
+	if (--parent->refs == 0) {
+		cg_event_slot_remove(w, parent->wd);
+		inotify_rm_watch(w->fd, parent->wd);
+		parent->wd = -1;
+	}
+	watch->parent = -1;
+}
+
+void cgroup_event_watcher_free(struct cgroup_event_watcher **watcher)
+{
+	struct cgroup_event_watcher *w;
+	int i, j;
+
+	if (!watcher || !*watcher)
+		return;
+
+	w = *watcher;
+	for (i = 0; i < w->watches_max; i++) {
+		free(w->watches[i].path);
+		for (j = 0; j < CG_EVENT_FILES; j++)
+			free(w->watches[i].files[j].path);
+	}
+
+	/* Closing the inotify instance drops all its watches */
+	close(w->fd);
+	cgroup_stat_reader_free(&w->reader);
+	free(w->watches);
+	free(w->parents);
+	free(w->slots);
+	free(w->dirty);
+	free(w->events);
+	free(w);
+	*watcher = NULL;
+}
+
+static int cg_event_watches_grow(struct cgroup_event_watcher *w)
+{
+	struct cg_event_watch *watches;
+	int max, i, j;
+	int *dirty;
+
+	max = w->watches_max + CG_EVENT_WATCHES_CHUNK;
+
+	watches = realloc(w->watches, max * sizeof(*watches));
+	if (!watches)
+		goto err;
+	w->watches = watches;
+
+	dirty = realloc(w->dirty, max * CG_EVENT_FILES * sizeof(*dirty));
+	if (!dirty)
+		goto err;
+	w->dirty = dirty;
+
+	memset(&watches[w->watches_max], 0,
+	       CG_EVENT_WATCHES_CHUNK * sizeof(*watches));
+	for (i = w->watches_max; i < max; i++) {
+		watches[i].parent = -1;
+		for (j = 0; j < CG_EVENT_FILES; j++)
+			watches[i].files[j].wd = -1;
+	}
+	w->watches_max = max;
+
+	return 0;
+err:
+	last_errno = errno;
+	return ECGOTHER;
+}
+
+/*
+ * Watch the directory holding a group, or take a reference on it if another
+ * group of this directory is watched already.
+ *	@param file A watched file of the group
+ */
+static int cg_event_parent_get(struct cgroup_event_watcher *w, int id,
+			       const char *file)
+{
+	struct cg_event_watch *watch = &w->watches[id];
+	struct cg_event_parent *parents;
+	const char *end, *name;
+	char dir[FILENAME_MAX];
+	int i, max, wd;
+	int node, ret;
+
+	/* file is <dir>/<name>/<file name> */
+	end = strrchr(file, '/');
+	for (name = end; name > file && name[-1] != '/'; name--)
+		;
+	if (name == file)
+		return 0;
+
+	snprintf(dir, sizeof(dir), "%.*s", (int)(name - file), file);
+	wd = inotify_add_watch(w->fd, dir, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+	if (wd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	watch->name = name;
+	watch->name_len = end - name;
+
+	/* The kernel returns the same descriptor for the same directory */
+	node = cg_event_node_find(w, wd);
+	if (node >= 0) {
+		watch->parent = node >> CG_EVENT_NODE_SHIFT;
+		w->parents[watch->parent].refs++;
+		return 0;
+	}
+
+	for (i = 0; i < w->parents_max; i++)
+		if (!w->parents[i].refs)
+			break;
+
+	if (i == w->parents_max) {
+		max = w->parents_max + CG_EVENT_WATCHES_CHUNK;
+		parents = realloc(w->parents, max * sizeof(*parents));
+		if (!parents) {
+			last_errno = errno;
+			goto err;
+		}
+		memset(&parents[w->parents_max], 0,
+		       CG_EVENT_WATCHES_CHUNK * sizeof(*parents));
+		w->parents = parents;
+		w->parents_max = max;
+	}
+
+	w->parents[i].wd = wd;
+	ret = cg_event_slot_insert(w, wd,
+				   i << CG_EVENT_NODE_SHIFT |
+				   CG_EVENT_NODE_PARENT);
+	if (ret)
+		goto err;
+
+	w->parents[i].refs = 1;
+	watch->parent = i;
+
+	return 0;
+err:
+	inotify_rm_watch(w->fd, wd);
+	return ECGOTHER;
+}
+
+static int cg_event_reserve(struct cgroup_event_watcher *w)
+{
+	struct cgroup_event *events;
+	int max;
+
+	max = w->events_max ? w->events_max * 2 : CG_EVENT_WATCHES_CHUNK;
+	events = realloc(w->events, max * sizeof(*events));
+	if (!events) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	w->events = events;
+	w->events_max = max;
+
+	return 0;
+}
+
+static int cg_event_report(struct cgroup_event_watcher *w, int id,
+			   enum cgroup_event_type type, uint64_t value,
+			   uint64_t delta)
+{
+	struct cgroup_event *ev;
+	int ret;
+
+	if (w->events_count == w->events_max) {
+		ret = cg_event_reserve(w);
+		if (ret)
+			return ret;
+	}
+
+	ev = &w->events[w->events_count++];
+	ev->id = id;
+	ev->path = w->watches[id].path;
+	ev->type = type;
+	ev->value = value;
+	ev->delta = delta;
+
+	return 0;
+}
+
+/*
+ * Read a watched file and compare its values with the previous ones.
+ *	@param report Add the changes to the events of the watcher
+ *	@return 0 on success, ECGROUPNOTEXIST if the group is gone
+ */
+static int cg_event_file_read(struct cgroup_event_watcher *w, int id,
+			      int file, bool report)
+{
+	struct cg_event_file *f = &w->watches[id].files[file];
+	const struct cgroup_stat_entry *entries;
+	int first, last, type;
+	uint64_t delta;
+	int i, count, ret;
+
+	ret = cg_stat_read_path(w->reader, f->path, &entries, &count);
+	if (ret) {
+		if (last_errno == ENOENT || last_errno == ENODEV)
+			return ECGROUPNOTEXIST;
+		return ret;
+	}
+
+	first = file == CG_EVENT_NODE_GROUP ? CG_EVENT_GROUP_FIRST :
+					      CG_EVENT_MEMORY_FIRST;
+	last = file == CG_EVENT_NODE_GROUP ? CG_EVENT_MEMORY_FIRST :
+					     CGROUP_EVENT_REMOVED;
+
+	for (i = 0; i < count; i++) {
+		for (type = first; type < last; type++)
+			if (entries[i].key == w->keys[type])
+				break;
+
+		if (type == last || entries[i].value == f->values[type])
+			continue;
+
+		if (type < CG_EVENT_MEMORY_FIRST ||
+		    entries[i].value < f->values[type])
+			delta = 0;
+		else
+			delta = entries[i].value - f->values[type];
+		f->values[type] = entries[i].value;
+
+		if (report) {
+			ret = cg_event_report(w, id, type, entries[i].value,
+					      delta);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Report the removal of a group and stop watching its files.  Its parent
+ * directory is still watched, for the creation of the group.
+ */
+static int cg_event_removed(struct cgroup_event_watcher *w, int id)
+{
+	struct cg_event_watch *watch = &w->watches[id];
+
+	if (watch->removed)
+		return 0;
+
+	watch->removed = true;
+	cg_event_files_stop(w, id);
+
+	return cg_event_report(w, id, CGROUP_EVENT_REMOVED, 0, 0);
+}
+
+static void cg_event_mark_dirty(struct cgroup_event_watcher *w, int id,
+				int file)
+{
+	struct cg_event_file *f = &w->watches[id].files[file];
+
+	if (f->dirty)
+		return;
+
+	f->dirty = true;
+	w->dirty[w->dirty_count++] = id << 1 | file;
+}
+
+static void cg_event_mark_all_dirty(struct cgroup_event_watcher *w)
+{
+	int i, j;
+
+	for (i = 0; i < w->watches_max; i++)
+		for (j = 0; j < CG_EVENT_FILES; j++)
+			if (w->watches[i].files[j].wd >= 0)
+				cg_event_mark_dirty(w, i, j);
+}
+
+static void cg_event_free_watch(struct cg_event_watch *watch)
+{
+	int i;
+
+	free(watch->path);
+	watch->path = NULL;
+	watch->removed = false;
+	for (i = 0; i < CG_EVENT_FILES; i++) {
+		free(watch->files[i].path);
+		watch->files[i].path = NULL;
+		watch->files[i].dirty = false;
+	}
+}
+
+/*
+ * Start watching a file of a group.
+ *	@param controller The controller of the file, NULL for the unified
+ *	hierarchy
+ */
+static int cg_event_file_add(struct cgroup_event_watcher *w, int id,
+			     int file, const char *controller)
+{
+	struct cg_event_file *f = &w->watches[id].files[file];
+	enum cg_version_t version;
+	char path[FILENAME_MAX];
+	int ret;
+
+	if (cgroup_get_controller_version(controller, &version) ||
+	    version != CGROUP_V2 ||
+	    !cg_build_path(w->watches[id].path, path, controller))
+		return ECGROUPUNSUPP;
+
+	/* A recreated group keeps its path, the name of the watch is in it */
+	if (!f->path &&
+	    asprintf(&f->path, "%s%s", path, cg_event_file_names[file]) < 0) {
+		f->path = NULL;
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	f->wd = inotify_add_watch(w->fd, f->path, IN_MODIFY);
+	if (f->wd < 0) {
+		if (errno != ENOENT) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		/* Either the group or the file is missing */
+		return access(path, F_OK) ? ECGROUPNOTEXIST : ECGROUPUNSUPP;
+	}
+
+	/* The kernel returns the same descriptor for the same file */
+	if (cg_event_node_find(w, f->wd) >= 0) {
+		f->wd = -1;
+		return ECGVALUEEXISTS;
+	}
+
+	ret = cg_event_slot_insert(w, f->wd, id << CG_EVENT_NODE_SHIFT | file);
+	if (ret) {
+		inotify_rm_watch(w->fd, f->wd);
+		f->wd = -1;
+		return ret;
+	}
+
+	memset(f->values, 0, sizeof(f->values));
+
+	return cg_event_file_read(w, id, file, false);
+}
+
+/*
+ * Start watching the files of a group given to cgroup_event_watcher_add().
+ */
+static int cg_event_files_add(struct cgroup_event_watcher *w, int id)
+{
+	struct cg_event_watch *watch = &w->watches[id];
+	int ret = 0;
+
+	if (watch->mask & CGROUP_EVENT_FILE_GROUP)
+		ret = cg_event_file_add(w, id, CG_EVENT_NODE_GROUP, NULL);
+	if (!ret && (watch->mask & CGROUP_EVENT_FILE_MEMORY))
+		ret = cg_event_file_add(w, id, CG_EVENT_NODE_MEMORY,
+					"memory");
+
+	return ret;
+}
+
+int cgroup_event_watcher_add(struct cgroup_event_watcher *watcher,
+			     const char *path, int files, int *id)
+{
+	struct cg_event_watch *watch;
+	const char *file;
+	int i, ret = 0;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!watcher || !id || !files ||
+	    (files & ~(CGROUP_EVENT_FILE_GROUP | CGROUP_EVENT_FILE_MEMORY)))
+		return ECGINVAL;
+
+	for (i = 0; i < watcher->watches_max; i++)
+		if (!watcher->watches[i].path)
+			break;
+
+	if (i == watcher->watches_max) {
+		ret = cg_event_watches_grow(watcher);
+		if (ret)
+			return ret;
+	}
+	watch = &watcher->watches[i];
+
+	watch->path = strdup(path ? path : "/");
+	if (!watch->path) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	watch->mask = files;
+	ret = cg_event_files_add(watcher, i);
+	if (!ret) {
+		file = watch->files[CG_EVENT_NODE_GROUP].path;
+		if (!file)
+			file = watch->files[CG_EVENT_NODE_MEMORY].path;
+		ret = cg_event_parent_get(watcher, i, file);
+	}
+	if (ret) {
+		cg_event_watch_stop(watcher, i);
+		cg_event_free_watch(watch);
+		return ret;
+	}
+
+	*id = i;
+
+	return 0;
+}
+
+int cgroup_event_watcher_remove(struct cgroup_event_watcher *watcher,
+				int id)
+{
+	if (!watcher || id < 0 || id >= watcher->watches_max ||
+	    !watcher->watches[id].path)
+		return ECGINVAL;
+
+	cg_event_watch_stop(watcher, id);
+	cg_event_free_watch(&watcher->watches[id]);
+
+	return 0;
+}
+
+int cgroup_event_watcher_fd(struct cgroup_event_watcher *watcher)
+{
+	return watcher ? watcher->fd : -1;
+}
+
+/*
+ * Report the removal of the watched groups deleted from a directory.
+ */
+static int cg_event_parent_delete(struct cgroup_event_watcher *w,
+				  int parent, const char *name)
+{
+	struct cg_event_watch *watch;
+	int i, ret;
+
+	for (i = 0; i < w->watches_max; i++) {
+		watch = &w->watches[i];
+		if (!watch->path || watch->parent != parent ||
+		    strncmp(watch->name, name, watch->name_len) ||
+		    name[watch->name_len])
+			continue;
+
+		ret = cg_event_removed(w, i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Watch the files of a removed group again, if it was created again.
+ */
+static int cg_event_recreated(struct cgroup_event_watcher *w, int id)
+{
+	struct cg_event_watch *watch = &w->watches[id];
+	int ret;
+
+	ret = cg_event_files_add(w, id);
+	if (ret) {
+		cg_event_files_stop(w, id);
+
+		/* It may be gone again already, or lack the watched files */
+		if (ret == ECGROUPNOTEXIST || ret == ECGROUPUNSUPP)
+			return 0;
+		return ret;
+	}
+
+	watch->removed = false;
+
+	return cg_event_report(w, id, CGROUP_EVENT_CREATED, 0, 0);
+}
+
+/*
+ * Watch the removed groups created again in a directory.
+ *	@param name The name of the created directory, NULL to check all the
+ *	removed groups of all directories after events were lost
+ */
+static int cg_event_parent_create(struct cgroup_event_watcher *w,
+				  int parent, const char *name)
+{
+	struct cg_event_watch *watch;
+	int i, ret;
+
+	for (i = 0; i < w->watches_max; i++) {
+		watch = &w->watches[i];
+		if (!watch->path || !watch->removed || watch->parent < 0)
+			continue;
+
+		if (name && (watch->parent != parent ||
+			     strncmp(watch->name, name, watch->name_len) ||
+			     name[watch->name_len]))
+			continue;
+
+		ret = cg_event_recreated(w, i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * The directory holding watched groups was removed, they cannot be created
+ * again.  Report their removal and forget the directory.
+ */
+static int cg_event_parent_removed(struct cgroup_event_watcher *w,
+				   int parent)
+{
+	struct cg_event_watch *watch;
+	int i, ret = 0;
+
+	cg_event_slot_remove(w, w->parents[parent].wd);
+	w->parents[parent].wd = -1;
+	w->parents[parent].refs = 0;
+
+	for (i = 0; i < w->watches_max; i++) {
+		watch = &w->watches[i];
+		if (!watch->path || watch->parent != parent)
+			continue;
+
+		watch->parent = -1;
+		if (!ret)
+			ret = cg_event_removed(w, i);
+	}
+
+	return ret;
+}
+
+/*
+ * Handle the events queued by inotify, marking the files to read.
+ */
+static int cg_event_drain(struct cgroup_event_watcher *w)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ie;
+	int node, kind, ret;
+	ssize_t n;
+	char *p;
+
+	for (;;) {
+		n = read(w->fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		for (p = buf; p < buf + n; p += sizeof(*ie) + ie->len) {
+			ie = (const struct inotify_event *)p;
+
+			/* Events were lost, read all the files */
+			if (ie->mask & IN_Q_OVERFLOW) {
+				cg_event_mark_all_dirty(w);
+				ret = cg_event_parent_create(w, -1, NULL);
+				if (ret)
+					return ret;
+				continue;
+			}
+
+			node = cg_event_node_find(w, ie->wd);
+			if (node < 0)
+				continue;
+
+			kind = node & ((1 << CG_EVENT_NODE_SHIFT) - 1);
+			node >>= CG_EVENT_NODE_SHIFT;
+
+			if (kind == CG_EVENT_NODE_PARENT) {
+				if (ie->mask & IN_IGNORED)
+					ret = cg_event_parent_removed(w, node);
+				else if (!ie->len)
+					ret = 0;
+				else if (ie->mask & IN_DELETE)
+					ret = cg_event_parent_delete(w, node,
+								     ie->name);
+				else
+					ret = cg_event_parent_create(w, node,
+								     ie->name);
+			} else if (ie->mask & IN_IGNORED) {
+				/* The kernel dropped the watch */
+				ret = cg_event_removed(w, node);
+			} else {
+				cg_event_mark_dirty(w, node, kind);
+				ret = 0;
+			}
+
+			if (ret)
+				return ret;
+		}
+	}
+}
+
+int cgroup_event_watcher_read(struct cgroup_event_watcher *watcher,
+			      const struct cgroup_event **events, int *count)
+{
+	struct cg_event_watch *watch;
+	int i, id, file, ret;
+
+	if (!watcher || !events || !count)
+		return ECGINVAL;
+
+	watcher->events_count = 0;
+	watcher->dirty_count = 0;
+
+	ret = cg_event_drain(watcher);
+
+	/* Each file is read once, however many times it changed */
+	for (i = 0; i < watcher->dirty_count; i++) {
+		id = watcher->dirty[i] >> 1;
+		file = watcher->dirty[i] & 1;
+		watch = &watcher->watches[id];
+
+		watch->files[file].dirty = false;
+		if (ret || watch->removed)
+			continue;
+
+		ret = cg_event_file_read(watcher, id, file, true);
+		if (ret == ECGROUPNOTEXIST)
+			ret = cg_event_removed(watcher, id);
+	}
+
+	*events = watcher->events;
+	*count = watcher->events_count;
+
+	return ret;
+}
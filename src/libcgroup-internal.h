@@ -22,6 +22,7 @@ extern "C" {
 #include <limits.h>
 #include <mntent.h>
 #include <setjmp.h>
+#include <stdint.h>
 #include <fts.h>
 
 #include <sys/stat.h>
@@ -35,23 +36,75 @@ extern "C" {
 /* Maximum length of a value */
 #define CG_CONTROL_VALUE_MAX	4096
 
+/*
+ * The library grows its tables of controllers and values as needed, these
+ * only bound the fixed lists of the tools, e.g. the -g options.
+ */
 #define CG_NV_MAX		100
 #define CG_CONTROLLER_MAX	100
 #define CG_OPTIONS_MAX		100
-/* Max number of mounted hierarchies. Event if one controller is mounted per
- * hier, it can not exceed CG_CONTROLLER_MAX
- */
+/* Max number of hierarchies listed on a tool command line */
 #define CG_HIER_MAX  CG_CONTROLLER_MAX
 
 /* Maximum length of a controller's name */
 #define CONTROL_NAMELEN_MAX	32
 
+/* Directory whose subdirectories cgroup_init() uses instead of the mounts */
+#define CGROUP_ROOT_OVERRIDE_ENV	"CGROUP_ROOT_OVERRIDE"
+
+/*
+ * Rules file read instead of CGRULES_CONF_FILE and CGRULES_CONF_DIR, in the
+ * unit test builds only
+ */
+#define CGRULES_CONF_OVERRIDE_ENV	"CGRULES_CONF_OVERRIDE"
+
 /* Definitions for the uid and gid members of a cgroup_rules */
 #define CGRULE_INVALID	((uid_t) -1)
 #define CGRULE_WILD	((uid_t) -2)
 
 #define CGRULE_SUCCESS_STORE_PID	"SUCCESS_STORE_PID"
 
+/* cgrulesengd sends a text snapshot of its statistics to each client */
+#define CGRULE_CGRED_STATS_SOCKET_PATH	CGRULE_CGRED_SOCKET_PATH ".stats"
+
+/*
+ * Batched protocol of cgrulesengd.  A client keeps a SOCK_SEQPACKET
+ * connection open and sends messages made of a struct cgrule_batch_hdr
+ * followed by hdr.count struct cgrule_batch_item.  The daemon answers every
+ * message with one struct cgrule_batch_reply carrying the same seq.
+ */
+#define CGRULE_CGRED_BATCH_SOCKET_PATH	CGRULE_CGRED_SOCKET_PATH ".batch"
+#define CGRULE_BATCH_MAGIC		0x43475244	/* "CGRD" */
+#define CGRULE_BATCH_VERSION		1
+#define CGRULE_BATCH_MAX_ITEMS		256
+
+struct cgrule_batch_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+	uint32_t seq;
+};
+
+struct cgrule_batch_item {
+	int32_t pid;
+	int32_t flags;
+};
+
+struct cgrule_batch_reply {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t failed;	/* number of items which were not stored */
+	uint32_t seq;
+	int32_t status;		/* 0 on success, errno value otherwise */
+};
+
+#define CGRULE_BATCH_MSG_MAX	(sizeof(struct cgrule_batch_hdr) + \
+	CGRULE_BATCH_MAX_ITEMS * sizeof(struct cgrule_batch_item))
+
+/* Worker threads and chunk size of cgroup_change_all_cgroups() */
+#define CG_CHANGE_ALL_MAX_WORKERS	8
+#define CG_CHANGE_ALL_CHUNK		256
+
 /* Definitions for the cgrules options field */
 #define CGRULE_OPTION_IGNORE		"ignore"
 
@@ -103,7 +156,17 @@ struct control_value {
 
 struct cgroup_controller {
 	char name[CONTROL_NAMELEN_MAX];
-	struct control_value *values[CG_NV_MAX];
+	struct control_value **values;
+	int values_max;		/* allocated entries of values */
+
+	/*
+	 * Hash of the value names, see cg_value_find().  Each slot holds the
+	 * position in values + 1, 0 if it is free.
+	 */
+	int *value_slots;
+	int value_slots_max;	/* power of two, 0 if not built */
+	int value_slots_count;	/* values entered in value_slots */
+
 	struct cgroup *cgroup;
 	int index;
 	enum cg_version_t version;
@@ -111,8 +174,18 @@ struct cgroup_controller {
 
 struct cgroup {
 	char name[FILENAME_MAX];
-	struct cgroup_controller *controller[CG_CONTROLLER_MAX];
+	struct cgroup_controller **controller;
+	int controller_max;	/* allocated entries of controller */
 	int index;
+
+	/*
+	 * Hash of the controller names, see cg_controller_find().  Each slot
+	 * holds the position in controller + 1, 0 if it is free.  Like the
+	 * hash of the values, it is rebuilt when controllers were dropped.
+	 */
+	int *controller_slots;
+	int controller_slots_max;	/* power of two, 0 if not built */
+	int controller_slots_count;	/* controllers in controller_slots */
 	uid_t tasks_uid;
 	gid_t tasks_gid;
 	mode_t task_fperm;
@@ -219,6 +292,12 @@ struct cgroup_dictionary_iterator {
  */
 extern __thread int last_errno;
 
+/* Set once cgroup_init() or cgroup_init_mount_table() succeeded */
+extern int cgroup_initialized;
+
+/* Set if cg_mounts was supplied by the caller, not read from the system */
+extern int cg_mount_table_injected;
+
 /**
  * 'Exception handler' for lex parser.
  */
@@ -228,22 +307,123 @@ extern jmp_buf parser_error_env;
 char *cg_build_path(const char *name, char *path, const char *type);
 int cgroup_get_uid_gid_from_procfs(pid_t pid, uid_t *euid, gid_t *egid);
 int cgroup_get_procname_from_procfs(pid_t pid, char **procname);
+
+/**
+ * Open the /proc/<pid> directory of a process.  The files below the
+ * returned descriptor always belong to that process, even if the pid is
+ * reused later; reading them fails once the process has exited.
+ *
+ * @param pid The process id
+ * @return the directory file descriptor, -1 on error
+ */
+int cg_open_procfd(pid_t pid);
+
+/**
+ * Read the per-process directories from another directory than /proc.  This
+ * allows to replay recorded processes against a fake procfs.  It must be set
+ * before any process is looked up and is not thread safe.
+ *
+ * @param path The directory to use, NULL restores /proc
+ * @return 0 on success, ECGINVAL if the path is too long
+ */
+int cg_set_procfs_path(const char *path);
+
+/**
+ * Same as cgroup_get_uid_gid_from_procfs(), reading through a descriptor
+ * returned by cg_open_procfd().
+ */
+int cg_get_uid_gid_from_procfd(int procfd, uid_t *euid, gid_t *egid);
+
+/**
+ * Same as cgroup_get_procname_from_procfs(), reading through a descriptor
+ * returned by cg_open_procfd().
+ */
+int cg_get_procname_from_procfd(int procfd, char **procname);
+
 int cg_mkdir_p(const char *path);
+
+/**
+ * Hash a controller or value name.
+ *
+ * @param name The name
+ * @return the FNV-1a hash of the name
+ */
+unsigned int cg_name_hash(const char *name);
+
+/**
+ * Same as cg_name_hash(), for a name that is not NUL terminated.
+ *
+ * @param name The name
+ * @param len Length of the name
+ * @return the FNV-1a hash of the name
+ */
+unsigned int cg_name_hash_len(const char *name, size_t len);
+
+/**
+ * Find a value of a controller by name.
+ *
+ * @param controller The controller
+ * @param name The name of the value
+ * @return the position in controller->values, -1 if there is none
+ */
+int cg_value_find(struct cgroup_controller *controller, const char *name);
+
+/**
+ * Append a value to a controller, growing its values as needed.  The
+ * controller takes ownership of the value on success.
+ *
+ * @param controller The controller
+ * @param value The value, its name must not be in the controller yet
+ * @return 0 on success, ECGOTHER if out of memory
+ */
+int cg_value_append(struct cgroup_controller *controller,
+		    struct control_value *value);
+
+/**
+ * Drop the name hash of a controller.  It must be called after values are
+ * removed or reordered other than by the wrapper functions; the hash is
+ * rebuilt on the next lookup.
+ *
+ * @param controller The controller
+ */
+void cg_value_index_reset(struct cgroup_controller *controller);
+
+/**
+ * Read and parse a stats file given by its full path, see
+ * cgroup_stat_read().
+ *
+ * @param reader The reader
+ * @param file The path of the file
+ * @param entries Output, the values of the file
+ * @param count Output, the number of values
+ * @return 0 on success, ECGOTHER with last_errno set on error
+ */
+int cg_stat_read_path(struct cgroup_stat_reader *reader, const char *file,
+		      const struct cgroup_stat_entry **entries, int *count);
+
 struct cgroup *create_cgroup_from_name_value_pairs(const char *name,
 		struct control_value *name_value, int nv_number);
 void init_cgroup_table(struct cgroup *cgroups, size_t count);
 
 /*
- * Main mounting structures
+ * Main mounting structures.  cg_mounts points to cg_mount_table until more
+ * mounts are found than it holds, and then to a table on the heap, which is
+ * grown as needed.  Either one always ends with an entry with an empty name.
+ * cg_mount_table is exported, it holds the first CG_CONTROLLER_MAX - 1
+ * mounts for the existing users.
  */
 extern struct cg_mount_table_s cg_mount_table[CG_CONTROLLER_MAX];
+extern struct cg_mount_table_s *cg_mounts;
 extern pthread_rwlock_t cg_mount_table_lock;
 
 /*
- * config related structures
+ * config related structures.  cg_namespace_table has an entry for each
+ * cg_mounts entry known when the namespaces were loaded, NULL if there
+ * are none.
  */
 
-extern __thread char *cg_namespace_table[CG_CONTROLLER_MAX];
+extern __thread char **cg_namespace_table;
+extern __thread int cg_namespace_table_max;
 
 /*
  * config related API
@@ -341,7 +521,7 @@ char *cg_build_path_locked(const char *setting, char *path,
  * @param ctrl_dir dirent representation of the setting, e.g. memory.stat
  * @param cgroup current cgroup
  * @param cgc current cgroup controller
- * @param cg_index Index into the cg_mount_table of the cgroup
+ * @param cg_index Index into the cg_mounts of the cgroup
  *
  * @note The cg_mount_table_lock must be held prior to calling this function
  */
@@ -0,0 +1,356 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/**
+ * Pressure stall information triggers.
+ *
+ * A trigger is registered by writing it to a pressure file of a cgroup v2
+ * group, the kernel then wakes up the pollers of this file descriptor with
+ * POLLPRI when it fires.  A monitor gathers many triggers in one epoll
+ * set, and remembers the group and the resource of each of them.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+#include <libcgroup-internal.h>
+
+#include <sys/epoll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/* The triggers of a monitor grow by this many entries */
+#define CG_PSI_TRIGGERS_CHUNK	16
+
+/* The pressure file and the controller of each resource */
+static const char * const cg_psi_files[CGROUP_PSI_MAX] = {
+	[CGROUP_PSI_CPU] = "cpu.pressure",
+	[CGROUP_PSI_MEMORY] = "memory.pressure",
+	[CGROUP_PSI_IO] = "io.pressure",
+};
+
+static const char * const cg_psi_controllers[CGROUP_PSI_MAX] = {
+	[CGROUP_PSI_CPU] = "cpu",
+	[CGROUP_PSI_MEMORY] = "memory",
+	[CGROUP_PSI_IO] = "io",
+};
+
+struct cg_psi_trigger {
+	int fd;			/* -1 if the slot is free */
+	char *path;
+	enum cgroup_psi_resource resource;
+};
+
+struct cgroup_psi_monitor {
+	int epoll_fd;
+
+	/* Indexed by the id of the triggers */
+	struct cg_psi_trigger *triggers;
+	int triggers_max;
+
+	/* Both sized like triggers, so waiting allocates nothing */
+	struct epoll_event *epoll_events;
+	struct cgroup_psi_event *events;
+};
+
+/*
+ * Open the pressure file of a group.
+ *	@return 0 on success, an ECG* error else
+ */
+static int cg_psi_open(const char *path, enum cgroup_psi_resource resource,
+		       int *fd)
+{
+	const char *controller = cg_psi_controllers[resource];
+	char file[FILENAME_MAX];
+	enum cg_version_t version;
+	size_t len, file_len;
+
+	/*
+	 * Every cgroup v2 group has the pressure files, even when the
+	 * controller is not enabled or is mounted on a cgroup v1 hierarchy
+	 * next to the unified one.  Fall back to the unified hierarchy then.
+	 */
+	if (cgroup_get_controller_version(controller, &version) ||
+	    version != CGROUP_V2)
+		controller = NULL;
+
+	if (!cg_build_path(path, file, controller))
+		return ECGROUPUNSUPP;
+
+	len = strlen(file);
+	file_len = strlen(cg_psi_files[resource]);
+	if (len + file_len >= sizeof(file))
+		return ECGINVAL;
+	memcpy(file + len, cg_psi_files[resource], file_len + 1);
+
+	*fd = open(file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (*fd >= 0)
+		return 0;
+
+	switch (errno) {
+	case ENOENT:
+		/* Either the group or the pressure file is missing */
+		file[len] = '\0';
+		return access(file, F_OK) ? ECGROUPNOTEXIST : ECGROUPUNSUPP;
+	case EPERM:
+	case EACCES:
+		return ECGROUPNOTALLOWED;
+	default:
+		last_errno = errno;
+		return ECGOTHER;
+	}
+}
+
+int cgroup_psi_trigger_open(const char *path,
+			    enum cgroup_psi_resource resource,
+			    const char *trigger, int *fd)
+{
+	int ret;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!trigger || !fd || resource < 0 || resource >= CGROUP_PSI_MAX)
+		return ECGINVAL;
+
+	ret = cg_psi_open(path, resource, fd);
+	if (ret)
+		return ret;
+
+	/* The kernel expects the terminating NUL too */
+	if (write(*fd, trigger, strlen(trigger) + 1) >= 0)
+		return 0;
+
+	switch (errno) {
+	case EINVAL:
+	case ERANGE:
+		ret = ECGINVAL;
+		break;
+	case EOPNOTSUPP:
+		ret = ECGROUPUNSUPP;
+		break;
+	case EPERM:
+	case EACCES:
+		ret = ECGROUPNOTALLOWED;
+		break;
+	default:
+		last_errno = errno;
+		ret = ECGOTHER;
+		break;
+	}
+
+	cgroup_dbg("failed to set trigger \"%s\" on %s of %s: %s\n", trigger,
+		   cg_psi_files[resource], path ? path : "/", strerror(errno));
+	close(*fd);
+	*fd = -1;
+
+	return ret;
+}
+
+static int cg_psi_monitor_grow(struct cgroup_psi_monitor *monitor)
+{
+	struct cgroup_psi_event *events;
+	struct cg_psi_trigger *triggers;
+	struct epoll_event *epoll_events;
+	int max, i;
+
+	max = monitor->triggers_max + CG_PSI_TRIGGERS_CHUNK;
+
+	triggers = realloc(monitor->triggers, max * sizeof(*triggers));
+	if (!triggers)
+		goto err;
+	monitor->triggers = triggers;
+
+	epoll_events = realloc(monitor->epoll_events,
+			       max * sizeof(*epoll_events));
+	if (!epoll_events)
+		goto err;
+	monitor->epoll_events = epoll_events;
+
+	events = realloc(monitor->events, max * sizeof(*events));
+	if (!events)
+		goto err;
+	monitor->events = events;
+
+	for (i = monitor->triggers_max; i < max; i++) {
+		triggers[i].fd = -1;
+		triggers[i].path = NULL;
+	}
+	monitor->triggers_max = max;
+
+	return 0;
+err:
+	last_errno = errno;
+	return ECGOTHER;
+}
+
+struct cgroup_psi_monitor *cgroup_psi_monitor_new(void)
+{
+	struct cgroup_psi_monitor *monitor;
+
+	monitor = calloc(1, sizeof(*monitor));
+	if (!monitor) {
+		last_errno = errno;
+		return NULL;
+	}
+
+	monitor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (monitor->epoll_fd < 0) {
+		last_errno = errno;
+		free(monitor);
+		return NULL;
+	}
+
+	if (cg_psi_monitor_grow(monitor)) {
+		cgroup_psi_monitor_free(&monitor);
+		return NULL;
+	}
+
+	return monitor;
+}
+
+void cgroup_psi_monitor_free(struct cgroup_psi_monitor **monitor)
+{
+	struct cgroup_psi_monitor *m;
+	int i;
+
+	if (!monitor || !*monitor)
+		return;
+
+	m = *monitor;
+	for (i = 0; i < m->triggers_max; i++) {
+		if (m->triggers[i].fd >= 0)
+			close(m->triggers[i].fd);
+		free(m->triggers[i].path);
+	}
+
+	close(m->epoll_fd);
+	free(m->triggers);
+	free(m->epoll_events);
+	free(m->events);
+	free(m);
+	*monitor = NULL;
+}
+
+int cgroup_psi_monitor_add(struct cgroup_psi_monitor *monitor,
+			   const char *path,
+			   enum cgroup_psi_resource resource,
+			   const char *trigger, int *id)
+{
+	struct cg_psi_trigger *t;
+	struct epoll_event ev;
+	int i, ret;
+
+	if (!monitor || !id)
+		return ECGINVAL;
+
+	for (i = 0; i < monitor->triggers_max; i++)
+		if (monitor->triggers[i].fd < 0)
+			break;
+
+	if (i == monitor->triggers_max) {
+		ret = cg_psi_monitor_grow(monitor);
+		if (ret)
+			return ret;
+	}
+	t = &monitor->triggers[i];
+
+	t->path = strdup(path ? path : "/");
+	if (!t->path) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	ret = cgroup_psi_trigger_open(path, resource, trigger, &t->fd);
+	if (ret)
+		goto err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLPRI;
+	ev.data.u32 = i;
+	if (epoll_ctl(monitor->epoll_fd, EPOLL_CTL_ADD, t->fd, &ev) < 0) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		close(t->fd);
+		t->fd = -1;
+		goto err;
+	}
+
+	t->resource = resource;
+	*id = i;
+
+	return 0;
+err:
+	free(t->path);
+	t->path = NULL;
+	return ret;
+}
+
+int cgroup_psi_monitor_remove(struct cgroup_psi_monitor *monitor, int id)
+{
+	struct cg_psi_trigger *t;
+
+	if (!monitor || id < 0 || id >= monitor->triggers_max ||
+	    monitor->triggers[id].fd < 0)
+		return ECGINVAL;
+
+	/* Closing the last reference removes it from the epoll set */
+	t = &monitor->triggers[id];
+	close(t->fd);
+	t->fd = -1;
+	free(t->path);
+	t->path = NULL;
+
+	return 0;
+}
+
+int cgroup_psi_monitor_fd(struct cgroup_psi_monitor *monitor)
+{
+	return monitor ? monitor->epoll_fd : -1;
+}
+
+int cgroup_psi_monitor_wait(struct cgroup_psi_monitor *monitor, int timeout,
+			    const struct cgroup_psi_event **events,
+			    int *count)
+{
+	struct cgroup_psi_event *ev;
+	struct cg_psi_trigger *t;
+	int i, n;
+
+	if (!monitor || !events || !count)
+		return ECGINVAL;
+
+	*events = monitor->events;
+	*count = 0;
+
+	n = epoll_wait(monitor->epoll_fd, monitor->epoll_events,
+		       monitor->triggers_max, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	for (i = 0; i < n; i++) {
+		t = &monitor->triggers[monitor->epoll_events[i].data.u32];
+		ev = &monitor->events[i];
+
+		ev->id = monitor->epoll_events[i].data.u32;
+		ev->path = t->path;
+		ev->resource = t->resource;
+		ev->removed = !!(monitor->epoll_events[i].events &
+				 (EPOLLERR | EPOLLHUP));
+
+		/* Do not report a removed group again until it is removed */
+		if (ev->removed)
+			epoll_ctl(monitor->epoll_fd, EPOLL_CTL_DEL, t->fd,
+				  NULL);
+	}
+	*count = n;
+
+	return 0;
+}
@@ -33,7 +33,7 @@ class Controller:
     def __init__(self, name):
         self.name = name
         # self.settings maps to
-        # struct control_value *values[CG_NV_MAX];
+        # struct control_value **values;
         self.settings = dict()
 
     def __str__(self):
@@ -0,0 +1,975 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/**
+ * Typed reading of the cgroup stats files.
+ *
+ * A stats file is read with a single read() into the buffer of the reader
+ * and parsed in place into (key id, value) entries.  The key names are
+ * interned once per process, so a file read again costs no allocation.
+ *
+ * A collector keeps many stats files open, reads them again from offset 0
+ * and keeps their previous values in columns, to report the changes.  A file
+ * that fails to read is closed and opened again by the following samples.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <libcgroup.h>
+#include <libcgroup-internal.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+/* Initial size of the buffer of a reader, most stats files fit in it */
+#define CG_STAT_BUF_MIN		8192
+
+/* Initial number of entries of a reader */
+#define CG_STAT_ENTRIES_MIN	64
+
+/* Smallest number of slots of cg_stat_key_slots, a power of two */
+#define CG_STAT_KEY_SLOTS_MIN	256
+
+/* The sources of a collector grow by this many entries */
+#define CG_STAT_SOURCES_CHUNK	64
+
+struct cgroup_stat_reader {
+	char *buf;
+	size_t buf_size;
+	size_t len;		/* bytes read into buf */
+
+	struct cgroup_stat_entry *entries;
+	int entries_max;
+	int count;
+
+	/* Set of the keys to report, by id, NULL to report all of them */
+	unsigned char *wanted;
+	int wanted_max;
+
+	/* Keys skipped by the last parse because they were not interned */
+	int unknown;
+};
+
+/*
+ * A file sampled by a collector, with its values of the previous sample
+ * stored by column.
+ */
+struct cg_stat_source {
+	int fd;			/* -1 until the file can be opened again */
+	char *controller;
+	char *path;
+	char *file;
+
+	/* Time of the previous sample, 0 before the first one */
+	uint64_t last_ns;
+
+	unsigned char *wanted;
+	int wanted_max;
+
+	int *keys;
+	uint64_t *devs;		/* major << 32 | minor */
+	uint64_t *values;
+	int count;		/* values of the previous sample */
+	int max;		/* allocated entries of the columns */
+};
+
+struct cgroup_stat_collector {
+	struct cgroup_stat_reader *reader;
+
+	struct cg_stat_source *sources;
+	int sources_count;
+	int sources_max;
+
+	struct cgroup_stat_delta *deltas;
+	int deltas_max;
+};
+
+/*
+ * The interned keys.  Ids index cg_stat_keys, and the names are never freed,
+ * so cgroup_stat_key_name() can return them.  cg_stat_key_slots is a hash of
+ * the names, using open addressing, each slot holds the id + 1 or 0 if it is
+ * free.
+ */
+static pthread_rwlock_t cg_stat_keys_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char **cg_stat_keys;
+static int cg_stat_keys_count;
+static int cg_stat_keys_max;
+static int *cg_stat_key_slots;
+static int cg_stat_key_slots_max;
+
+/*
+ * Find an interned key. This function should be called with
+ * cg_stat_keys_lock taken.
+ *
+ *	@return the id, -1 if the key was never interned
+ */
+static int cg_stat_key_find(const char *name, size_t len)
+{
+	unsigned int mask = cg_stat_key_slots_max - 1;
+	unsigned int slot;
+	int id;
+
+	if (!cg_stat_key_slots_max)
+		return -1;
+
+	slot = cg_name_hash_len(name, len) & mask;
+	while (cg_stat_key_slots[slot]) {
+		id = cg_stat_key_slots[slot] - 1;
+		if (strncmp(cg_stat_keys[id], name, len) == 0 &&
+		    cg_stat_keys[id][len] == '\0')
+			return id;
+		slot = (slot + 1) & mask;
+	}
+
+	return -1;
+}
+
+static void cg_stat_key_insert(int id)
+{
+	unsigned int mask = cg_stat_key_slots_max - 1;
+	unsigned int slot;
+
+	slot = cg_name_hash(cg_stat_keys[id]) & mask;
+	while (cg_stat_key_slots[slot])
+		slot = (slot + 1) & mask;
+
+	cg_stat_key_slots[slot] = id + 1;
+}
+
+/*
+ * Intern a key, the hash is kept at most half full. This function should be
+ * called with cg_stat_keys_lock write locked.
+ *
+ *	@return the id, -1 if out of memory
+ */
+static int cg_stat_key_intern(const char *name, size_t len)
+{
+	char **keys;
+	int *slots;
+	char *copy;
+	int id, max;
+
+	id = cg_stat_key_find(name, len);
+	if (id >= 0)
+		return id;
+
+	if (cg_stat_keys_count >= cg_stat_keys_max) {
+		max = cg_stat_keys_max ? cg_stat_keys_max * 2 :
+		      CG_STAT_KEY_SLOTS_MIN / 2;
+		keys = realloc(cg_stat_keys, max * sizeof(*keys));
+		if (!keys)
+			goto err;
+
+		cg_stat_keys = keys;
+		cg_stat_keys_max = max;
+	}
+
+	if ((cg_stat_keys_count + 1) * 2 > cg_stat_key_slots_max) {
+		max = cg_stat_key_slots_max ? cg_stat_key_slots_max * 2 :
+		      CG_STAT_KEY_SLOTS_MIN;
+		slots = calloc(max, sizeof(*slots));
+		if (!slots)
+			goto err;
+
+		free(cg_stat_key_slots);
+		cg_stat_key_slots = slots;
+		cg_stat_key_slots_max = max;
+		for (id = 0; id < cg_stat_keys_count; id++)
+			cg_stat_key_insert(id);
+	}
+
+	copy = strndup(name, len);
+	if (!copy)
+		goto err;
+
+	id = cg_stat_keys_count++;
+	cg_stat_keys[id] = copy;
+	cg_stat_key_insert(id);
+
+	return id;
+
+err:
+	last_errno = errno;
+	return -1;
+}
+
+int cgroup_stat_key_id(const char *name)
+{
+	int id;
+
+	if (!name)
+		return -1;
+
+	pthread_rwlock_wrlock(&cg_stat_keys_lock);
+	id = cg_stat_key_intern(name, strlen(name));
+	pthread_rwlock_unlock(&cg_stat_keys_lock);
+
+	return id;
+}
+
+const char *cgroup_stat_key_name(int id)
+{
+	const char *name = NULL;
+
+	pthread_rwlock_rdlock(&cg_stat_keys_lock);
+	if (id >= 0 && id < cg_stat_keys_count)
+		name = cg_stat_keys[id];
+	pthread_rwlock_unlock(&cg_stat_keys_lock);
+
+	return name;
+}
+
+struct cgroup_stat_reader *cgroup_stat_reader_new(void)
+{
+	struct cgroup_stat_reader *reader;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		goto err;
+
+	reader->buf = malloc(CG_STAT_BUF_MIN);
+	reader->entries = malloc(CG_STAT_ENTRIES_MIN *
+				 sizeof(*reader->entries));
+	if (!reader->buf || !reader->entries)
+		goto err;
+
+	reader->buf_size = CG_STAT_BUF_MIN;
+	reader->entries_max = CG_STAT_ENTRIES_MIN;
+
+	return reader;
+
+err:
+	last_errno = errno;
+	cgroup_stat_reader_free(&reader);
+	return NULL;
+}
+
+void cgroup_stat_reader_free(struct cgroup_stat_reader **reader)
+{
+	struct cgroup_stat_reader *r = *reader;
+
+	if (!r)
+		return;
+
+	free(r->buf);
+	free(r->entries);
+	free(r->wanted);
+	free(r);
+	*reader = NULL;
+}
+
+/*
+ * Build the set of the ids of some keys, interning them.
+ *
+ *	@param wanted Output, the set indexed by id, NULL for all keys
+ *	@param wanted_max Output, the number of entries of the set
+ */
+static int cg_stat_wanted_build(const char * const keys[], int count,
+				unsigned char **wanted, int *wanted_max)
+{
+	int *ids = NULL;
+	int max = 0;
+	int ret = 0;
+	int i;
+
+	*wanted = NULL;
+	*wanted_max = 0;
+	if (!keys)
+		return 0;
+
+	ids = malloc((count + 1) * sizeof(*ids));
+	if (!ids) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	pthread_rwlock_wrlock(&cg_stat_keys_lock);
+	for (i = 0; i < count; i++) {
+		ids[i] = cg_stat_key_intern(keys[i], strlen(keys[i]));
+		if (ids[i] < 0) {
+			ret = ECGOTHER;
+			break;
+		}
+		if (ids[i] >= max)
+			max = ids[i] + 1;
+	}
+	pthread_rwlock_unlock(&cg_stat_keys_lock);
+	if (ret)
+		goto out;
+
+	/* An empty selection still has to reject every key */
+	*wanted = calloc(max + 1, 1);
+	if (!*wanted) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++)
+		(*wanted)[ids[i]] = 1;
+	*wanted_max = max;
+
+out:
+	free(ids);
+	return ret;
+}
+
+int cgroup_stat_reader_select(struct cgroup_stat_reader *reader,
+			      const char * const keys[], int count)
+{
+	unsigned char *wanted;
+	int wanted_max;
+	int ret;
+
+	if (!reader || count < 0 || (!keys && count))
+		return ECGINVAL;
+
+	ret = cg_stat_wanted_build(keys, count, &wanted, &wanted_max);
+	if (ret)
+		return ret;
+
+	free(reader->wanted);
+	reader->wanted = wanted;
+	reader->wanted_max = wanted_max;
+
+	return 0;
+}
+
+/*
+ * Parse a decimal integer, which must span the whole [s, end) range.
+ *
+ *	@return 0 on success, -1 if it is not a number or overflows
+ */
+static int cg_stat_scan_u64(const char *s, const char *end, uint64_t *value)
+{
+	uint64_t v = 0;
+	unsigned int d;
+
+	if (s == end)
+		return -1;
+
+	for (; s < end; s++) {
+		d = (unsigned char)*s - '0';
+		if (d > 9)
+			return -1;
+		if (v > (UINT64_MAX - d) / 10)
+			return -1;
+		v = v * 10 + d;
+	}
+
+	*value = v;
+	return 0;
+}
+
+/*
+ * Parse the "MAJ:MIN" device that starts an io.stat line.
+ *
+ *	@return 0 on success, -1 if it is not a device
+ */
+static int cg_stat_scan_dev(const char *s, const char *end,
+			    unsigned int *major, unsigned int *minor)
+{
+	const char *colon;
+	uint64_t maj, min;
+
+	colon = memchr(s, ':', end - s);
+	if (!colon || cg_stat_scan_u64(s, colon, &maj) ||
+	    cg_stat_scan_u64(colon + 1, end, &min) ||
+	    maj > UINT32_MAX || min > UINT32_MAX)
+		return -1;
+
+	*major = maj;
+	*minor = min;
+	return 0;
+}
+
+/*
+ * Append an entry, unless its key is not selected. Keys that were never
+ * interned are counted in reader->unknown, unless intern is set. This
+ * function should be called with cg_stat_keys_lock taken, write locked if
+ * intern is set.
+ */
+static int cg_stat_add(struct cgroup_stat_reader *reader, const char *key,
+		       size_t len, unsigned int major, unsigned int minor,
+		       uint64_t value, bool intern)
+{
+	struct cgroup_stat_entry *entries;
+	int id, max;
+
+	/* The selected keys are all interned, the others cannot match */
+	if (intern && !reader->wanted)
+		id = cg_stat_key_intern(key, len);
+	else
+		id = cg_stat_key_find(key, len);
+
+	if (id < 0) {
+		if (intern && !reader->wanted)
+			return ECGOTHER;
+		if (!reader->wanted)
+			reader->unknown++;
+		return 0;
+	}
+
+	if (reader->wanted && (id >= reader->wanted_max || !reader->wanted[id]))
+		return 0;
+
+	if (reader->count >= reader->entries_max) {
+		max = reader->entries_max * 2;
+		entries = realloc(reader->entries, max * sizeof(*entries));
+		if (!entries) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		reader->entries = entries;
+		reader->entries_max = max;
+	}
+
+	entries = &reader->entries[reader->count++];
+	entries->key = id;
+	entries->major = major;
+	entries->minor = minor;
+	entries->value = value;
+
+	return 0;
+}
+
+/*
+ * Parse the buffer of the reader into its entries. The buffer is not
+ * modified, so it can be parsed again. This function should be called with
+ * cg_stat_keys_lock taken, write locked if intern is set.
+ */
+static int cg_stat_parse(struct cgroup_stat_reader *reader, bool intern)
+{
+	const char *p = reader->buf, *end = reader->buf + reader->len;
+	const char *line_end, *key, *sep, *tok, *tok_end, *eq;
+	unsigned int major, minor;
+	uint64_t value;
+	int ret;
+
+	reader->count = 0;
+	reader->unknown = 0;
+
+	while (p < end) {
+		line_end = memchr(p, '\n', end - p);
+		if (!line_end)
+			line_end = end;
+
+		key = p;
+		p = line_end + 1;
+
+		sep = memchr(key, ' ', line_end - key);
+		if (!sep)
+			continue;
+		tok = sep + 1;
+
+		if (!memchr(tok, '=', line_end - tok)) {
+			/* A "key value" line */
+			if (cg_stat_scan_u64(tok, line_end, &value))
+				continue;
+
+			ret = cg_stat_add(reader, key, sep - key, 0, 0, value,
+					  intern);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		/* A "MAJ:MIN key=value ..." line */
+		if (cg_stat_scan_dev(key, sep, &major, &minor))
+			continue;
+
+		while (tok < line_end) {
+			tok_end = memchr(tok, ' ', line_end - tok);
+			if (!tok_end)
+				tok_end = line_end;
+
+			eq = memchr(tok, '=', tok_end - tok);
+			if (eq && !cg_stat_scan_u64(eq + 1, tok_end, &value)) {
+				ret = cg_stat_add(reader, tok, eq - tok, major,
+						  minor, value, intern);
+				if (ret)
+					return ret;
+			}
+
+			tok = tok_end + 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read a whole file from its start into the buffer of the reader.  The
+ * kernel fills the buffer as far as the file allows, so a short read is the
+ * end of it and most files take a single pread().  Reading a cgroup file
+ * again from offset 0 gives a fresh snapshot.
+ */
+static int cg_stat_read_fd(struct cgroup_stat_reader *reader, int fd)
+{
+	size_t size;
+	ssize_t n;
+	char *buf;
+
+	reader->len = 0;
+	for (;;) {
+		if (reader->len == reader->buf_size) {
+			size = reader->buf_size * 2;
+			buf = realloc(reader->buf, size);
+			if (!buf) {
+				last_errno = errno;
+				return ECGOTHER;
+			}
+
+			reader->buf = buf;
+			reader->buf_size = size;
+		}
+
+		n = pread(fd, reader->buf + reader->len,
+			  reader->buf_size - reader->len, reader->len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		reader->len += n;
+		if (!n || reader->len < reader->buf_size)
+			return 0;
+	}
+}
+
+/*
+ * Parse the buffer of the reader, interning the keys seen for the first
+ * time.
+ */
+static int cg_stat_parse_all(struct cgroup_stat_reader *reader)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&cg_stat_keys_lock);
+	ret = cg_stat_parse(reader, false);
+	pthread_rwlock_unlock(&cg_stat_keys_lock);
+
+	/* New keys, parse again to intern them */
+	if (!ret && reader->unknown) {
+		pthread_rwlock_wrlock(&cg_stat_keys_lock);
+		ret = cg_stat_parse(reader, true);
+		pthread_rwlock_unlock(&cg_stat_keys_lock);
+	}
+
+	return ret;
+}
+
+/*
+ * Open a stats file of a group.
+ *
+ *	@param fd Output, the file descriptor
+ */
+static int cg_stat_open(const char *controller, const char *path,
+			const char *file, int *fd)
+{
+	char stat_file[FILENAME_MAX];
+	size_t len, file_len;
+
+	if (!cg_build_path(path, stat_file, controller))
+		return ECGOTHER;
+
+	len = strlen(stat_file);
+	file_len = strlen(file);
+	if (len + file_len >= sizeof(stat_file))
+		return ECGINVAL;
+	memcpy(stat_file + len, file, file_len + 1);
+
+	*fd = open(stat_file, O_RDONLY | O_CLOEXEC);
+	if (*fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	return 0;
+}
+
+int cgroup_stat_read(struct cgroup_stat_reader *reader,
+		     const char *controller, const char *path,
+		     const char *file,
+		     const struct cgroup_stat_entry **entries, int *count)
+{
+	int ret, fd;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!reader || !controller || !file || !entries || !count)
+		return ECGINVAL;
+
+	ret = cg_stat_open(controller, path, file, &fd);
+	if (ret)
+		return ret;
+
+	ret = cg_stat_read_fd(reader, fd);
+	close(fd);
+	if (!ret)
+		ret = cg_stat_parse_all(reader);
+	if (ret)
+		return ret;
+
+	*entries = reader->entries;
+	*count = reader->count;
+
+	return 0;
+}
+
+int cg_stat_read_path(struct cgroup_stat_reader *reader, const char *file,
+		      const struct cgroup_stat_entry **entries, int *count)
+{
+	int ret, fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	ret = cg_stat_read_fd(reader, fd);
+	close(fd);
+	if (!ret)
+		ret = cg_stat_parse_all(reader);
+	if (ret)
+		return ret;
+
+	*entries = reader->entries;
+	*count = reader->count;
+
+	return 0;
+}
+
+struct cgroup_stat_collector *cgroup_stat_collector_new(void)
+{
+	struct cgroup_stat_collector *collector;
+
+	collector = calloc(1, sizeof(*collector));
+	if (!collector) {
+		last_errno = errno;
+		return NULL;
+	}
+
+	collector->reader = cgroup_stat_reader_new();
+	if (!collector->reader) {
+		free(collector);
+		return NULL;
+	}
+
+	return collector;
+}
+
+void cgroup_stat_collector_free(struct cgroup_stat_collector **collector)
+{
+	struct cgroup_stat_collector *c = *collector;
+	struct cg_stat_source *src;
+	int i;
+
+	if (!c)
+		return;
+
+	for (i = 0; i < c->sources_count; i++) {
+		src = &c->sources[i];
+		if (src->fd >= 0)
+			close(src->fd);
+		free(src->controller);
+		free(src->path);
+		free(src->file);
+		free(src->wanted);
+		free(src->keys);
+		free(src->devs);
+		free(src->values);
+	}
+
+	/* The reader borrows the selection of the sources while sampling */
+	c->reader->wanted = NULL;
+	cgroup_stat_reader_free(&c->reader);
+	free(c->sources);
+	free(c->deltas);
+	free(c);
+	*collector = NULL;
+}
+
+int cgroup_stat_collector_add(struct cgroup_stat_collector *collector,
+			      const char *controller, const char *path,
+			      const char *file, const char * const keys[],
+			      int count, int *source)
+{
+	struct cg_stat_source *sources, *src;
+	int ret, max;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!collector || !controller || !file || !source || count < 0 ||
+	    (!keys && count))
+		return ECGINVAL;
+
+	if (collector->sources_count >= collector->sources_max) {
+		max = collector->sources_max + CG_STAT_SOURCES_CHUNK;
+		sources = realloc(collector->sources, max * sizeof(*sources));
+		if (!sources) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		collector->sources = sources;
+		collector->sources_max = max;
+	}
+
+	src = &collector->sources[collector->sources_count];
+	memset(src, 0, sizeof(*src));
+
+	ret = cg_stat_wanted_build(keys, count, &src->wanted,
+				   &src->wanted_max);
+	if (ret)
+		return ret;
+
+	src->controller = strdup(controller);
+	src->path = path ? strdup(path) : NULL;
+	src->file = strdup(file);
+	if (!src->controller || (path && !src->path) || !src->file) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto err;
+	}
+
+	ret = cg_stat_open(controller, path, file, &src->fd);
+	if (ret)
+		goto err;
+
+	*source = collector->sources_count++;
+
+	return 0;
+
+err:
+	free(src->controller);
+	free(src->path);
+	free(src->file);
+	free(src->wanted);
+	return ret;
+}
+
+/*
+ * Make room for count values in the columns of a source, keeping the
+ * previous sample.
+ */
+static int cg_stat_source_reserve(struct cg_stat_source *src, int count)
+{
+	uint64_t *devs, *values;
+	int *keys;
+
+	if (count <= src->max)
+		return 0;
+
+	keys = realloc(src->keys, count * sizeof(*keys));
+	if (keys)
+		src->keys = keys;
+	devs = realloc(src->devs, count * sizeof(*devs));
+	if (devs)
+		src->devs = devs;
+	values = realloc(src->values, count * sizeof(*values));
+	if (values)
+		src->values = values;
+
+	if (!keys || !devs || !values) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	src->max = count;
+	return 0;
+}
+
+/*
+ * Find a value in the previous sample of a source, for samples whose
+ * layout changed, e.g. a device showed up in io.stat.
+ *
+ *	@return the column, -1 if the value is new
+ */
+static int cg_stat_source_find(const struct cg_stat_source *src, int key,
+			       uint64_t dev)
+{
+	int i;
+
+	for (i = 0; i < src->count; i++) {
+		if (src->keys[i] == key && src->devs[i] == dev)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Compute the deltas of the values parsed into the reader against the
+ * previous sample of a source, then store the new sample.  The rates use
+ * the time since the previous sample of this source, which is older than
+ * the previous sample of the collector if that one failed partway.
+ */
+static int cg_stat_source_update(struct cgroup_stat_collector *collector,
+				 int source, uint64_t now,
+				 struct cgroup_stat_delta *deltas)
+{
+	struct cg_stat_source *src = &collector->sources[source];
+	struct cgroup_stat_reader *reader = collector->reader;
+	const struct cgroup_stat_entry *e;
+	uint64_t *prev = NULL;
+	double interval = 0;
+	bool same = true;
+	uint64_t dev;
+	int i, col;
+
+	if (src->last_ns)
+		interval = (now - src->last_ns) / 1e9;
+
+	/* Most samples find the values in the same order as the last one */
+	if (reader->count != src->count)
+		same = false;
+	for (i = 0; same && i < reader->count; i++) {
+		e = &reader->entries[i];
+		if (src->keys[i] != e->key ||
+		    src->devs[i] != ((uint64_t)e->major << 32 | e->minor))
+			same = false;
+	}
+
+	if (!same && src->count) {
+		/* Keep the previous sample aside to look values up in it */
+		prev = malloc(src->count * sizeof(*prev));
+		if (!prev) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		memcpy(prev, src->values, src->count * sizeof(*prev));
+	}
+
+	if (cg_stat_source_reserve(src, reader->count)) {
+		free(prev);
+		return ECGOTHER;
+	}
+
+	for (i = 0; i < reader->count; i++) {
+		e = &reader->entries[i];
+		dev = (uint64_t)e->major << 32 | e->minor;
+
+		deltas[i].source = source;
+		deltas[i].key = e->key;
+		deltas[i].major = e->major;
+		deltas[i].minor = e->minor;
+		deltas[i].value = e->value;
+		deltas[i].delta = 0;
+		deltas[i].rate = 0;
+
+		if (same) {
+			deltas[i].delta = e->value - src->values[i];
+		} else {
+			col = cg_stat_source_find(src, e->key, dev);
+			if (col >= 0)
+				deltas[i].delta = e->value - prev[col];
+		}
+
+		if (interval > 0)
+			deltas[i].rate = deltas[i].delta / interval;
+	}
+
+	/* Store the new sample, after all the lookups in the old one */
+	for (i = 0; i < reader->count; i++) {
+		e = &reader->entries[i];
+		src->keys[i] = e->key;
+		src->devs[i] = (uint64_t)e->major << 32 | e->minor;
+		src->values[i] = e->value;
+	}
+	src->count = reader->count;
+	src->last_ns = now;
+
+	free(prev);
+	return 0;
+}
+
+int cgroup_stat_collector_sample(struct cgroup_stat_collector *collector,
+				 const struct cgroup_stat_delta **deltas,
+				 int *count)
+{
+	struct cgroup_stat_reader *reader;
+	struct cgroup_stat_delta *out;
+	struct cg_stat_source *src;
+	struct timespec ts;
+	int ret = 0;
+	uint64_t now;
+	int i, n = 0;
+	int max;
+
+	if (!collector || !deltas || !count)
+		return ECGINVAL;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	reader = collector->reader;
+	for (i = 0; i < collector->sources_count; i++) {
+		src = &collector->sources[i];
+
+		if (src->fd < 0 &&
+		    cg_stat_open(src->controller, src->path, src->file,
+				 &src->fd)) {
+			src->fd = -1;
+			continue;
+		}
+
+		if (cg_stat_read_fd(reader, src->fd)) {
+			/*
+			 * The group is gone, or going.  Open the file again
+			 * next time, in case the group is created again.
+			 */
+			close(src->fd);
+			src->fd = -1;
+			src->count = 0;
+			src->last_ns = 0;
+			continue;
+		}
+
+		reader->wanted = src->wanted;
+		reader->wanted_max = src->wanted_max;
+		ret = cg_stat_parse_all(reader);
+		reader->wanted = NULL;
+		if (ret)
+			break;
+
+		if (n + reader->count > collector->deltas_max) {
+			max = (n + reader->count) * 2;
+			out = realloc(collector->deltas, max * sizeof(*out));
+			if (!out) {
+				last_errno = errno;
+				ret = ECGOTHER;
+				break;
+			}
+
+			collector->deltas = out;
+			collector->deltas_max = max;
+		}
+
+		ret = cg_stat_source_update(collector, i, now,
+					    &collector->deltas[n]);
+		if (ret)
+			break;
+		n += reader->count;
+	}
+
+	if (ret)
+		return ret;
+
+	*deltas = collector->deltas;
+	*count = n;
+
+	return 0;
+}
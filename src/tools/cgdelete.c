@@ -19,6 +19,8 @@
 
 static const struct option  long_options[] = {
 	{"recursive",	      no_argument, NULL, 'r'},
+	{"kill",	      no_argument, NULL, 'k'},
+	{"freeze",	      no_argument, NULL, 'f'},
 	{"help",	      no_argument, NULL, 'h'},
 	{"group",	required_argument, NULL, 'g'},
 	{NULL, 0, NULL, 0}
@@ -39,13 +41,17 @@ static void usage(int status, const char *program_name)
 		return;
 	}
 
-	info("Usage: %s [-h] [-r] [[-g] <controllers>:<path>] ...\n",
+	info("Usage: %s [-h] [-r] [-k|-f] [[-g] <controllers>:<path>] ...\n",
 	     program_name);
 	info("Remove control group(s)\n");
 	info("  -g <controllers>:<path>	Control group to be removed ");
 	info("(-g is optional)\n");
 	info("  -h, --help			Display this help\n");
 	info("  -r, --recursive		Recursively remove all subgroups\n");
+	info("  -k, --kill			Kill the processes instead ");
+	info("of moving them\n");
+	info("  -f, --freeze			Freeze the processes while ");
+	info("moving them\n");
 }
 
 /*
@@ -151,12 +157,18 @@ int main(int argc, char *argv[])
 	}
 
 	/* Parse arguments */
-	while ((c = getopt_long(argc, argv, "rhg:",
+	while ((c = getopt_long(argc, argv, "rkfhg:",
 		long_options, NULL)) > 0) {
 		switch (c) {
 		case 'r':
 			flags |= CGFLAG_DELETE_RECURSIVE;
 			break;
+		case 'k':
+			flags |= CGFLAG_DELETE_KILL;
+			break;
+		case 'f':
+			flags |= CGFLAG_DELETE_FREEZE;
+			break;
 		case 'g':
 			ret = parse_cgroup_spec(cgroup_list, optarg, argc);
 			if (ret != 0) {
@@ -584,8 +584,7 @@ static int fill_empty_controller(struct cgroup * const cg,
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
 
-	for (i = 0; i < CG_CONTROLLER_MAX && cg_mount_table[i].name[0] != '\0';
-	     i++) {
+	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
 		if (strlen(cgc->name) == strlen(cg_mount_table[i].name) &&
 		    strncmp(cgc->name, cg_mount_table[i].name,
 			    strlen(cgc->name)) == 0) {
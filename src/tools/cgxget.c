@@ -612,11 +612,10 @@ static int fill_empty_controller(struct cgroup * const cg,
 
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
 
-	for (i = 0; i < CG_CONTROLLER_MAX &&
-			cg_mount_table[i].name[0] != '\0'; i++) {
+	for (i = 0; cg_mounts[i].name[0] != '\0'; i++) {
 
-		if (strlen(cgc->name) == strlen(cg_mount_table[i].name) &&
-		    strncmp(cgc->name, cg_mount_table[i].name,
+		if (strlen(cgc->name) == strlen(cg_mounts[i].name) &&
+		    strncmp(cgc->name, cg_mounts[i].name,
 			    strlen(cgc->name)) == 0) {
 			found_mount = true;
 			break;
@@ -627,7 +626,7 @@ static int fill_empty_controller(struct cgroup * const cg,
 		goto out;
 
 	if (!cg_build_path_locked(NULL, path,
-				  cg_mount_table[i].name)) {
+				  cg_mounts[i].name)) {
 		goto out;
 	}
 
@@ -639,7 +638,7 @@ static int fill_empty_controller(struct cgroup * const cg,
 		goto out;
 
 	if (!cg_build_path_locked(cg->name, path,
-		cg_mount_table[i].name))
+		cg_mounts[i].name))
 		goto out;
 
 	dir = opendir(path);
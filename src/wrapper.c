@@ -20,6 +20,26 @@
 #include <stdio.h>
 #include <errno.h>
 
+/*
+ * Controllers with fewer values are scanned, the others get a hash of the
+ * value names.  cgroup_get_cgroup() fills controllers with tens of values,
+ * e.g. from memory.stat, and each one is looked up before it is added.
+ */
+#define CG_VALUE_INDEX_MIN	8
+
+/* The values of a controller grow by this many entries */
+#define CG_VALUES_CHUNK		16
+
+/* The controllers of a cgroup grow by this many entries */
+#define CG_CONTROLLERS_CHUNK	4
+
+/*
+ * Cgroups with fewer controllers are scanned, the others get a hash of the
+ * controller names.  cgroup_add_all_controllers() adds every mounted
+ * controller, and each one is looked up before it is added.
+ */
+#define CG_CONTROLLER_INDEX_MIN	8
+
 static void init_cgroup(struct cgroup *cgroup)
 {
 	cgroup->task_fperm = cgroup->control_fperm =
@@ -49,11 +69,103 @@ struct cgroup *cgroup_new_cgroup(const char *name)
 	return cgroup;
 }
 
+static void cg_controller_index_reset(struct cgroup *cgroup)
+{
+	free(cgroup->controller_slots);
+	cgroup->controller_slots = NULL;
+	cgroup->controller_slots_max = 0;
+	cgroup->controller_slots_count = 0;
+}
+
+static void cg_controller_index_insert(struct cgroup *cgroup, int pos)
+{
+	unsigned int mask = cgroup->controller_slots_max - 1;
+	unsigned int slot;
+
+	slot = cg_name_hash(cgroup->controller[pos]->name) & mask;
+	while (cgroup->controller_slots[slot])
+		slot = (slot + 1) & mask;
+
+	cgroup->controller_slots[slot] = pos + 1;
+	cgroup->controller_slots_count++;
+}
+
+/*
+ * Enter the controllers added since the last lookup in the name hash, and
+ * build or grow it as needed.  The hash is kept at most half full.
+ *
+ *	@return 0 on success, -1 if out of memory
+ */
+static int cg_controller_index_update(struct cgroup *cgroup)
+{
+	int *slots;
+	int max;
+	int i;
+
+	/* Controllers were dropped, e.g. by cgroup_convert_cgroup() */
+	if (cgroup->controller_slots_count > cgroup->index)
+		cg_controller_index_reset(cgroup);
+
+	if (cgroup->index * 2 > cgroup->controller_slots_max) {
+		max = CG_CONTROLLER_INDEX_MIN * 2;
+		while (max < cgroup->index * 2)
+			max *= 2;
+
+		slots = calloc(max, sizeof(*slots));
+		if (!slots)
+			return -1;
+
+		free(cgroup->controller_slots);
+		cgroup->controller_slots = slots;
+		cgroup->controller_slots_max = max;
+		cgroup->controller_slots_count = 0;
+	}
+
+	for (i = cgroup->controller_slots_count; i < cgroup->index; i++)
+		cg_controller_index_insert(cgroup, i);
+
+	return 0;
+}
+
+/*
+ * Find a controller of a cgroup by name.
+ *
+ *	@return the position in cgroup->controller, -1 if there is none
+ */
+static int cg_controller_find(struct cgroup *cgroup, const char *name)
+{
+	unsigned int mask;
+	unsigned int slot;
+	int i;
+
+	if (cgroup->index < CG_CONTROLLER_INDEX_MIN ||
+	    cg_controller_index_update(cgroup)) {
+		for (i = 0; i < cgroup->index; i++) {
+			if (!strcmp(cgroup->controller[i]->name, name))
+				return i;
+		}
+
+		return -1;
+	}
+
+	mask = cgroup->controller_slots_max - 1;
+	slot = cg_name_hash(name) & mask;
+	while (cgroup->controller_slots[slot]) {
+		i = cgroup->controller_slots[slot] - 1;
+		if (!strcmp(cgroup->controller[i]->name, name))
+			return i;
+		slot = (slot + 1) & mask;
+	}
+
+	return -1;
+}
+
 struct cgroup_controller *cgroup_add_controller(struct cgroup *cgroup,
 						const char *name)
 {
+	struct cgroup_controller **controllers;
 	struct cgroup_controller *controller;
-	int i, ret;
+	int ret, max;
 
 	if (!cgroup)
 		return NULL;
@@ -61,18 +173,9 @@ struct cgroup_controller *cgroup_add_controller(struct cgroup *cgroup,
 	/*
 	 * Still not sure how to handle the failure here.
 	 */
-	if (cgroup->index >= CG_CONTROLLER_MAX)
+	if (cg_controller_find(cgroup, name) >= 0)
 		return NULL;
 
-	/*
-	 * Still not sure how to handle the failure here.
-	 */
-	for (i = 0; i < cgroup->index; i++) {
-		if (strncmp(name, cgroup->controller[i]->name,
-			    sizeof(cgroup->controller[i]->name)) == 0)
-			return NULL;
-	}
-
 	controller = calloc(1, sizeof(struct cgroup_controller));
 
 	if (!controller)
@@ -101,6 +204,20 @@ struct cgroup_controller *cgroup_add_controller(struct cgroup *cgroup,
 		}
 	}
 
+	if (cgroup->index >= cgroup->controller_max) {
+		max = cgroup->controller_max + CG_CONTROLLERS_CHUNK;
+		controllers = realloc(cgroup->controller,
+				      max * sizeof(*controllers));
+		if (!controllers) {
+			last_errno = errno;
+			free(controller);
+			return NULL;
+		}
+
+		cgroup->controller = controllers;
+		cgroup->controller_max = max;
+	}
+
 	cgroup->controller[cgroup->index] = controller;
 	cgroup->index++;
 
@@ -177,6 +294,8 @@ void cgroup_free_controller(struct cgroup_controller *ctrl)
 		cgroup_free_value(ctrl->values[i]);
 	ctrl->index = 0;
 
+	free(ctrl->values);
+	free(ctrl->value_slots);
 	free(ctrl);
 }
 
@@ -190,7 +309,12 @@ void cgroup_free_controllers(struct cgroup *cgroup)
 	for (i = 0; i < cgroup->index; i++)
 		cgroup_free_controller(cgroup->controller[i]);
 
+	free(cgroup->controller);
+	cgroup->controller = NULL;
+	cgroup->controller_max = 0;
 	cgroup->index = 0;
+
+	cg_controller_index_reset(cgroup);
 }
 
 void cgroup_free(struct cgroup **cgroup)
@@ -208,22 +332,129 @@ void cgroup_free(struct cgroup **cgroup)
 	*cgroup = NULL;
 }
 
+void cg_value_index_reset(struct cgroup_controller *controller)
+{
+	free(controller->value_slots);
+	controller->value_slots = NULL;
+	controller->value_slots_max = 0;
+	controller->value_slots_count = 0;
+}
+
+static void cg_value_index_insert(struct cgroup_controller *controller,
+				  int pos)
+{
+	unsigned int mask = controller->value_slots_max - 1;
+	unsigned int slot;
+
+	slot = cg_name_hash(controller->values[pos]->name) & mask;
+	while (controller->value_slots[slot])
+		slot = (slot + 1) & mask;
+
+	controller->value_slots[slot] = pos + 1;
+	controller->value_slots_count++;
+}
+
+/*
+ * Enter the values appended since the last lookup in the name hash, and
+ * build or grow it as needed.  The hash is kept at most half full.
+ *
+ *	@return 0 on success, -1 if out of memory
+ */
+static int cg_value_index_update(struct cgroup_controller *controller)
+{
+	int *slots;
+	int max;
+	int i;
+
+	/* Values were removed behind our back, start over */
+	if (controller->value_slots_count > controller->index)
+		cg_value_index_reset(controller);
+
+	if (controller->index * 2 > controller->value_slots_max) {
+		max = CG_VALUE_INDEX_MIN * 2;
+		while (max < controller->index * 2)
+			max *= 2;
+
+		slots = calloc(max, sizeof(*slots));
+		if (!slots)
+			return -1;
+
+		free(controller->value_slots);
+		controller->value_slots = slots;
+		controller->value_slots_max = max;
+		controller->value_slots_count = 0;
+	}
+
+	for (i = controller->value_slots_count; i < controller->index; i++)
+		cg_value_index_insert(controller, i);
+
+	return 0;
+}
+
+int cg_value_find(struct cgroup_controller *controller, const char *name)
+{
+	unsigned int mask;
+	unsigned int slot;
+	int i;
+
+	if (controller->index < CG_VALUE_INDEX_MIN ||
+	    cg_value_index_update(controller)) {
+		for (i = 0; i < controller->index; i++) {
+			if (!strcmp(controller->values[i]->name, name))
+				return i;
+		}
+
+		return -1;
+	}
+
+	mask = controller->value_slots_max - 1;
+	slot = cg_name_hash(name) & mask;
+	while (controller->value_slots[slot]) {
+		i = controller->value_slots[slot] - 1;
+		if (!strcmp(controller->values[i]->name, name))
+			return i;
+		slot = (slot + 1) & mask;
+	}
+
+	return -1;
+}
+
+int cg_value_append(struct cgroup_controller *controller,
+		    struct control_value *value)
+{
+	struct control_value **values;
+	int max;
+
+	if (controller->index >= controller->values_max) {
+		max = controller->values_max + CG_VALUES_CHUNK;
+		values = realloc(controller->values, max * sizeof(*values));
+		if (!values) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		controller->values = values;
+		controller->values_max = max;
+	}
+
+	controller->values[controller->index] = value;
+	controller->index++;
+
+	/* A built hash is extended on the next lookup */
+	return 0;
+}
+
 int cgroup_add_value_string(struct cgroup_controller *controller,
 			    const char *name, const char *value)
 {
-	int i;
 	struct control_value *cntl_value;
+	int ret;
 
 	if (!controller)
 		return ECGINVAL;
 
-	if (controller->index >= CG_NV_MAX)
-		return ECGMAXVALUESEXCEEDED;
-
-	for (i = 0; i < controller->index && i < CG_NV_MAX; i++) {
-		if (!strcmp(controller->values[i]->name, name))
-			return ECGVALUEEXISTS;
-	}
+	if (cg_value_find(controller, name) >= 0)
+		return ECGVALUEEXISTS;
 
 	cntl_value = calloc(1, sizeof(struct control_value));
 
@@ -247,10 +478,11 @@ int cgroup_add_value_string(struct cgroup_controller *controller,
 		cntl_value->dirty = true;
 	}
 
-	controller->values[controller->index] = cntl_value;
-	controller->index++;
+	ret = cg_value_append(controller, cntl_value);
+	if (ret)
+		free(cntl_value);
 
-	return 0;
+	return ret;
 }
 
 int cgroup_add_value_int64(struct cgroup_controller *controller,
@@ -315,28 +547,28 @@ int cgroup_remove_value(struct cgroup_controller * const controller,
 {
 	int i;
 
-	for (i = 0; i < controller->index; i++) {
-		if (strcmp(controller->values[i]->name, name) == 0) {
-			cgroup_free_value(controller->values[i]);
-
-			if (i == (controller->index - 1)) {
-				/* This is the last entry in the table.
-				 * There's nothing to move
-				 */
-				controller->index--;
-			} else {
-				memmove(&controller->values[i],
-					&controller->values[i + 1],
-					sizeof(struct control_value *) *
-						(controller->index - i - 1));
-				controller->index--;
-			}
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return ECGROUPNOTEXIST;
 
-			return 0;
-		}
+	cgroup_free_value(controller->values[i]);
+
+	if (i == (controller->index - 1)) {
+		/* This is the last entry in the table.
+		 * There's nothing to move
+		 */
+		controller->index--;
+	} else {
+		memmove(&controller->values[i], &controller->values[i + 1],
+			sizeof(struct control_value *) *
+				(controller->index - i - 1));
+		controller->index--;
+
+		/* The following values moved */
+		cg_value_index_reset(controller);
 	}
 
-	return ECGROUPNOTEXIST;
+	return 0;
 }
 
 int cgroup_compare_controllers(struct cgroup_controller *cgca,
@@ -434,226 +666,199 @@ struct cgroup_controller *cgroup_get_controller(struct cgroup *cgroup,
 						const char *name)
 {
 	int i;
-	struct cgroup_controller *cgc;
 
 	if (!cgroup)
 		return NULL;
 
-	for (i = 0; i < cgroup->index; i++) {
-		cgc = cgroup->controller[i];
-
-		if (!strcmp(cgc->name, name))
-			return cgc;
-	}
+	i = cg_controller_find(cgroup, name);
+	if (i < 0)
+		return NULL;
 
-	return NULL;
+	return cgroup->controller[i];
 }
 
 int cgroup_get_value_string(struct cgroup_controller *controller,
 			    const char *name, char **value)
 {
+	struct control_value *val;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-		if (!strcmp(val->name, name)) {
-			*value = strdup(val->value);
+	val = controller->values[i];
+	*value = strdup(val->value);
 
-			if (!*value)
-				return ECGOTHER;
-
-			return 0;
-		}
-	}
-
-	return ECGROUPVALUENOTEXIST;
+	if (!*value)
+		return ECGOTHER;
 
+	return 0;
 }
 
 int cgroup_set_value_string(struct cgroup_controller *controller,
 			    const char *name, const char *value)
 {
+	struct control_value *val;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
-			strncpy(val->value, value, CG_VALUE_MAX);
-			val->value[sizeof(val->value)-1] = '\0';
-			val->dirty = true;
-			return 0;
-		}
-	}
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return cgroup_add_value_string(controller, name, value);
 
-	return cgroup_add_value_string(controller, name, value);
+	val = controller->values[i];
+	strncpy(val->value, value, CG_VALUE_MAX);
+	val->value[sizeof(val->value)-1] = '\0';
+	val->dirty = true;
+	return 0;
 }
 
 int cgroup_get_value_int64(struct cgroup_controller *controller,
 			   const char *name, int64_t *value)
 {
+	struct control_value *val;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-			if (sscanf(val->value, "%" SCNd64, value) != 1)
-				return ECGINVAL;
-
-			return 0;
-		}
-	}
+	val = controller->values[i];
+	if (sscanf(val->value, "%" SCNd64, value) != 1)
+		return ECGINVAL;
 
-	return ECGROUPVALUENOTEXIST;
+	return 0;
 }
 
 int cgroup_set_value_int64(struct cgroup_controller *controller,
 			   const char *name, int64_t value)
 {
+	struct control_value *val;
 	int ret;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return cgroup_add_value_int64(controller, name, value);
 
-		if (!strcmp(val->name, name)) {
-			ret = snprintf(val->value,
-				       sizeof(val->value), "%" PRId64, value);
+	val = controller->values[i];
+	ret = snprintf(val->value, sizeof(val->value), "%" PRId64, value);
 
-			if (ret >= sizeof(val->value))
-				return ECGINVAL;
-
-			val->dirty = true;
-			return 0;
-		}
-	}
+	if (ret >= sizeof(val->value))
+		return ECGINVAL;
 
-	return cgroup_add_value_int64(controller, name, value);
+	val->dirty = true;
+	return 0;
 }
 
 int cgroup_get_value_uint64(struct cgroup_controller *controller,
 			    const char *name, u_int64_t *value)
 {
+	struct control_value *val;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-		if (!strcmp(val->name, name)) {
-			if (sscanf(val->value, "%" SCNu64, value) != 1)
-				return ECGINVAL;
-
-			return 0;
-		}
-	}
+	val = controller->values[i];
+	if (sscanf(val->value, "%" SCNu64, value) != 1)
+		return ECGINVAL;
 
-	return ECGROUPVALUENOTEXIST;
+	return 0;
 }
 
 int cgroup_set_value_uint64(struct cgroup_controller *controller,
 			    const char *name, u_int64_t value)
 {
+	struct control_value *val;
 	int ret;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return cgroup_add_value_uint64(controller, name, value);
 
-		if (!strcmp(val->name, name)) {
-			ret = snprintf(val->value, sizeof(val->value),
-				       "%" PRIu64, value);
+	val = controller->values[i];
+	ret = snprintf(val->value, sizeof(val->value), "%" PRIu64, value);
 
-			if (ret >= sizeof(val->value))
-				return ECGINVAL;
-
-			val->dirty = true;
-			return 0;
-		}
-	}
+	if (ret >= sizeof(val->value))
+		return ECGINVAL;
 
-	return cgroup_add_value_uint64(controller, name, value);
+	val->dirty = true;
+	return 0;
 }
 
 int cgroup_get_value_bool(struct cgroup_controller *controller,
 			  const char *name, bool *value)
 {
+	struct control_value *val;
+	int cgc_val;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
-			int cgc_val;
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-			if (sscanf(val->value, "%d", &cgc_val) != 1)
-				return ECGINVAL;
+	val = controller->values[i];
+	if (sscanf(val->value, "%d", &cgc_val) != 1)
+		return ECGINVAL;
 
-			if (cgc_val)
-				*value = true;
-			else
-				*value = false;
+	if (cgc_val)
+		*value = true;
+	else
+		*value = false;
 
-			return 0;
-		}
-	}
-	return ECGROUPVALUENOTEXIST;
+	return 0;
 }
 
 int cgroup_set_value_bool(struct cgroup_controller *controller,
 			  const char *name, bool value)
 {
+	struct control_value *val;
 	int ret;
 	int i;
 
 	if (!controller)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cg_value_find(controller, name);
+	if (i < 0)
+		return cgroup_add_value_bool(controller, name, value);
 
-		if (!strcmp(val->name, name)) {
-			if (value) {
-				ret = snprintf(val->value,
-						sizeof(val->value), "1");
-			} else {
-				ret = snprintf(val->value,
-						sizeof(val->value), "0");
-			}
-
-			if (ret >= sizeof(val->value))
-				return ECGINVAL;
-
-			val->dirty = true;
-			return 0;
-
-		}
+	val = controller->values[i];
+	if (value) {
+		ret = snprintf(val->value, sizeof(val->value), "1");
+	} else {
+		ret = snprintf(val->value, sizeof(val->value), "0");
 	}
 
-	return cgroup_add_value_bool(controller, name, value);
+	if (ret >= sizeof(val->value))
+		return ECGINVAL;
+
+	val->dirty = true;
+	return 0;
 }
 
 struct cgroup *create_cgroup_from_name_value_pairs(const char *name,